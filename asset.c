@@ -0,0 +1,738 @@
+/* asset.c -- static files served from memory
+ *
+ * The client library and the pages using it are requested by every
+ * browser opening a page, usually all at once.  They are read once at
+ * startup, compressed ahead of time with gzip and, if built with it,
+ * brotli, and served from memory with an ETag so revisits are answered
+ * with 304.  Files too large to keep a copy of are sent with sendfile()
+ * from a snapshot, an unnamed copy in the same directory.
+ *
+ * The files are shared by all workers.  Responses hold a reference to the
+ * file they send from, so one written while being sent is swapped in for
+ * new requests and the old one freed once the last response is out.
+ * Changed files are reloaded and compressed again by a thread of their
+ * own, the workers never wait for more than the swap.
+ */
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include <event2/util.h>
+
+#ifdef HAVE_BROTLI
+#include <brotli/encode.h>
+#endif
+
+#include "asset.h"
+#include "htable.h"
+
+#define ASSET_MAX_NAME 255
+
+struct asset_type {
+	const char *suffix;
+	const char *content_type;
+	bool compress;
+};
+
+static const struct asset_type types[] = {
+	{ ".html", "text/html; charset=utf-8", true },
+	{ ".htm", "text/html; charset=utf-8", true },
+	{ ".js", "text/javascript; charset=utf-8", true },
+	{ ".css", "text/css; charset=utf-8", true },
+	{ ".json", "application/json", true },
+	{ ".txt", "text/plain; charset=utf-8", true },
+	{ ".svg", "image/svg+xml", true },
+	{ ".ico", "image/x-icon", true },
+	{ ".wasm", "application/wasm", true },
+	{ ".png", "image/png", false },
+	{ ".jpg", "image/jpeg", false },
+	{ ".gif", "image/gif", false },
+	{ ".woff2", "font/woff2", false },
+	{ NULL, NULL, false }
+};
+
+static const char *const encoding_names[ASSET_ENCODINGS] = { NULL, "gzip", "br" };
+static const char *const etag_suffixes[ASSET_ENCODINGS] = { "", "-gz", "-br" };
+
+struct asset_variant {
+	bool available;
+	unsigned char *data;
+	size_t length;
+	char etag[48];
+};
+
+struct asset {
+	char name[ASSET_MAX_NAME + 1];
+	const struct asset_type *type;
+	unsigned refs;
+
+	/**
+	 * Identity content of files of ASSET_SENDFILE_MIN or more, data of
+	 * the identity variant is NULL then.
+	 */
+	struct evbuffer_file_segment *segment;
+
+	struct asset_variant variants[ASSET_ENCODINGS];
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct htable assets;
+static struct asset_stats stats;
+static int dir_fd = -1;
+static char *dir_path;
+
+static int watch_fd = -1;
+static int stop_pipe[2] = { -1, -1 };
+static pthread_t loader;
+static bool loader_running;
+
+static uint64_t name_hash(const char *name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while(*name)
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static bool asset_match(const void *value, const void *key)
+{
+	return strcmp(((const struct asset *)value)->name, key) == 0;
+}
+
+static const struct asset_type *find_type(const char *name)
+{
+	const struct asset_type *t;
+	size_t len = strlen(name), slen;
+
+	if(len == 0 || len > ASSET_MAX_NAME || name[0] == '.' || strchr(name, '/'))
+		return NULL;
+
+	for(t = types; t->suffix; t++)
+	{
+		slen = strlen(t->suffix);
+		if(len > slen && strcmp(name + len - slen, t->suffix) == 0)
+			return t;
+	}
+
+	return NULL;
+}
+
+static void asset_free(struct asset *a)
+{
+	unsigned i;
+
+	for(i = 0; i < ASSET_ENCODINGS; i++)
+		free(a->variants[i].data);
+
+	if(a->segment)
+		evbuffer_file_segment_free(a->segment);
+
+	free(a);
+}
+
+void asset_put(struct asset *a)
+{
+	if(__atomic_sub_fetch(&a->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		asset_free(a);
+}
+
+static void asset_hold(struct asset *a)
+{
+	__atomic_add_fetch(&a->refs, 1, __ATOMIC_RELAXED);
+}
+
+static int read_all(int fd, unsigned char *data, size_t len)
+{
+	size_t off = 0;
+	ssize_t n;
+
+	while(off < len)
+	{
+		if((n = pread(fd, data + off, len - off, off)) <= 0)
+		{
+			if(n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		off += n;
+	}
+
+	return 0;
+}
+
+static void gzip_variant(struct asset_variant *v, const unsigned char *src, size_t len)
+{
+	z_stream zs;
+	unsigned char *out;
+	uLong bound;
+
+	memset(&zs, 0, sizeof(zs));
+
+	/* A window of 15 bits plus 16 writes a gzip header and trailer. */
+	if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return;
+
+	bound = deflateBound(&zs, len);
+	if((out = malloc(bound)) == NULL)
+	{
+		deflateEnd(&zs);
+		return;
+	}
+
+	zs.next_in = (Bytef *)src;
+	zs.avail_in = len;
+	zs.next_out = out;
+	zs.avail_out = bound;
+
+	if(deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= len)
+	{
+		free(out);
+		deflateEnd(&zs);
+		return;
+	}
+
+	v->data = out;
+	v->length = zs.total_out;
+	v->available = true;
+	deflateEnd(&zs);
+}
+
+static void brotli_variant(struct asset_variant *v, const unsigned char *src, size_t len)
+{
+#ifdef HAVE_BROTLI
+	unsigned char *out;
+	size_t out_len = BrotliEncoderMaxCompressedSize(len);
+
+	if(out_len == 0 || (out = malloc(out_len)) == NULL)
+		return;
+
+	if(!BrotliEncoderCompress(BROTLI_MAX_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+		len, src, &out_len, out) || out_len >= len)
+	{
+		free(out);
+		return;
+	}
+
+	v->data = out;
+	v->length = out_len;
+	v->available = true;
+#endif
+}
+
+/**
+ * Copies the file open as fd to an unnamed file in the same directory, so
+ * responses keep sending what was loaded even if the file is rewritten in
+ * place.  copy_file_range() shares the blocks where the filesystem can.
+ * Returns -1 if the directory does not allow it.
+ */
+static int asset_snapshot(int fd, size_t len)
+{
+	size_t done = 0;
+	ssize_t n;
+	int copy;
+
+	if((copy = openat(dir_fd, ".", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600)) < 0)
+		return -1;
+
+	while(done < len)
+	{
+		if((n = copy_file_range(fd, NULL, copy, NULL, len - done, 0)) <= 0)
+		{
+			if(n < 0 && errno == EINTR)
+				continue;
+
+			close(copy);
+			return -1;
+		}
+
+		done += n;
+	}
+
+	return copy;
+}
+
+/**
+ * Reads and compresses the file called name.  Returns NULL if it cannot be
+ * read or is not a regular file.
+ */
+static struct asset *asset_load(const char *name, const struct asset_type *type)
+{
+	struct asset *a;
+	struct stat st;
+	unsigned char *contents = NULL;
+	char tag[32];
+	size_t len;
+	unsigned i;
+	int fd, copy = -1;
+
+	if((fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC)) < 0)
+		return NULL;
+
+	if(fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (a = calloc(1, sizeof(struct asset))) == NULL)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	strcpy(a->name, name);
+	a->type = type;
+	a->refs = 1;
+	len = st.st_size;
+
+	if(len < ASSET_SENDFILE_MIN || (type->compress && len <= ASSET_COMPRESS_MAX))
+	{
+		if((contents = malloc(len ? len : 1)) == NULL || read_all(fd, contents, len) < 0)
+			goto fail;
+	}
+
+	if(type->compress && len <= ASSET_COMPRESS_MAX)
+	{
+		gzip_variant(&a->variants[ASSET_GZIP], contents, len);
+		brotli_variant(&a->variants[ASSET_BROTLI], contents, len);
+	}
+
+	if(len >= ASSET_SENDFILE_MIN && (copy = asset_snapshot(fd, len)) >= 0)
+	{
+		a->segment = evbuffer_file_segment_new(copy, 0, len, EVBUF_FS_CLOSE_ON_FREE);
+		if(a->segment == NULL)
+			goto fail;
+
+		copy = -1;
+		free(contents);
+		contents = NULL;
+	}
+	else if(contents == NULL)
+	{
+		/* Without a snapshot the file is kept in memory as well. */
+		if((contents = malloc(len)) == NULL || read_all(fd, contents, len) < 0)
+			goto fail;
+	}
+
+	close(fd);
+	fd = -1;
+
+	a->variants[ASSET_IDENTITY].data = contents;
+	a->variants[ASSET_IDENTITY].length = len;
+	a->variants[ASSET_IDENTITY].available = true;
+
+	/* Changes with every write, unless one within the same nanosecond
+	 * keeps the size. */
+	snprintf(tag, sizeof(tag), "%llx-%llx",
+		(unsigned long long)st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec,
+		(unsigned long long)len);
+
+	for(i = 0; i < ASSET_ENCODINGS; i++)
+	{
+		snprintf(a->variants[i].etag, sizeof(a->variants[i].etag), "\"%s%s\"",
+			tag, etag_suffixes[i]);
+	}
+
+	return a;
+
+fail:
+	if(fd >= 0)
+		close(fd);
+	if(copy >= 0)
+		close(copy);
+	free(contents);
+	asset_free(a);
+	return NULL;
+}
+
+static void account(struct asset *a, int sign)
+{
+	unsigned i;
+
+	stats.entries += sign;
+
+	for(i = 0; i < ASSET_ENCODINGS; i++)
+	{
+		if(a->variants[i].data)
+			stats.bytes += sign * (int64_t)a->variants[i].length;
+	}
+}
+
+/**
+ * Replaces the file called name by what is on disk now, dropping it if it
+ * is gone.  Called with the lock not held, compressing takes a while.
+ * Only ever called from one thread at a time, during startup or by the
+ * loader.
+ */
+static void asset_reload(const char *name)
+{
+	const struct asset_type *type;
+	struct asset *a, *old;
+	uint64_t hash = name_hash(name);
+
+	if((type = find_type(name)) == NULL)
+		return;
+
+	a = asset_load(name, type);
+
+	pthread_mutex_lock(&lock);
+
+	if((old = htable_remove(&assets, hash, asset_match, name)) != NULL)
+		account(old, -1);
+
+	if(a)
+	{
+		if(htable_insert(&assets, hash, a) < 0)
+		{
+			asset_put(a);
+			a = NULL;
+		}
+		else
+		{
+			account(a, 1);
+		}
+	}
+
+	if(old && a)
+		stats.reloads++;
+
+	pthread_mutex_unlock(&lock);
+
+	if(old)
+		asset_put(old);
+}
+
+static void asset_scan(void)
+{
+	struct dirent *de;
+	DIR *dir;
+
+	if((dir = opendir(dir_path)) == NULL)
+		return;
+
+	while((de = readdir(dir)) != NULL)
+		asset_reload(de->d_name);
+
+	closedir(dir);
+}
+
+int asset_init(const char *dir)
+{
+	htable_init(&assets);
+
+	if((dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -1;
+
+	if((dir_path = strdup(dir)) == NULL)
+		return -1;
+
+	asset_scan();
+	return 0;
+}
+
+/**
+ * Reads what inotify reports until asset_shutdown() closes stop_pipe.
+ */
+static void *loader_main(void *arg)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd fds[2];
+	ssize_t n;
+	char *p;
+
+	fds[0].fd = watch_fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = stop_pipe[0];
+	fds[1].events = POLLIN;
+
+	for(;;)
+	{
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+
+		if(fds[1].revents)
+			break;
+
+		while((n = read(watch_fd, buf, sizeof(buf))) > 0)
+		{
+			for(p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len)
+			{
+				ev = (const struct inotify_event *)p;
+
+				if(ev->mask & IN_Q_OVERFLOW)
+					asset_scan();
+				else if(ev->len > 0)
+					asset_reload(ev->name);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+int asset_watch(void)
+{
+	int err;
+
+	if((watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0)
+		return -1;
+
+	if(inotify_add_watch(watch_fd, dir_path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0 ||
+		pipe(stop_pipe) < 0)
+		goto fail;
+
+	if((err = pthread_create(&loader, NULL, loader_main, NULL)) != 0)
+	{
+		errno = err;
+		goto fail;
+	}
+
+	loader_running = true;
+	return 0;
+
+fail:
+	err = errno;
+
+	close(watch_fd);
+	watch_fd = -1;
+
+	if(stop_pipe[0] >= 0)
+	{
+		close(stop_pipe[0]);
+		close(stop_pipe[1]);
+		stop_pipe[0] = stop_pipe[1] = -1;
+	}
+
+	errno = err;
+	return -1;
+}
+
+void asset_shutdown(void)
+{
+	struct asset *a;
+	size_t pos = 0;
+
+	if(loader_running)
+	{
+		/* Closing the write end wakes the loader, a reload under way is
+		 * finished first. */
+		close(stop_pipe[1]);
+		pthread_join(loader, NULL);
+		loader_running = false;
+
+		close(stop_pipe[0]);
+		stop_pipe[0] = stop_pipe[1] = -1;
+	}
+
+	if(watch_fd >= 0)
+	{
+		close(watch_fd);
+		watch_fd = -1;
+	}
+
+	while((a = htable_next(&assets, &pos)) != NULL)
+		asset_put(a);
+
+	htable_destroy(&assets);
+
+	if(dir_fd >= 0)
+		close(dir_fd);
+
+	free(dir_path);
+}
+
+struct asset *asset_get(const char *name)
+{
+	struct asset *a;
+
+	pthread_mutex_lock(&lock);
+
+	if((a = htable_find(&assets, name_hash(name), asset_match, name)) != NULL)
+	{
+		asset_hold(a);
+		stats.hits++;
+	}
+	else
+	{
+		stats.misses++;
+	}
+
+	pthread_mutex_unlock(&lock);
+	return a;
+}
+
+/**
+ * Returns the encodings an Accept-Encoding value allows, identity always.
+ * Codings with q=0 are refused, other weights are not compared as the
+ * smallest encoding is preferred anyway.
+ */
+static unsigned accepted_encodings(const char *value)
+{
+	unsigned mask = 1u << ASSET_IDENTITY, enc;
+	const char *p = value, *end, *params;
+	size_t len;
+
+	while(p && *p)
+	{
+		while(*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+
+		end = p + strcspn(p, ",");
+		len = strcspn(p, " \t;,");
+		params = p + len;
+
+		if(len == 1 && *p == '*')
+			enc = ~0u;
+		else if((len == 4 && evutil_ascii_strncasecmp(p, "gzip", 4) == 0) || (len == 6 && evutil_ascii_strncasecmp(p, "x-gzip", 6) == 0))
+			enc = 1u << ASSET_GZIP;
+		else if(len == 2 && evutil_ascii_strncasecmp(p, "br", 2) == 0)
+			enc = 1u << ASSET_BROTLI;
+		else
+			enc = 0;
+
+		while(params < end && (params = strchr(params, ';')) != NULL && params < end)
+		{
+			params++;
+			while(*params == ' ' || *params == '\t')
+				params++;
+
+			if((params[0] == 'q' || params[0] == 'Q') && params[1] == '=' && strtod(params + 2, NULL) <= 0)
+				enc = 0;
+		}
+
+		mask |= enc;
+		p = end;
+	}
+
+	return mask;
+}
+
+enum asset_encoding asset_negotiate(const struct asset *a, const char *accept_encoding)
+{
+	enum asset_encoding best = ASSET_IDENTITY;
+	unsigned mask = accepted_encodings(accept_encoding);
+	unsigned i;
+
+	for(i = ASSET_IDENTITY + 1; i < ASSET_ENCODINGS; i++)
+	{
+		if((mask & (1u << i)) && a->variants[i].available &&
+			a->variants[i].length < a->variants[best].length)
+			best = i;
+	}
+
+	return best;
+}
+
+bool asset_not_modified(struct asset *a, const char *if_none_match)
+{
+	const char *p = if_none_match;
+	size_t len;
+	unsigned i;
+
+	while(p && *p)
+	{
+		while(*p == ' ' || *p == '\t' || *p == ',')
+			p++;
+
+		if(*p == '*')
+			goto matched;
+
+		if(strncmp(p, "W/", 2) == 0)
+			p += 2;
+
+		len = strcspn(p, " \t,");
+
+		for(i = 0; i < ASSET_ENCODINGS; i++)
+		{
+			if(a->variants[i].available && strlen(a->variants[i].etag) == len &&
+				strncmp(a->variants[i].etag, p, len) == 0)
+				goto matched;
+		}
+
+		p += len;
+	}
+
+	return false;
+
+matched:
+	pthread_mutex_lock(&lock);
+	stats.not_modified++;
+	pthread_mutex_unlock(&lock);
+	return true;
+}
+
+const char *asset_content_type(const struct asset *a)
+{
+	return a->type->content_type;
+}
+
+const char *asset_etag(const struct asset *a, enum asset_encoding enc)
+{
+	return a->variants[enc].etag;
+}
+
+size_t asset_length(const struct asset *a, enum asset_encoding enc)
+{
+	return a->variants[enc].length;
+}
+
+bool asset_is_file(const struct asset *a, enum asset_encoding enc)
+{
+	return enc == ASSET_IDENTITY && a->segment != NULL;
+}
+
+static void release_reference(const void *data, size_t len, void *udata)
+{
+	asset_put(udata);
+}
+
+int asset_add(struct evbuffer *out, struct asset *a, enum asset_encoding enc)
+{
+	const struct asset_variant *v = &a->variants[enc];
+
+	if(asset_is_file(a, enc))
+		return evbuffer_add_file_segment(out, a->segment, 0, v->length);
+
+	if(v->length == 0)
+		return 0;
+
+	asset_hold(a);
+
+	if(evbuffer_add_reference(out, v->data, v->length, release_reference, a) < 0)
+	{
+		asset_put(a);
+		return -1;
+	}
+
+	return 0;
+}
+
+void asset_get_stats(struct asset_stats *st)
+{
+	pthread_mutex_lock(&lock);
+	*st = stats;
+	pthread_mutex_unlock(&lock);
+}
+
+const char *asset_encoding_name(enum asset_encoding enc)
+{
+	return encoding_names[enc];
+}
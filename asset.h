@@ -0,0 +1,100 @@
+/* asset.h -- static files served from memory */
+
+#ifndef HADES_ASSET_H
+#define HADES_ASSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/buffer.h>
+
+/**
+ * Files at least this large are sent from the file with sendfile() rather
+ * than from a copy in memory.
+ */
+#define ASSET_SENDFILE_MIN (64 * 1024)
+
+/**
+ * Files larger than this are not precompressed.
+ */
+#define ASSET_COMPRESS_MAX (8 * 1024 * 1024)
+
+enum asset_encoding {
+	ASSET_IDENTITY,
+	ASSET_GZIP,
+	ASSET_BROTLI,
+	ASSET_ENCODINGS
+};
+
+struct asset;
+
+struct asset_stats {
+	uint64_t hits;
+	uint64_t not_modified;
+	uint64_t misses;
+	uint64_t reloads;
+	uint64_t entries;
+	uint64_t bytes;
+};
+
+/**
+ * Loads every file of a known type from dir, precompressing those worth
+ * compressing.  Must be called after libevent thread support is enabled.
+ */
+int asset_init(const char *dir);
+
+/**
+ * Watches dir with inotify from a loader thread, files written, moved in
+ * or deleted are reloaded or dropped there.  Returns -1 with errno set if
+ * watching fails, the files loaded so far are served regardless.
+ */
+int asset_watch(void);
+
+/**
+ * Stops watching and drops all files, responses still being sent keep
+ * theirs until done.
+ */
+void asset_shutdown(void);
+
+/**
+ * Returns a reference to the file called name, or NULL if there is none.
+ */
+struct asset *asset_get(const char *name);
+void asset_put(struct asset *a);
+
+/**
+ * Picks the smallest encoding the Accept-Encoding header value allows,
+ * which may be NULL.
+ */
+enum asset_encoding asset_negotiate(const struct asset *a, const char *accept_encoding);
+
+/**
+ * Returns true if the If-None-Match header value names any encoding of a,
+ * so a 304 may be sent instead.
+ */
+bool asset_not_modified(struct asset *a, const char *if_none_match);
+
+const char *asset_content_type(const struct asset *a);
+const char *asset_etag(const struct asset *a, enum asset_encoding enc);
+size_t asset_length(const struct asset *a, enum asset_encoding enc);
+
+/**
+ * Returns true if the content of enc is sent from the file and should be
+ * added straight to the output buffer of the connection, where sendfile()
+ * is used.
+ */
+bool asset_is_file(const struct asset *a, enum asset_encoding enc);
+
+/**
+ * Adds the content of enc to out without copying it.
+ */
+int asset_add(struct evbuffer *out, struct asset *a, enum asset_encoding enc);
+
+void asset_get_stats(struct asset_stats *st);
+
+/**
+ * Returns the Content-Encoding value of enc, NULL for identity.
+ */
+const char *asset_encoding_name(enum asset_encoding enc);
+
+#endif
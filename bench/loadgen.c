@@ -0,0 +1,696 @@
+/* loadgen.c -- load generator speaking the /session protocol
+ *
+ * Opens a number of sessions with a number of connections each to an echo
+ * upstream and keeps one message of the given size in flight per
+ * connection: as soon as the last byte of it has come back on the recv
+ * stream the next one is sent.  After a warmup the round trips are timed
+ * for a while and the results printed as a single JSON line, together
+ * with the proxy's CPU time and RSS when its pid is given.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/event.h>
+#include <event2/http.h>
+
+#include "../stats.h"
+
+/**
+ * Packet types of the recv stream and of act=batch bodies.
+ */
+#define PKT_CONNFAIL 0
+#define PKT_CONNECTED 1
+#define PKT_DISCONNECTED 2
+#define PKT_DATA 3
+#define PKT_RECONN 6
+
+#define VARINT_MAX 10
+#define HEADER_MAX (3 * VARINT_MAX)
+
+/**
+ * Time allowed for the sessions to be deleted at the end.
+ */
+#define SHUTDOWN_TIMEOUT 2
+
+struct bench_session;
+
+struct bench_conn {
+	struct bench_session *sess;
+	uint32_t id;
+	uint32_t seq;
+	bool connected;
+
+	/**
+	 * When the message in flight was sent and how much of it is back.
+	 */
+	uint64_t sent_at;
+	size_t received;
+};
+
+struct bench_session {
+	/**
+	 * Requests are queued on ctl, the recv stream has its own.
+	 */
+	struct evhttp_connection *ctl;
+	struct evhttp_connection *stream;
+	char sid[64];
+
+	struct bench_conn *conns;
+
+	/**
+	 * Unparsed recv stream data and packets waiting for the next
+	 * act=batch POST.
+	 */
+	struct evbuffer *rbuf;
+	struct evbuffer *pending;
+	bool posting;
+};
+
+struct results {
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t errors;
+	struct histogram latency;
+};
+
+static struct event_base *base;
+
+static const char *proxy_host = "127.0.0.1";
+static unsigned long proxy_port = 8080;
+static const char *upstream = "127.0.0.1:9999";
+static unsigned long num_sessions = 1;
+static unsigned long num_conns = 1;
+static unsigned long payload_size = 64;
+static unsigned long duration = 5;
+static unsigned long warmup = 1;
+static unsigned long proxy_pid = 0;
+static const char *engine = NULL;
+static bool batch = true;
+
+static struct bench_session *sessions;
+static char *payload;
+static struct results results;
+
+static bool measuring = false;
+static bool stopping = false;
+static unsigned deletes_pending = 0;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t put_varint(uint8_t *p, uint64_t value)
+{
+	size_t n = 0;
+
+	while(value >= 0x80)
+	{
+		p[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	p[n++] = value;
+
+	return n;
+}
+
+static size_t get_varint(const uint8_t *p, size_t avail, uint64_t *value)
+{
+	size_t n;
+
+	*value = 0;
+	for(n = 0; n < avail && n < VARINT_MAX; n++)
+	{
+		*value |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+		if(!(p[n] & 0x80))
+			return n + 1;
+	}
+
+	return 0;
+}
+
+static struct evhttp_request *request_new(void (*cb)(struct evhttp_request *, void *), void *arg)
+{
+	struct evhttp_request *req = evhttp_request_new(cb, arg);
+
+	if(req == NULL)
+	{
+		fprintf(stderr, "Request allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	evhttp_add_header(evhttp_request_get_output_headers(req), "Host", proxy_host);
+	return req;
+}
+
+static void post(struct bench_session *s, const char *uri, struct evbuffer *body,
+		void (*cb)(struct evhttp_request *, void *))
+{
+	struct evhttp_request *req = request_new(cb, s);
+
+	if(body)
+		evbuffer_add_buffer(evhttp_request_get_output_buffer(req), body);
+
+	if(evhttp_make_request(s->ctl, req, EVHTTP_REQ_POST, uri) < 0)
+		results.errors++;
+}
+
+static bool request_ok(struct evhttp_request *req)
+{
+	return req && evhttp_request_get_response_code(req) == 200;
+}
+
+static void handle_reply(struct evhttp_request *req, void *udata)
+{
+	if(!request_ok(req))
+		results.errors++;
+}
+
+static void handle_batch_reply(struct evhttp_request *req, void *udata);
+
+static void flush_batch(struct bench_session *s)
+{
+	char uri[128];
+
+	snprintf(uri, sizeof(uri), "/session?act=batch&sid=%s", s->sid);
+
+	s->posting = true;
+	post(s, uri, s->pending, handle_batch_reply);
+}
+
+static void handle_batch_reply(struct evhttp_request *req, void *udata)
+{
+	struct bench_session *s = udata;
+	struct evbuffer *body;
+	char *status;
+
+	s->posting = false;
+
+	if(!request_ok(req))
+	{
+		results.errors++;
+	}
+	else
+	{
+		body = evhttp_request_get_input_buffer(req);
+		evbuffer_add(body, "", 1);
+		status = (char *)evbuffer_pullup(body, -1);
+
+		for(status = strtok(status, " \r\n"); status; status = strtok(NULL, " \r\n"))
+		{
+			if(strcmp(status, "200"))
+				results.errors++;
+		}
+	}
+
+	if(evbuffer_get_length(s->pending) > 0)
+		flush_batch(s);
+}
+
+/**
+ * Queues a packet for the next act=batch POST, which is sent right away
+ * unless one is in flight already.
+ */
+static void queue_packet(struct bench_session *s, uint8_t type, uint32_t cid, const void *data, size_t len)
+{
+	uint8_t hdr[HEADER_MAX];
+	size_t n = 0;
+
+	n += put_varint(hdr + n, type);
+	n += put_varint(hdr + n, cid);
+	n += put_varint(hdr + n, len);
+
+	evbuffer_add(s->pending, hdr, n);
+	evbuffer_add(s->pending, data, len);
+
+	if(!s->posting)
+		flush_batch(s);
+}
+
+static void send_message(struct bench_conn *conn)
+{
+	struct bench_session *s = conn->sess;
+	struct evbuffer *body;
+	char uri[128];
+
+	if(stopping)
+		return;
+
+	conn->sent_at = now_usec();
+
+	if(batch)
+	{
+		queue_packet(s, PKT_DATA, conn->id, payload, payload_size);
+		return;
+	}
+
+	body = evbuffer_new();
+	evbuffer_add(body, payload, payload_size);
+
+	snprintf(uri, sizeof(uri), "/session?act=send&sid=%s&cid=%"PRIx32"&seq=%"PRIu32,
+		s->sid, conn->id, conn->seq++);
+	post(s, uri, body, handle_reply);
+
+	evbuffer_free(body);
+}
+
+static void handle_packet(struct bench_session *s, uint64_t type, uint64_t cid, size_t len)
+{
+	struct bench_conn *conn = NULL;
+
+	if(cid >= 1 && cid <= num_conns)
+		conn = &s->conns[cid - 1];
+
+	if(conn == NULL)
+		return;
+
+	switch(type)
+	{
+	case PKT_CONNECTED:
+		conn->connected = true;
+		send_message(conn);
+		break;
+	case PKT_CONNFAIL:
+	case PKT_DISCONNECTED:
+		conn->connected = false;
+		results.errors++;
+		break;
+	case PKT_DATA:
+		if(measuring)
+			results.bytes += len;
+
+		conn->received += len;
+		if(conn->received >= payload_size)
+		{
+			conn->received -= payload_size;
+
+			if(measuring)
+			{
+				results.messages++;
+				histogram_record(&results.latency, now_usec() - conn->sent_at);
+			}
+
+			send_message(conn);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Parses the varint framed packets that have arrived completely.
+ */
+static void parse_stream(struct bench_session *s)
+{
+	uint8_t hdr[HEADER_MAX];
+	ev_ssize_t avail;
+
+	while((avail = evbuffer_copyout(s->rbuf, hdr, sizeof(hdr))) > 0)
+	{
+		uint64_t type, cid, len;
+		size_t n, pos = 0;
+
+		if((n = get_varint(hdr + pos, avail - pos, &type)) == 0)
+			break;
+		pos += n;
+		if((n = get_varint(hdr + pos, avail - pos, &cid)) == 0)
+			break;
+		pos += n;
+		if((n = get_varint(hdr + pos, avail - pos, &len)) == 0)
+			break;
+		pos += n;
+
+		if(evbuffer_get_length(s->rbuf) < pos + len)
+			break;
+
+		evbuffer_drain(s->rbuf, pos + len);
+		handle_packet(s, type, cid, len);
+	}
+}
+
+static void start_recv(struct bench_session *s);
+
+static void handle_chunk(struct evhttp_request *req, void *udata)
+{
+	struct bench_session *s = udata;
+
+	evbuffer_add_buffer(s->rbuf, evhttp_request_get_input_buffer(req));
+	parse_stream(s);
+}
+
+static void handle_recv_done(struct evhttp_request *req, void *udata)
+{
+	struct bench_session *s = udata;
+
+	if(!request_ok(req))
+	{
+		if(!stopping)
+			results.errors++;
+		return;
+	}
+
+	handle_chunk(req, s);
+
+	/* The proxy ends the stream every few chunks. */
+	if(!stopping)
+		start_recv(s);
+}
+
+static void start_recv(struct bench_session *s)
+{
+	struct evhttp_request *req = request_new(handle_recv_done, s);
+	char uri[128];
+
+	snprintf(uri, sizeof(uri), "/session?act=recv&sid=%s&framing=2", s->sid);
+
+	evhttp_request_set_chunked_cb(req, handle_chunk);
+	if(evhttp_make_request(s->stream, req, EVHTTP_REQ_GET, uri) < 0)
+		results.errors++;
+}
+
+static void handle_created(struct evhttp_request *req, void *udata)
+{
+	struct bench_session *s = udata;
+	struct evbuffer *body;
+	char uri[256];
+	size_t len;
+	unsigned i;
+	char *sep;
+
+	if(!request_ok(req))
+	{
+		fprintf(stderr, "Creating a session failed\n");
+		exit(EXIT_FAILURE);
+	}
+
+	body = evhttp_request_get_input_buffer(req);
+	len = evbuffer_get_length(body);
+	if(len >= sizeof(s->sid))
+		len = sizeof(s->sid) - 1;
+
+	evbuffer_remove(body, s->sid, len);
+	s->sid[len] = 0;
+	s->sid[strcspn(s->sid, "\r\n")] = 0;
+
+	start_recv(s);
+
+	sep = strrchr(upstream, ':');
+
+	for(i = 0; i < num_conns; i++)
+	{
+		if(batch)
+		{
+			queue_packet(s, PKT_CONNECTED, s->conns[i].id, upstream, strlen(upstream));
+			continue;
+		}
+
+		snprintf(uri, sizeof(uri), "/session?act=connect&sid=%s&cid=%"PRIx32"&host=%.*s&port=%s",
+			s->sid, s->conns[i].id, (int)(sep - upstream), upstream, sep + 1);
+		post(s, uri, NULL, handle_reply);
+	}
+}
+
+/**
+ * Reads the CPU time in seconds and the RSS in KiB of a process.
+ */
+static bool proc_usage(unsigned long pid, double *cpu, unsigned long *rss)
+{
+	char path[64], line[512];
+	unsigned long utime, stime;
+	char *p;
+	FILE *f;
+
+	snprintf(path, sizeof(path), "/proc/%lu/stat", pid);
+	if((f = fopen(path, "r")) == NULL)
+		return false;
+
+	p = fgets(line, sizeof(line), f);
+	fclose(f);
+
+	/* utime and stime are the 12th and 13th field after the name. */
+	if(p == NULL || (p = strrchr(line, ')')) == NULL ||
+		sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+		return false;
+
+	*cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+	snprintf(path, sizeof(path), "/proc/%lu/status", pid);
+	if((f = fopen(path, "r")) == NULL)
+		return false;
+
+	*rss = 0;
+	while(fgets(line, sizeof(line), f))
+	{
+		if(sscanf(line, "VmRSS: %lu", rss) == 1)
+			break;
+	}
+	fclose(f);
+
+	return true;
+}
+
+static uint64_t started_at;
+static double cpu_at_start;
+
+static void handle_start(evutil_socket_t fd, short what, void *udata)
+{
+	unsigned long rss;
+
+	measuring = true;
+	started_at = now_usec();
+
+	if(proxy_pid && !proc_usage(proxy_pid, &cpu_at_start, &rss))
+		proxy_pid = 0;
+}
+
+static void handle_deleted(struct evhttp_request *req, void *udata)
+{
+	if(--deletes_pending == 0)
+		event_base_loopexit(base, NULL);
+}
+
+static void handle_stop(evutil_socket_t fd, short what, void *udata)
+{
+	struct timeval tv = { SHUTDOWN_TIMEOUT, 0 };
+	double seconds = (now_usec() - started_at) / 1e6;
+	double cpu = 0;
+	unsigned long rss = 0;
+	char uri[128];
+	unsigned i;
+
+	measuring = false;
+	stopping = true;
+
+	if(proxy_pid && proc_usage(proxy_pid, &cpu, &rss))
+		cpu -= cpu_at_start;
+
+	/* Tells apart the runs of a sweep over proxy I/O engines. */
+	if(engine)
+		printf("{\"engine\":\"%s\",", engine);
+	else
+		printf("{");
+
+	printf("\"mode\":\"%s\",\"sessions\":%lu,\"connections\":%lu,\"payload\":%lu,"
+		"\"seconds\":%.3f,\"messages\":%"PRIu64",\"errors\":%"PRIu64","
+		"\"msgs_per_sec\":%.1f,\"mib_per_sec\":%.3f,"
+		"\"p50_us\":%"PRIu64",\"p99_us\":%"PRIu64",\"p999_us\":%"PRIu64","
+		"\"proxy_cpu_percent\":%.1f,\"proxy_rss_kib\":%lu}\n",
+		batch ? "batch" : "send", num_sessions, num_conns, payload_size,
+		seconds, results.messages, results.errors,
+		results.messages / seconds, results.bytes / seconds / (1024 * 1024),
+		histogram_quantile(&results.latency, 0.5),
+		histogram_quantile(&results.latency, 0.99),
+		histogram_quantile(&results.latency, 0.999),
+		100 * cpu / seconds, rss);
+	fflush(stdout);
+
+	for(i = 0; i < num_sessions; i++)
+	{
+		if(sessions[i].sid[0] == 0)
+			continue;
+
+		snprintf(uri, sizeof(uri), "/session?act=delete&sid=%s", sessions[i].sid);
+		post(&sessions[i], uri, NULL, handle_deleted);
+		deletes_pending++;
+	}
+
+	event_base_loopexit(base, deletes_pending ? &tv : NULL);
+}
+
+static void show_usage(void)
+{
+	fprintf(stderr,
+		"Usage: loadgen [OPTION]...\n"
+		"Available options:\n"
+		" -H HOST	Proxy host (default 127.0.0.1)\n"
+		" -p PORT	Proxy port (default 8080)\n"
+		" -u HOST:PORT	Echo upstream the proxy connects to (default 127.0.0.1:9999)\n"
+		" -s SESSIONS	Number of sessions (default 1)\n"
+		" -c CONNS	Connections per session (default 1)\n"
+		" -b BYTES	Message size (default 64)\n"
+		" -d SECONDS	Measured duration (default 5)\n"
+		" -w SECONDS	Warmup before measuring (default 1)\n"
+		" -m MODE	Uplink: batch or send (default batch)\n"
+		" -P PID	Proxy process to report CPU time and RSS of\n"
+		" -e ENGINE	I/O engine of the proxy to label the results with\n"
+		" -h 		Prints this information\n");
+}
+
+static unsigned long parse_number(const char *str, unsigned long min, unsigned long max)
+{
+	unsigned long value;
+	char *end;
+
+	value = strtoul(str, &end, 10);
+	if(*str == 0 || *end != 0 || value < min || value > max)
+	{
+		fprintf(stderr, "Error: Invalid number: %s\n", str);
+		show_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	return value;
+}
+
+int main(int argc, char **argv)
+{
+	struct timeval tv = { 0, 0 };
+	struct event *start_ev, *stop_ev;
+	unsigned i, j;
+	int c;
+
+	while((c = getopt(argc, argv, "hH:p:u:s:c:b:d:w:m:P:e:")) != -1)
+	{
+		switch(c)
+		{
+		case 'H':
+			proxy_host = optarg;
+			break;
+		case 'p':
+			proxy_port = parse_number(optarg, 1, 0xffff);
+			break;
+		case 'u':
+			upstream = optarg;
+			break;
+		case 's':
+			num_sessions = parse_number(optarg, 1, 100000);
+			break;
+		case 'c':
+			num_conns = parse_number(optarg, 1, 100000);
+			break;
+		case 'b':
+			payload_size = parse_number(optarg, 1, 16 * 1024 * 1024);
+			break;
+		case 'd':
+			duration = parse_number(optarg, 1, 3600);
+			break;
+		case 'w':
+			warmup = parse_number(optarg, 0, 3600);
+			break;
+		case 'm':
+			if(strcmp(optarg, "batch") && strcmp(optarg, "send"))
+			{
+				fprintf(stderr, "Error: Invalid mode: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			batch = !strcmp(optarg, "batch");
+			break;
+		case 'P':
+			proxy_pid = parse_number(optarg, 1, 0xffffffffUL);
+			break;
+		case 'e':
+			engine = optarg;
+			break;
+		case 'h':
+			show_usage();
+			return EXIT_SUCCESS;
+		default:
+			show_usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(strrchr(upstream, ':') == NULL)
+	{
+		fprintf(stderr, "Error: Invalid upstream: %s\n", upstream);
+		return EXIT_FAILURE;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	base = event_base_new();
+	payload = malloc(payload_size);
+	sessions = calloc(num_sessions, sizeof(struct bench_session));
+	if(base == NULL || payload == NULL || sessions == NULL)
+	{
+		fprintf(stderr, "Initialization failed\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(payload, 'x', payload_size);
+
+	for(i = 0; i < num_sessions; i++)
+	{
+		struct bench_session *s = &sessions[i];
+
+		s->ctl = evhttp_connection_base_new(base, NULL, proxy_host, proxy_port);
+		s->stream = evhttp_connection_base_new(base, NULL, proxy_host, proxy_port);
+		s->conns = calloc(num_conns, sizeof(struct bench_conn));
+		s->rbuf = evbuffer_new();
+		s->pending = evbuffer_new();
+		if(s->ctl == NULL || s->stream == NULL || s->conns == NULL || s->rbuf == NULL || s->pending == NULL)
+		{
+			fprintf(stderr, "Session allocation failed\n");
+			return EXIT_FAILURE;
+		}
+
+		for(j = 0; j < num_conns; j++)
+		{
+			s->conns[j].sess = s;
+			s->conns[j].id = j + 1;
+		}
+
+		post(s, "/session?act=create", NULL, handle_created);
+	}
+
+	start_ev = evtimer_new(base, handle_start, NULL);
+	stop_ev = evtimer_new(base, handle_stop, NULL);
+
+	tv.tv_sec = warmup;
+	evtimer_add(start_ev, &tv);
+	tv.tv_sec = warmup + duration;
+	evtimer_add(stop_ev, &tv);
+
+	event_base_dispatch(base);
+
+	event_free(start_ev);
+	event_free(stop_ev);
+
+	for(i = 0; i < num_sessions; i++)
+	{
+		evhttp_connection_free(sessions[i].ctl);
+		evhttp_connection_free(sessions[i].stream);
+		evbuffer_free(sessions[i].rbuf);
+		evbuffer_free(sessions[i].pending);
+		free(sessions[i].conns);
+	}
+
+	free(sessions);
+	free(payload);
+	event_base_free(base);
+
+	return results.messages > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# run.sh -- sweeps the load generator over sessions x connections x payload
+# sizes against a local proxy and echo upstream, one JSON line per point.
+#
+# Override the sweep through the environment, e.g.
+#   BENCH_SESSIONS="1 10" BENCH_PAYLOADS="64" make bench
+#
+# BENCH_ENGINES="libevent uring" runs the sweep once per upstream I/O
+# engine, restarting the proxy with -e in between.
+
+set -e
+
+cd "$(dirname "$0")/.."
+
+PROXY_PORT=${BENCH_PROXY_PORT:-8089}
+UPSTREAM_PORT=${BENCH_UPSTREAM_PORT:-9989}
+THREADS=${BENCH_THREADS:-1}
+SESSIONS=${BENCH_SESSIONS:-"1 10 50"}
+CONNS=${BENCH_CONNS:-"1 8"}
+PAYLOADS=${BENCH_PAYLOADS:-"64 1024 16384"}
+MODES=${BENCH_MODES:-"batch send"}
+DURATION=${BENCH_DURATION:-3}
+ENGINES=${BENCH_ENGINES:-"libevent"}
+
+./bench/upstream -p "$UPSTREAM_PORT" &
+UPSTREAM_PID=$!
+PROXY_PID=
+PROXY_LOG=$(mktemp)
+
+trap 'kill $UPSTREAM_PID $PROXY_PID 2> /dev/null; rm -f "$PROXY_LOG"' EXIT
+
+for engine in $ENGINES; do
+	./hades -e "$engine" -p "$PROXY_PORT" -t "$THREADS" -l warn > "$PROXY_LOG" 2>&1 &
+	PROXY_PID=$!
+
+	sleep 1
+
+	# A proxy that cannot use the engine falls back to libevent, which
+	# would be labelled wrongly.
+	if grep -q "not available" "$PROXY_LOG"; then
+		echo "Engine $engine is not available, skipped" >&2
+		kill $PROXY_PID
+		wait $PROXY_PID 2> /dev/null || true
+		PROXY_PID=
+		continue
+	fi
+
+	for mode in $MODES; do
+		for sessions in $SESSIONS; do
+			for conns in $CONNS; do
+				for payload in $PAYLOADS; do
+					./bench/loadgen -p "$PROXY_PORT" -u "127.0.0.1:$UPSTREAM_PORT" \
+						-s "$sessions" -c "$conns" -b "$payload" -m "$mode" \
+						-d "$DURATION" -P "$PROXY_PID" -e "$engine"
+				done
+			done
+		done
+	done
+
+	kill $PROXY_PID
+	wait $PROXY_PID 2> /dev/null || true
+	PROXY_PID=
+done
@@ -0,0 +1,143 @@
+/* upstream.c -- TCP echo or sink server for benchmarking the proxy */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+
+/**
+ * Echoing stops reading while this much is waiting to go back out.
+ */
+#define OUTPUT_HIGH_WATERMARK (1024 * 1024)
+
+static bool sink = false;
+
+static void handle_read(struct bufferevent *bev, void *udata)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+
+	if(sink)
+	{
+		evbuffer_drain(input, evbuffer_get_length(input));
+		return;
+	}
+
+	evbuffer_add_buffer(bufferevent_get_output(bev), input);
+
+	if(evbuffer_get_length(bufferevent_get_output(bev)) >= OUTPUT_HIGH_WATERMARK)
+		bufferevent_disable(bev, EV_READ);
+}
+
+static void handle_write(struct bufferevent *bev, void *udata)
+{
+	bufferevent_enable(bev, EV_READ);
+}
+
+static void handle_event(struct bufferevent *bev, short what, void *udata)
+{
+	if(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		bufferevent_free(bev);
+}
+
+static void handle_accept(struct evconnlistener *listener, evutil_socket_t fd,
+		struct sockaddr *addr, int socklen, void *udata)
+{
+	struct event_base *base = udata;
+	struct bufferevent *bev = bufferevent_socket_new(base, fd, BEV_OPT_CLOSE_ON_FREE);
+
+	if(bev == NULL)
+	{
+		evutil_closesocket(fd);
+		return;
+	}
+
+	/* Resume reading once the output is down to half the mark. */
+	bufferevent_setwatermark(bev, EV_WRITE, OUTPUT_HIGH_WATERMARK / 2, 0);
+	bufferevent_setcb(bev, handle_read, handle_write, handle_event, NULL);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+static void show_usage(void)
+{
+	fprintf(stderr,
+		"Usage: upstream [OPTION]...\n"
+		"Available options:\n"
+		" -p PORT	Binds to the given port (default 9999)\n"
+		" -s 		Discards everything instead of echoing it\n"
+		" -h 		Prints this information\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct event_base *base;
+	struct evconnlistener *listener;
+	struct sockaddr_in sin;
+	unsigned long port = 9999;
+	char *end;
+	int c;
+
+	while((c = getopt(argc, argv, "hp:s")) != -1)
+	{
+		switch(c)
+		{
+		case 'p':
+			port = strtoul(optarg, &end, 10);
+			if(*optarg == 0 || *end != 0 || port < 1 || port > 0xffff)
+			{
+				fprintf(stderr, "Error: Invalid port: %s\n", optarg);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			sink = true;
+			break;
+		case 'h':
+			show_usage();
+			return EXIT_SUCCESS;
+		default:
+			show_usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	base = event_base_new();
+	if(base == NULL)
+	{
+		fprintf(stderr, "Failed to create event base\n");
+		return EXIT_FAILURE;
+	}
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	listener = evconnlistener_new_bind(base, handle_accept, base,
+		LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE, -1, (struct sockaddr *)&sin, sizeof(sin));
+	if(listener == NULL)
+	{
+		fprintf(stderr, "Binding to port %lu failed\n", port);
+		return EXIT_FAILURE;
+	}
+
+	event_base_dispatch(base);
+
+	evconnlistener_free(listener);
+	event_base_free(base);
+
+	return EXIT_SUCCESS;
+}
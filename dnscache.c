@@ -0,0 +1,595 @@
+/* dnscache.c -- process-wide cache of host name resolutions
+ *
+ * Every worker has an evdns base of its own, but the hosts their sessions
+ * connect to are mostly the same few.  Resolutions are kept here, shared by
+ * all workers, for as long as their TTL allows.  Names that do not exist
+ * or have no addresses are remembered for DNSCACHE_NEGATIVE_TTL seconds,
+ * timeouts and server failures not at all.  Lookups of a name that is
+ * already being resolved queue up on its entry and are all answered by the
+ * one pair of A and AAAA queries.
+ *
+ * Results are handed to the requester by activating an event on its own
+ * base, so callbacks never run from within dnscache_resolve() and workers
+ * never run each other's code.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/queue.h>
+
+#include <event2/util.h>
+
+#include "dnscache.h"
+#include "htable.h"
+
+#define DNSCACHE_MAX_NAME 255
+
+/**
+ * Expired entries are swept out once the cache holds this many.
+ */
+#define DNSCACHE_MAX_ENTRIES 4096
+
+/**
+ * TTLs in seconds.  Those of answers are clamped to [MIN, MAX].
+ */
+#define DNSCACHE_MIN_TTL 1
+#define DNSCACHE_MAX_TTL 3600
+#define DNSCACHE_NEGATIVE_TTL 30
+
+/**
+ * With refreshing enabled, entries looked up this many times are resolved
+ * again on the first lookup with less than a tenth of their TTL left.
+ */
+#define DNSCACHE_REFRESH_HITS 4
+
+#define HOSTS_FILE "/etc/hosts"
+
+struct dnscache_entry;
+
+struct dnscache_request {
+	TAILQ_ENTRY(dnscache_request) next;
+	struct dnscache_entry *entry;
+
+	struct event *ev;
+	dnscache_cb cb;
+	void *arg;
+
+	/**
+	 * Set under the lock once ev has been activated, from then on the
+	 * request only belongs to the thread of its base.
+	 */
+	bool scheduled;
+
+	int error;
+	struct dnscache_addrs addrs;
+};
+
+TAILQ_HEAD(dnscache_request_list, dnscache_request);
+
+struct dnscache_entry {
+	char name[DNSCACHE_MAX_NAME + 1];
+
+	/**
+	 * Outcome of the last resolution, valid until expires (monotonic
+	 * microseconds).  Entries from the hosts file never expire.
+	 */
+	bool resolved;
+	bool permanent;
+	int error;
+	struct dnscache_addrs addrs;
+	uint64_t expires;
+	uint64_t ttl;
+	unsigned hits;
+
+	/**
+	 * Queries in flight and what they returned so far, A first.
+	 */
+	unsigned pending;
+	int errors[2];
+	uint32_t ttls[2];
+	struct dnscache_addrs next;
+
+	struct dnscache_request_list waiters;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct htable entries;
+static bool refresh_ahead;
+static struct dnscache_stats stats;
+
+static uint64_t now_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t name_hash(const char *name)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	while(*name)
+	{
+		hash ^= (unsigned char)*name++;
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+static bool entry_match(const void *value, const void *key)
+{
+	const struct dnscache_entry *entry = value;
+
+	return strcmp(entry->name, key) == 0;
+}
+
+/**
+ * Lowercases host into name, without a trailing dot.  Returns false for
+ * names too long or empty.
+ */
+static bool normalize_name(const char *host, char *name)
+{
+	size_t len = strlen(host), i;
+
+	if(len > 0 && host[len - 1] == '.')
+		len--;
+
+	if(len == 0 || len > DNSCACHE_MAX_NAME)
+		return false;
+
+	for(i = 0; i < len; i++)
+		name[i] = tolower((unsigned char)host[i]);
+	name[len] = 0;
+
+	return true;
+}
+
+static bool entry_idle(const struct dnscache_entry *entry)
+{
+	return !entry->permanent && entry->pending == 0 && TAILQ_EMPTY(&entry->waiters);
+}
+
+static void entry_remove(struct dnscache_entry *entry)
+{
+	htable_remove(&entries, name_hash(entry->name), entry_match, entry->name);
+	free(entry);
+}
+
+/**
+ * Drops expired entries nobody waits for and, if that is not enough, any
+ * idle entry until there is room for one more.
+ */
+static void make_room(uint64_t now)
+{
+	struct dnscache_entry *entry;
+	size_t pos = 0;
+
+	while((entry = htable_next(&entries, &pos)) != NULL)
+	{
+		if(entry_idle(entry) && (!entry->resolved || entry->expires <= now))
+			entry_remove(entry);
+	}
+
+	pos = 0;
+	while(htable_count(&entries) >= DNSCACHE_MAX_ENTRIES && (entry = htable_next(&entries, &pos)) != NULL)
+	{
+		if(entry_idle(entry))
+			entry_remove(entry);
+	}
+}
+
+static struct dnscache_entry *entry_new(const char *name, uint64_t now)
+{
+	struct dnscache_entry *entry;
+
+	if(htable_count(&entries) >= DNSCACHE_MAX_ENTRIES)
+		make_room(now);
+
+	entry = calloc(1, sizeof(*entry));
+	if(entry == NULL)
+		return NULL;
+
+	strcpy(entry->name, name);
+	TAILQ_INIT(&entry->waiters);
+
+	if(htable_insert(&entries, name_hash(name), entry) < 0)
+	{
+		free(entry);
+		return NULL;
+	}
+
+	return entry;
+}
+
+static void add_addr(struct dnscache_addrs *addrs, int family, const void *addr)
+{
+	if(family == AF_INET && addrs->num4 < DNSCACHE_MAX_ADDRS)
+		memcpy(&addrs->addr4[addrs->num4++], addr, sizeof(struct in_addr));
+	else if(family == AF_INET6 && addrs->num6 < DNSCACHE_MAX_ADDRS)
+		memcpy(&addrs->addr6[addrs->num6++], addr, sizeof(struct in6_addr));
+}
+
+static void handle_deliver(evutil_socket_t fd, short what, void *arg)
+{
+	struct dnscache_request *req = arg;
+
+	event_free(req->ev);
+	req->cb(req->error, &req->addrs, req->arg);
+	free(req);
+}
+
+/**
+ * Hands the result in req over to the thread of its base.
+ */
+static void request_schedule(struct dnscache_request *req)
+{
+	req->scheduled = true;
+	event_active(req->ev, EV_TIMEOUT, 0);
+}
+
+static bool negative_error(int error)
+{
+	return error == DNS_ERR_NONE || error == DNS_ERR_NOTEXIST || error == DNS_ERR_NODATA;
+}
+
+/**
+ * Called with the lock held once both queries of entry have returned.
+ */
+static void entry_complete(struct dnscache_entry *entry)
+{
+	struct dnscache_request *req;
+	const struct dnscache_addrs *addrs = &entry->next;
+	uint64_t ttl = DNSCACHE_MAX_TTL;
+	bool cache = true;
+	int error;
+
+	if(addrs->num4 > 0 || addrs->num6 > 0)
+	{
+		error = DNS_ERR_NONE;
+
+		if(addrs->num4 > 0 && entry->ttls[0] < ttl)
+			ttl = entry->ttls[0];
+		if(addrs->num6 > 0 && entry->ttls[1] < ttl)
+			ttl = entry->ttls[1];
+		if(ttl < DNSCACHE_MIN_TTL)
+			ttl = DNSCACHE_MIN_TTL;
+	}
+	else if(negative_error(entry->errors[0]) && negative_error(entry->errors[1]))
+	{
+		if(entry->errors[0] == DNS_ERR_NOTEXIST || entry->errors[1] == DNS_ERR_NOTEXIST)
+			error = DNS_ERR_NOTEXIST;
+		else
+			error = DNS_ERR_NODATA;
+
+		ttl = DNSCACHE_NEGATIVE_TTL;
+	}
+	else
+	{
+		/* Nothing learned, a failed refresh keeps the previous result. */
+		error = entry->errors[0] != DNS_ERR_NONE ? entry->errors[0] : entry->errors[1];
+		cache = false;
+	}
+
+	if(cache)
+	{
+		entry->resolved = true;
+		entry->error = error;
+		entry->addrs = *addrs;
+		entry->ttl = ttl * 1000000;
+		entry->expires = now_usec() + entry->ttl;
+		entry->hits = 0;
+	}
+
+	while((req = TAILQ_FIRST(&entry->waiters)) != NULL)
+	{
+		TAILQ_REMOVE(&entry->waiters, req, next);
+
+		req->entry = NULL;
+		req->error = error;
+		if(error == DNS_ERR_NONE)
+			req->addrs = *addrs;
+
+		request_schedule(req);
+	}
+
+	if(!entry->resolved)
+		entry_remove(entry);
+}
+
+static void handle_reply(int family, int result, int count, uint32_t ttl, void *addresses, void *arg)
+{
+	struct dnscache_entry *entry = arg;
+	unsigned i = family == AF_INET ? 0 : 1;
+	size_t size = family == AF_INET ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+	int n;
+
+	pthread_mutex_lock(&lock);
+
+	entry->errors[i] = result;
+	entry->ttls[i] = ttl;
+
+	if(result == DNS_ERR_NONE)
+	{
+		for(n = 0; n < count; n++)
+			add_addr(&entry->next, family, (const char *)addresses + n * size);
+	}
+
+	if(--entry->pending == 0)
+		entry_complete(entry);
+
+	pthread_mutex_unlock(&lock);
+}
+
+static void handle_reply4(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+	handle_reply(AF_INET, result, count, ttl, addresses, arg);
+}
+
+static void handle_reply6(int result, char type, int count, int ttl, void *addresses, void *arg)
+{
+	handle_reply(AF_INET6, result, count, ttl, addresses, arg);
+}
+
+/**
+ * Called with the lock held before starting the queries.
+ */
+static void entry_prepare(struct dnscache_entry *entry)
+{
+	entry->pending = 2;
+	entry->errors[0] = entry->errors[1] = DNS_ERR_NONE;
+	entry->ttls[0] = entry->ttls[1] = 0;
+	memset(&entry->next, 0, sizeof(entry->next));
+}
+
+/**
+ * Called without the lock, evdns may answer right away.
+ */
+static void entry_start(struct dnscache_entry *entry, struct evdns_base *dns)
+{
+	if(evdns_base_resolve_ipv4(dns, entry->name, 0, handle_reply4, entry) == NULL)
+		handle_reply4(DNS_ERR_UNKNOWN, DNS_IPv4_A, 0, 0, NULL, entry);
+
+	if(evdns_base_resolve_ipv6(dns, entry->name, 0, handle_reply6, entry) == NULL)
+		handle_reply6(DNS_ERR_UNKNOWN, DNS_IPv6_AAAA, 0, 0, NULL, entry);
+}
+
+static void add_host(const char *host, int family, const void *addr)
+{
+	struct dnscache_entry *entry;
+	char name[DNSCACHE_MAX_NAME + 1];
+
+	if(!normalize_name(host, name))
+		return;
+
+	entry = htable_find(&entries, name_hash(name), entry_match, name);
+	if(entry == NULL)
+	{
+		entry = entry_new(name, 0);
+		if(entry == NULL)
+			return;
+
+		entry->resolved = true;
+		entry->permanent = true;
+		entry->error = DNS_ERR_NONE;
+	}
+
+	add_addr(&entry->addrs, family, addr);
+}
+
+/**
+ * The A and AAAA queries do not consult the hosts file the way
+ * getaddrinfo() does, so its names are loaded as permanent entries.
+ */
+static void load_hosts(void)
+{
+	static const struct in6_addr loopback6 = IN6ADDR_LOOPBACK_INIT;
+	struct in_addr loopback4;
+	char line[1024];
+	FILE *f;
+
+	f = fopen(HOSTS_FILE, "r");
+	while(f && fgets(line, sizeof(line), f))
+	{
+		struct in6_addr addr;
+		char *p = line, *token;
+		int family;
+
+		p[strcspn(p, "#\r\n")] = 0;
+
+		p += strspn(p, " \t");
+		token = p;
+		p += strcspn(p, " \t");
+		if(*p)
+			*p++ = 0;
+
+		if(evutil_inet_pton(AF_INET, token, &addr) == 1)
+			family = AF_INET;
+		else if(evutil_inet_pton(AF_INET6, token, &addr) == 1)
+			family = AF_INET6;
+		else
+			continue;
+
+		for(;;)
+		{
+			p += strspn(p, " \t");
+			if(*p == 0)
+				break;
+
+			token = p;
+			p += strcspn(p, " \t");
+			if(*p)
+				*p++ = 0;
+
+			add_host(token, family, &addr);
+		}
+	}
+
+	if(f)
+		fclose(f);
+
+	if(htable_find(&entries, name_hash("localhost"), entry_match, "localhost") == NULL)
+	{
+		loopback4.s_addr = htonl(INADDR_LOOPBACK);
+		add_host("localhost", AF_INET, &loopback4);
+		add_host("localhost", AF_INET6, &loopback6);
+	}
+}
+
+int dnscache_init(bool refresh)
+{
+	htable_init(&entries);
+	refresh_ahead = refresh;
+
+	load_hosts();
+
+	return 0;
+}
+
+void dnscache_shutdown(void)
+{
+	struct dnscache_entry *entry;
+	size_t pos = 0;
+
+	while((entry = htable_next(&entries, &pos)) != NULL)
+		entry_remove(entry);
+
+	htable_destroy(&entries);
+}
+
+struct dnscache_request *dnscache_resolve(struct event_base *base, struct evdns_base *dns,
+		const char *host, dnscache_cb cb, void *arg)
+{
+	struct dnscache_request *req;
+	struct dnscache_entry *entry;
+	char name[DNSCACHE_MAX_NAME + 1];
+	struct in6_addr addr;
+	bool start = false;
+	uint64_t now;
+
+	req = calloc(1, sizeof(*req));
+	if(req == NULL)
+		return NULL;
+
+	req->ev = event_new(base, -1, 0, handle_deliver, req);
+	if(req->ev == NULL)
+	{
+		free(req);
+		return NULL;
+	}
+
+	req->cb = cb;
+	req->arg = arg;
+
+	/* Numeric addresses are not cached. */
+	if(evutil_inet_pton(AF_INET, host, &addr) == 1)
+	{
+		add_addr(&req->addrs, AF_INET, &addr);
+		request_schedule(req);
+		return req;
+	}
+
+	if(evutil_inet_pton(AF_INET6, host, &addr) == 1)
+	{
+		add_addr(&req->addrs, AF_INET6, &addr);
+		request_schedule(req);
+		return req;
+	}
+
+	if(!normalize_name(host, name))
+	{
+		req->error = DNS_ERR_NOTEXIST;
+		request_schedule(req);
+		return req;
+	}
+
+	now = now_usec();
+
+	pthread_mutex_lock(&lock);
+
+	entry = htable_find(&entries, name_hash(name), entry_match, name);
+
+	if(entry && entry->resolved && (entry->permanent || now < entry->expires))
+	{
+		if(entry->error == DNS_ERR_NONE)
+			stats.hits++;
+		else
+			stats.negative_hits++;
+
+		req->error = entry->error;
+		req->addrs = entry->addrs;
+		request_schedule(req);
+
+		entry->hits++;
+		if(refresh_ahead && !entry->permanent && entry->error == DNS_ERR_NONE && entry->pending == 0
+			&& entry->hits >= DNSCACHE_REFRESH_HITS && entry->expires - now < entry->ttl / 10)
+		{
+			stats.refreshes++;
+			entry_prepare(entry);
+			start = true;
+		}
+	}
+	else if(entry && entry->pending > 0)
+	{
+		stats.coalesced++;
+
+		req->entry = entry;
+		TAILQ_INSERT_TAIL(&entry->waiters, req, next);
+	}
+	else
+	{
+		stats.misses++;
+
+		if(entry == NULL)
+			entry = entry_new(name, now);
+
+		if(entry == NULL)
+		{
+			req->error = DNS_ERR_UNKNOWN;
+			request_schedule(req);
+		}
+		else
+		{
+			req->entry = entry;
+			TAILQ_INSERT_TAIL(&entry->waiters, req, next);
+
+			entry_prepare(entry);
+			start = true;
+		}
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	if(start)
+		entry_start(entry, dns);
+
+	return req;
+}
+
+void dnscache_cancel(struct dnscache_request *req)
+{
+	pthread_mutex_lock(&lock);
+
+	if(!req->scheduled)
+		TAILQ_REMOVE(&req->entry->waiters, req, next);
+
+	pthread_mutex_unlock(&lock);
+
+	event_free(req->ev);
+	free(req);
+}
+
+void dnscache_get_stats(struct dnscache_stats *st)
+{
+	pthread_mutex_lock(&lock);
+
+	*st = stats;
+	st->entries = htable_count(&entries);
+
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,72 @@
+/* dnscache.h -- process-wide cache of host name resolutions */
+
+#ifndef HADES_DNSCACHE_H
+#define HADES_DNSCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <netinet/in.h>
+
+#include <event2/event.h>
+#include <event2/dns.h>
+
+#define DNSCACHE_MAX_ADDRS 8
+
+/**
+ * Addresses a name resolved to, at most DNSCACHE_MAX_ADDRS per family in
+ * the order the server returned them.
+ */
+struct dnscache_addrs {
+	unsigned num4;
+	unsigned num6;
+	struct in_addr addr4[DNSCACHE_MAX_ADDRS];
+	struct in6_addr addr6[DNSCACHE_MAX_ADDRS];
+};
+
+/**
+ * Called on the thread running the event base the lookup was started
+ * from, never from within dnscache_resolve().  error is DNS_ERR_NONE with
+ * at least one address, or one of the DNS_ERR_* codes.
+ */
+typedef void (*dnscache_cb)(int error, const struct dnscache_addrs *addrs, void *arg);
+
+struct dnscache_request;
+
+struct dnscache_stats {
+	uint64_t hits;
+	uint64_t negative_hits;
+	uint64_t misses;
+	uint64_t coalesced;
+	uint64_t refreshes;
+	uint64_t entries;
+};
+
+/**
+ * Loads /etc/hosts.  With refresh set, names looked up often are resolved
+ * again shortly before they expire so they never miss.
+ */
+int dnscache_init(bool refresh);
+
+/**
+ * Frees all entries, the evdns bases used for lookups must have been
+ * freed already.
+ */
+void dnscache_shutdown(void);
+
+/**
+ * Looks up host, querying the name servers of dns on a miss.  Lookups of
+ * a name already being resolved wait for that resolution.  Returns NULL
+ * if the request could not be allocated.
+ */
+struct dnscache_request *dnscache_resolve(struct event_base *base, struct evdns_base *dns,
+		const char *host, dnscache_cb cb, void *arg);
+
+/**
+ * Drops a request whose callback has not been called yet.
+ */
+void dnscache_cancel(struct dnscache_request *req);
+
+void dnscache_get_stats(struct dnscache_stats *st);
+
+#endif
@@ -17,24 +17,164 @@
 #include <stdint.h>
 #include <string.h>
 #include <inttypes.h>
+#include <pthread.h>
 
 #include <errno.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 #include <event.h>
 #include <evutil.h>
 #include <evhttp.h>
 #include <evdns.h>
-
-#include "tree.h"
+#include <event2/listener.h>
+#include <event2/thread.h>
+
+#include <zlib.h>
+
+#include "asset.h"
+#include "dnscache.h"
+#include "htable.h"
+#include "log.h"
+#include "mem.h"
+#include "pool.h"
+#include "restart.h"
+#include "stats.h"
+#include "tunnel.h"
+#include "udp.h"
+#include "uring.h"
+#include "wheel.h"
+#include "ws.h"
 
 #ifdef WIN32
 #pragma comment(lib, "libevent-2.0.5-beta/libevent.lib")
 #pragma comment(lib, "ws2_32.lib")
 #endif
 
+#define MAX_WORKERS 256
+
+/**
+ * Number of sequenced sends a connection accepts ahead of the next one it
+ * is waiting for.
+ */
+#define SEND_WINDOW 16
+
+/**
+ * Sessions and connections are allocated this many at a time, and up to
+ * EVBUFFER_POOL_MAX emptied buffers are kept per worker.
+ */
+#define SESSION_SLAB 64
+#define CONNECTION_SLAB 256
+#define EVBUFFER_POOL_MAX 256
+
+/**
+ * Longest flush delay a recv may ask for, in milliseconds, and the amount
+ * of pending data that is flushed regardless of the delay.
+ */
+#define FLUSH_DELAY_MAX 100
+#define FLUSH_DELAY_BYTES (64 * 1024)
+
+/**
+ * Budgets of XHR recv streams that do not negotiate their own, in bytes
+ * and milliseconds.
+ */
+#define RECV_MAX_BYTES (1024 * 1024)
+#define RECV_MAX_AGE 30000
+
+/**
+ * Bytes of packets already passed on that a session keeps for resending
+ * when a recv stream resumes after a loss.
+ */
+#define REPLAY_MAX (512 * 1024)
+
+/**
+ * Window bits of the deflate streams of compressed recv streams, the
+ * largest whose window and hash chains, 2^(bits + 3) bytes with a memLevel
+ * of bits - 7, fit deflate_mem_max along with DEFLATE_OVERHEAD bytes of
+ * state.  Output is produced DEFLATE_CHUNK bytes at a time.
+ */
+#define DEFLATE_MIN_BITS 9
+#define DEFLATE_MAX_BITS 15
+#define DEFLATE_OVERHEAD (8 * 1024)
+#define DEFLATE_CHUNK 4096
+
+/**
+ * Head start in milliseconds every connection attempt gets before the
+ * next address is tried as well, RFC 8305's Connection Attempt Delay.
+ */
+#define CONNECT_ATTEMPT_DELAY 250
+#define CONNECT_ATTEMPTS_MAX (2 * DNSCACHE_MAX_ADDRS)
+
+/**
+ * Length of a timing wheel tick in milliseconds, and the number of expired
+ * sessions and connections reaped per pass of the event loop.
+ */
+#define WHEEL_TICK_MS 100
+#define EXPIRE_BUDGET 64
+
 uint16_t port = 8080;
+unsigned num_workers = 1;
+
+/**
+ * Watermarks for bytes a session holds for the client, in total and per
+ * connection.  Upstream reads are suspended at the high mark and resumed
+ * once the backlog is down to the low mark again.
+ */
+size_t session_high_watermark = 1024 * 1024;
+size_t session_low_watermark = 512 * 1024;
+size_t conn_high_watermark = 256 * 1024;
+size_t conn_low_watermark = 128 * 1024;
+
+/**
+ * Name server to query instead of those in resolv.conf, as "ADDR[:PORT]",
+ * and whether popular names are resolved again before they expire.
+ */
+const char *nameserver = NULL;
+bool dns_refresh = false;
+
+/**
+ * Timeouts in seconds, 0 for none: sessions without a recv stream,
+ * sessions in total and upstream connections without traffic.
+ */
+unsigned session_detach_timeout = 60;
+unsigned session_max_age = 0;
+unsigned conn_idle_timeout = 0;
+
+/**
+ * Seconds browsers may use static files without asking again.
+ */
+unsigned asset_max_age = 86400;
+
+/**
+ * Upstream sockets are read and written through a per-worker io_uring if
+ * built with URING=1 and the kernel supports it, unless -e libevent asks
+ * for bufferevents.
+ */
+typedef enum {
+	ENGINE_AUTO,
+	ENGINE_LIBEVENT,
+	ENGINE_URING
+} io_engine;
+
+io_engine engine = ENGINE_AUTO;
+
+/**
+ * Why the ring could not be set up, reported once logging is up.
+ */
+static int uring_error;
+
+/**
+ * Memory a session may use for compressing its recv stream, 0 to refuse
+ * compression.
+ */
+size_t deflate_mem_max = 128 * 1024;
+
+/**
+ * Unix socket a successor connects to for the listening sockets and the
+ * sessions, and a new process looks for a predecessor at on startup.
+ */
+const char *restart_path = NULL;
 
 typedef enum 
 {
@@ -44,65 +184,530 @@ typedef enum
 	ACTION_CONNECT = 3,
 	ACTION_DISCONNECT = 4,
 	ACTION_SEND = 5,
-	ACTION_RECV = 6
+	ACTION_RECV = 6,
+	ACTION_WINDOW = 7,
+	ACTION_BATCH = 8
 } action_type;
 
 struct session;
+struct proxy;
+struct wsstream;
+
+typedef enum {
+	FRAMING_ASCII = 1,
+	FRAMING_VARINT = 2
+} framing_type;
+
+/**
+ * An HTTP request being served, possibly by a worker other than the one
+ * whose event loop accepted it.  The evhttp_request must only ever be
+ * touched by its origin worker; remote workers reply through handoffs.
+ * A WebSocket attaching as recv stream takes the place of req.
+ */
+struct request {
+	struct evhttp_request *req;
+	struct proxy *origin;
+	bool remote;
+	struct evbuffer *body;
+	struct wsstream *ws;
+	struct recv_watch *watch;
+};
 
 struct connection {
 
 	struct bufferevent *bev;
 	struct session *sess;
 
-	TREE_ENTRY(connection) linkage;
+	uint32_t id;
+	uint16_t port;
+
+	/**
+	 * Pending lookup of the host, then the attempts to connect to its
+	 * addresses.  Until one of them wins, bev is a placeholder holding
+	 * whatever is sent meanwhile.
+	 */
+	struct dnscache_request *resolve;
+	struct connect_race *race;
+
+	/**
+	 * Socket of a connection made with proto=udp, which has no bev.
+	 */
+	struct udp_socket *udp;
+
+	/**
+	 * Set once a connected socket is driven by the worker's io_uring, bev
+	 * then has no socket and only holds the output.
+	 */
+	struct uring_sock *uring;
+
+	bool connected;
+
+	/**
+	 * Closes the connection once no data has gone either way for
+	 * conn_idle_timeout since active, in wheel ticks.
+	 */
+	struct wheel_timer idle;
+	uint64_t active;
+
+	/**
+	 * Bytes queued in the session buffer since flush number queued_gen,
+	 * reading is suspended while throttled.
+	 */
+	size_t queued;
+	unsigned queued_gen;
+	bool throttled;
+
+	/**
+	 * Sequence number of the next act=send to write, sends arriving early
+	 * wait in reorder[seq % SEND_WINDOW], allocated on first use.
+	 */
+	uint32_t send_seq;
+	struct evbuffer **reorder;
+};
+
+/**
+ * Attempts to connect to the addresses of a host, started one
+ * CONNECT_ATTEMPT_DELAY after another or right after the previous one
+ * failed.  attempts[i] is the bufferevent connecting to addrs[i].  done is
+ * called once, with the socket of the first attempt to connect or -1 if
+ * all of them failed, after the race has been freed.
+ */
+struct connect_race {
+	struct proxy *prx;
+	struct event *timer;
+
+	void (*done)(evutil_socket_t fd, void *udata);
+	void *udata;
+
+	unsigned num;
+	unsigned next;
+	unsigned running;
+	struct sockaddr_storage addrs[CONNECT_ATTEMPTS_MAX];
+	socklen_t lens[CONNECT_ATTEMPTS_MAX];
+	struct bufferevent *attempts[CONNECT_ATTEMPTS_MAX];
+};
+
+/**
+ * A UDP connection, ev is NULL until its host is resolved and the socket
+ * connected.  Every act=send or DATA packet is one datagram, queued in out
+ * back to back, lens[i] bytes each.  Queued datagrams all go out with one
+ * sendmmsg() at the end of the loop iteration, or right away once
+ * UDP_BATCH are waiting.
+ */
+struct udp_socket {
+	struct connection *conn;
+	struct event *ev;
+
+	struct evbuffer *out;
+	size_t lens[UDP_BATCH];
+	unsigned queued;
 
-	int id;
+	bool dirty;
+	TAILQ_ENTRY(udp_socket) dirty_next;
 };
 
-static int connection_compare(struct connection *lhs, struct connection *rhs)
+TAILQ_HEAD(udp_list, udp_socket);
+
+static uint64_t connection_hash(uint32_t id)
 {
-	return (lhs->id < rhs->id) ? -1 : ((lhs->id > rhs->id) ? 1 : 0);
+	return id * UINT64_C(0x9e3779b97f4a7c15);
 }
 
-typedef TREE_HEAD(connection_tree, connection) connection_tree;
+static bool connection_match(const void *value, const void *key)
+{
+	return ((const struct connection *)value)->id == *(const uint32_t *)key;
+}
 
-TREE_DEFINE(connection, linkage);
+/**
+ * Random session identifier, unguessable so that session ids cannot be
+ * enumerated by other clients.
+ */
+struct session_token {
+	uint64_t hi;
+	uint64_t lo;
+};
 
 struct session {
 
 	struct proxy *prx;
 	struct evbuffer *evb;
 
-	unsigned sent_chunks;
+	struct session_token token;
+
+	/**
+	 * Worker index in the session id.  The session belongs to the worker
+	 * of that index modulo num_workers, a restart may change their number.
+	 */
+	unsigned worker;
 
-	connection_tree conns;
+	/**
+	 * Connections by id.
+	 */
+	struct htable conns;
 
 	/**
-	 * Currently sessioning request if any, NULL otherwise.
+	 * Currently streaming request if any, see request_active().
 	 */
-	struct evhttp_request *req;
+	struct request recv;
 
 	bool long_poll;
 
-	TREE_ENTRY(session) linkage;
+	/**
+	 * Framing of the packets in evb, as negotiated by the last recv.
+	 */
+	framing_type framing;
+
+	/**
+	 * Flow control: bytes sent on the current recv stream, how many of
+	 * them the client reported as consumed and how many it is willing to
+	 * buffer beyond that (0 for no limit).
+	 */
+	size_t recv_sent;
+	size_t recv_acked;
+	size_t window;
+
+	/**
+	 * An XHR recv stream is ended with PKT_RECONN once it has carried
+	 * recv_max_bytes or is older than recv_max_age microseconds, so the
+	 * browser can let go of its response text.  0 for no limit.
+	 */
+	size_t recv_max_bytes;
+	uint64_t recv_max_age;
+	uint64_t recv_started;
+
+	unsigned flush_gen;
+	unsigned throttled_conns;
+	bool throttled;
+
+	/**
+	 * When the oldest data in evb not yet passed on was read, 0 if none.
+	 */
+	uint64_t pending_since;
+
+	/**
+	 * Connection packets are numbered from 1 as they are passed on to a
+	 * recv stream, seq is the last one and evb_packets counts those still
+	 * in evb.  Once a recv has asked to resume, the last replay_count of
+	 * them stay in replay, up to REPLAY_MAX bytes in the session's
+	 * framing, until the client reports having parsed them.
+	 */
+	uint64_t seq;
+	unsigned evb_packets;
+	struct evbuffer *replay;
+	uint64_t replay_count;
+
+	/**
+	 * Deflate stream of the recv stream while compressed is set, and the
+	 * buffer its output is passed on in.  Both are allocated by the first
+	 * recv asking for compression, later ones reset the stream.
+	 */
+	bool compressed;
+	z_stream *deflate;
+	struct evbuffer *deflated;
+
+	/**
+	 * Upstream events only queue packets and put the session on the
+	 * worker's dirty list, it is flushed once at the end of the loop
+	 * iteration.  With a flush delay the packets are held by flush_timer
+	 * for up to that long instead, to be sent in fewer, bigger chunks.
+	 */
+	bool dirty;
+	TAILQ_ENTRY(session) dirty_next;
+	struct timeval flush_delay;
+	struct event *flush_timer;
+
+	/**
+	 * Deletes the session session_max_age after it was created, or
+	 * session_detach_timeout after its last recv stream ended.  Ticks
+	 * of the worker's wheel.
+	 */
+	struct wheel_timer expiry;
+	uint64_t created;
+	uint64_t detached;
 };
 
-static int session_compare(struct session *lhs, struct session *rhs)
+TAILQ_HEAD(session_list, session);
+
+/**
+ * The low half of a token is uniformly random and serves as hash.
+ */
+static uint64_t session_hash(const struct session_token *token)
+{
+	return token->lo;
+}
+
+static bool session_match(const void *value, const void *key)
 {
-	return (lhs < rhs) ? -1 : ((lhs > rhs) ? 1 : 0);
+	const struct session_token *lhs = &((const struct session *)value)->token;
+	const struct session_token *rhs = key;
+
+	return lhs->hi == rhs->hi && lhs->lo == rhs->lo;
 }
 
-typedef TREE_HEAD(session_tree, session) session_tree;
+typedef enum {
+	HANDOFF_REQUEST,
+	HANDOFF_WS_MESSAGE,
+	HANDOFF_WS_DETACH,
+	HANDOFF_WS_RELEASE,
+	HANDOFF_RECV_CLOSED,
+	HANDOFF_REPLY,
+	HANDOFF_START,
+	HANDOFF_CHUNK,
+	HANDOFF_END
+} handoff_type;
+
+/**
+ * Message passed between workers.  Requests travel from the worker which
+ * accepted the HTTP connection to the one owning the session, replies and
+ * recv stream chunks travel back to the origin.
+ */
+struct handoff {
+	TAILQ_ENTRY(handoff) next;
+
+	handoff_type type;
+	struct proxy *origin;
+	struct evhttp_request *req;
+	struct wsstream *ws;
+	struct evbuffer *evb;
+
+	/**
+	 * Session addressed by HANDOFF_WS_MESSAGE, HANDOFF_WS_DETACH and
+	 * HANDOFF_RECV_CLOSED.
+	 */
+	struct session_token token;
+
+	int code;
+	const char *reason;
+
+	struct recv_watch *watch;
+	unsigned start_flags;
+
+	char uri[];
+};
+
+/**
+ * Flags of HANDOFF_START: the recv takes over from another one, and its
+ * packets are varint framed rather than text.
+ */
+#define START_TAKEOVER 1
+#define START_BINARY 2
+#define START_DEFLATE 4
+
+TAILQ_HEAD(handoff_queue, handoff);
+
+/**
+ * Tells the owner of a session when the connection of its XHR recv stream
+ * closes.  Allocated by the owner along with HANDOFF_START, then belongs to
+ * the origin worker until HANDOFF_END.
+ */
+struct recv_watch {
+	struct proxy *origin;
+	struct evhttp_request *req;
+	unsigned worker;
+	struct session_token token;
+	bool closed;
+};
+
+/**
+ * A WebSocket carrying the recv stream and the uplink of a session.  It
+ * belongs to the worker that accepted it, the session may be owned by
+ * another one.  Once attached, it is only freed after the owner has let go
+ * of it, so that chunks still in flight never reach a freed stream.
+ */
+struct wsstream {
+	TAILQ_ENTRY(wsstream) next;
+
+	struct ws *ws;
+	struct proxy *prx;
+
+	unsigned worker;
+	struct session_token token;
+
+	bool attached;
+	bool detaching;
+	bool closed;
+};
+
+TAILQ_HEAD(wsstream_list, wsstream);
+
+/**
+ * A CONNECT request while its host is resolved and connected, and the
+ * tunnel that takes its connection over afterwards.  It belongs to the
+ * worker that accepted it and has nothing to do with sessions.
+ */
+struct tunnelstream {
+	TAILQ_ENTRY(tunnelstream) next;
+
+	struct proxy *prx;
+	struct evhttp_request *req;
+	uint16_t port;
+
+	struct dnscache_request *resolve;
+	struct connect_race *race;
+	struct tunnel *tunnel;
+};
+
+TAILQ_HEAD(tunnelstream_list, tunnelstream);
+
+typedef enum {
+	PKT_CONNFAIL,
+	PKT_CONNECTED,
+	PKT_DISCONNECTED,
+	PKT_DATA,
+	PKT_PAD,
+	PKT_TAKEOVER,
+	PKT_RECONN,
+	PKT_DELETED,
+	PKT_WINDOW
+} session_pkt_type;
+
+#define PKT_TYPES (PKT_WINDOW + 1)
+
+/**
+ * Counters exported by /stats, only ever written by the worker they
+ * belong to.  relay_latency holds the microseconds from an upstream read
+ * until its data is passed on for the recv stream, backlog the size of
+ * the session buffer after every read.
+ */
+struct proxy_stats {
+	uint64_t sessions_created;
+	uint64_t sessions_deleted;
+	uint64_t connections_opened;
+	uint64_t connections_closed;
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	uint64_t packets[PKT_TYPES];
+	uint64_t takeovers;
+	uint64_t reconnects;
+	uint64_t dns_failures;
+	uint64_t connect_attempts;
+	uint64_t sessions_expired_detached;
+	uint64_t sessions_expired_age;
+	uint64_t connections_expired;
+	uint64_t replayed_packets;
+	uint64_t resumes_failed;
+
+	/**
+	 * Compressed recv streams, the bytes compressed and what they came to,
+	 * and the microseconds spent compressing.
+	 */
+	uint64_t deflate_streams;
+	uint64_t deflate_in;
+	uint64_t deflate_out;
+	uint64_t deflate_usec;
+
+	/**
+	 * Datagrams of UDP connections by direction, those dropped on the way
+	 * up and the recvmmsg() and sendmmsg() calls moving them.
+	 */
+	uint64_t udp_datagrams_up;
+	uint64_t udp_datagrams_down;
+	uint64_t udp_dropped;
+	uint64_t udp_recv_calls;
+	uint64_t udp_send_calls;
+
+	/**
+	 * Upstream reads relayed and heap allocations made while doing so.
+	 */
+	uint64_t relay_reads;
+	uint64_t relay_heap_allocs;
+
+	/**
+	 * CONNECT tunnels, and what they spliced each way.
+	 */
+	uint64_t tunnels_opened;
+	uint64_t tunnels_closed;
+	uint64_t tunnels_failed;
+	struct tunnel_stats tunnel;
+
+	/**
+	 * Copied from the pools of the worker when collected.
+	 */
+	uint64_t session_pool_used;
+	uint64_t session_pool_capacity;
+	uint64_t connection_pool_used;
+	uint64_t connection_pool_capacity;
+	uint64_t buffer_pool_hits;
+	uint64_t buffer_pool_misses;
+
+	/**
+	 * Copied from the ring of the worker, if it has one.
+	 */
+	struct uring_stats uring;
 
-TREE_DEFINE(session, linkage);
+	struct histogram relay_latency;
+	struct histogram backlog;
+};
 
+/**
+ * One worker: an event loop with its own HTTP server, resolver and
+ * sessions.  Sessions are only ever touched by the worker owning them.
+ */
 struct proxy {
-	session_tree sessions;
+	/**
+	 * Sessions by token.
+	 */
+	struct htable sessions;
 	struct event_base *base;
 	struct evhttp *http;
 	struct evdns_base *dns;
+	struct evconnlistener *listener;
+
+	unsigned index;
+	pthread_t thread;
+
+	pthread_mutex_t inbox_lock;
+	struct handoff_queue inbox;
+	struct event *inbox_ev;
+
+	struct wsstream_list wsstreams;
+	struct tunnelstream_list tunnels;
+
+	/**
+	 * Session and connection timeouts, advanced by wheel_ev every
+	 * WHEEL_TICK_MS.
+	 */
+	struct wheel wheel;
+	struct event *wheel_ev;
+
+	/**
+	 * Sessions with packets to flush at the end of the loop iteration.
+	 */
+	struct session_list dirty;
+	struct event *flush_ev;
+
+	/**
+	 * UDP sockets with datagrams to send at the end of the loop iteration,
+	 * and where their replies are received into.
+	 */
+	struct udp_list udp_dirty;
+	struct udp_batch udp_in;
+
+	/**
+	 * Ring driving the upstream sockets, NULL for bufferevents.
+	 */
+	struct uring *ring;
+
+	struct pool session_pool;
+	struct pool connection_pool;
+	struct evbuffer_pool buffers;
+
+	struct proxy_stats stats;
 };
 
+static struct proxy *workers;
+
+/**
+ * Hot restart: the Unix socket listening for a successor, the successor
+ * once one has connected, and the listening sockets inherited from the
+ * predecessor.
+ */
+static int restart_sock = -1;
+static struct event *restart_ev;
+static int successor = -1;
+static int *inherited_fds;
+static unsigned num_inherited;
+
 static const char *dump_what(short what)
 {
 	static char buffer[256];
@@ -126,17 +731,6 @@ static const char *dump_what(short what)
 	return buffer;
 }
 
-typedef enum {
-	PKT_CONNFAIL,
-	PKT_CONNECTED,
-	PKT_DISCONNECTED,
-	PKT_DATA,
-	PKT_PAD,
-	PKT_TAKEOVER,
-	PKT_RECONN,
-	PKT_DELETED
-} session_pkt_type;
-
 struct prefix {
 	char magic[5];
 	char type[2];
@@ -144,701 +738,4308 @@ struct prefix {
 	char payload_length[8];
 };
 
-static void make_prefix(struct prefix *pfx, uint8_t type, uint64_t cid, uint32_t payload_length)
-{
-	memcpy(pfx->magic, "MAGIC", 5);
-	sprintf(pfx->type, "%02x", type);
-	sprintf(pfx->cid, "%016" PRIx64, cid);
-	sprintf(pfx->payload_length, "%08x", payload_length);
-}
+/**
+ * Upper bound for the header size of any framing.
+ */
+#define HEADER_MAX sizeof(struct prefix)
 
-static void send_some_pad(struct evhttp_request *req, size_t sz)
-{
-	struct evbuffer *evb = evbuffer_new();
-        struct prefix pfx;
-        char *pad;
-	pad = malloc(sz);
-	memset(pad, '?', sz);
-        make_prefix(&pfx, PKT_PAD, 0, sz);
-        evbuffer_add(evb, &pfx, sizeof(pfx));
-        evbuffer_add(evb, pad, sz);
-        evhttp_send_reply_chunk(req, evb);
-        evbuffer_free(evb);
-	free(pad);
-}
+#define PAD_SIZE 16
 
-static void ask_recon(struct session *sess, struct connection *conn)
+/**
+ * Longest host name accepted for a connection.
+ */
+#define HOST_MAX 255
+
+/**
+ * Pad packets for every framing, built once at startup.
+ */
+static uint8_t pad_packets[FRAMING_VARINT + 1][HEADER_MAX + PAD_SIZE];
+static size_t pad_lengths[FRAMING_VARINT + 1];
+
+static void hex_encode(char *dst, uint64_t value, size_t width)
 {
-	struct prefix pfx;
-	make_prefix(&pfx, PKT_RECONN, conn->id, 0);
-	evbuffer_add(sess->evb, &pfx, sizeof(pfx));
-	evhttp_send_reply_chunk(sess->req, sess->evb);
-	sess->sent_chunks = 0;
-	evhttp_send_reply_end(sess->req);
-	sess->req = NULL;
+	static const char digits[] = "0123456789abcdef";
+
+	while(width-- > 0)
+	{
+		dst[width] = digits[value & 0xf];
+		value >>= 4;
+	}
 }
 
-static void handle_bev_read(struct bufferevent *bev, void *udata)
+static bool hex_decode(const char *src, size_t width, uint64_t *value)
 {
-	struct connection *conn = udata;
-	struct session *sess = conn->sess;
-	struct prefix pfx;
-	struct evbuffer *evb;
-	
-	printf("handle_bev_read() -- evbuffer_get_length(evb)=%zd\n", evbuffer_get_length(bufferevent_get_input(bev)));
-
-	evb = evbuffer_new();
-	bufferevent_read_buffer(bev, evb);
-	make_prefix(&pfx, PKT_DATA, conn->id, evbuffer_get_length(evb));
-	evbuffer_prepend(evb, &pfx, sizeof(pfx));
-	evbuffer_add_buffer(sess->evb, evb);
-	evbuffer_free(evb);
+	size_t i;
 
-	if(sess->req)
+	*value = 0;
+	for(i = 0; i < width; i++)
 	{
-		evhttp_send_reply_chunk(sess->req, sess->evb);
-		send_some_pad(sess->req, 16);
+		char c = src[i];
 
-		if(sess->long_poll || ++sess->sent_chunks > 2)
-		{
-			ask_recon(sess, conn);
-		}
+		if(c >= '0' && c <= '9')
+			*value = (*value << 4) | (c - '0');
+		else if(c >= 'a' && c <= 'f')
+			*value = (*value << 4) | (c - 'a' + 10);
+		else
+			return false;
 	}
+
+	return true;
 }
 
-static void handle_bev_write(struct bufferevent *bev, void *udata)
+static void make_prefix(struct prefix *pfx, uint8_t type, uint64_t cid, uint32_t payload_length)
 {
-	printf("handle_bev_write()\n"); 
+	memcpy(pfx->magic, "MAGIC", 5);
+	hex_encode(pfx->type, type, sizeof(pfx->type));
+	hex_encode(pfx->cid, cid, sizeof(pfx->cid));
+	hex_encode(pfx->payload_length, payload_length, sizeof(pfx->payload_length));
 }
 
-static void handle_bev_event(struct bufferevent *bev, short what, void *udata)
+static size_t put_varint(uint8_t *p, uint64_t value)
 {
-	struct connection *conn = udata;
-	struct session *sess = conn->sess;
+	size_t n = 0;
 
-	if(sess == NULL)
+	while(value >= 0x80)
 	{
-		fprintf(stderr, "Internal error - sess of conn %p is NULL", conn);
-		abort();
+		p[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
 	}
+	p[n++] = value;
 
-	if(conn == NULL)
+	return n;
+}
+
+static size_t get_varint(const uint8_t *p, size_t avail, uint64_t *value)
+{
+	size_t n;
+
+	*value = 0;
+	for(n = 0; n < avail && n < 10; n++)
 	{
-		fprintf(stderr, "Internal error - conn is NULL");
-		abort();
+		*value |= (uint64_t)(p[n] & 0x7f) << (7 * n);
+		if(!(p[n] & 0x80))
+			return n + 1;
 	}
 
-	printf("handle_bev_event()\n");
+	return 0;
+}
+
+/**
+ * Encodes a packet header into hdr (at least HEADER_MAX bytes) and returns
+ * its length.  FRAMING_ASCII is the classic "MAGIC" prefix, FRAMING_VARINT
+ * packs type, cid and payload length as LEB128 varints.
+ */
+static size_t make_header(uint8_t *hdr, framing_type framing, uint8_t type, uint64_t cid, uint32_t payload_length)
+{
+	size_t n = 0;
 
-	if(what & BEV_EVENT_CONNECTED)
+	if(framing == FRAMING_ASCII)
 	{
-		struct prefix pfx;
+		make_prefix((struct prefix *)hdr, type, cid, payload_length);
+		return sizeof(struct prefix);
+	}
 
-		printf("CONNECTED\n"); 
+	n += put_varint(hdr + n, type);
+	n += put_varint(hdr + n, cid);
+	n += put_varint(hdr + n, payload_length);
+	return n;
+}
 
-		if(sess->evb == NULL)
-		{
-			fprintf(stderr, "Internal error - evb of sess %p is NULL", sess);
-			abort();
-		}
+/**
+ * Decodes a header produced by make_header(), returns its length or 0 if
+ * avail bytes don't hold a complete, valid header.
+ */
+static size_t parse_header(const uint8_t *hdr, size_t avail, framing_type framing, uint8_t *type, uint64_t *cid, uint32_t *payload_length)
+{
+	uint64_t value;
+	size_t n, len;
 
-		make_prefix(&pfx, PKT_CONNECTED, conn->id, 0);
-	        evbuffer_add(sess->evb, &pfx, sizeof(pfx));
+	if(framing == FRAMING_ASCII)
+	{
+		const struct prefix *pfx = (const struct prefix *)hdr;
 
-		if(sess->req)
-		{
-			evhttp_send_reply_chunk(sess->req, sess->evb);
-			send_some_pad(sess->req, 16); //2096 * 4);
-			
-			if(sess->long_poll) ask_recon(sess, conn);			
-		}
+		if(avail < sizeof(struct prefix) || memcmp(pfx->magic, "MAGIC", 5) != 0)
+			return 0;
 
-		conn->bev = bev;
+		if(!hex_decode(pfx->type, sizeof(pfx->type), &value))
+			return 0;
+		*type = value;
+
+		if(!hex_decode(pfx->cid, sizeof(pfx->cid), cid))
+			return 0;
+
+		if(!hex_decode(pfx->payload_length, sizeof(pfx->payload_length), &value))
+			return 0;
+		*payload_length = value;
 
-		bufferevent_enable(bev, EV_READ|EV_WRITE);
+		return sizeof(struct prefix);
 	}
-	else if(what & BEV_EVENT_EOF)
-	{
-		struct prefix pfx;
 
-		printf("EOF -- sending PKT_DISCONNECTED\n");
+	if((n = get_varint(hdr, avail, &value)) == 0)
+		return 0;
+	*type = value;
+	len = n;
 
-		bufferevent_free(conn->bev);
-		conn->bev = NULL;
+	if((n = get_varint(hdr + len, avail - len, cid)) == 0)
+		return 0;
+	len += n;
 
-		make_prefix(&pfx, PKT_DISCONNECTED, conn->id, 0);
-        	evbuffer_add(sess->evb, &pfx, sizeof(pfx));
+	if((n = get_varint(hdr + len, avail - len, &value)) == 0)
+		return 0;
+	*payload_length = value;
 
-		if(sess->req)
-		{
-		        evhttp_send_reply_chunk(sess->req, sess->evb);
-			send_some_pad(sess->req, 16);
+	return len + n;
+}
 
-			if(sess->long_poll) ask_recon(sess, conn);			
-//			evhttp_send_reply_end(sess->req);
-			/* evhttp_request_free(sess->req); */
-//			sess->req = NULL;
-		}
-	}
-	else if(what & BEV_EVENT_ERROR)
-	{
-		struct prefix pfx;
-		
-		int dns_error = bufferevent_socket_get_dns_error(bev);
+/**
+ * Whether packets of that type are numbered for replay, the others only
+ * steer the recv stream they are sent on.
+ */
+static bool packet_numbered(uint8_t type)
+{
+	return type == PKT_CONNFAIL || type == PKT_CONNECTED ||
+		type == PKT_DISCONNECTED || type == PKT_DATA;
+}
 
-		if(dns_error)
-		{
-			fprintf(stderr, "ERROR (dns error)\n");
-		}
-		else
-		{
-			fprintf(stderr, "ERROR (failed to connect)\n");
-		}
+/**
+ * Appends a copy of the contents of src to dst.
+ */
+static void copy_buffer(struct evbuffer *dst, struct evbuffer *src)
+{
+	struct evbuffer_ptr pos;
+	struct evbuffer_iovec vec;
 
-		bufferevent_free(conn->bev);
-		conn->bev = NULL;
+	evbuffer_ptr_set(src, &pos, 0, EVBUFFER_PTR_SET);
 
-		make_prefix(&pfx, PKT_CONNFAIL, conn->id, 0);
-		evbuffer_add(sess->evb, &pfx, sizeof(pfx));
-		
-		if(sess->req)
-		{
-			evhttp_send_reply_chunk(sess->req, sess->evb);
-			evhttp_send_reply_end(sess->req);
-			sess->req = NULL;	
-		}
-	}
-	else
+	while(evbuffer_peek(src, -1, &pos, &vec, 1) > 0 && vec.iov_len > 0)
 	{
-		fprintf(stderr, "WARN: Unknown event: %s", dump_what(what));
+		evbuffer_add(dst, vec.iov_base, vec.iov_len);
+		if(evbuffer_ptr_set(src, &pos, vec.iov_len, EVBUFFER_PTR_ADD) < 0)
+			break;
 	}
 }
 
-static void disable_caching(struct evhttp_request *req)
+/**
+ * Drops the oldest count packets from replay.
+ */
+static void session_replay_drop(struct session *sess, uint64_t count)
 {
-	evhttp_add_header(req->output_headers, "Cache-Control", "no-store,no-cache,must-revalidate");
-	evhttp_add_header(req->output_headers, "Pragma", "no-cache");
-	evhttp_add_header(req->output_headers, "Expires", "-1");
+	uint8_t hdr[HEADER_MAX];
+	ev_ssize_t avail;
+	size_t len;
+	uint8_t type;
+	uint64_t cid;
+	uint32_t payload_length;
+
+	while(count-- > 0 && (avail = evbuffer_copyout(sess->replay, hdr, sizeof(hdr))) > 0)
+	{
+		len = parse_header(hdr, avail, sess->framing, &type, &cid, &payload_length);
+		if(len == 0)
+		{
+			log_error("Internal error - corrupt packet in replay of sess %p", sess);
+			log_flush();
+			abort();
+		}
 
-	evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", "*");
-	evhttp_add_header(req->output_headers, "Access-Control-Allow-Methods", "GET, POST");
-	evhttp_add_header(req->output_headers, "Access-Control-Allow-Headers", "cache-control,expires,pragma,content-type");
+		evbuffer_drain(sess->replay, len + payload_length);
+		sess->replay_count--;
+	}
+}
 
+/**
+ * The client has parsed all packets up to seq, they need not be kept.
+ */
+static void session_replay_ack(struct session *sess, uint64_t seq)
+{
+	if(sess->replay && seq <= sess->seq && seq > sess->seq - sess->replay_count)
+		session_replay_drop(sess, seq - (sess->seq - sess->replay_count));
 }
 
-static void session_create(struct evhttp_request *req, struct proxy *prx)
+/**
+ * Numbers the packets in evb, which is about to be passed on, and keeps a
+ * copy of them if the session replays.
+ */
+static void session_replay_record(struct session *sess)
 {
-	struct session *sess;
-	struct evbuffer *buf;
+	sess->seq += sess->evb_packets;
 
-	sess = calloc(1, sizeof(struct session));
-	if(sess == NULL)
+	if(sess->replay && sess->evb_packets > 0)
 	{
-		evhttp_send_error(req, 500, "Session allocation failed");
-		return;
-	}
-	
-	TREE_INIT(&sess->conns, connection_compare);
-
-	sess->long_poll = false;
-	sess->sent_chunks = 0;
-	sess->prx = prx;
-
-	sess->evb = evbuffer_new();
-	if(sess->evb == NULL)
-	{
-		evhttp_send_error(req, 500, "Buffer allocation failed");
-		free(sess);
-		return;
-	}
+		copy_buffer(sess->replay, sess->evb);
+		sess->replay_count += sess->evb_packets;
 
-	buf = evbuffer_new();
-	if(buf == NULL)
-	{
-		evhttp_send_error(req, 500, "Buffer allocation failed");
-		evbuffer_free(sess->evb);
-		free(sess);
-		return;
+		while(evbuffer_get_length(sess->replay) > REPLAY_MAX)
+			session_replay_drop(sess, 1);
 	}
 
-	if(evhttp_add_header(req->output_headers, "Content-type", "text/plain; charset=utf-8") == 0)
-	{
-		if(evbuffer_add_printf(buf, "%"PRIxPTR"\r\n", (uintptr_t)sess) > 0)
-		{
-			TREE_INSERT(&prx->sessions, session, linkage, sess);
+	sess->evb_packets = 0;
+}
 
-			evhttp_send_reply(req, 200, NULL, buf);
-			evbuffer_free(buf);
+/**
+ * Appends a packet without payload to the session's pending buffer.
+ * Stream control packets end the chunk they are sent with, so what
+ * precedes them is numbered first.
+ */
+static void session_add_packet(struct session *sess, uint8_t type, uint64_t cid)
+{
+	uint8_t hdr[HEADER_MAX];
+	size_t len;
 
-			printf("session_create(...) => %"PRIxPTR"\n", (uintptr_t)sess); 
+	if(packet_numbered(type))
+		sess->evb_packets++;
+	else
+		session_replay_record(sess);
 
-			return;
-		}
-	}
+	len = make_header(hdr, sess->framing, type, cid, 0);
+	evbuffer_add(sess->evb, hdr, len);
 
-	evhttp_send_error(req, 500, "Failed to construct reply");
-	evbuffer_free(buf);
-	evbuffer_free(sess->evb);
-	free(sess);
+	stat_add(&sess->prx->stats.packets[type], 1);
 }
 
-static void connection_free(struct connection *conn, void *udata)
+static uint64_t now_usec(void)
 {
-	if(conn->bev)
-	{
-		bufferevent_free(conn->bev);
-		conn->bev = NULL;
-	}
-
-	conn->sess = NULL;
+	struct timespec ts;
 
-	free(conn);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static void session_free(struct session *sess, void *udata)
+/**
+ * Re-encodes the packets in buf, one of the buffers of sess, from the
+ * session's framing to another through the empty buffer evb, which is
+ * given back to the pool.
+ */
+static void session_reframe(struct session *sess, struct evbuffer *buf, struct evbuffer *evb, framing_type framing)
 {
-	printf("session_delete(0x%"PRIxPTR")\n", (uintptr_t)sess);
-	
-	while(sess->conns.th_root != NULL)
+	uint8_t hdr[HEADER_MAX];
+	ev_ssize_t avail;
+	size_t len;
+	uint8_t type;
+	uint64_t cid;
+	uint32_t payload_length;
+
+	while((avail = evbuffer_copyout(buf, hdr, sizeof(hdr))) > 0)
 	{
-		struct connection *conn = sess->conns.th_root;
-		TREE_REMOVE(&sess->conns, connection, linkage, sess->conns.th_root);
-		connection_free(conn, NULL);
-	}
+		len = parse_header(hdr, avail, sess->framing, &type, &cid, &payload_length);
+		if(len == 0)
+		{
+			log_error("Internal error - corrupt packet in buffer of sess %p", sess);
+			log_flush();
+			abort();
+		}
 
-	if(sess->evb)
-	{
-		evbuffer_free(sess->evb);
-		sess->evb = NULL;
-	}
+		evbuffer_drain(buf, len);
 
-	if(sess->req)
-	{
-		evhttp_send_reply_end(sess->req);
-		sess->req = NULL;
+		len = make_header(hdr, framing, type, cid, payload_length);
+		evbuffer_add(evb, hdr, len);
+		evbuffer_remove_buffer(buf, evb, payload_length);
 	}
 
-	TREE_REMOVE(&sess->prx->sessions, session, linkage, sess);
-	free(sess);
+	evbuffer_add_buffer(buf, evb);
+	evbuffer_pool_put(&sess->prx->buffers, evb);
 }
 
-static void session_delete(struct evhttp_request *req, struct session *sess)
+/**
+ * Re-encodes the packets still pending in evb and those kept for replay
+ * when a recv switches the session to another framing.  Returns false,
+ * with nothing changed, if the buffers for that cannot be allocated.
+ */
+static bool session_set_framing(struct session *sess, framing_type framing)
 {
-	printf("session_delete(..., 0x%"PRIxPTR")\n", (uintptr_t)sess);
+	struct evbuffer *evb, *replay = NULL;
 
-	if(sess->req)
-	{
-		struct prefix pfx;
-        	make_prefix(&pfx, PKT_DELETED, 0, 0);
-		evbuffer_add(sess->evb, &pfx, sizeof(pfx));
+	if(sess->framing == framing)
+		return true;
+
+	if((evb = evbuffer_pool_get(&sess->prx->buffers)) == NULL)
+		return false;
 
-		evhttp_send_reply_chunk(sess->req, sess->evb); 
-		evhttp_send_reply_end(sess->req);
-		sess->req = NULL;
+	if(sess->replay && (replay = evbuffer_pool_get(&sess->prx->buffers)) == NULL)
+	{
+		evbuffer_pool_put(&sess->prx->buffers, evb);
+		return false;
 	}
 
-	session_free(sess, NULL);
+	session_reframe(sess, sess->evb, evb, framing);
+	if(replay)
+		session_reframe(sess, sess->replay, replay, framing);
 
-	evhttp_send_reply(req, 200, NULL, NULL);
+	sess->framing = framing;
+	return true;
 }
 
-static int safe_strtoul(const char *str, unsigned base, uintptr_t *out)
+static void handoff_post(struct proxy *dst, struct handoff *h)
 {
-	char *endp;
-	errno = 0;
-	*out = strtoull(str, &endp, base);
-	return (errno == 0 && *endp == 0 && endp != str);
+	pthread_mutex_lock(&dst->inbox_lock);
+	TAILQ_INSERT_TAIL(&dst->inbox, h, next);
+	pthread_mutex_unlock(&dst->inbox_lock);
+
+	event_active(dst->inbox_ev, EV_READ, 0);
 }
 
-static void session_connect(struct evhttp_request *req, struct evkeyvalq *params, struct session *sess)
+/**
+ * The connection of an XHR recv stream has closed, tells the owner of the
+ * session so it can let go of the stream.  The request itself lives on
+ * until the owner ends it.
+ */
+static void handle_recv_close(struct evhttp_connection *con, void *udata)
 {
-	struct bufferevent *bev;
-	const char *host;
-	const char *port_str;
-	const char *cid_str;
-	uintptr_t port;
-	uintptr_t cid;
-	struct connection *conn;
-	int ret;
-	struct evbuffer *buf;
-	printf("session_connect(..., sess=0x%"PRIxPTR")\n", (uintptr_t)sess); 
-
-	host = evhttp_find_header(params, "host");
-        if (host == NULL) {
-                evhttp_send_error(req, 400, "No host specified");
-                return;
-        }
+	struct recv_watch *watch = udata;
+	struct handoff *h;
 
-        port_str = evhttp_find_header(params, "port");
-        if(port_str == NULL) {
-                evhttp_send_error(req, 400, "No port specified");
-                return;
-        }
+	log_debug("handle_recv_close(..., 0x%"PRIxPTR")", (uintptr_t)watch->req);
 
-	if(!safe_strtoul(port_str, 10, &port) || port < 1 || port > 0xffff) {
-                evhttp_send_error(req, 400, "Invalid port specified");
-                return;
-        }
+	watch->closed = true;
 
-        cid_str = evhttp_find_header(params, "cid");
-        if(cid_str == NULL) {
-                evhttp_send_error(req, 400, "No cid specified");
-                return;
+	h = calloc(1, sizeof(struct handoff));
+	if(h == NULL)
+	{
+		log_error("Internal error - handoff allocation failed");
+		log_flush();
+		abort();
 	}
 
-	if(!safe_strtoul(cid_str, 16, &cid) || cid < 1 || cid > 0xffffffffULL) {
-                evhttp_send_error(req, 400, "Invalid cid specified");
-                return;
-        }
+	h->type = HANDOFF_RECV_CLOSED;
+	h->origin = watch->origin;
+	h->req = watch->req;
+	h->token = watch->token;
+
+	handoff_post(&workers[watch->worker], h);
+}
 
-	printf("created connection 0x%"PRIxPTR"\n", cid); 
+/**
+ * Called by the origin worker when the recv stream ends.
+ */
+static void recv_watch_free(struct evhttp_request *req, struct recv_watch *watch)
+{
+	if(!watch->closed && req->evcon)
+		evhttp_connection_set_closecb(req->evcon, NULL, NULL);
 
-	buf = evbuffer_new();
-	if(buf == NULL)
-	{
-		evhttp_send_error(req, 500, "Buffer allocation failed");
-		evbuffer_free(sess->evb);
-		free(sess);
-		return;
-	}
+	free(watch);
+}
 
-        bev = bufferevent_socket_new(sess->prx->base, -1, BEV_OPT_CLOSE_ON_FREE);
-        if (bev == NULL) {
-                evhttp_send_error(req, 500, "bufferevent_socket_new() failed");
-                return;
-        }
+static void wsstream_free(struct wsstream *wss)
+{
+	TAILQ_REMOVE(&wss->prx->wsstreams, wss, next);
+	ws_free(wss->ws);
+	free(wss);
+}
 
-	conn = calloc(1, sizeof(struct connection));
-	if(conn == NULL)
+/**
+ * Performs a reply operation on a WebSocket attached as recv stream.  An
+ * error or the end of the stream closes it, the session has let go of it
+ * then.
+ */
+static void wsstream_deliver(handoff_type type, struct wsstream *wss, int code, const char *reason,
+		struct evbuffer *evb)
+{
+	switch(type)
 	{
-		evhttp_send_error(req, 500, "Connection allocation failed");
-		return;
-	}
-	conn->id = cid;
-	conn->sess = sess;
-	conn->bev = bev;
+	case HANDOFF_REPLY:
+		if(code == 200)
+			break;
 
-	bufferevent_setcb(bev, handle_bev_read, handle_bev_write, handle_bev_event, conn);
+		wss->attached = false;
+		ws_close(wss->ws, 4000 + code, reason);
+		break;
+	case HANDOFF_START:
+		break;
+	case HANDOFF_CHUNK:
+		ws_send(wss->ws, evb);
+		break;
+	case HANDOFF_END:
+		wss->attached = false;
+		ws_close(wss->ws, WS_CLOSE_NORMAL, NULL);
+		break;
+	case HANDOFF_REQUEST:
+	case HANDOFF_WS_MESSAGE:
+	case HANDOFF_WS_DETACH:
+	case HANDOFF_WS_RELEASE:
+	case HANDOFF_RECV_CLOSED:
+	default:
+		abort();
+	}
 
-	printf("session_connect(..., 0x%"PRIxPTR") -- connecting to %s:%ld\n", (uintptr_t)sess, host, port); 
+	if(wss->closed && !wss->attached && !wss->detaching)
+		wsstream_free(wss);
+}
 
-	ret = bufferevent_socket_connect_hostname(bev, sess->prx->dns, AF_UNSPEC, host, port);
-	if (ret < 0) {
-		evhttp_send_error(req, 500, "bufferevent_socket_connect_hostname() failed");
-		connection_free(conn, NULL);
-		conn = NULL;
+/**
+ * Performs a reply operation on a request owned by the calling worker.
+ */
+static void deliver(handoff_type type, struct evhttp_request *req, struct wsstream *ws, int code,
+		const char *reason, struct evbuffer *evb, struct recv_watch *watch, unsigned start_flags)
+{
+	if(ws)
+	{
+		wsstream_deliver(type, ws, code, reason, evb);
 		return;
 	}
 
-	if(evhttp_add_header(req->output_headers, "Content-type", "text/plain; charset=utf-8") == 0)
+	switch(type)
 	{
-		if(evbuffer_add_printf(buf, "%"PRIxPTR"\r\n", (uintptr_t)conn) > 0)
+	case HANDOFF_REPLY:
+		if(code != 200)
+		{
+			evhttp_send_error(req, code, reason);
+			break;
+		}
+
+		if(evb)
+		{
+			evhttp_add_header(req->output_headers, "Content-type", "text/plain; charset=utf-8");
+		}
+
+		evhttp_send_reply(req, code, reason, evb);
+		break;
+	case HANDOFF_START:
+		if(watch && req->evcon)
 		{
-			TREE_INSERT(&sess->conns, connection, linkage, conn);
+			evhttp_connection_set_closecb(req->evcon, handle_recv_close, watch);
+		}
 
-			evhttp_send_reply(req, 200, NULL, buf);
-			evbuffer_free(buf);
+		if(start_flags & START_TAKEOVER)
+		{
+			evhttp_add_header(req->output_headers, "X-Session-Takeover", "true");
+		}
 
-			printf("session_connect(...) => %"PRIxPTR"\n", (uintptr_t)conn); 
+		if(start_flags & START_DEFLATE)
+		{
+			evhttp_add_header(req->output_headers, "X-Recv-Encoding", "deflate");
+			evhttp_add_header(req->output_headers, "Access-Control-Expose-Headers", "X-Recv-Encoding");
+		}
 
-			return;
+		if(start_flags & START_BINARY)
+		{
+			evhttp_add_header(req->output_headers, "Content-Type", "application/octet-stream");
+			evhttp_add_header(req->output_headers, "X-Content-Type-Options", "nosniff");
+		}
+		else
+		{
+			evhttp_add_header(req->output_headers, "Content-Type", "x-application/something-unknown");
 		}
-	}
 
+		evhttp_send_reply_start(req, 200, NULL);
+		break;
+	case HANDOFF_CHUNK:
+		evhttp_send_reply_chunk(req, evb);
+		break;
+	case HANDOFF_END:
+		if(watch)
+			recv_watch_free(req, watch);
 
-	evhttp_send_reply(req, 200, NULL, NULL);
+		evhttp_send_reply_end(req);
+		break;
+	case HANDOFF_REQUEST:
+	case HANDOFF_WS_MESSAGE:
+	case HANDOFF_WS_DETACH:
+	case HANDOFF_WS_RELEASE:
+	case HANDOFF_RECV_CLOSED:
+	default:
+		abort();
+	}
 }
 
-static void session_disconnect(struct evhttp_request *req, struct session *sess, struct connection *conn)
+static struct handoff *handoff_new(handoff_type type, const struct request *r, const char *uri)
 {
-	printf("connection_disconnect(..., 0x%"PRIxPTR")\n", (uintptr_t)conn);
+	size_t urilen = uri ? strlen(uri) + 1 : 0;
+	struct handoff *h;
 
-	bufferevent_free(conn->bev);
-	conn->bev = NULL;	
+	h = calloc(1, sizeof(struct handoff) + urilen);
+	if(h == NULL)
+	{
+		log_error("Internal error - handoff allocation failed");
+		log_flush();
+		abort();
+	}
+
+	h->type = type;
+	h->origin = r->origin;
+	h->req = r->req;
+	h->ws = r->ws;
 
-        evhttp_send_reply(req, 200, NULL, NULL);
+	if(uri)
+	{
+		memcpy(h->uri, uri, urilen);
+	}
+
+	return h;
 }
 
-static void session_send(struct evhttp_request *req, struct connection *conn)
+/**
+ * Reply helpers -- served directly when the request is ours, otherwise
+ * handed back to the origin worker.  Buffers passed in are drained.
+ */
+static void reply_post(struct request *r, handoff_type type, int code, const char *reason,
+		struct evbuffer *evb, unsigned start_flags)
 {
-	printf("connection_send(..., 0x%"PRIxPTR") -- %zd bytes\n", (uintptr_t)conn, evbuffer_get_length(req->input_buffer));
+	struct handoff *h;
 
-	if(conn->bev == NULL)
+	if(!r->remote)
 	{
-		evhttp_send_error(req, 400, "Connection not connected");
+		deliver(type, r->req, r->ws, code, reason, evb, r->watch, start_flags);
 		return;
 	}
 
-	if(bufferevent_write_buffer(conn->bev, req->input_buffer) < 0)
+	h = handoff_new(type, r, NULL);
+	h->code = code;
+	h->reason = reason;
+	h->watch = r->watch;
+	h->start_flags = start_flags;
+
+	if(evb)
 	{
-		evhttp_send_error(req, 500, "Writing to buffer failed");
-		return;
+		h->evb = evbuffer_new();
+		evbuffer_add_buffer(h->evb, evb);
 	}
 
-	evhttp_send_reply(req, 200, NULL, NULL);
+	handoff_post(r->origin, h);
 }
 
-static void handle_recv_close(struct evhttp_connection *con, void *udata)
+static void reply_send(struct request *r, int code, struct evbuffer *evb)
 {
-	struct session *sess = udata;
-	printf("handle_recv_close(..., 0x%"PRIxPTR")\n", (uintptr_t)sess); 
+	reply_post(r, HANDOFF_REPLY, code, NULL, evb, 0);
 }
 
-static void session_recv(struct evhttp_request *req, struct session *sess, struct evkeyvalq *params)
+static void reply_error(struct request *r, int code, const char *reason)
 {
-	const char *long_poll_str;
-
-	printf("session_recv(..., 0x%"PRIxPTR")\n", (uintptr_t)sess); 
+	reply_post(r, HANDOFF_REPLY, code, reason, NULL, 0);
+}
 
-	if(sess->req)
+/**
+ * Starts the recv stream r of sess.  XHR streams get a recv_watch.
+ */
+static void reply_start(struct request *r, struct session *sess, unsigned start_flags)
+{
+	if(r->req && (r->watch = calloc(1, sizeof(struct recv_watch))) != NULL)
 	{
-		struct prefix pfx;
-	        make_prefix(&pfx, PKT_TAKEOVER, 0, 0);
-		evbuffer_add(sess->evb, &pfx, sizeof(pfx));
-		evhttp_send_reply_chunk(sess->req, sess->evb);
-		evhttp_send_reply_end(sess->req);
-		evhttp_add_header(req->output_headers, "X-Session-Takeover", "true");
+		r->watch->origin = r->origin;
+		r->watch->req = r->req;
+		r->watch->worker = sess->prx->index;
+		r->watch->token = sess->token;
 	}
 
-	evhttp_connection_set_closecb(req->evcon, handle_recv_close, sess);
-
-	//evhttp_request_own(req);
-	sess->req = req;
-
-	long_poll_str = evhttp_find_header(params, "long_poll");
-	sess->long_poll = long_poll_str ? (atoi(long_poll_str) != 0) : false;
-
-	evhttp_add_header(req->output_headers, "Content-Type", "x-application/something-unknown");
-
-	evhttp_send_reply_start(req, 200, NULL);
+	reply_post(r, HANDOFF_START, 200, NULL, NULL, start_flags);
+}
 
-	send_some_pad(req, 16); //2048);
+static void reply_chunk(struct request *r, struct evbuffer *evb)
+{
+	reply_post(r, HANDOFF_CHUNK, 200, NULL, evb, 0);
+}
 
-	if(evbuffer_get_length(sess->evb))
-	{
-		evhttp_send_reply_chunk(sess->req, sess->evb);
-		send_some_pad(req, 16);
+static void reply_end(struct request *r)
+{
+	reply_post(r, HANDOFF_END, 200, NULL, NULL, 0);
+}
 
-		if(sess->long_poll)
-		{
-                	evhttp_send_reply_end(sess->req);
-			sess->req = NULL;			
-		}
-	}
+static bool request_active(const struct request *r)
+{
+	return r->req != NULL || r->ws != NULL;
 }
 
-static action_type parse_action(const char *action)
+static void request_clear(struct request *r)
 {
-	if(!strcmp(action, "create"))
-		return ACTION_CREATE;
-	if(!strcmp(action, "delete"))
-		return ACTION_DELETE;
-	if(!strcmp(action, "connect"))
-		return ACTION_CONNECT;
-	if(!strcmp(action, "disconnect"))
-		return ACTION_DISCONNECT;
-	if(!strcmp(action, "recv"))
-		return ACTION_RECV;
-	if(!strcmp(action, "send"))
-		return ACTION_SEND;
-	return ACTION_UNKNOWN;
+	r->req = NULL;
+	r->ws = NULL;
+	r->watch = NULL;
 }
 
-static void handle_connection_action(action_type action, struct evhttp_request *req, struct evkeyvalq *params, struct session *sess)
+static void init_pad_packets(void)
 {
-	const char *cid_str = NULL;
-	uintptr_t cid;
-	struct connection *conn = NULL;
-	struct connection dummy;
+	framing_type framing;
 
-	cid_str = evhttp_find_header(params, "cid");
-	if(!safe_strtoul(cid_str, 16, (uintptr_t *)&cid))
+	for(framing = FRAMING_ASCII; framing <= FRAMING_VARINT; framing++)
 	{
-		evhttp_send_error(req, 400, "Invalid connection specified");
-		return;
+		uint8_t *pkt = pad_packets[framing];
+		size_t len = make_header(pkt, framing, PKT_PAD, 0, PAD_SIZE);
+
+		memset(pkt + len, '?', PAD_SIZE);
+		pad_lengths[framing] = len + PAD_SIZE;
 	}
+}
 
-	dummy.id = cid;
+static void connection_update_read(struct connection *conn, void *udata)
+{
+	bool enable = !conn->throttled && !conn->sess->throttled;
 
-	conn = TREE_FIND(&sess->conns, connection, linkage, &dummy);
-	if(conn == NULL)
-	{
-		evhttp_send_error(req, 404, "Connection not found");
+	if(!conn->connected)
 		return;
-	};
 
-	if(action == ACTION_DISCONNECT)
+	if(conn->udp && conn->udp->ev)
 	{
-		session_disconnect(req, sess, conn);
+		if(enable)
+			event_add(conn->udp->ev, NULL);
+		else
+			event_del(conn->udp->ev);
 	}
-	else if(action == ACTION_SEND)
+	else if(conn->uring)
 	{
-		session_send(req, conn);
+		uring_sock_recv(conn->uring, enable);
 	}
-	else
+	else if(conn->bev)
 	{
-		evhttp_send_error(req, 400, "Invalid action");
+		if(enable)
+			bufferevent_enable(conn->bev, EV_READ);
+		else
+			bufferevent_disable(conn->bev, EV_READ);
 	}
 }
 
-static void handle_session(struct evhttp_request *req, void *udata)
+static void connection_release(struct connection *conn, void *udata)
 {
-	struct proxy *prx = udata;
-	struct evkeyvalq params;
-        const char *session_str;
-	uintptr_t session_id;
-	struct session *sess;
-	const char *action_str;
-	action_type action;
-	char *endp;
+	struct session *sess = conn->sess;
 
-	disable_caching(req);
+	if(conn->queued_gen != sess->flush_gen)
+	{
+		conn->queued = 0;
+		conn->queued_gen = sess->flush_gen;
+	}
 
-	if(req->type == EVHTTP_REQ_OPTIONS)
+	if(conn->throttled && conn->queued <= conn_low_watermark)
 	{
-		evhttp_send_reply(req, 200, NULL, NULL);
-		return;
+		conn->throttled = false;
+		sess->throttled_conns--;
+		connection_update_read(conn, NULL);
 	}
+}
 
-        TAILQ_INIT(&params);
+/**
+ * Bytes held for the client: still queued in evb plus, if the client
+ * announced a window, sent but not yet reported as consumed.
+ */
+static size_t session_backlog(struct session *sess)
+{
+	size_t backlog = evbuffer_get_length(sess->evb);
+
+	if(sess->window && sess->recv_sent > sess->recv_acked)
+		backlog += sess->recv_sent - sess->recv_acked;
+
+	return backlog;
+}
+
+static void session_foreach_conn(struct session *sess, void (*fn)(struct connection *, void *))
+{
+	struct connection *conn;
+	size_t pos = 0;
+
+	while((conn = htable_next(&sess->conns, &pos)) != NULL)
+		fn(conn, NULL);
+}
+
+static void session_update_throttle(struct session *sess)
+{
+	size_t backlog = session_backlog(sess);
+	bool throttled;
 
-        evhttp_parse_query(req->uri, &params);
+	if(sess->throttled)
+		throttled = backlog > session_low_watermark;
+	else
+		throttled = backlog >= session_high_watermark;
 
-	action_str = evhttp_find_header(&params, "act");
-	if(action_str == NULL)
+	if(throttled != sess->throttled)
 	{
-		evhttp_send_error(req, 400, "No action specified");
-		goto cleanup;
+		log_debug("session 0x%"PRIxPTR" %s upstream reads, backlog %zu",
+			(uintptr_t)sess, throttled ? "suspends" : "resumes", backlog);
+
+		sess->throttled = throttled;
+		session_foreach_conn(sess, connection_update_read);
 	}
+}
 
-	action = parse_action(action_str);
-	if(action == ACTION_UNKNOWN)
+/**
+ * Accounts for bytes of conn that had to stay queued in evb.
+ */
+static void session_queue(struct session *sess, struct connection *conn, size_t bytes)
+{
+	if(conn->queued_gen != sess->flush_gen)
 	{
-		evhttp_send_error(req, 400, "Invalid action specified");
-		goto cleanup;
+		conn->queued = 0;
+		conn->queued_gen = sess->flush_gen;
 	}
 
-	if(action == ACTION_CREATE)
+	conn->queued += bytes;
+
+	if(!conn->throttled && conn->queued >= conn_high_watermark)
 	{
-		session_create(req, prx);
-		goto cleanup;
+		conn->throttled = true;
+		sess->throttled_conns++;
+		connection_update_read(conn, NULL);
 	}
 
-	session_str = evhttp_find_header(&params, "sid");
-        if (session_str == NULL) {
-       	        evhttp_send_error(req, 400, "No session specified");
-		goto cleanup;
-        }
+	session_update_throttle(sess);
+}
 
-        errno = 0;
-       	session_id = strtoull(session_str, &endp, 16);
-        if (errno != 0 || *endp != 0 || endp == session_str) {
-       	        evhttp_send_error(req, 400, "Invalid session specified");
-               	goto cleanup;
-        }
+/**
+ * Compresses all of src, or nothing if it is NULL, into dst and ends the
+ * output with flush.
+ */
+static void deflate_buffer(struct proxy *prx, z_stream *zs, struct evbuffer *src, struct evbuffer *dst, int flush)
+{
+	struct evbuffer_iovec in, out;
+	size_t in_len = src ? evbuffer_get_length(src) : 0;
+	size_t out_len = evbuffer_get_length(dst);
+	uint64_t start = now_usec();
+	bool last;
 
-	sess = TREE_FIND(&prx->sessions, session, linkage, (struct session *)session_id);
-	if(sess == NULL)
+	do
 	{
-		evhttp_send_error(req, 404, "Session not found");
-		goto cleanup;
-	}
+		if(src == NULL || evbuffer_peek(src, -1, NULL, &in, 1) < 1)
+		{
+			in.iov_base = NULL;
+			in.iov_len = 0;
+		}
 
-	switch(action)
-	{
-	case ACTION_CONNECT:
-		session_connect(req, &params, sess);
-		break;
-	case ACTION_DELETE:
-		session_delete(req, sess);
-		break;
-	case ACTION_RECV:
-		session_recv(req, sess, &params);
-		break;
-	case ACTION_DISCONNECT:
-	case ACTION_SEND:
-		handle_connection_action(action, req, &params, sess);
-		break;
-	case ACTION_UNKNOWN:
-	case ACTION_CREATE:
-	default:
+		last = src == NULL || in.iov_len == evbuffer_get_length(src);
+
+		zs->next_in = in.iov_base;
+		zs->avail_in = in.iov_len;
+
+		/* Input is only left over once the output space ran out. */
+		do
+		{
+			if(evbuffer_reserve_space(dst, DEFLATE_CHUNK, &out, 1) < 1)
+			{
+				log_error("Internal error - deflate output allocation failed");
+				log_flush();
+				abort();
+			}
+
+			zs->next_out = out.iov_base;
+			zs->avail_out = out.iov_len;
+
+			deflate(zs, last ? flush : Z_NO_FLUSH);
+
+			out.iov_len -= zs->avail_out;
+			evbuffer_commit_space(dst, &out, 1);
+		}
+		while(zs->avail_out == 0);
+
+		if(src)
+			evbuffer_drain(src, in.iov_len);
+	}
+	while(!last);
+
+	stat_add(&prx->stats.deflate_in, in_len);
+	stat_add(&prx->stats.deflate_out, evbuffer_get_length(dst) - out_len);
+	stat_add(&prx->stats.deflate_usec, now_usec() - start);
+}
+
+/**
+ * Passes evb on to the recv stream, compressed and flushed to a byte
+ * boundary if the stream is compressed so the client can parse every
+ * packet in it right away.
+ */
+static void session_send_chunk(struct session *sess, struct evbuffer *evb)
+{
+	if(!sess->compressed)
+	{
+		reply_chunk(&sess->recv, evb);
+		return;
+	}
+
+	deflate_buffer(sess->prx, sess->deflate, evb, sess->deflated, Z_SYNC_FLUSH);
+	reply_chunk(&sess->recv, sess->deflated);
+}
+
+/**
+ * Passes evb on to the recv stream, noting how long its oldest data
+ * waited.
+ */
+static void session_reply_chunk(struct session *sess)
+{
+	if(sess->pending_since)
+	{
+		histogram_record(&sess->prx->stats.relay_latency, now_usec() - sess->pending_since);
+		sess->pending_since = 0;
+	}
+
+	session_send_chunk(sess, sess->evb);
+}
+
+/**
+ * Ends the recv stream, completing its deflate stream first.
+ */
+static void session_reply_end(struct session *sess)
+{
+	if(sess->compressed)
+	{
+		deflate_buffer(sess->prx, sess->deflate, NULL, sess->deflated, Z_FINISH);
+		reply_chunk(&sess->recv, sess->deflated);
+		sess->compressed = false;
+	}
+
+	reply_end(&sess->recv);
+}
+
+/**
+ * Whether a flush would pass evb on right now.
+ */
+static bool session_writable(struct session *sess)
+{
+	if(!request_active(&sess->recv))
+		return false;
+
+	return !sess->window || sess->recv_sent <= sess->recv_acked ||
+		sess->recv_sent - sess->recv_acked < sess->window;
+}
+
+/**
+ * Sends everything pending in evb, followed by a pad packet copied from
+ * static storage, as one chunk of the recv stream.  Returns false if there
+ * is no recv stream or the client's window is exhausted.
+ */
+static bool session_flush(struct session *sess)
+{
+	size_t len;
+
+	if(!session_writable(sess))
+		return false;
+
+	session_replay_record(sess);
+
+	/* Pad packets only help browsers along that buffer partial XHR
+	 * responses, WebSocket messages arrive as a whole. */
+	if(sess->recv.ws == NULL)
+	{
+		evbuffer_add(sess->evb, pad_packets[sess->framing], pad_lengths[sess->framing]);
+		stat_add(&sess->prx->stats.packets[PKT_PAD], 1);
+	}
+	else if(evbuffer_get_length(sess->evb) == 0)
+		return true;
+
+	len = evbuffer_get_length(sess->evb);
+	session_reply_chunk(sess);
+	sess->recv_sent += len;
+
+	sess->flush_gen++;
+	if(sess->throttled_conns > 0)
+		session_foreach_conn(sess, connection_release);
+
+	session_update_throttle(sess);
+
+	return true;
+}
+
+static uint64_t timeout_ticks(unsigned seconds)
+{
+	return (uint64_t)seconds * 1000 / WHEEL_TICK_MS;
+}
+
+/**
+ * Schedules the expiry of sess for whichever of its timeouts is due
+ * first, if any applies.
+ */
+static void session_arm_expiry(struct session *sess)
+{
+	uint64_t due = UINT64_MAX;
+
+	if(session_max_age)
+		due = sess->created + timeout_ticks(session_max_age);
+
+	if(session_detach_timeout && !request_active(&sess->recv)
+		&& sess->detached + timeout_ticks(session_detach_timeout) < due)
+	{
+		due = sess->detached + timeout_ticks(session_detach_timeout);
+	}
+
+	if(due == UINT64_MAX)
+		wheel_del(&sess->prx->wheel, &sess->expiry);
+	else
+		wheel_add(&sess->prx->wheel, &sess->expiry, due);
+}
+
+/**
+ * Lets go of the recv stream, which starts the detach timeout.
+ */
+static void session_recv_clear(struct session *sess)
+{
+	request_clear(&sess->recv);
+
+	sess->detached = sess->prx->wheel.now;
+	session_arm_expiry(sess);
+}
+
+static void ask_recon(struct session *sess)
+{
+	stat_add(&sess->prx->stats.reconnects, 1);
+	session_add_packet(sess, PKT_RECONN, 0);
+	session_reply_chunk(sess);
+	session_reply_end(sess);
+	session_recv_clear(sess);
+}
+
+/**
+ * Whether the XHR recv stream has used up its byte or age budget.
+ */
+static bool session_recv_spent(struct session *sess)
+{
+	if(sess->recv_max_bytes && sess->recv_sent >= sess->recv_max_bytes)
+		return true;
+
+	return sess->recv_max_age && now_usec() - sess->recv_started >= sess->recv_max_age;
+}
+
+/**
+ * Sends what the upstream events of the session have queued, as a single
+ * chunk.  XHR streams are recycled once they are spent, or after every
+ * chunk when long polling.
+ */
+static void session_flush_pending(struct session *sess)
+{
+	if(sess->flush_timer)
+		evtimer_del(sess->flush_timer);
+
+	if(evbuffer_get_length(sess->evb) == 0)
+		return;
+
+	if(session_flush(sess) && sess->recv.ws == NULL &&
+		(sess->long_poll || session_recv_spent(sess)))
+	{
+		ask_recon(sess);
+	}
+}
+
+/**
+ * Has the session flushed at the end of the current loop iteration, or
+ * once its flush delay expires.
+ */
+static void session_schedule_flush(struct session *sess)
+{
+	struct proxy *prx = sess->prx;
+
+	if(sess->dirty)
+		return;
+
+	if(sess->flush_timer && sess->flush_delay.tv_usec > 0 &&
+		evbuffer_get_length(sess->evb) < FLUSH_DELAY_BYTES)
+	{
+		if(!evtimer_pending(sess->flush_timer, NULL))
+			evtimer_add(sess->flush_timer, &sess->flush_delay);
+		return;
+	}
+
+	sess->dirty = true;
+	TAILQ_INSERT_TAIL(&prx->dirty, sess, dirty_next);
+
+	/* Active events run in the order they were activated, so this runs
+	 * after every other event of the iteration. */
+	event_active(prx->flush_ev, EV_READ, 0);
+}
+
+static void handle_flush_timer(evutil_socket_t fd, short what, void *udata)
+{
+	session_flush_pending(udata);
+}
+
+/**
+ * Sends the datagrams queued for a connected UDP socket.
+ */
+static void udp_socket_send(struct udp_socket *udp)
+{
+	struct proxy *prx = udp->conn->sess->prx;
+	uint64_t calls = 0;
+	unsigned sent;
+
+	if(udp->dirty)
+	{
+		TAILQ_REMOVE(&prx->udp_dirty, udp, dirty_next);
+		udp->dirty = false;
+	}
+
+	if(udp->queued == 0)
+		return;
+
+	sent = udp_send(event_get_fd(udp->ev), udp->out, udp->lens, udp->queued, &calls);
+
+	if(sent < udp->queued)
+		log_debug("Connection %"PRIx32" dropped %u of %u datagrams", udp->conn->id, udp->queued - sent, udp->queued);
+
+	stat_add(&prx->stats.udp_datagrams_up, sent);
+	stat_add(&prx->stats.udp_dropped, udp->queued - sent);
+	stat_add(&prx->stats.udp_send_calls, calls);
+
+	udp->queued = 0;
+}
+
+/**
+ * Has the datagrams queued for a connected UDP socket sent at the end of
+ * the current loop iteration.
+ */
+static void udp_socket_schedule_send(struct udp_socket *udp)
+{
+	struct proxy *prx = udp->conn->sess->prx;
+
+	if(udp->dirty || udp->ev == NULL)
+		return;
+
+	udp->dirty = true;
+	TAILQ_INSERT_TAIL(&prx->udp_dirty, udp, dirty_next);
+	event_active(prx->flush_ev, EV_READ, 0);
+}
+
+static void handle_flush(evutil_socket_t fd, short what, void *udata)
+{
+	struct proxy *prx = udata;
+	struct session *sess;
+	struct udp_socket *udp;
+
+	while((udp = TAILQ_FIRST(&prx->udp_dirty)) != NULL)
+		udp_socket_send(udp);
+
+	while((sess = TAILQ_FIRST(&prx->dirty)) != NULL)
+	{
+		TAILQ_REMOVE(&prx->dirty, sess, dirty_next);
+		sess->dirty = false;
+
+		session_flush_pending(sess);
+	}
+}
+
+static void handle_bev_read(struct bufferevent *bev, void *udata)
+{
+	struct connection *conn = udata;
+	struct session *sess = conn->sess;
+	struct proxy *prx = sess->prx;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	uint64_t heap_allocs = mem_heap_allocs();
+	uint8_t hdr[HEADER_MAX];
+	size_t len, avail;
+	
+	avail = evbuffer_get_length(input);
+
+	log_debug("handle_bev_read() -- evbuffer_get_length(evb)=%zd", avail);
+
+	/* The header is copied in front, the payload chains are moved over
+	 * from the input buffer without copying. */
+	len = make_header(hdr, sess->framing, PKT_DATA, conn->id, avail);
+	evbuffer_add(sess->evb, hdr, len);
+	evbuffer_add_buffer(sess->evb, input);
+	sess->evb_packets++;
+
+	if(sess->pending_since == 0)
+		sess->pending_since = now_usec();
+
+	conn->active = prx->wheel.now;
+
+	stat_add(&prx->stats.packets[PKT_DATA], 1);
+	stat_add(&prx->stats.bytes_down, avail);
+	histogram_record(&prx->stats.backlog, evbuffer_get_length(sess->evb));
+
+	if(session_writable(sess))
+		session_schedule_flush(sess);
+	else
+		session_queue(sess, conn, len + avail);
+
+	stat_add(&prx->stats.relay_reads, 1);
+	stat_add(&prx->stats.relay_heap_allocs, mem_heap_allocs() - heap_allocs);
+}
+
+static void udp_socket_free(struct udp_socket *udp)
+{
+	struct proxy *prx = udp->conn->sess->prx;
+
+	if(udp->dirty)
+		TAILQ_REMOVE(&prx->udp_dirty, udp, dirty_next);
+
+	if(udp->ev)
+	{
+		evutil_closesocket(event_get_fd(udp->ev));
+		event_free(udp->ev);
+	}
+
+	evbuffer_pool_put(&prx->buffers, udp->out);
+	udp->conn->udp = NULL;
+	free(udp);
+}
+
+/**
+ * Relays the datagrams waiting on a UDP socket, one PKT_DATA packet each,
+ * received with a single recvmmsg().
+ */
+static void handle_udp_read(evutil_socket_t fd, short what, void *udata)
+{
+	struct connection *conn = udata;
+	struct session *sess = conn->sess;
+	struct proxy *prx = sess->prx;
+	struct udp_batch *in = &prx->udp_in;
+	uint8_t hdr[HEADER_MAX];
+	size_t len, total = 0, bytes = 0;
+	unsigned i;
+	int n;
+
+	n = udp_recv(fd, in);
+	stat_add(&prx->stats.udp_recv_calls, 1);
+
+	if(n < 0)
+	{
+		/* An ICMP error for an earlier datagram, which is as good as
+		 * lost. */
+		if(errno == ECONNREFUSED)
+			return;
+
+		log_warn("Receiving on connection %"PRIx32" failed: %s", conn->id, strerror(errno));
+
+		udp_socket_free(conn->udp);
+		session_add_packet(sess, PKT_DISCONNECTED, conn->id);
+		session_schedule_flush(sess);
+		return;
+	}
+
+	if(n == 0)
+		return;
+
+	for(i = 0; i < in->num; i++)
+	{
+		len = make_header(hdr, sess->framing, PKT_DATA, conn->id, in->lens[i]);
+		evbuffer_add(sess->evb, hdr, len);
+		evbuffer_add(sess->evb, in->data[i], in->lens[i]);
+		sess->evb_packets++;
+
+		total += len + in->lens[i];
+		bytes += in->lens[i];
+	}
+
+	if(sess->pending_since == 0)
+		sess->pending_since = now_usec();
+
+	conn->active = prx->wheel.now;
+
+	stat_add(&prx->stats.packets[PKT_DATA], in->num);
+	stat_add(&prx->stats.bytes_down, bytes);
+	stat_add(&prx->stats.udp_datagrams_down, in->num);
+	histogram_record(&prx->stats.backlog, evbuffer_get_length(sess->evb));
+
+	if(session_writable(sess))
+		session_schedule_flush(sess);
+	else
+		session_queue(sess, conn, total);
+}
+
+static void handle_bev_write(struct bufferevent *bev, void *udata)
+{
+	log_debug("handle_bev_write()"); 
+}
+
+/**
+ * Frees bev, and takes its socket off the ring if it is there.
+ */
+static void connection_free_bev(struct connection *conn)
+{
+	if(conn->uring)
+	{
+		uring_sock_close(conn->uring);
+		conn->uring = NULL;
+	}
+
+	bufferevent_free(conn->bev);
+	conn->bev = NULL;
+}
+
+/**
+ * Data the ring received goes through the input of bev like data read by
+ * libevent, which is copied there just the same.
+ */
+static void handle_uring_read(struct uring_sock *s, const void *data, size_t len, void *udata)
+{
+	struct connection *conn = udata;
+
+	evbuffer_add(bufferevent_get_input(conn->bev), data, len);
+	handle_bev_read(conn->bev, conn);
+}
+
+static void handle_uring_event(struct uring_sock *s, short what, void *udata);
+
+/**
+ * Moves the socket of a connection that just connected from its bev onto
+ * the ring.  Returns false if it stays with bev.
+ */
+static bool connection_attach_uring(struct connection *conn)
+{
+	struct uring *ring = conn->sess->prx->ring;
+	evutil_socket_t fd = bufferevent_getfd(conn->bev);
+
+	conn->uring = uring_sock_new(ring, fd, bufferevent_get_output(conn->bev),
+		handle_uring_read, handle_uring_event, conn);
+	if(conn->uring == NULL)
+		return false;
+
+	bufferevent_disable(conn->bev, EV_READ | EV_WRITE);
+	bufferevent_setfd(conn->bev, -1);
+
+	/* Whatever was sent while connecting. */
+	uring_sock_write(conn->uring);
+	return true;
+}
+
+/**
+ * Gives up on a connection that never got connected and tells the client
+ * with PKT_CONNFAIL.
+ */
+static void connection_fail(struct connection *conn)
+{
+	struct session *sess = conn->sess;
+
+	if(conn->bev)
+		connection_free_bev(conn);
+
+	if(conn->udp)
+		udp_socket_free(conn->udp);
+
+	session_add_packet(sess, PKT_CONNFAIL, conn->id);
+
+	if(sess->recv.ws)
+	{
+		session_flush(sess);
+	}
+	else if(request_active(&sess->recv))
+	{
+		session_reply_chunk(sess);
+		session_reply_end(sess);
+		session_recv_clear(sess);
+	}
+}
+
+static void handle_bev_event(struct bufferevent *bev, short what, void *udata)
+{
+	struct connection *conn = udata;
+	struct session *sess = conn->sess;
+
+	if(sess == NULL)
+	{
+		log_error("Internal error - sess of conn %p is NULL", conn);
+		log_flush();
+		abort();
+	}
+
+	if(conn == NULL)
+	{
+		log_error("Internal error - conn is NULL");
+		log_flush();
 		abort();
 	}
 
+	log_debug("handle_bev_event()");
+
+	if(what & BEV_EVENT_CONNECTED)
+	{
+		log_debug("CONNECTED"); 
+
+		if(sess->evb == NULL)
+		{
+			log_error("Internal error - evb of sess %p is NULL", sess);
+			log_flush();
+			abort();
+		}
+
+		session_add_packet(sess, PKT_CONNECTED, conn->id);
+		session_schedule_flush(sess);
+
+		conn->bev = bev;
+		conn->connected = true;
+
+		if(sess->prx->ring == NULL || !connection_attach_uring(conn))
+			bufferevent_enable(bev, EV_WRITE);
+		connection_update_read(conn, NULL);
+	}
+	else if(what & BEV_EVENT_EOF)
+	{
+		log_debug("EOF -- sending PKT_DISCONNECTED");
+
+		connection_free_bev(conn);
+
+		session_add_packet(sess, PKT_DISCONNECTED, conn->id);
+		session_schedule_flush(sess);
+	}
+	else if(what & BEV_EVENT_ERROR)
+	{
+		log_warn("Connecting %"PRIx32" failed", conn->id);
+		connection_fail(conn);
+	}
+	else
+	{
+		log_warn("Unknown event: %s", dump_what(what));
+	}
+}
+
+static void handle_uring_event(struct uring_sock *s, short what, void *udata)
+{
+	struct connection *conn = udata;
+
+	handle_bev_event(conn->bev, what, conn);
+}
+
+static void allow_cross_origin(struct evhttp_request *req)
+{
+	evhttp_add_header(req->output_headers, "Access-Control-Allow-Origin", "*");
+	evhttp_add_header(req->output_headers, "Access-Control-Allow-Methods", "GET, POST");
+	evhttp_add_header(req->output_headers, "Access-Control-Allow-Headers", "cache-control,expires,pragma,content-type");
+}
+
+static void disable_caching(struct evhttp_request *req)
+{
+	evhttp_add_header(req->output_headers, "Cache-Control", "no-store,no-cache,must-revalidate");
+	evhttp_add_header(req->output_headers, "Pragma", "no-cache");
+	evhttp_add_header(req->output_headers, "Expires", "-1");
+
+	allow_cross_origin(req);
+}
+
+static int safe_strtoul(const char *str, unsigned base, uintptr_t *out)
+{
+	char *endp;
+	errno = 0;
+	*out = strtoull(str, &endp, base);
+	return (errno == 0 && *endp == 0 && endp != str);
+}
+
+/**
+ * Session ids are the index of the owning worker (two hex digits)
+ * followed by the session token (32 hex digits).
+ */
+#define SESSION_ID_LENGTH (2 + 32)
+
+static int session_id_print(struct evbuffer *buf, struct session *sess)
+{
+	char id[SESSION_ID_LENGTH];
+
+	hex_encode(id, sess->worker, 2);
+	hex_encode(id + 2, sess->token.hi, 16);
+	hex_encode(id + 18, sess->token.lo, 16);
+
+	return evbuffer_add_printf(buf, "%.*s\r\n", SESSION_ID_LENGTH, id);
+}
+
+static bool session_id_parse(const char *str, unsigned *worker, struct session_token *token)
+{
+	uint64_t index;
+
+	if(strlen(str) != SESSION_ID_LENGTH)
+		return false;
+
+	if(!hex_decode(str, 2, &index) ||
+		!hex_decode(str + 2, 16, &token->hi) ||
+		!hex_decode(str + 18, 16, &token->lo))
+		return false;
+
+	*worker = index % num_workers;
+	return true;
+}
+
+static void handle_session_expiry(struct wheel_timer *t, void *udata);
+
+/**
+ * Allocates a session of prx with the given token and id worker index.
+ * Returns NULL on failure.
+ */
+static struct session *session_new(struct proxy *prx, const struct session_token *token, unsigned worker)
+{
+	struct session *sess;
+
+	sess = pool_get(&prx->session_pool);
+	if(sess == NULL)
+		return NULL;
+	
+	htable_init(&sess->conns);
+	sess->token = *token;
+	sess->worker = worker;
+
+	sess->long_poll = false;
+	sess->framing = FRAMING_ASCII;
+	sess->prx = prx;
+
+	sess->evb = evbuffer_pool_get(&prx->buffers);
+	if(sess->evb == NULL)
+	{
+		pool_put(&prx->session_pool, sess);
+		return NULL;
+	}
+
+	if(htable_insert(&prx->sessions, session_hash(&sess->token), sess) < 0)
+	{
+		evbuffer_pool_put(&prx->buffers, sess->evb);
+		pool_put(&prx->session_pool, sess);
+		return NULL;
+	}
+
+	wheel_timer_init(&sess->expiry, handle_session_expiry, sess);
+	sess->created = sess->detached = prx->wheel.now;
+	session_arm_expiry(sess);
+
+	return sess;
+}
+
+static void session_create(struct request *r, struct proxy *prx)
+{
+	struct session_token token;
+	struct session *sess;
+	struct evbuffer *buf;
+
+	buf = evbuffer_pool_get(&prx->buffers);
+	if(buf == NULL)
+	{
+		reply_error(r, 500, "Buffer allocation failed");
+		return;
+	}
+
+	evutil_secure_rng_get_bytes(&token, sizeof(token));
+
+	sess = session_new(prx, &token, prx->index);
+	if(sess == NULL)
+	{
+		reply_error(r, 500, "Session allocation failed");
+		evbuffer_pool_put(&prx->buffers, buf);
+		return;
+	}
+
+	if(session_id_print(buf, sess) > 0)
+	{
+		reply_send(r, 200, buf);
+		evbuffer_pool_put(&prx->buffers, buf);
+
+		log_info("session_create(...) => %"PRIxPTR, (uintptr_t)sess);
+		stat_add(&prx->stats.sessions_created, 1);
+		return;
+	}
+
+	reply_error(r, 500, "Failed to construct reply");
+	evbuffer_pool_put(&prx->buffers, buf);
+	wheel_del(&prx->wheel, &sess->expiry);
+	htable_remove(&prx->sessions, session_hash(&sess->token), session_match, &sess->token);
+	evbuffer_pool_put(&prx->buffers, sess->evb);
+	pool_put(&prx->session_pool, sess);
+}
+
+static void handle_attempt_event(struct bufferevent *bev, short what, void *udata);
+
+static void race_free(struct connect_race *race)
+{
+	unsigned i;
+
+	for(i = 0; i < race->num; i++)
+	{
+		if(race->attempts[i])
+			bufferevent_free(race->attempts[i]);
+	}
+
+	event_free(race->timer);
+	free(race);
+}
+
+static void race_finish(struct connect_race *race, evutil_socket_t fd)
+{
+	void (*done)(evutil_socket_t, void *) = race->done;
+	void *udata = race->udata;
+
+	race_free(race);
+	done(fd, udata);
+}
+
+/**
+ * Starts the attempt on the next address, or gives up once all addresses
+ * have been tried without success.
+ */
+static void race_start_next(struct connect_race *race)
+{
+	struct bufferevent *bev;
+	struct timeval delay = {0, CONNECT_ATTEMPT_DELAY * 1000};
+	unsigned i;
+
+	while(race->next < race->num)
+	{
+		i = race->next++;
+
+		bev = bufferevent_socket_new(race->prx->base, -1, BEV_OPT_CLOSE_ON_FREE);
+		if(bev == NULL)
+			continue;
+
+		stat_add(&race->prx->stats.connect_attempts, 1);
+		bufferevent_setcb(bev, NULL, NULL, handle_attempt_event, race);
+
+		/* Errors such as an unreachable network are reported right
+		 * away, everything else comes through handle_attempt_event(). */
+		if(bufferevent_socket_connect(bev, (struct sockaddr *)&race->addrs[i], race->lens[i]) < 0)
+		{
+			bufferevent_free(bev);
+			continue;
+		}
+
+		race->attempts[i] = bev;
+		race->running++;
+
+		if(race->next < race->num)
+			evtimer_add(race->timer, &delay);
+
+		return;
+	}
+
+	if(race->running == 0)
+		race_finish(race, -1);
+}
+
+static void handle_race_timer(evutil_socket_t fd, short what, void *udata)
+{
+	race_start_next(udata);
+}
+
+/**
+ * Hands on the socket of the first attempt to connect and moves on to the
+ * next address as soon as one fails.
+ */
+static void handle_attempt_event(struct bufferevent *bev, short what, void *udata)
+{
+	struct connect_race *race = udata;
+	evutil_socket_t fd;
+	unsigned i;
+
+	for(i = 0; race->attempts[i] != bev; i++)
+		;
+
+	race->attempts[i] = NULL;
+
+	if(what & BEV_EVENT_CONNECTED)
+	{
+		log_debug("Race 0x%"PRIxPTR" won by address %u of %u", (uintptr_t)race, i + 1, race->num);
+
+		fd = bufferevent_getfd(bev);
+		bufferevent_setfd(bev, -1);
+		bufferevent_free(bev);
+
+		race_finish(race, fd);
+		return;
+	}
+
+	log_debug("Race 0x%"PRIxPTR" attempt %u of %u failed", (uintptr_t)race, i + 1, race->num);
+
+	bufferevent_free(bev);
+	race->running--;
+
+	if(race->next < race->num)
+	{
+		evtimer_del(race->timer);
+		race_start_next(race);
+	}
+	else if(race->running == 0)
+	{
+		race_finish(race, -1);
+	}
+}
+
+/**
+ * Fills in ss with addr and port, returns its length.
+ */
+static socklen_t make_sockaddr(struct sockaddr_storage *ss, int family, const void *addr, uint16_t port)
+{
+	memset(ss, 0, sizeof(*ss));
+
+	if(family == AF_INET)
+	{
+		struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+
+		sin->sin_family = AF_INET;
+		sin->sin_port = htons(port);
+		memcpy(&sin->sin_addr, addr, sizeof(sin->sin_addr));
+		return sizeof(*sin);
+	}
+	else
+	{
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+
+		sin6->sin6_family = AF_INET6;
+		sin6->sin6_port = htons(port);
+		memcpy(&sin6->sin6_addr, addr, sizeof(sin6->sin6_addr));
+		return sizeof(*sin6);
+	}
+}
+
+static void race_add(struct connect_race *race, int family, const void *addr, uint16_t port)
+{
+	race->lens[race->num] = make_sockaddr(&race->addrs[race->num], family, addr, port);
+	race->num++;
+}
+
+/**
+ * Sets up a race between the addresses a host resolved to, alternating
+ * between IPv6 and IPv4.  Nothing happens until race_start_next(), which
+ * may be done already when it returns.
+ */
+static struct connect_race *race_new(struct proxy *prx, const struct dnscache_addrs *addrs, uint16_t port,
+		void (*done)(evutil_socket_t, void *), void *udata)
+{
+	struct connect_race *race;
+	unsigned i;
+
+	race = calloc(1, sizeof(*race));
+	if(race == NULL)
+		return NULL;
+
+	race->timer = evtimer_new(prx->base, handle_race_timer, race);
+	if(race->timer == NULL)
+	{
+		free(race);
+		return NULL;
+	}
+
+	race->prx = prx;
+	race->done = done;
+	race->udata = udata;
+
+	for(i = 0; i < addrs->num6 || i < addrs->num4; i++)
+	{
+		if(i < addrs->num6)
+			race_add(race, AF_INET6, &addrs->addr6[i], port);
+		if(i < addrs->num4)
+			race_add(race, AF_INET, &addrs->addr4[i], port);
+	}
+
+	return race;
+}
+
+/**
+ * Closes the upstream socket or abandons connecting it.
+ */
+static void connection_close(struct connection *conn)
+{
+	if(conn->resolve)
+	{
+		dnscache_cancel(conn->resolve);
+		conn->resolve = NULL;
+	}
+
+	if(conn->race)
+	{
+		race_free(conn->race);
+		conn->race = NULL;
+	}
+
+	if(conn->bev)
+		connection_free_bev(conn);
+
+	/* Nothing is read anymore, so it no longer counts as throttled. */
+	if(conn->throttled)
+	{
+		conn->throttled = false;
+		conn->sess->throttled_conns--;
+	}
+
+	/* Datagrams sent before the close still go out. */
+	if(conn->udp)
+	{
+		if(conn->udp->ev)
+			udp_socket_send(conn->udp);
+		udp_socket_free(conn->udp);
+	}
+}
+
+static void connection_free(struct connection *conn, void *udata)
+{
+	struct proxy *prx = conn->sess->prx;
+	unsigned i;
+
+	connection_close(conn);
+	wheel_del(&prx->wheel, &conn->idle);
+
+	if(conn->reorder)
+	{
+		for(i = 0; i < SEND_WINDOW; i++)
+		{
+			if(conn->reorder[i])
+				evbuffer_pool_put(&prx->buffers, conn->reorder[i]);
+		}
+
+		free(conn->reorder);
+	}
+
+	stat_add(&prx->stats.connections_closed, 1);
+	conn->sess = NULL;
+
+	pool_put(&prx->connection_pool, conn);
+}
+
+static void session_free(struct session *sess, void *udata)
+{
+	log_info("session_delete(0x%"PRIxPTR")", (uintptr_t)sess);
+	stat_add(&sess->prx->stats.sessions_deleted, 1);
+
+	session_foreach_conn(sess, connection_free);
+	htable_destroy(&sess->conns);
+
+	if(sess->dirty)
+		TAILQ_REMOVE(&sess->prx->dirty, sess, dirty_next);
+
+	if(sess->flush_timer)
+		event_free(sess->flush_timer);
+
+	wheel_del(&sess->prx->wheel, &sess->expiry);
+
+	if(sess->evb)
+	{
+		evbuffer_pool_put(&sess->prx->buffers, sess->evb);
+		sess->evb = NULL;
+	}
+
+	if(sess->replay)
+	{
+		evbuffer_pool_put(&sess->prx->buffers, sess->replay);
+		sess->replay = NULL;
+	}
+
+	if(request_active(&sess->recv))
+	{
+		session_reply_end(sess);
+		request_clear(&sess->recv);
+	}
+
+	if(sess->deflate)
+	{
+		deflateEnd(sess->deflate);
+		free(sess->deflate);
+		sess->deflate = NULL;
+
+		evbuffer_pool_put(&sess->prx->buffers, sess->deflated);
+		sess->deflated = NULL;
+	}
+
+	htable_remove(&sess->prx->sessions, session_hash(&sess->token), session_match, &sess->token);
+	pool_put(&sess->prx->session_pool, sess);
+}
+
+/**
+ * Ends the recv stream, if any, with PKT_DELETED and frees the session.
+ */
+static void session_close(struct session *sess)
+{
+	if(request_active(&sess->recv))
+	{
+		session_add_packet(sess, PKT_DELETED, 0);
+
+		session_reply_chunk(sess);
+		session_reply_end(sess);
+		request_clear(&sess->recv);
+	}
+
+	session_free(sess, NULL);
+}
+
+static void handle_session_expiry(struct wheel_timer *t, void *udata)
+{
+	struct session *sess = udata;
+	uint64_t now = sess->prx->wheel.now;
+	const char *reason;
+
+	if(session_max_age && now >= sess->created + timeout_ticks(session_max_age))
+	{
+		stat_add(&sess->prx->stats.sessions_expired_age, 1);
+		reason = "too old";
+	}
+	else if(session_detach_timeout && !request_active(&sess->recv)
+		&& now >= sess->detached + timeout_ticks(session_detach_timeout))
+	{
+		stat_add(&sess->prx->stats.sessions_expired_detached, 1);
+		reason = "no recv";
+	}
+	else
+	{
+		session_arm_expiry(sess);
+		return;
+	}
+
+	log_info("Session 0x%"PRIxPTR" expired: %s", (uintptr_t)sess, reason);
+
+	session_close(sess);
+}
+
+static void session_delete(struct request *r, struct session *sess)
+{
+	log_debug("session_delete(..., 0x%"PRIxPTR")", (uintptr_t)sess);
+
+	session_close(sess);
+
+	reply_send(r, 200, NULL);
+}
+
+/**
+ * Connects the socket of a UDP connection to the first address that takes
+ * it, in the order addresses are raced in.  There is no handshake to wait
+ * for, so the connection is up right away.
+ */
+static void connection_connect_udp(struct connection *conn, const struct dnscache_addrs *addrs)
+{
+	struct session *sess = conn->sess;
+	struct udp_socket *udp = conn->udp;
+	struct sockaddr_storage ss;
+	socklen_t len;
+	evutil_socket_t fd = -1;
+	unsigned i;
+
+	for(i = 0; fd < 0 && (i < addrs->num6 || i < addrs->num4); i++)
+	{
+		if(i < addrs->num6)
+		{
+			len = make_sockaddr(&ss, AF_INET6, &addrs->addr6[i], conn->port);
+			fd = udp_connect((struct sockaddr *)&ss, len);
+			stat_add(&sess->prx->stats.connect_attempts, 1);
+		}
+
+		if(fd < 0 && i < addrs->num4)
+		{
+			len = make_sockaddr(&ss, AF_INET, &addrs->addr4[i], conn->port);
+			fd = udp_connect((struct sockaddr *)&ss, len);
+			stat_add(&sess->prx->stats.connect_attempts, 1);
+		}
+	}
+
+	if(fd < 0)
+	{
+		log_warn("Connecting %"PRIx32" failed: %s", conn->id, strerror(errno));
+		connection_fail(conn);
+		return;
+	}
+
+	udp->ev = event_new(sess->prx->base, fd, EV_READ | EV_PERSIST, handle_udp_read, conn);
+	if(udp->ev == NULL)
+	{
+		log_warn("Connecting %"PRIx32" failed: event allocation failed", conn->id);
+		evutil_closesocket(fd);
+		connection_fail(conn);
+		return;
+	}
+
+	session_add_packet(sess, PKT_CONNECTED, conn->id);
+	session_schedule_flush(sess);
+
+	conn->connected = true;
+	connection_update_read(conn, NULL);
+
+	if(udp->queued > 0)
+		udp_socket_schedule_send(udp);
+}
+
+/**
+ * The socket moves into the placeholder bufferevent, which already holds
+ * whatever was sent meanwhile.
+ */
+static void handle_race_done(evutil_socket_t fd, void *udata)
+{
+	struct connection *conn = udata;
+
+	conn->race = NULL;
+
+	if(fd < 0)
+	{
+		log_warn("Connecting %"PRIx32" failed", conn->id);
+		connection_fail(conn);
+		return;
+	}
+
+	bufferevent_setfd(conn->bev, fd);
+	handle_bev_event(conn->bev, BEV_EVENT_CONNECTED, conn);
+}
+
+/**
+ * Races the addresses the host resolved to as RFC 8305 has it: IPv6 and
+ * IPv4 addresses alternate, IPv6 first, and every attempt gets a head
+ * start of CONNECT_ATTEMPT_DELAY before the next one joins in.
+ */
+static void handle_resolved(int error, const struct dnscache_addrs *addrs, void *udata)
+{
+	struct connection *conn = udata;
+
+	conn->resolve = NULL;
+
+	if(error != DNS_ERR_NONE)
+	{
+		stat_add(&conn->sess->prx->stats.dns_failures, 1);
+		log_warn("Connecting %"PRIx32" failed: %s", conn->id, evdns_err_to_string(error));
+		connection_fail(conn);
+		return;
+	}
+
+	if(conn->udp)
+	{
+		connection_connect_udp(conn, addrs);
+		return;
+	}
+
+	conn->race = race_new(conn->sess->prx, addrs, conn->port, handle_race_done, conn);
+	if(conn->race == NULL)
+	{
+		log_warn("Connecting %"PRIx32" failed: race allocation failed", conn->id);
+		connection_fail(conn);
+		return;
+	}
+
+	race_start_next(conn->race);
+}
+
+/**
+ * Closes the connection if nothing has gone either way for
+ * conn_idle_timeout, a connection still connecting by then has failed.
+ */
+static void handle_connection_idle(struct wheel_timer *t, void *udata)
+{
+	struct connection *conn = udata;
+	struct session *sess = conn->sess;
+	uint64_t due = conn->active + timeout_ticks(conn_idle_timeout);
+
+	if(conn->bev == NULL && conn->udp == NULL)
+		return;
+
+	if(sess->prx->wheel.now < due)
+	{
+		wheel_add(&sess->prx->wheel, &conn->idle, due);
+		return;
+	}
+
+	log_info("Connection %"PRIx32" of session 0x%"PRIxPTR" idle, closing", conn->id, (uintptr_t)sess);
+	stat_add(&sess->prx->stats.connections_expired, 1);
+
+	connection_close(conn);
+
+	if(conn->connected)
+	{
+		session_add_packet(sess, PKT_DISCONNECTED, conn->id);
+		session_schedule_flush(sess);
+	}
+	else
+	{
+		connection_fail(conn);
+	}
+}
+
+/**
+ * Allocates the socket of a UDP connection, connected once the host is
+ * resolved.
+ */
+static struct udp_socket *udp_socket_new(struct connection *conn)
+{
+	struct udp_socket *udp = calloc(1, sizeof(*udp));
+
+	if(udp == NULL)
+		return NULL;
+
+	if((udp->out = evbuffer_pool_get(&conn->sess->prx->buffers)) == NULL)
+	{
+		free(udp);
+		return NULL;
+	}
+
+	udp->conn = conn;
+	conn->udp = udp;
+	return udp;
+}
+
+/**
+ * Starts connecting a new connection cid to host:port, over UDP if udp is
+ * set.  Returns 200, or an HTTP status code with *reason set on failure.
+ */
+static int connection_open(struct session *sess, uint32_t cid, const char *host, uint16_t port,
+		bool udp, const char **reason)
+{
+	struct bufferevent *bev = NULL;
+	struct connection *conn;
+
+	if(htable_find(&sess->conns, connection_hash(cid), connection_match, &cid) != NULL)
+	{
+		*reason = "Connection id in use";
+		return 409;
+	}
+
+	log_debug("created connection 0x%"PRIx32, cid); 
+
+	if(!udp)
+	{
+		bev = bufferevent_socket_new(sess->prx->base, -1, BEV_OPT_CLOSE_ON_FREE);
+		if(bev == NULL)
+		{
+			*reason = "bufferevent_socket_new() failed";
+			return 500;
+		}
+	}
+
+	conn = pool_get(&sess->prx->connection_pool);
+	if(conn == NULL)
+	{
+		*reason = "Connection allocation failed";
+		if(bev)
+			bufferevent_free(bev);
+		return 500;
+	}
+	conn->id = cid;
+	conn->port = port;
+	conn->sess = sess;
+	conn->bev = bev;
+	stat_add(&sess->prx->stats.connections_opened, 1);
+
+	wheel_timer_init(&conn->idle, handle_connection_idle, conn);
+	conn->active = sess->prx->wheel.now;
+	if(conn_idle_timeout)
+		wheel_add(&sess->prx->wheel, &conn->idle, conn->active + timeout_ticks(conn_idle_timeout));
+
+	if(udp && udp_socket_new(conn) == NULL)
+	{
+		*reason = "Connection allocation failed";
+		connection_free(conn, NULL);
+		return 500;
+	}
+
+	if(bev)
+		bufferevent_setcb(bev, handle_bev_read, handle_bev_write, handle_bev_event, conn);
+
+	log_debug("session_connect(..., 0x%"PRIxPTR") -- connecting to %s:%"PRIu16"%s", (uintptr_t)sess, host, port,
+		udp ? " over UDP" : ""); 
+
+	conn->resolve = dnscache_resolve(sess->prx->base, sess->prx->dns, host, handle_resolved, conn);
+	if(conn->resolve == NULL)
+	{
+		*reason = "dnscache_resolve() failed";
+		connection_free(conn, NULL);
+		return 500;
+	}
+
+	if(htable_insert(&sess->conns, connection_hash(conn->id), conn) < 0)
+	{
+		*reason = "Connection allocation failed";
+		connection_free(conn, NULL);
+		return 500;
+	}
+
+	return 200;
+}
+
+/**
+ * Queues len bytes from evb as one datagram of a UDP connection.  Those
+ * that do not fit the queue of a socket still being connected are
+ * dropped, as they might be on the way.
+ */
+static int connection_write_datagram(struct connection *conn, struct evbuffer *evb, size_t len, const char **reason)
+{
+	struct udp_socket *udp = conn->udp;
+	struct proxy *prx = conn->sess->prx;
+
+	if(len > UDP_DATAGRAM_MAX)
+	{
+		*reason = "Datagram too long";
+		return 400;
+	}
+
+	if(udp->queued == UDP_BATCH)
+	{
+		if(udp->ev == NULL)
+		{
+			evbuffer_drain(evb, len);
+			stat_add(&prx->stats.udp_dropped, 1);
+			return 200;
+		}
+
+		udp_socket_send(udp);
+	}
+
+	if(evbuffer_remove_buffer(evb, udp->out, len) != (int)len)
+	{
+		*reason = "Writing to buffer failed";
+		return 500;
+	}
+
+	udp->lens[udp->queued++] = len;
+	udp_socket_schedule_send(udp);
+
+	conn->active = prx->wheel.now;
+	stat_add(&prx->stats.bytes_up, len);
+
+	return 200;
+}
+
+/**
+ * Moves len bytes from evb to the connection.  Returns 200, or an HTTP
+ * status code with *reason set on failure.
+ */
+static int connection_write(struct connection *conn, struct evbuffer *evb, size_t len, const char **reason)
+{
+	if(conn->udp)
+		return connection_write_datagram(conn, evb, len, reason);
+
+	if(conn->bev == NULL)
+	{
+		*reason = "Connection not connected";
+		return 400;
+	}
+
+	if(evbuffer_remove_buffer(evb, bufferevent_get_output(conn->bev), len) < 0)
+	{
+		*reason = "Writing to buffer failed";
+		return 500;
+	}
+
+	if(conn->uring)
+		uring_sock_write(conn->uring);
+
+	conn->active = conn->sess->prx->wheel.now;
+	stat_add(&conn->sess->prx->stats.bytes_up, len);
+
+	return 200;
+}
+
+static void session_connect(struct request *r, struct evkeyvalq *params, struct session *sess)
+{
+	const char *host;
+	const char *port_str;
+	const char *cid_str;
+	const char *proto;
+	uintptr_t port;
+	uintptr_t cid;
+	const char *reason;
+	int code;
+	struct evbuffer *buf;
+	log_debug("session_connect(..., sess=0x%"PRIxPTR")", (uintptr_t)sess); 
+
+	host = evhttp_find_header(params, "host");
+        if (host == NULL) {
+                reply_error(r, 400, "No host specified");
+                return;
+        }
+
+        port_str = evhttp_find_header(params, "port");
+        if(port_str == NULL) {
+                reply_error(r, 400, "No port specified");
+                return;
+        }
+
+	if(!safe_strtoul(port_str, 10, &port) || port < 1 || port > 0xffff) {
+                reply_error(r, 400, "Invalid port specified");
+                return;
+        }
+
+        cid_str = evhttp_find_header(params, "cid");
+        if(cid_str == NULL) {
+                reply_error(r, 400, "No cid specified");
+                return;
+	}
+
+	if(!safe_strtoul(cid_str, 16, &cid) || cid < 1 || cid > 0xffffffffULL) {
+                reply_error(r, 400, "Invalid cid specified");
+                return;
+        }
+
+	proto = evhttp_find_header(params, "proto");
+	if(proto && strcmp(proto, "tcp") != 0 && strcmp(proto, "udp") != 0)
+	{
+		reply_error(r, 400, "Invalid proto specified");
+		return;
+	}
+
+	buf = evbuffer_pool_get(&sess->prx->buffers);
+	if(buf == NULL)
+	{
+		reply_error(r, 500, "Buffer allocation failed");
+		return;
+	}
+
+	code = connection_open(sess, cid, host, port, proto && strcmp(proto, "udp") == 0, &reason);
+	if(code != 200)
+	{
+		reply_error(r, code, reason);
+		evbuffer_pool_put(&sess->prx->buffers, buf);
+		return;
+	}
+
+	if(evbuffer_add_printf(buf, "%"PRIxPTR"\r\n", cid) > 0)
+	{
+		reply_send(r, 200, buf);
+		evbuffer_pool_put(&sess->prx->buffers, buf);
+
+		log_debug("session_connect(...) => %"PRIxPTR, cid);
+
+		return;
+	}
+
+	evbuffer_pool_put(&sess->prx->buffers, buf);
+	reply_send(r, 200, NULL);
+}
+
+static void session_disconnect(struct request *r, struct session *sess, struct connection *conn)
+{
+	log_debug("connection_disconnect(..., 0x%"PRIxPTR")", (uintptr_t)conn);
+
+	connection_close(conn);
+
+        reply_send(r, 200, NULL);
+}
+
+/**
+ * Keeps the body of a send that arrived ahead of its turn.  Returns false
+ * if it cannot be stored.
+ */
+static bool connection_stash(struct connection *conn, uint32_t seq, struct evbuffer *body)
+{
+	struct evbuffer **slot;
+
+	if(conn->reorder == NULL)
+	{
+		conn->reorder = calloc(SEND_WINDOW, sizeof(struct evbuffer *));
+		if(conn->reorder == NULL)
+			return false;
+	}
+
+	slot = &conn->reorder[seq % SEND_WINDOW];
+
+	/* A retransmission of a send still waiting. */
+	if(*slot)
+		return true;
+
+	if((*slot = evbuffer_pool_get(&conn->sess->prx->buffers)) == NULL)
+		return false;
+
+	evbuffer_add_buffer(*slot, body);
+	return true;
+}
+
+/**
+ * Writes the stashed sends that have become next in line.
+ */
+static void connection_unstash(struct connection *conn)
+{
+	struct evbuffer **slot;
+	const char *reason;
+
+	while(conn->reorder && *(slot = &conn->reorder[conn->send_seq % SEND_WINDOW]))
+	{
+		if(connection_write(conn, *slot, evbuffer_get_length(*slot), &reason) != 200)
+			log_warn("Writing stashed send to connection %p failed: %s", (void *)conn, reason);
+
+		evbuffer_pool_put(&conn->sess->prx->buffers, *slot);
+		*slot = NULL;
+		conn->send_seq++;
+	}
+}
+
+/**
+ * Sends with a seq parameter are written in sequence order, so the client
+ * may have several in flight.  Those arriving early are kept until their
+ * turn and acknowledged right away, repeated ones are acknowledged and
+ * dropped.  Sends without seq are written as they come.
+ */
+static void session_send(struct request *r, struct connection *conn, struct evkeyvalq *params)
+{
+	const char *seq_str;
+	const char *reason;
+	uintptr_t seq;
+	uint32_t ahead;
+	int code;
+
+	log_debug("connection_send(..., 0x%"PRIxPTR") -- %zd bytes", (uintptr_t)conn, evbuffer_get_length(r->body));
+
+	seq_str = evhttp_find_header(params, "seq");
+	if(seq_str)
+	{
+		if(!safe_strtoul(seq_str, 10, &seq) || seq > 0xffffffffULL)
+		{
+			reply_error(r, 400, "Invalid sequence number specified");
+			return;
+		}
+
+		ahead = (uint32_t)seq - conn->send_seq;
+		if(ahead >= UINT32_C(0x80000000))
+		{
+			reply_send(r, 200, NULL);
+			return;
+		}
+
+		if(ahead >= SEND_WINDOW)
+		{
+			reply_error(r, 400, "Sequence number out of window");
+			return;
+		}
+
+		if(ahead > 0)
+		{
+			if(conn->bev == NULL && conn->udp == NULL)
+			{
+				reply_error(r, 400, "Connection not connected");
+				return;
+			}
+
+			if(!connection_stash(conn, seq, r->body))
+			{
+				reply_error(r, 500, "Buffer allocation failed");
+				return;
+			}
+
+			reply_send(r, 200, NULL);
+			return;
+		}
+	}
+
+	code = connection_write(conn, r->body, evbuffer_get_length(r->body), &reason);
+	if(code != 200)
+	{
+		reply_error(r, code, reason);
+		return;
+	}
+
+	if(seq_str)
+	{
+		conn->send_seq++;
+		connection_unstash(conn);
+	}
+
+	reply_send(r, 200, NULL);
+}
+
+/**
+ * Whether all packets after seq are still in replay, or there are none.
+ */
+static bool session_can_resume(struct session *sess, uint64_t seq)
+{
+	return seq <= sess->seq && seq >= sess->seq - sess->replay_count;
+}
+
+/**
+ * Refuses a recv that cannot resume after seq with 410.
+ */
+static void session_resume_failed(struct request *r, struct session *sess, uint64_t seq)
+{
+	log_info("Session 0x%"PRIxPTR" cannot resume after %"PRIu64", replay starts after %"PRIu64,
+		(uintptr_t)sess, seq, sess->seq - sess->replay_count);
+	stat_add(&sess->prx->stats.resumes_failed, 1);
+
+	reply_error(r, 410, "Packets to resume from are gone");
+}
+
+/**
+ * Resends the packets after seq, which are all in replay, on the recv
+ * stream just started.  Returns false if there are none.  If they cannot
+ * be copied the stream is ended instead, they stay in replay for the
+ * client's next attempt.
+ */
+static bool session_replay_send(struct session *sess, uint64_t seq)
+{
+	struct evbuffer *evb;
+	size_t len;
+
+	session_replay_ack(sess, seq);
+
+	len = evbuffer_get_length(sess->replay);
+	if(len == 0)
+		return false;
+
+	evb = evbuffer_pool_get(&sess->prx->buffers);
+	if(evb == NULL)
+	{
+		log_warn("Session 0x%"PRIxPTR" cannot resume after %"PRIu64", buffer allocation failed",
+			(uintptr_t)sess, seq);
+		stat_add(&sess->prx->stats.resumes_failed, 1);
+
+		session_reply_end(sess);
+		session_recv_clear(sess);
+		return false;
+	}
+
+	copy_buffer(evb, sess->replay);
+
+	session_send_chunk(sess, evb);
+	evbuffer_pool_put(&sess->prx->buffers, evb);
+
+	sess->recv_sent += len;
+	stat_add(&sess->prx->stats.replayed_packets, sess->replay_count);
+
+	log_debug("session 0x%"PRIxPTR" resends %"PRIu64" packets after %"PRIu64,
+		(uintptr_t)sess, sess->replay_count, seq);
+
+	return true;
+}
+
+/**
+ * Sets up the deflate stream of sess for a new recv stream.  Returns false
+ * if compression is refused or fails, the stream is sent as is then.
+ */
+static bool session_deflate_start(struct session *sess)
+{
+	int bits = DEFLATE_MAX_BITS;
+
+	while(bits >= DEFLATE_MIN_BITS && ((size_t)1 << (bits + 3)) + DEFLATE_OVERHEAD > deflate_mem_max)
+		bits--;
+
+	if(bits < DEFLATE_MIN_BITS)
+		return false;
+
+	if(sess->deflate)
+		return deflateReset(sess->deflate) == Z_OK;
+
+	if((sess->deflated = evbuffer_pool_get(&sess->prx->buffers)) == NULL)
+		return false;
+
+	if((sess->deflate = calloc(1, sizeof(z_stream))) == NULL ||
+		deflateInit2(sess->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, bits, bits - 7, Z_DEFAULT_STRATEGY) != Z_OK)
+	{
+		free(sess->deflate);
+		sess->deflate = NULL;
+		evbuffer_pool_put(&sess->prx->buffers, sess->deflated);
+		sess->deflated = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+static void session_recv(struct request *r, struct session *sess, struct evkeyvalq *params)
+{
+	const char *long_poll_str;
+	const char *framing_str;
+	const char *window_str;
+	const char *flush_delay_str;
+	const char *max_bytes_str;
+	const char *max_age_str;
+	const char *seq_str;
+	const char *compress_str;
+	uintptr_t framing = FRAMING_ASCII;
+	uintptr_t window = 0;
+	uintptr_t flush_delay = 0;
+	uintptr_t max_bytes = RECV_MAX_BYTES;
+	uintptr_t max_age = RECV_MAX_AGE;
+	uintptr_t seq = 0;
+	unsigned start_flags = 0;
+	bool pending;
+
+	log_debug("session_recv(..., 0x%"PRIxPTR")", (uintptr_t)sess); 
+
+	framing_str = evhttp_find_header(params, "framing");
+	if(framing_str && (!safe_strtoul(framing_str, 10, &framing) ||
+		(framing != FRAMING_ASCII && framing != FRAMING_VARINT)))
+	{
+		reply_error(r, 400, "Invalid framing specified");
+		return;
+	}
+
+	window_str = evhttp_find_header(params, "window");
+	if(window_str && !safe_strtoul(window_str, 10, &window))
+	{
+		reply_error(r, 400, "Invalid window specified");
+		return;
+	}
+
+	flush_delay_str = evhttp_find_header(params, "flush_delay");
+	if(flush_delay_str && (!safe_strtoul(flush_delay_str, 10, &flush_delay) ||
+		flush_delay > FLUSH_DELAY_MAX))
+	{
+		reply_error(r, 400, "Invalid flush delay specified");
+		return;
+	}
+
+	max_bytes_str = evhttp_find_header(params, "max_bytes");
+	if(max_bytes_str && !safe_strtoul(max_bytes_str, 10, &max_bytes))
+	{
+		reply_error(r, 400, "Invalid max_bytes specified");
+		return;
+	}
+
+	max_age_str = evhttp_find_header(params, "max_age");
+	if(max_age_str && !safe_strtoul(max_age_str, 10, &max_age))
+	{
+		reply_error(r, 400, "Invalid max_age specified");
+		return;
+	}
+
+	/* The last packet the client has parsed, it wants the stream to
+	 * resume after it. */
+	seq_str = evhttp_find_header(params, "seq");
+	if(seq_str && (!safe_strtoul(seq_str, 10, &seq) || seq > sess->seq))
+	{
+		reply_error(r, 400, "Invalid seq specified");
+		return;
+	}
+
+	if(seq_str && !session_can_resume(sess, seq))
+	{
+		session_resume_failed(r, sess, seq);
+		return;
+	}
+
+	/* Compressing is up to the server, the client learns from the
+	 * response headers whether it did. */
+	compress_str = evhttp_find_header(params, "compress");
+	if(compress_str && strcmp(compress_str, "deflate") != 0)
+	{
+		reply_error(r, 400, "Invalid compress specified");
+		return;
+	}
+
+	if(seq_str && sess->replay == NULL)
+	{
+		sess->replay = evbuffer_pool_get(&sess->prx->buffers);
+		if(sess->replay == NULL)
+		{
+			reply_error(r, 500, "Buffer allocation failed");
+			return;
+		}
+	}
+
+	if(flush_delay && sess->flush_timer == NULL)
+	{
+		sess->flush_timer = evtimer_new(sess->prx->base, handle_flush_timer, sess);
+		if(sess->flush_timer == NULL)
+		{
+			reply_error(r, 500, "Timer allocation failed");
+			return;
+		}
+	}
+
+	/* WebSocket messages are binary and arrive as a whole, and are not
+	 * compressed here. */
+	if(r->ws)
+	{
+		framing = FRAMING_VARINT;
+		long_poll_str = NULL;
+		compress_str = NULL;
+	}
+	else
+	{
+		long_poll_str = evhttp_find_header(params, "long_poll");
+	}
+
+	if(request_active(&sess->recv))
+	{
+		session_add_packet(sess, PKT_TAKEOVER, 0);
+		stat_add(&sess->prx->stats.takeovers, 1);
+		session_reply_chunk(sess);
+		session_reply_end(sess);
+		start_flags |= START_TAKEOVER;
+	}
+
+	/* What the old stream carried last may have pushed the packets to
+	 * resume from out of replay. */
+	if(seq_str && !session_can_resume(sess, seq))
+	{
+		session_resume_failed(r, sess, seq);
+		if(start_flags & START_TAKEOVER)
+			session_recv_clear(sess);
+		return;
+	}
+
+	if(!session_set_framing(sess, framing))
+	{
+		reply_error(r, 500, "Buffer allocation failed");
+		if(start_flags & START_TAKEOVER)
+			session_recv_clear(sess);
+		return;
+	}
+
+	//evhttp_request_own(req);
+	sess->recv = *r;
+	sess->recv.body = NULL;
+
+	sess->long_poll = long_poll_str ? (atoi(long_poll_str) != 0) : false;
+
+	sess->window = window;
+	sess->recv_sent = 0;
+	sess->recv_acked = 0;
+
+	sess->flush_delay.tv_sec = 0;
+	sess->flush_delay.tv_usec = flush_delay * 1000;
+
+	sess->recv_max_bytes = max_bytes;
+	sess->recv_max_age = (uint64_t)max_age * 1000;
+	sess->recv_started = now_usec();
+
+	if(framing == FRAMING_VARINT)
+		start_flags |= START_BINARY;
+
+	sess->compressed = compress_str && session_deflate_start(sess);
+	if(sess->compressed)
+	{
+		start_flags |= START_DEFLATE;
+		stat_add(&sess->prx->stats.deflate_streams, 1);
+	}
+
+	reply_start(&sess->recv, sess, start_flags);
+
+	pending = evbuffer_get_length(sess->evb) > 0;
+	if(seq_str && session_replay_send(sess, seq))
+		pending = true;
+
+	/* Ended if the replay could not be sent. */
+	if(!request_active(&sess->recv))
+		return;
+
+	session_flush(sess);
+
+	if(pending)
+	{
+		if(sess->long_poll)
+		{
+                	session_reply_end(sess);
+			session_recv_clear(sess);
+		}
+	}
+}
+
+/**
+ * The client has consumed that many bytes of the current recv stream,
+ * sends whatever the window now allows.
+ */
+static void session_ack(struct session *sess, size_t consumed)
+{
+	if(consumed > sess->recv_acked)
+		sess->recv_acked = consumed;
+
+	if(evbuffer_get_length(sess->evb) > 0 && session_flush(sess))
+	{
+		if(sess->long_poll)
+		{
+			session_reply_end(sess);
+			session_recv_clear(sess);
+		}
+	}
+	else
+	{
+		session_update_throttle(sess);
+	}
+}
+
+/**
+ * PKT_WINDOW from the client: it has consumed that many bytes of the
+ * current recv stream and optionally changes the window it is willing to
+ * buffer beyond that and reports the last packet it has parsed.
+ */
+static void session_window(struct request *r, struct session *sess, struct evkeyvalq *params)
+{
+	const char *consumed_str;
+	const char *window_str;
+	const char *seq_str;
+	uintptr_t consumed;
+	uintptr_t window;
+	uintptr_t seq;
+
+	consumed_str = evhttp_find_header(params, "consumed");
+	if(consumed_str == NULL || !safe_strtoul(consumed_str, 10, &consumed))
+	{
+		reply_error(r, 400, "Invalid consumed count specified");
+		return;
+	}
+
+	window_str = evhttp_find_header(params, "window");
+	if(window_str)
+	{
+		if(!safe_strtoul(window_str, 10, &window))
+		{
+			reply_error(r, 400, "Invalid window specified");
+			return;
+		}
+
+		sess->window = window;
+	}
+
+	seq_str = evhttp_find_header(params, "seq");
+	if(seq_str)
+	{
+		if(!safe_strtoul(seq_str, 10, &seq))
+		{
+			reply_error(r, 400, "Invalid seq specified");
+			return;
+		}
+
+		session_replay_ack(sess, seq);
+	}
+
+	reply_send(r, 200, NULL);
+
+	session_ack(sess, consumed);
+}
+
+/**
+ * Executes a sequence of packets in order, varint framed like the recv
+ * stream, as sent in an act=batch body or a WebSocket message:
+ * PKT_CONNECTED connects cid to the "host:port" in its payload, over UDP
+ * if followed by "/udp", PKT_DATA sends the payload, PKT_DISCONNECTED
+ * disconnects, PKT_WINDOW carries the consumed count and optionally a new
+ * window and the last packet parsed as varints and PKT_DELETED deletes
+ * the session.
+ *
+ * With status, the outcome of every packet is appended to it as an HTTP
+ * status code and execution stops at the first malformed one.  Without,
+ * failures are answered with PKT_CONNFAIL or PKT_DISCONNECTED for the cid.
+ */
+static void session_execute(struct session *sess, struct evbuffer *msg, struct evbuffer *status)
+{
+	uint8_t hdr[HEADER_MAX];
+	char payload[HOST_MAX + sizeof(":65535/udp")];
+	ev_ssize_t avail;
+	size_t len;
+	uint8_t type;
+	uint64_t cid;
+	uint32_t payload_length;
+
+	while((avail = evbuffer_copyout(msg, hdr, sizeof(hdr))) > 0)
+	{
+		struct connection *conn = NULL;
+		const char *reason = NULL;
+		uint32_t id;
+		int code = 200;
+
+		len = parse_header(hdr, avail, FRAMING_VARINT, &type, &cid, &payload_length);
+		if(len == 0 || cid > 0xffffffffULL || evbuffer_get_length(msg) - len < payload_length)
+		{
+			log_warn("Malformed packet sequence for session %p", (void *)sess);
+			if(status)
+				evbuffer_add_printf(status, "%s400", evbuffer_get_length(status) ? " " : "");
+			break;
+		}
+
+		evbuffer_drain(msg, len);
+
+		id = cid;
+		conn = htable_find(&sess->conns, connection_hash(id), connection_match, &id);
+
+		switch(type)
+		{
+		case PKT_CONNECTED:
+		{
+			uintptr_t port;
+			char *sep;
+			bool udp;
+
+			if(payload_length >= sizeof(payload))
+			{
+				code = 400;
+				break;
+			}
+
+			evbuffer_remove(msg, payload, payload_length);
+			payload[payload_length] = 0;
+			payload_length = 0;
+
+			sep = strrchr(payload, '/');
+			udp = sep != NULL;
+
+			if(udp)
+			{
+				if(strcmp(sep, "/udp") != 0)
+				{
+					code = 400;
+					break;
+				}
+
+				*sep = 0;
+			}
+
+			sep = strrchr(payload, ':');
+			if(sep == NULL || id == 0 || !safe_strtoul(sep + 1, 10, &port) || port < 1 || port > 0xffff)
+			{
+				code = 400;
+				break;
+			}
+
+			*sep = 0;
+			code = connection_open(sess, id, payload, port, udp, &reason);
+			break;
+		}
+		case PKT_DATA:
+			if(conn == NULL)
+			{
+				code = 404;
+				break;
+			}
+
+			code = connection_write(conn, msg, payload_length, &reason);
+			if(code == 200)
+				payload_length = 0;
+			break;
+		case PKT_DISCONNECTED:
+			if(conn == NULL)
+			{
+				code = 404;
+				break;
+			}
+
+			connection_close(conn);
+			break;
+		case PKT_WINDOW:
+		{
+			uint8_t buf[30];
+			uint64_t consumed, window, seq;
+			size_t n, m;
+
+			if(payload_length > sizeof(buf))
+			{
+				code = 400;
+				break;
+			}
+
+			evbuffer_remove(msg, buf, payload_length);
+			len = payload_length;
+			payload_length = 0;
+
+			if((n = get_varint(buf, len, &consumed)) == 0)
+			{
+				code = 400;
+				break;
+			}
+
+			if((m = get_varint(buf + n, len - n, &window)) > 0)
+			{
+				sess->window = window;
+
+				if(get_varint(buf + n + m, len - n - m, &seq) > 0)
+					session_replay_ack(sess, seq);
+			}
+
+			session_ack(sess, consumed);
+			break;
+		}
+		case PKT_DELETED:
+			session_close(sess);
+			if(status)
+				evbuffer_add_printf(status, "%s200", evbuffer_get_length(status) ? " " : "");
+			return;
+		case PKT_CONNFAIL:
+		case PKT_PAD:
+		case PKT_TAKEOVER:
+		case PKT_RECONN:
+		default:
+			code = 400;
+			break;
+		}
+
+		evbuffer_drain(msg, payload_length);
+
+		if(code != 200)
+		{
+			log_debug("session_execute(..., 0x%"PRIxPTR") -- packet %u for %"PRIx32" failed: %d %s",
+				(uintptr_t)sess, type, id, code, reason ? reason : "");
+		}
+
+		if(status)
+			evbuffer_add_printf(status, "%s%d", evbuffer_get_length(status) ? " " : "", code);
+		else if(code != 200)
+			session_add_packet(sess, type == PKT_CONNECTED ? PKT_CONNFAIL : PKT_DISCONNECTED, id);
+	}
+
+	if(evbuffer_get_length(sess->evb) > 0)
+		session_flush(sess);
+}
+
+/**
+ * Runs the packets in the body through session_execute() and replies with
+ * the status of each, separated by spaces.  A PKT_DELETED among them frees
+ * sess, which is not touched afterwards.
+ */
+static void session_batch(struct request *r, struct session *sess)
+{
+	struct proxy *prx = sess->prx;
+	struct evbuffer *status = evbuffer_pool_get(&prx->buffers);
+
+	if(status == NULL)
+	{
+		reply_error(r, 500, "Buffer allocation failed");
+		return;
+	}
+
+	log_debug("session_batch(..., 0x%"PRIxPTR") -- %zd bytes", (uintptr_t)sess, r->body ? evbuffer_get_length(r->body) : 0);
+
+	if(r->body)
+		session_execute(sess, r->body, status);
+
+	evbuffer_add(status, "\r\n", 2);
+	reply_send(r, 200, status);
+
+	evbuffer_pool_put(&prx->buffers, status);
+}
+
+static action_type parse_action(const char *action)
+{
+	if(!strcmp(action, "create"))
+		return ACTION_CREATE;
+	if(!strcmp(action, "delete"))
+		return ACTION_DELETE;
+	if(!strcmp(action, "connect"))
+		return ACTION_CONNECT;
+	if(!strcmp(action, "disconnect"))
+		return ACTION_DISCONNECT;
+	if(!strcmp(action, "recv"))
+		return ACTION_RECV;
+	if(!strcmp(action, "send"))
+		return ACTION_SEND;
+	if(!strcmp(action, "window"))
+		return ACTION_WINDOW;
+	if(!strcmp(action, "batch"))
+		return ACTION_BATCH;
+	return ACTION_UNKNOWN;
+}
+
+static void handle_connection_action(action_type action, struct request *r, struct evkeyvalq *params, struct session *sess)
+{
+	const char *cid_str = NULL;
+	uintptr_t cid;
+	uint32_t id;
+	struct connection *conn = NULL;
+
+	cid_str = evhttp_find_header(params, "cid");
+	if(cid_str == NULL || !safe_strtoul(cid_str, 16, &cid) || cid > 0xffffffffULL)
+	{
+		reply_error(r, 400, "Invalid connection specified");
+		return;
+	}
+
+	id = cid;
+	conn = htable_find(&sess->conns, connection_hash(id), connection_match, &id);
+	if(conn == NULL)
+	{
+		reply_error(r, 404, "Connection not found");
+		return;
+	};
+
+	if(action == ACTION_DISCONNECT)
+	{
+		session_disconnect(r, sess, conn);
+	}
+	else if(action == ACTION_SEND)
+	{
+		session_send(r, conn, params);
+	}
+	else
+	{
+		reply_error(r, 400, "Invalid action");
+	}
+}
+
+/**
+ * Hands a request for a session owned by another worker over to it.
+ */
+static void session_forward(struct request *r, const char *uri, struct proxy *owner)
+{
+	struct handoff *h;
+
+	h = handoff_new(HANDOFF_REQUEST, r, uri);
+
+	h->evb = evbuffer_new();
+	if(r->body)
+		evbuffer_add_buffer(h->evb, r->body);
+
+	handoff_post(owner, h);
+}
+
+static void session_dispatch(struct proxy *prx, struct request *r, const char *uri)
+{
+	struct evkeyvalq params;
+        const char *session_str;
+	struct session_token token;
+	unsigned worker;
+	struct session *sess;
+	const char *action_str;
+	action_type action;
+
+        TAILQ_INIT(&params);
+
+        evhttp_parse_query(uri, &params);
+
+	/* A WebSocket only ever attaches as the session's recv stream. */
+	if(r->ws)
+	{
+		action = ACTION_RECV;
+	}
+	else
+	{
+		action_str = evhttp_find_header(&params, "act");
+		if(action_str == NULL)
+		{
+			reply_error(r, 400, "No action specified");
+			goto cleanup;
+		}
+
+		action = parse_action(action_str);
+	}
+
+	if(action == ACTION_UNKNOWN)
+	{
+		reply_error(r, 400, "Invalid action specified");
+		goto cleanup;
+	}
+
+	if(action == ACTION_CREATE)
+	{
+		session_create(r, prx);
+		goto cleanup;
+	}
+
+	session_str = evhttp_find_header(&params, "sid");
+        if (session_str == NULL) {
+       	        reply_error(r, 400, "No session specified");
+		goto cleanup;
+        }
+
+        if (!session_id_parse(session_str, &worker, &token)) {
+       	        reply_error(r, 400, "Invalid session specified");
+               	goto cleanup;
+        }
+
+	if(worker != prx->index)
+	{
+		if(r->remote)
+		{
+			reply_error(r, 404, "Session not found");
+			goto cleanup;
+		}
+
+		session_forward(r, uri, &workers[worker]);
+		goto cleanup;
+	}
+
+	sess = htable_find(&prx->sessions, session_hash(&token), session_match, &token);
+	if(sess == NULL)
+	{
+		reply_error(r, 404, "Session not found");
+		goto cleanup;
+	}
+
+	switch(action)
+	{
+	case ACTION_CONNECT:
+		session_connect(r, &params, sess);
+		break;
+	case ACTION_DELETE:
+		session_delete(r, sess);
+		break;
+	case ACTION_RECV:
+		session_recv(r, sess, &params);
+		break;
+	case ACTION_WINDOW:
+		session_window(r, sess, &params);
+		break;
+	case ACTION_BATCH:
+		session_batch(r, sess);
+		break;
+	case ACTION_DISCONNECT:
+	case ACTION_SEND:
+		handle_connection_action(action, r, &params, sess);
+		break;
+	case ACTION_UNKNOWN:
+	case ACTION_CREATE:
+	default:
+		abort();
+	}
+
+cleanup:
+        evhttp_clear_headers(&params);
+}
+
+static void handle_session(struct evhttp_request *req, void *udata)
+{
+	struct proxy *prx = udata;
+	struct request r = { req, prx, false, req->input_buffer, NULL, NULL };
+	
+	disable_caching(req);
+
+	if(req->type == EVHTTP_REQ_OPTIONS)
+	{
+		evhttp_send_reply(req, 200, NULL, NULL);
+		return;
+	}
+
+	session_dispatch(prx, &r, req->uri);
+}
+
+/**
+ * Lets go of a WebSocket that has gone away if it still is the recv stream
+ * of its session.
+ */
+static void session_ws_detach(struct proxy *prx, const struct session_token *token, struct wsstream *wss)
+{
+	struct session *sess = htable_find(&prx->sessions, session_hash(token), session_match, token);
+
+	if(sess && sess->recv.ws == wss)
+	{
+		log_debug("session_ws_detach(..., 0x%"PRIxPTR")", (uintptr_t)sess);
+		session_recv_clear(sess);
+	}
+}
+
+/**
+ * Ends an XHR recv stream whose connection has closed if it still is the
+ * recv stream of its session.
+ */
+static void session_recv_closed(struct proxy *prx, const struct session_token *token, struct evhttp_request *req)
+{
+	struct session *sess = htable_find(&prx->sessions, session_hash(token), session_match, token);
+
+	if(sess && sess->recv.req == req)
+	{
+		log_debug("session_recv_closed(..., 0x%"PRIxPTR")", (uintptr_t)sess);
+		reply_end(&sess->recv);
+		session_recv_clear(sess);
+	}
+}
+
+static void handle_ws_message(struct ws *ws, struct evbuffer *msg, void *udata)
+{
+	struct wsstream *wss = udata;
+	struct proxy *prx = wss->prx;
+	struct handoff *h;
+
+	if(wss->worker == prx->index)
+	{
+		struct session *sess = htable_find(&prx->sessions, session_hash(&wss->token), session_match, &wss->token);
+
+		if(sess)
+			session_execute(sess, msg, NULL);
+		return;
+	}
+
+	h = calloc(1, sizeof(struct handoff));
+	if(h == NULL || (h->evb = evbuffer_new()) == NULL)
+	{
+		log_error("Internal error - handoff allocation failed");
+		log_flush();
+		abort();
+	}
+
+	h->type = HANDOFF_WS_MESSAGE;
+	h->origin = prx;
+	h->token = wss->token;
+	evbuffer_add_buffer(h->evb, msg);
+
+	handoff_post(&workers[wss->worker], h);
+}
+
+static void handle_ws_close(struct ws *ws, void *udata)
+{
+	struct wsstream *wss = udata;
+	struct proxy *prx = wss->prx;
+	struct handoff *h;
+
+	log_debug("handle_ws_close(..., 0x%"PRIxPTR")", (uintptr_t)wss);
+
+	wss->closed = true;
+
+	if(!wss->attached || wss->detaching)
+	{
+		if(!wss->detaching)
+			wsstream_free(wss);
+		return;
+	}
+
+	if(wss->worker == prx->index)
+	{
+		session_ws_detach(prx, &wss->token, wss);
+		wsstream_free(wss);
+		return;
+	}
+
+	h = calloc(1, sizeof(struct handoff));
+	if(h == NULL)
+	{
+		log_error("Internal error - handoff allocation failed");
+		log_flush();
+		abort();
+	}
+
+	h->type = HANDOFF_WS_DETACH;
+	h->origin = prx;
+	h->ws = wss;
+	h->token = wss->token;
+
+	wss->detaching = true;
+	handoff_post(&workers[wss->worker], h);
+}
+
+/**
+ * Upgrades /ws?sid=... to a WebSocket which then serves as the session's
+ * recv stream and uplink.
+ */
+static void handle_ws(struct evhttp_request *req, void *udata)
+{
+	struct proxy *prx = udata;
+	struct evkeyvalq params;
+	const char *session_str;
+	struct wsstream *wss;
+	struct request r = { NULL, prx, false, NULL, NULL, NULL };
+
+	TAILQ_INIT(&params);
+	evhttp_parse_query(req->uri, &params);
+
+	session_str = evhttp_find_header(&params, "sid");
+	if(session_str == NULL)
+	{
+		evhttp_send_error(req, 400, "No session specified");
+		goto cleanup;
+	}
+
+	wss = calloc(1, sizeof(struct wsstream));
+	if(wss == NULL)
+	{
+		evhttp_send_error(req, 500, "WebSocket allocation failed");
+		goto cleanup;
+	}
+
+	if(!session_id_parse(session_str, &wss->worker, &wss->token))
+	{
+		evhttp_send_error(req, 404, "Session not found");
+		free(wss);
+		goto cleanup;
+	}
+
+	wss->prx = prx;
+	wss->ws = ws_accept(req, handle_ws_message, handle_ws_close, wss);
+	if(wss->ws == NULL)
+	{
+		free(wss);
+		goto cleanup;
+	}
+
+	TAILQ_INSERT_TAIL(&prx->wsstreams, wss, next);
+
+	log_debug("handle_ws(...) => 0x%"PRIxPTR, (uintptr_t)wss);
+
+	/* Attaching fails with an error reply if the session is gone, which
+	 * closes the WebSocket again. */
+	wss->attached = true;
+	r.ws = wss;
+	session_dispatch(prx, &r, req->uri);
+
+cleanup:
+	evhttp_clear_headers(&params);
+}
+
+static void tunnelstream_free(struct tunnelstream *ts)
+{
+	TAILQ_REMOVE(&ts->prx->tunnels, ts, next);
+
+	if(ts->resolve)
+		dnscache_cancel(ts->resolve);
+	if(ts->race)
+		race_free(ts->race);
+
+	if(ts->tunnel)
+	{
+		tunnel_free(ts->tunnel);
+		stat_add(&ts->prx->stats.tunnels_closed, 1);
+	}
+	else if(ts->req && evhttp_request_get_connection(ts->req))
+	{
+		evhttp_connection_set_closecb(evhttp_request_get_connection(ts->req), NULL, NULL);
+	}
+
+	free(ts);
+}
+
+/**
+ * Answers the CONNECT request with an error instead of a tunnel.
+ */
+static void tunnelstream_fail(struct tunnelstream *ts, int code, const char *reason)
+{
+	struct evhttp_request *req = ts->req;
+
+	stat_add(&ts->prx->stats.tunnels_failed, 1);
+	tunnelstream_free(ts);
+
+	evhttp_send_error(req, code, reason);
+}
+
+/**
+ * The client closed its connection before the tunnel was up.  A request
+ * whose connection failed is no longer freed by evhttp.
+ */
+static void handle_tunnel_client_close(struct evhttp_connection *evcon, void *udata)
+{
+	struct tunnelstream *ts = udata;
+	struct evhttp_request *req = ts->req;
+
+	log_debug("handle_tunnel_client_close(..., 0x%"PRIxPTR")", (uintptr_t)ts);
+
+	ts->req = NULL;
+	tunnelstream_free(ts);
+
+	if(evhttp_request_get_connection(req) == NULL)
+		evhttp_request_free(req);
+}
+
+static void handle_tunnel_close(struct tunnel *t, void *udata)
+{
+	struct tunnelstream *ts = udata;
+
+	log_debug("handle_tunnel_close(..., 0x%"PRIxPTR")", (uintptr_t)ts);
+
+	tunnelstream_free(ts);
+}
+
+static void handle_tunnel_connected(evutil_socket_t fd, void *udata)
+{
+	struct tunnelstream *ts = udata;
+	struct proxy *prx = ts->prx;
+
+	ts->race = NULL;
+
+	if(fd < 0)
+	{
+		log_warn("Tunnel 0x%"PRIxPTR" failed connecting", (uintptr_t)ts);
+		tunnelstream_fail(ts, 502, "Connecting upstream failed");
+		return;
+	}
+
+	evhttp_connection_set_closecb(evhttp_request_get_connection(ts->req), NULL, NULL);
+
+	ts->tunnel = tunnel_accept(ts->req, fd, &prx->stats.tunnel, handle_tunnel_close, ts);
+	ts->req = NULL;
+
+	if(ts->tunnel == NULL)
+	{
+		stat_add(&prx->stats.tunnels_failed, 1);
+		tunnelstream_free(ts);
+		return;
+	}
+
+	log_debug("Tunnel 0x%"PRIxPTR" established", (uintptr_t)ts);
+	stat_add(&prx->stats.tunnels_opened, 1);
+}
+
+static void handle_tunnel_resolved(int error, const struct dnscache_addrs *addrs, void *udata)
+{
+	struct tunnelstream *ts = udata;
+
+	ts->resolve = NULL;
+
+	if(error != DNS_ERR_NONE)
+	{
+		stat_add(&ts->prx->stats.dns_failures, 1);
+		log_warn("Tunnel 0x%"PRIxPTR" failed: %s", (uintptr_t)ts, evdns_err_to_string(error));
+		tunnelstream_fail(ts, 502, "Resolving host failed");
+		return;
+	}
+
+	ts->race = race_new(ts->prx, addrs, ts->port, handle_tunnel_connected, ts);
+	if(ts->race == NULL)
+	{
+		tunnelstream_fail(ts, 500, "Race allocation failed");
+		return;
+	}
+
+	race_start_next(ts->race);
+}
+
+/**
+ * Opens a tunnel for "CONNECT host:port", resolving and connecting host
+ * like a connection of a session.  The reply waits for the outcome.
+ */
+static void handle_connect(struct evhttp_request *req, struct proxy *prx)
+{
+	const char *target = evhttp_request_get_uri(req);
+	char host[HOST_MAX + 1];
+	struct tunnelstream *ts;
+	const char *sep;
+	uintptr_t port;
+	size_t len;
+
+	sep = strrchr(target, ':');
+	len = sep ? (size_t)(sep - target) : 0;
+
+	/* IPv6 addresses come in brackets. */
+	if(len >= 2 && target[0] == '[' && target[len - 1] == ']')
+	{
+		target++;
+		len -= 2;
+	}
+
+	if(len == 0 || len > HOST_MAX || !safe_strtoul(sep + 1, 10, &port) || port < 1 || port > 0xffff)
+	{
+		evhttp_send_error(req, 400, "Invalid CONNECT target");
+		return;
+	}
+
+	memcpy(host, target, len);
+	host[len] = 0;
+
+	ts = calloc(1, sizeof(struct tunnelstream));
+	if(ts == NULL)
+	{
+		evhttp_send_error(req, 500, "Tunnel allocation failed");
+		return;
+	}
+
+	ts->prx = prx;
+	ts->req = req;
+	ts->port = port;
+	TAILQ_INSERT_TAIL(&prx->tunnels, ts, next);
+
+	log_debug("handle_connect(...) -- tunnel 0x%"PRIxPTR" to %s:%"PRIuPTR, (uintptr_t)ts, host, port);
+
+	evhttp_connection_set_closecb(evhttp_request_get_connection(req), handle_tunnel_client_close, ts);
+
+	ts->resolve = dnscache_resolve(prx->base, prx->dns, host, handle_tunnel_resolved, ts);
+	if(ts->resolve == NULL)
+		tunnelstream_fail(ts, 500, "dnscache_resolve() failed");
+}
+
+static void handle_inbox(evutil_socket_t fd, short what, void *udata)
+{
+	struct proxy *prx = udata;
+	struct handoff_queue queue;
+	struct handoff *h;
+
+	TAILQ_INIT(&queue);
+
+	pthread_mutex_lock(&prx->inbox_lock);
+	TAILQ_CONCAT(&queue, &prx->inbox, next);
+	pthread_mutex_unlock(&prx->inbox_lock);
+
+	while((h = TAILQ_FIRST(&queue)) != NULL)
+	{
+		TAILQ_REMOVE(&queue, h, next);
+
+		if(h->type == HANDOFF_REQUEST)
+		{
+			struct request r = { h->req, h->origin, true, h->evb, h->ws, NULL };
+			session_dispatch(prx, &r, h->uri);
+		}
+		else if(h->type == HANDOFF_WS_MESSAGE)
+		{
+			struct session *sess = htable_find(&prx->sessions, session_hash(&h->token), session_match, &h->token);
+
+			if(sess)
+				session_execute(sess, h->evb, NULL);
+		}
+		else if(h->type == HANDOFF_WS_DETACH)
+		{
+			session_ws_detach(prx, &h->token, h->ws);
+
+			h->type = HANDOFF_WS_RELEASE;
+			handoff_post(h->origin, h);
+			continue;
+		}
+		else if(h->type == HANDOFF_RECV_CLOSED)
+		{
+			session_recv_closed(prx, &h->token, h->req);
+		}
+		else if(h->type == HANDOFF_WS_RELEASE)
+		{
+			h->ws->detaching = false;
+			h->ws->attached = false;
+
+			if(h->ws->closed)
+				wsstream_free(h->ws);
+		}
+		else
+		{
+			deliver(h->type, h->req, h->ws, h->code, h->reason, h->evb, h->watch, h->start_flags);
+		}
+
+		if(h->evb)
+			evbuffer_free(h->evb);
+		free(h);
+	}
+}
+
+static void stop_workers(void)
+{
+	unsigned i;
+
+	for(i = 0; i < num_workers; i++)
+		event_base_loopbreak(workers[i].base);
+}
+
+static void handle_shutdown(struct evhttp_request *req, void *udata)
+{
+	disable_caching(req);
+
+	if(req->type == EVHTTP_REQ_OPTIONS)
+	{
+		evhttp_send_reply(req, 200, NULL, NULL);
+		return;
+	}
+
+	stop_workers();
+}
+
+/**
+ * A successor has connected to the restart socket.  Once all workers have
+ * stopped, main() hands everything over to it and shuts down.
+ */
+static void handle_restart(evutil_socket_t fd, short what, void *udata)
+{
+	int sock;
+
+	if((sock = accept(fd, NULL, NULL)) < 0)
+	{
+		if(errno != EAGAIN && errno != EINTR)
+			log_warn("Accepting successor failed: %s", strerror(errno));
+		return;
+	}
+
+	evutil_make_socket_closeonexec(sock);
+
+	log_info("Successor connected, handing over");
+
+	successor = sock;
+	event_del(restart_ev);
+	stop_workers();
+}
+
+/**
+ * Serves the static files of the working directory from the asset cache.
+ * Large files go out with sendfile(): the reply is sent without a body and
+ * the file is added to the output buffer of the connection behind the
+ * headers, as only a buffer draining to a socket can use it.
+ */
+static void handle_gen(struct evhttp_request *req, void *udata)
+{
+	const char *path;
+	struct asset *a;
+	enum asset_encoding enc;
+	struct evbuffer *body;
+	char buf[64];
+
+	if(req->type == EVHTTP_REQ_CONNECT)
+	{
+		handle_connect(req, udata);
+		return;
+	}
+
+	allow_cross_origin(req);
+
+	if(req->type == EVHTTP_REQ_OPTIONS)
+	{
+		evhttp_send_reply(req, 200, NULL, NULL);
+		return;
+	}
+
+	if(req->type != EVHTTP_REQ_GET && req->type != EVHTTP_REQ_HEAD)
+	{
+		evhttp_send_error(req, 405, "Method not allowed");
+		return;
+	}
+
+	path = evhttp_uri_get_path(evhttp_request_get_evhttp_uri(req));
+	if(path == NULL || path[0] != '/')
+	{
+		evhttp_send_error(req, 400, "Bad URI");
+		return;
+	}
+
+	if((a = asset_get(path + 1)) == NULL)
+	{
+		evhttp_send_error(req, 404, "Not found");
+		return;
+	}
+
+	enc = asset_negotiate(a, evhttp_find_header(req->input_headers, "Accept-Encoding"));
+
+	evutil_snprintf(buf, sizeof(buf), "public, max-age=%u", asset_max_age);
+	evhttp_add_header(req->output_headers, "Cache-Control", buf);
+	evhttp_add_header(req->output_headers, "Vary", "Accept-Encoding");
+	evhttp_add_header(req->output_headers, "ETag", asset_etag(a, enc));
+
+	if(asset_not_modified(a, evhttp_find_header(req->input_headers, "If-None-Match")))
+	{
+		evhttp_send_reply(req, 304, "Not Modified", NULL);
+		asset_put(a);
+		return;
+	}
+
+	evhttp_add_header(req->output_headers, "Content-Type", asset_content_type(a));
+	if(asset_encoding_name(enc))
+		evhttp_add_header(req->output_headers, "Content-Encoding", asset_encoding_name(enc));
+
+	if(req->type == EVHTTP_REQ_HEAD || asset_is_file(a, enc))
+	{
+		evutil_snprintf(buf, sizeof(buf), "%zu", asset_length(a, enc));
+		evhttp_add_header(req->output_headers, "Content-Length", buf);
+
+		evhttp_send_reply(req, 200, "OK", NULL);
+
+		if(req->type != EVHTTP_REQ_HEAD)
+		{
+			body = bufferevent_get_output(evhttp_connection_get_bufferevent(evhttp_request_get_connection(req)));
+			if(asset_add(body, a, enc) < 0)
+				log_error("Adding %s to the output failed", path);
+		}
+
+		asset_put(a);
+		return;
+	}
+
+	body = evbuffer_new();
+	if(body == NULL || asset_add(body, a, enc) < 0)
+	{
+		if(body)
+			evbuffer_free(body);
+
+		asset_put(a);
+		evhttp_send_error(req, 500, "Internal error");
+		return;
+	}
+
+	evhttp_send_reply(req, 200, "OK", body);
+	evbuffer_free(body);
+	asset_put(a);
+}
+
+/**
+ * Adds up the counters of all workers.  They are read while being
+ * written, so the totals may be a few updates apart.
+ */
+static void stats_collect(struct proxy_stats *total)
+{
+	unsigned i, t;
+
+	memset(total, 0, sizeof(*total));
+
+	for(i = 0; i < num_workers; i++)
+	{
+		const struct proxy_stats *st = &workers[i].stats;
+		const struct proxy *prx = &workers[i];
+
+		total->sessions_created += stat_get(&st->sessions_created);
+		total->sessions_deleted += stat_get(&st->sessions_deleted);
+		total->connections_opened += stat_get(&st->connections_opened);
+		total->connections_closed += stat_get(&st->connections_closed);
+		total->bytes_up += stat_get(&st->bytes_up);
+		total->bytes_down += stat_get(&st->bytes_down);
+		total->takeovers += stat_get(&st->takeovers);
+		total->reconnects += stat_get(&st->reconnects);
+		total->dns_failures += stat_get(&st->dns_failures);
+		total->connect_attempts += stat_get(&st->connect_attempts);
+		total->sessions_expired_detached += stat_get(&st->sessions_expired_detached);
+		total->sessions_expired_age += stat_get(&st->sessions_expired_age);
+		total->connections_expired += stat_get(&st->connections_expired);
+		total->replayed_packets += stat_get(&st->replayed_packets);
+		total->resumes_failed += stat_get(&st->resumes_failed);
+		total->deflate_streams += stat_get(&st->deflate_streams);
+		total->deflate_in += stat_get(&st->deflate_in);
+		total->deflate_out += stat_get(&st->deflate_out);
+		total->deflate_usec += stat_get(&st->deflate_usec);
+		total->udp_datagrams_up += stat_get(&st->udp_datagrams_up);
+		total->udp_datagrams_down += stat_get(&st->udp_datagrams_down);
+		total->udp_dropped += stat_get(&st->udp_dropped);
+		total->udp_recv_calls += stat_get(&st->udp_recv_calls);
+		total->udp_send_calls += stat_get(&st->udp_send_calls);
+		total->relay_reads += stat_get(&st->relay_reads);
+		total->relay_heap_allocs += stat_get(&st->relay_heap_allocs);
+		total->tunnels_opened += stat_get(&st->tunnels_opened);
+		total->tunnels_closed += stat_get(&st->tunnels_closed);
+		total->tunnels_failed += stat_get(&st->tunnels_failed);
+		total->tunnel.bytes_up += stat_get(&st->tunnel.bytes_up);
+		total->tunnel.bytes_down += stat_get(&st->tunnel.bytes_down);
+		total->tunnel.splices += stat_get(&st->tunnel.splices);
+
+		total->session_pool_used += stat_get(&prx->session_pool.gets) - stat_get(&prx->session_pool.puts);
+		total->session_pool_capacity += stat_get(&prx->session_pool.capacity);
+		total->connection_pool_used += stat_get(&prx->connection_pool.gets) - stat_get(&prx->connection_pool.puts);
+		total->connection_pool_capacity += stat_get(&prx->connection_pool.capacity);
+		total->buffer_pool_hits += stat_get(&prx->buffers.hits);
+		total->buffer_pool_misses += stat_get(&prx->buffers.misses);
+
+		if(prx->ring)
+		{
+			struct uring_stats us;
+
+			uring_get_stats(prx->ring, &us);
+			total->uring.enters += us.enters;
+			total->uring.submissions += us.submissions;
+			total->uring.completions += us.completions;
+			total->uring.buffers_exhausted += us.buffers_exhausted;
+		}
+
+		for(t = 0; t < PKT_TYPES; t++)
+			total->packets[t] += stat_get(&st->packets[t]);
+
+		histogram_merge(&total->relay_latency, &st->relay_latency);
+		histogram_merge(&total->backlog, &st->backlog);
+	}
+}
+
+/**
+ * Serves the counters of all workers in Prometheus text format.
+ */
+static void handle_stats(struct evhttp_request *req, void *udata)
+{
+	static const char *const pkt_names[PKT_TYPES] = {
+		"connfail", "connected", "disconnected", "data", "pad",
+		"takeover", "reconn", "deleted", "window"
+	};
+	struct proxy_stats *total;
+	struct dnscache_stats dns;
+	struct asset_stats assets;
+	struct evbuffer *evb;
+	char labels[32];
+	unsigned t;
+
+	disable_caching(req);
+
+	total = malloc(sizeof(*total));
+	evb = evbuffer_new();
+	if(total == NULL || evb == NULL)
+	{
+		free(total);
+		if(evb)
+			evbuffer_free(evb);
+		evhttp_send_error(req, 500, "Statistics allocation failed");
+		return;
+	}
+
+	stats_collect(total);
+	dnscache_get_stats(&dns);
+	asset_get_stats(&assets);
+
+	stats_print_help(evb, "hades_sessions", "gauge", "Live sessions");
+	stats_print_value(evb, "hades_sessions", NULL, total->sessions_created - total->sessions_deleted);
+	stats_print_help(evb, "hades_sessions_created_total", "counter", "Sessions created");
+	stats_print_value(evb, "hades_sessions_created_total", NULL, total->sessions_created);
+
+	stats_print_help(evb, "hades_sessions_expired_total", "counter", "Sessions deleted by a timeout");
+	stats_print_value(evb, "hades_sessions_expired_total", "reason=\"detached\"", total->sessions_expired_detached);
+	stats_print_value(evb, "hades_sessions_expired_total", "reason=\"age\"", total->sessions_expired_age);
+
+	stats_print_help(evb, "hades_connections", "gauge", "Live upstream connections");
+	stats_print_value(evb, "hades_connections", NULL, total->connections_opened - total->connections_closed);
+	stats_print_help(evb, "hades_connections_opened_total", "counter", "Upstream connections opened");
+	stats_print_value(evb, "hades_connections_opened_total", NULL, total->connections_opened);
+	stats_print_help(evb, "hades_connections_expired_total", "counter", "Upstream connections closed for being idle");
+	stats_print_value(evb, "hades_connections_expired_total", NULL, total->connections_expired);
+
+	stats_print_help(evb, "hades_bytes_up_total", "counter", "Bytes written to upstream connections");
+	stats_print_value(evb, "hades_bytes_up_total", NULL, total->bytes_up);
+	stats_print_help(evb, "hades_bytes_down_total", "counter", "Bytes read from upstream connections");
+	stats_print_value(evb, "hades_bytes_down_total", NULL, total->bytes_down);
+
+	stats_print_help(evb, "hades_packets_total", "counter", "Packets queued for clients by type");
+	for(t = 0; t < PKT_TYPES; t++)
+	{
+		snprintf(labels, sizeof(labels), "type=\"%s\"", pkt_names[t]);
+		stats_print_value(evb, "hades_packets_total", labels, total->packets[t]);
+	}
+
+	stats_print_help(evb, "hades_takeovers_total", "counter", "Recv streams taken over by another recv");
+	stats_print_value(evb, "hades_takeovers_total", NULL, total->takeovers);
+	stats_print_help(evb, "hades_reconnects_total", "counter", "Recv streams ended asking the client to reconnect");
+	stats_print_value(evb, "hades_reconnects_total", NULL, total->reconnects);
+	stats_print_help(evb, "hades_replayed_packets_total", "counter", "Packets resent to recv streams resuming after a loss");
+	stats_print_value(evb, "hades_replayed_packets_total", NULL, total->replayed_packets);
+	stats_print_help(evb, "hades_resumes_failed_total", "counter", "Recv streams refused as the packets to resume from were no longer kept");
+	stats_print_value(evb, "hades_resumes_failed_total", NULL, total->resumes_failed);
+
+	stats_print_help(evb, "hades_deflate_streams_total", "counter", "Recv streams sent compressed");
+	stats_print_value(evb, "hades_deflate_streams_total", NULL, total->deflate_streams);
+	stats_print_help(evb, "hades_deflate_bytes_total", "counter", "Bytes of compressed recv streams before and after compression");
+	stats_print_value(evb, "hades_deflate_bytes_total", "stage=\"in\"", total->deflate_in);
+	stats_print_value(evb, "hades_deflate_bytes_total", "stage=\"out\"", total->deflate_out);
+	stats_print_help(evb, "hades_deflate_microseconds_total", "counter", "Time spent compressing recv streams");
+	stats_print_value(evb, "hades_deflate_microseconds_total", NULL, total->deflate_usec);
+
+	stats_print_help(evb, "hades_udp_datagrams_total", "counter", "Datagrams relayed over UDP connections");
+	stats_print_value(evb, "hades_udp_datagrams_total", "direction=\"up\"", total->udp_datagrams_up);
+	stats_print_value(evb, "hades_udp_datagrams_total", "direction=\"down\"", total->udp_datagrams_down);
+	stats_print_help(evb, "hades_udp_datagrams_dropped_total", "counter", "Datagrams from clients that could not be sent upstream");
+	stats_print_value(evb, "hades_udp_datagrams_dropped_total", NULL, total->udp_dropped);
+	stats_print_help(evb, "hades_udp_syscalls_total", "counter", "Batched datagram system calls on UDP connections");
+	stats_print_value(evb, "hades_udp_syscalls_total", "call=\"recvmmsg\"", total->udp_recv_calls);
+	stats_print_value(evb, "hades_udp_syscalls_total", "call=\"sendmmsg\"", total->udp_send_calls);
+
+	stats_print_help(evb, "hades_tunnels", "gauge", "Open CONNECT tunnels");
+	stats_print_value(evb, "hades_tunnels", NULL, total->tunnels_opened - total->tunnels_closed);
+	stats_print_help(evb, "hades_tunnels_opened_total", "counter", "CONNECT tunnels opened");
+	stats_print_value(evb, "hades_tunnels_opened_total", NULL, total->tunnels_opened);
+	stats_print_help(evb, "hades_tunnels_failed_total", "counter", "CONNECT requests whose upstream could not be resolved or connected");
+	stats_print_value(evb, "hades_tunnels_failed_total", NULL, total->tunnels_failed);
+	stats_print_help(evb, "hades_tunnel_bytes_total", "counter", "Bytes spliced through CONNECT tunnels");
+	stats_print_value(evb, "hades_tunnel_bytes_total", "direction=\"up\"", total->tunnel.bytes_up);
+	stats_print_value(evb, "hades_tunnel_bytes_total", "direction=\"down\"", total->tunnel.bytes_down);
+	stats_print_help(evb, "hades_tunnel_splices_total", "counter", "splice() calls moving tunnel bytes");
+	stats_print_value(evb, "hades_tunnel_splices_total", NULL, total->tunnel.splices);
+
+	stats_print_help(evb, "hades_uring_enters_total", "counter", "io_uring_enter() calls submitting upstream socket operations");
+	stats_print_value(evb, "hades_uring_enters_total", NULL, total->uring.enters);
+	stats_print_help(evb, "hades_uring_operations_total", "counter", "Upstream socket operations on io_uring by stage");
+	stats_print_value(evb, "hades_uring_operations_total", "stage=\"submitted\"", total->uring.submissions);
+	stats_print_value(evb, "hades_uring_operations_total", "stage=\"completed\"", total->uring.completions);
+	stats_print_help(evb, "hades_uring_buffers_exhausted_total", "counter", "Receives stopped for running out of provided buffers");
+	stats_print_value(evb, "hades_uring_buffers_exhausted_total", NULL, total->uring.buffers_exhausted);
+	stats_print_help(evb, "hades_dns_failures_total", "counter", "Upstream connections failed resolving their host");
+	stats_print_value(evb, "hades_dns_failures_total", NULL, total->dns_failures);
+
+	stats_print_help(evb, "hades_connect_attempts_total", "counter", "Upstream addresses connected to, several per connection when racing");
+	stats_print_value(evb, "hades_connect_attempts_total", NULL, total->connect_attempts);
+
+	stats_print_help(evb, "hades_dns_cache_lookups_total", "counter", "Host name lookups by how the DNS cache answered them");
+	stats_print_value(evb, "hades_dns_cache_lookups_total", "result=\"hit\"", dns.hits);
+	stats_print_value(evb, "hades_dns_cache_lookups_total", "result=\"negative_hit\"", dns.negative_hits);
+	stats_print_value(evb, "hades_dns_cache_lookups_total", "result=\"miss\"", dns.misses);
+	stats_print_value(evb, "hades_dns_cache_lookups_total", "result=\"coalesced\"", dns.coalesced);
+	stats_print_help(evb, "hades_dns_cache_refreshes_total", "counter", "Cached names resolved again before expiring");
+	stats_print_value(evb, "hades_dns_cache_refreshes_total", NULL, dns.refreshes);
+	stats_print_help(evb, "hades_dns_cache_entries", "gauge", "Names in the DNS cache");
+	stats_print_value(evb, "hades_dns_cache_entries", NULL, dns.entries);
+
+	stats_print_help(evb, "hades_static_requests_total", "counter", "Static file requests by how the asset cache answered them");
+	stats_print_value(evb, "hades_static_requests_total", "result=\"hit\"", assets.hits);
+	stats_print_value(evb, "hades_static_requests_total", "result=\"not_modified\"", assets.not_modified);
+	stats_print_value(evb, "hades_static_requests_total", "result=\"miss\"", assets.misses);
+	stats_print_help(evb, "hades_static_reloads_total", "counter", "Static files loaded again after changing on disk");
+	stats_print_value(evb, "hades_static_reloads_total", NULL, assets.reloads);
+	stats_print_help(evb, "hades_static_files", "gauge", "Files in the asset cache");
+	stats_print_value(evb, "hades_static_files", NULL, assets.entries);
+	stats_print_help(evb, "hades_static_bytes", "gauge", "Bytes of static file content and its compressed variants kept in memory");
+	stats_print_value(evb, "hades_static_bytes", NULL, assets.bytes);
+
+	stats_print_help(evb, "hades_relay_reads_total", "counter", "Upstream reads relayed");
+	stats_print_value(evb, "hades_relay_reads_total", NULL, total->relay_reads);
+	stats_print_help(evb, "hades_relay_heap_allocs_total", "counter", "Heap allocations made relaying upstream reads");
+	stats_print_value(evb, "hades_relay_heap_allocs_total", NULL, total->relay_heap_allocs);
+
+	stats_print_help(evb, "hades_pool_objects", "gauge", "Pooled objects in use");
+	stats_print_value(evb, "hades_pool_objects", "pool=\"session\"", total->session_pool_used);
+	stats_print_value(evb, "hades_pool_objects", "pool=\"connection\"", total->connection_pool_used);
+	stats_print_help(evb, "hades_pool_capacity", "gauge", "Pooled objects allocated in slabs");
+	stats_print_value(evb, "hades_pool_capacity", "pool=\"session\"", total->session_pool_capacity);
+	stats_print_value(evb, "hades_pool_capacity", "pool=\"connection\"", total->connection_pool_capacity);
+	stats_print_help(evb, "hades_buffer_pool_hits_total", "counter", "Buffers reused from the buffer pool");
+	stats_print_value(evb, "hades_buffer_pool_hits_total", NULL, total->buffer_pool_hits);
+	stats_print_help(evb, "hades_buffer_pool_misses_total", "counter", "Buffers newly allocated with the buffer pool empty");
+	stats_print_value(evb, "hades_buffer_pool_misses_total", NULL, total->buffer_pool_misses);
+
+	stats_print_histogram(evb, "hades_relay_latency_microseconds",
+		"Time from an upstream read until its data is passed on for the recv stream",
+		&total->relay_latency, 26);
+	stats_print_histogram(evb, "hades_session_backlog_bytes",
+		"Session buffer size after an upstream read",
+		&total->backlog, 30);
+
+	evhttp_add_header(req->output_headers, "Content-Type", "text/plain; version=0.0.4");
+	evhttp_send_reply(req, 200, NULL, evb);
+
+	evbuffer_free(evb);
+	free(total);
+}
+
+/**
+ * Version of the state handed to a successor.  It holds the number of
+ * listening sockets and then for every session: its id, framing, replay
+ * state, expiry, pending and replay buffers and its connections, each
+ * with its id, flags, send sequence, activity, pending output and stashed
+ * sends.  A record of 0 ends the sessions.
+ */
+#define RESTART_VERSION 2
+
+/**
+ * Flags of a saved connection: it got connected, and its socket follows
+ * in the descriptors, a UDP socket without pending output.
+ */
+#define SAVED_CONNECTED 1
+#define SAVED_SOCKET 2
+#define SAVED_UDP 4
+
+struct handover {
+	struct evbuffer *state;
+	int *fds;
+	unsigned num_fds;
+	unsigned max_fds;
+};
+
+static bool handover_add_fd(struct handover *ho, int fd)
+{
+	int *fds;
+
+	if(ho->num_fds == ho->max_fds)
+	{
+		fds = realloc(ho->fds, (ho->max_fds * 2 + 16) * sizeof(int));
+		if(fds == NULL)
+			return false;
+
+		ho->fds = fds;
+		ho->max_fds = ho->max_fds * 2 + 16;
+	}
+
+	ho->fds[ho->num_fds++] = fd;
+	return true;
+}
+
+/**
+ * Connections still being set up cannot be moved, the client is told
+ * they failed.  What connected ones have read is queued for the client.
+ */
+static void connection_prepare_handover(struct connection *conn, void *udata)
+{
+	if(!conn->connected)
+	{
+		if(conn->resolve || conn->race || conn->bev || conn->udp)
+		{
+			connection_close(conn);
+			session_add_packet(conn->sess, PKT_CONNFAIL, conn->id);
+		}
+	}
+	else if(conn->udp)
+	{
+		udp_socket_send(conn->udp);
+	}
+	else if(conn->bev && evbuffer_get_length(bufferevent_get_input(conn->bev)) > 0)
+	{
+		handle_bev_read(conn->bev, conn);
+	}
+}
+
+static void connection_save(struct connection *conn, struct handover *ho)
+{
+	uint32_t flags = 0, mask = 0;
+	unsigned i;
+
+	if(conn->connected)
+		flags |= SAVED_CONNECTED;
+	if(conn->bev && handover_add_fd(ho, bufferevent_getfd(conn->bev)))
+		flags |= SAVED_SOCKET;
+	else if(conn->udp && handover_add_fd(ho, event_get_fd(conn->udp->ev)))
+		flags |= SAVED_SOCKET | SAVED_UDP;
+
+	restart_put_u32(ho->state, conn->id);
+	restart_put_u32(ho->state, flags);
+	restart_put_u32(ho->state, conn->send_seq);
+	restart_put_u64(ho->state, conn->active);
+
+	if((flags & SAVED_SOCKET) && !(flags & SAVED_UDP))
+		restart_put_buffer(ho->state, bufferevent_get_output(conn->bev));
+
+	for(i = 0; conn->reorder && i < SEND_WINDOW; i++)
+	{
+		if(conn->reorder[i])
+			mask |= 1u << i;
+	}
+
+	restart_put_u32(ho->state, mask);
+
+	for(i = 0; i < SEND_WINDOW; i++)
+	{
+		if(mask & (1u << i))
+			restart_put_buffer(ho->state, conn->reorder[i]);
+	}
+}
+
+static void session_save(struct session *sess, struct handover *ho)
+{
+	struct connection *conn;
+	size_t pos = 0;
+
+	session_foreach_conn(sess, connection_prepare_handover);
+
+	restart_put_u32(ho->state, 1);
+	restart_put_u32(ho->state, sess->worker);
+	restart_put_u64(ho->state, sess->token.hi);
+	restart_put_u64(ho->state, sess->token.lo);
+	restart_put_u32(ho->state, sess->framing);
+	restart_put_u64(ho->state, sess->created);
+	restart_put_u64(ho->state, sess->seq);
+	restart_put_u32(ho->state, sess->evb_packets);
+	restart_put_buffer(ho->state, sess->evb);
+
+	restart_put_u32(ho->state, sess->replay != NULL);
+	if(sess->replay)
+	{
+		restart_put_u64(ho->state, sess->replay_count);
+		restart_put_buffer(ho->state, sess->replay);
+	}
+
+	restart_put_u32(ho->state, htable_count(&sess->conns));
+
+	while((conn = htable_next(&sess->conns, &pos)) != NULL)
+		connection_save(conn, ho);
+}
+
+static void connection_stop_uring(struct connection *conn, void *udata)
+{
+	if(conn->uring)
+		uring_sock_stop(conn->uring);
+}
+
+static void connection_release_uring(struct connection *conn, void *udata)
+{
+	if(conn->uring)
+	{
+		bufferevent_setfd(conn->bev, uring_sock_release(conn->uring));
+		conn->uring = NULL;
+	}
+}
+
+/**
+ * Takes the sockets of a worker off its ring, so they are saved like any
+ * other.  What is received meanwhile ends up in their input buffers.
+ */
+static void proxy_release_uring(struct proxy *prx)
+{
+	struct session *sess;
+	size_t pos = 0;
+
+	if(prx->ring == NULL)
+		return;
+
+	while((sess = htable_next(&prx->sessions, &pos)) != NULL)
+		session_foreach_conn(sess, connection_stop_uring);
+
+	uring_wait(prx->ring);
+
+	pos = 0;
+	while((sess = htable_next(&prx->sessions, &pos)) != NULL)
+		session_foreach_conn(sess, connection_release_uring);
+}
+
+/**
+ * Sends the listening sockets and all sessions to the successor connected
+ * at sock.  The workers have stopped, so this thread owns every session.
+ */
+static void handover(int sock)
+{
+	struct handover ho = { NULL, NULL, 0, 0 };
+	struct session *sess;
+	size_t pos;
+	unsigned i, sessions = 0;
+
+	if((ho.state = evbuffer_new()) == NULL)
+	{
+		log_error("Handover state allocation failed");
+		return;
+	}
+
+	restart_put_u32(ho.state, RESTART_VERSION);
+	restart_put_u32(ho.state, num_workers);
+
+	for(i = 0; i < num_workers; i++)
+	{
+		if(!handover_add_fd(&ho, evconnlistener_get_fd(workers[i].listener)))
+			goto cleanup;
+	}
+
+	for(i = 0; i < num_workers; i++)
+	{
+		proxy_release_uring(&workers[i]);
+
+		pos = 0;
+		while((sess = htable_next(&workers[i].sessions, &pos)) != NULL)
+		{
+			session_save(sess, &ho);
+			sessions++;
+		}
+	}
+
+	restart_put_u32(ho.state, 0);
+
+	log_info("Handing over %u sockets and %u sessions, %zu bytes of state",
+		ho.num_fds, sessions, evbuffer_get_length(ho.state));
+
+	if(restart_send(sock, ho.fds, ho.num_fds, ho.state) < 0)
+		log_error("Handing over failed: %s", strerror(errno));
+
 cleanup:
-        evhttp_clear_headers(&params);
+	evbuffer_free(ho.state);
+	free(ho.fds);
 }
 
-static void handle_shutdown(struct evhttp_request *req, void *udata)
+static int connection_restore(struct session *sess, struct evbuffer *state, const int *fds, unsigned num_fds,
+		unsigned *next_fd)
 {
-	struct proxy *prx = udata;
-	
-	disable_caching(req);
+	struct proxy *prx = sess->prx;
+	struct connection *conn;
+	uint32_t id, flags, send_seq, mask;
+	uint64_t active;
+	unsigned i;
+	int fd;
 
-	if(req->type == EVHTTP_REQ_OPTIONS)
+	if(!restart_get_u32(state, &id) || !restart_get_u32(state, &flags) ||
+		!restart_get_u32(state, &send_seq) || !restart_get_u64(state, &active))
+		return -1;
+
+	conn = pool_get(&prx->connection_pool);
+	if(conn == NULL)
+		return -1;
+
+	conn->id = id;
+	conn->sess = sess;
+	conn->connected = (flags & SAVED_CONNECTED) != 0;
+	conn->send_seq = send_seq;
+	stat_add(&prx->stats.connections_opened, 1);
+
+	wheel_timer_init(&conn->idle, handle_connection_idle, conn);
+	conn->active = active;
+	if(conn_idle_timeout)
+		wheel_add(&prx->wheel, &conn->idle, conn->active + timeout_ticks(conn_idle_timeout));
+
+	if(htable_insert(&sess->conns, connection_hash(conn->id), conn) < 0)
 	{
-		evhttp_send_reply(req, 200, NULL, NULL);
-		return;
+		connection_free(conn, NULL);
+		return -1;
 	}
 
-	event_base_loopbreak(prx->base);
-}
+	if(flags & SAVED_SOCKET)
+	{
+		if(*next_fd >= num_fds)
+			return -1;
 
-static void handle_gen(struct evhttp_request *req, void *udata)
-{
-	const char *fn;
-	struct stat st;
-	int rc, fd;
-	struct evbuffer *evb;
+		fd = fds[(*next_fd)++];
 
-	disable_caching(req);
+		if(flags & SAVED_UDP)
+		{
+			if(udp_socket_new(conn) == NULL)
+			{
+				close(fd);
+				return -1;
+			}
 
-	if(req->type == EVHTTP_REQ_OPTIONS)
+			conn->udp->ev = event_new(prx->base, fd, EV_READ | EV_PERSIST, handle_udp_read, conn);
+			if(conn->udp->ev == NULL)
+			{
+				close(fd);
+				return -1;
+			}
+		}
+		else
+		{
+			conn->bev = bufferevent_socket_new(prx->base, fd, BEV_OPT_CLOSE_ON_FREE);
+			if(conn->bev == NULL)
+			{
+				close(fd);
+				return -1;
+			}
+
+			if(!restart_get_buffer(state, bufferevent_get_output(conn->bev)))
+				return -1;
+
+			bufferevent_setcb(conn->bev, handle_bev_read, handle_bev_write, handle_bev_event, conn);
+			if(prx->ring == NULL || !connection_attach_uring(conn))
+				bufferevent_enable(conn->bev, EV_WRITE);
+		}
+
+		connection_update_read(conn, NULL);
+	}
+
+	if(!restart_get_u32(state, &mask))
+		return -1;
+
+	if(mask && (conn->reorder = calloc(SEND_WINDOW, sizeof(struct evbuffer *))) == NULL)
+		return -1;
+
+	for(i = 0; i < SEND_WINDOW; i++)
 	{
-		evhttp_send_reply(req, 200, NULL, NULL);
-		return;
+		if(!(mask & (1u << i)))
+			continue;
+
+		conn->reorder[i] = evbuffer_pool_get(&prx->buffers);
+		if(conn->reorder[i] == NULL || !restart_get_buffer(state, conn->reorder[i]))
+			return -1;
 	}
 
-	if(req->uri[0] != '/' || strrchr(req->uri, '/') != req->uri)
+	return 0;
+}
+
+static int session_restore(struct evbuffer *state, const int *fds, unsigned num_fds, unsigned *next_fd)
+{
+	struct session_token token;
+	struct session *sess;
+	struct proxy *prx;
+	uint32_t worker, framing, evb_packets, has_replay, num_conns;
+	uint64_t created, seq;
+	unsigned i;
+
+	if(!restart_get_u32(state, &worker) || !restart_get_u64(state, &token.hi) ||
+		!restart_get_u64(state, &token.lo) || !restart_get_u32(state, &framing) ||
+		!restart_get_u64(state, &created) || !restart_get_u64(state, &seq) ||
+		!restart_get_u32(state, &evb_packets))
+		return -1;
+
+	if(framing != FRAMING_ASCII && framing != FRAMING_VARINT)
+		return -1;
+
+	prx = &workers[worker % num_workers];
+
+	sess = session_new(prx, &token, worker);
+	if(sess == NULL)
+		return -1;
+
+	stat_add(&prx->stats.sessions_created, 1);
+
+	sess->framing = framing;
+	sess->seq = seq;
+	sess->evb_packets = evb_packets;
+	sess->created = created;
+	session_arm_expiry(sess);
+
+	if(!restart_get_buffer(state, sess->evb) || !restart_get_u32(state, &has_replay))
+		return -1;
+
+	if(has_replay)
 	{
-		evhttp_send_error(req, 400, "Bad URI");		
+		sess->replay = evbuffer_pool_get(&prx->buffers);
+		if(sess->replay == NULL || !restart_get_u64(state, &sess->replay_count) ||
+			!restart_get_buffer(state, sess->replay))
+			return -1;
 	}
 
-	fn = req->uri + 1;
+	if(!restart_get_u32(state, &num_conns))
+		return -1;
 
-	fd = open(fn, O_RDONLY);
-	if(fd < 0)
+	for(i = 0; i < num_conns; i++)
 	{
-		evhttp_send_error(req, 400, "open() failed");
-		return;
+		if(connection_restore(sess, state, fds, num_fds, next_fd) < 0)
+			return -1;
 	}
 
-	rc = fstat(fd, &st);
-	if(rc < 0)
+	session_update_throttle(sess);
+	return 0;
+}
+
+/**
+ * Takes over the sessions handed over by the predecessor, once the
+ * workers are set up.  The listening sockets have been taken already.
+ */
+static int restore_sessions(struct evbuffer *state, const int *fds, unsigned num_fds)
+{
+	unsigned next_fd = num_inherited, sessions = 0;
+	uint32_t more;
+
+	while(restart_get_u32(state, &more) && more)
 	{
-		close(fd);
-		evhttp_send_error(req, 400, "stat() failed");
-		return;
+		if(session_restore(state, fds, num_fds, &next_fd) < 0)
+			return -1;
+
+		sessions++;
 	}
 
-	evb = evbuffer_new();
+	if(evbuffer_get_length(state) > 0 || next_fd != num_fds)
+		return -1;
 
-	rc = evbuffer_add_file(evb, fd, 0, st.st_size);
-	if(rc < 0)
-	{ 
-		close(fd);
-		evhttp_send_error(req, 400, "evbuffer_add_file() failed");
-		return;
+	log_info("Took over %u sessions with %u upstream connections", sessions, num_fds - num_inherited);
+	return 0;
+}
+
+/**
+ * Receives the listening sockets and the state from a predecessor running
+ * with the same restart path, if there is one.  Returns 0 if there is
+ * none, 1 if it handed over and -1 on failure.
+ */
+static int receive_handover(int **fds, unsigned *num_fds, struct evbuffer *state)
+{
+	uint32_t version, listeners;
+	int sock;
+
+	if((sock = restart_connect(restart_path)) < 0)
+	{
+		if(errno == ENOENT || errno == ECONNREFUSED)
+			return 0;
+
+		fprintf(stderr, "Connecting to predecessor at %s failed: %s\n", restart_path, strerror(errno));
+		return -1;
 	}
 
-	if(strstr(req->uri, ".js"))
+	if(restart_recv(sock, fds, num_fds, state) < 0)
 	{
-		evhttp_add_header(req->output_headers, "Content-Type", "text/javascript");
+		fprintf(stderr, "Receiving handover from predecessor failed: %s\n", strerror(errno));
+		close(sock);
+		return -1;
 	}
 
-	evhttp_send_reply(req, 200, NULL, evb);
+	close(sock);
 
-	evbuffer_free(evb);
+	if(!restart_get_u32(state, &version) || version != RESTART_VERSION ||
+		!restart_get_u32(state, &listeners) || listeners > *num_fds)
+	{
+		fprintf(stderr, "Predecessor handed over unknown state\n");
+		return -1;
+	}
+
+	inherited_fds = *fds;
+	num_inherited = listeners;
+	return 1;
 }
 
 static void show_usage(void)
@@ -847,15 +5048,63 @@ static void show_usage(void)
 		"Usage: hades [OPTION]...\n"
 		"Available options:\n"
 		" -p PORT	Binds to the given port\n"
+		" -t THREADS	Number of worker threads (default 1)\n"
+		" -b HIGH[:LOW]	Session buffer watermarks in bytes (default 1048576:524288)\n"
+		" -B HIGH[:LOW]	Per connection buffer watermarks in bytes (default 262144:131072)\n"
+		" -l LEVEL	Log level: error, warn, info or debug (default info)\n"
+		" -r ADDR[:PORT]	Resolves host names with the given name server\n"
+		" -R 		Resolves popular host names again before they expire\n"
+		" -i SECONDS	Deletes sessions left without recv stream (default 60, 0 never)\n"
+		" -a SECONDS	Deletes sessions this long after creation (default 0, never)\n"
+		" -c SECONDS	Closes upstream connections idle this long (default 0, never)\n"
+		" -m SECONDS	Lets browsers cache static files this long (default 86400)\n"
+		" -z BYTES	Memory per session for compressing recv streams (default 131072, 0 never)\n"
+		" -U PATH	Takes over from the process at this Unix socket and listens\n"
+		" 		there for a successor in turn\n"
+		" -e ENGINE	Upstream socket I/O: libevent or uring (default uring if available)\n"
 		" -h 		Prints this information\n");
 }
 
+/**
+ * Parses "HIGH[:LOW]", LOW defaults to half of HIGH.
+ */
+static bool parse_watermarks(const char *str, size_t *high, size_t *low)
+{
+	char buf[64];
+	char *sep;
+	uintptr_t h, l;
+
+	if(strlen(str) >= sizeof(buf))
+		return false;
+
+	strcpy(buf, str);
+
+	sep = strchr(buf, ':');
+	if(sep)
+		*sep++ = 0;
+
+	if(!safe_strtoul(buf, 10, &h) || h == 0)
+		return false;
+
+	l = h / 2;
+	if(sep && (!safe_strtoul(sep, 10, &l) || l > h))
+		return false;
+
+	*high = h;
+	*low = l;
+	return true;
+}
+
 static void handle_argv(int argc, char **argv)
 {
 	int c, err = 0;
 	unsigned long given_port;
+	uintptr_t given_workers;
+	uintptr_t given_timeout;
+	uintptr_t given_size;
+	int given_level;
 
-	while ((c = getopt(argc, argv, "hp:")) != -1) 
+	while ((c = getopt(argc, argv, "hp:t:b:B:l:r:Ri:a:c:m:z:U:e:")) != -1)
 	{
 		switch(c) 
 		{
@@ -871,6 +5120,113 @@ static void handle_argv(int argc, char **argv)
 			}
 			break;
 
+		case 't':
+			if(!safe_strtoul(optarg, 10, &given_workers) || given_workers < 1 || given_workers > MAX_WORKERS)
+			{
+				fprintf(stderr, "Error: Invalid number of threads: %s\n", optarg);
+				err += 1;
+			}
+			else
+			{
+				num_workers = given_workers;
+			}
+			break;
+
+		case 'b':
+			if(!parse_watermarks(optarg, &session_high_watermark, &session_low_watermark))
+			{
+				fprintf(stderr, "Error: Invalid session watermarks: %s\n", optarg);
+				err += 1;
+			}
+			break;
+
+		case 'B':
+			if(!parse_watermarks(optarg, &conn_high_watermark, &conn_low_watermark))
+			{
+				fprintf(stderr, "Error: Invalid connection watermarks: %s\n", optarg);
+				err += 1;
+			}
+			break;
+
+		case 'l':
+			if((given_level = log_parse_level(optarg)) < 0)
+			{
+				fprintf(stderr, "Error: Invalid log level: %s\n", optarg);
+				err += 1;
+			}
+			else
+			{
+				log_max_level = given_level;
+			}
+			break;
+
+		case 'r':
+			nameserver = optarg;
+			break;
+
+		case 'R':
+			dns_refresh = true;
+			break;
+
+		case 'U':
+			restart_path = optarg;
+			break;
+
+		case 'e':
+			if(strcmp(optarg, "libevent") == 0)
+			{
+				engine = ENGINE_LIBEVENT;
+			}
+			else if(strcmp(optarg, "uring") == 0)
+			{
+				engine = ENGINE_URING;
+			}
+			else
+			{
+				fprintf(stderr, "Error: Invalid I/O engine: %s\n", optarg);
+				err += 1;
+			}
+			break;
+
+		case 'z':
+			if(!safe_strtoul(optarg, 10, &given_size))
+			{
+				fprintf(stderr, "Error: Invalid deflate memory: %s\n", optarg);
+				err += 1;
+			}
+			else
+			{
+				deflate_mem_max = given_size;
+			}
+			break;
+
+		case 'i':
+		case 'a':
+		case 'c':
+		case 'm':
+			if(!safe_strtoul(optarg, 10, &given_timeout) || given_timeout > UINT32_MAX / 1000)
+			{
+				fprintf(stderr, "Error: Invalid timeout: %s\n", optarg);
+				err += 1;
+			}
+			else if(c == 'i')
+			{
+				session_detach_timeout = given_timeout;
+			}
+			else if(c == 'a')
+			{
+				session_max_age = given_timeout;
+			}
+			else if(c == 'c')
+			{
+				conn_idle_timeout = given_timeout;
+			}
+			else
+			{
+				asset_max_age = given_timeout;
+			}
+			break;
+
 		case ':':
 			fprintf(stderr, "Error: Option -%c requires an operand\n", optopt);
 			err += 1;
@@ -895,13 +5251,162 @@ static void handle_argv(int argc, char **argv)
 	}		
 }
 
-int main(int argc, char **argv)
+static uint64_t wheel_ticks(void)
+{
+	return now_usec() / (WHEEL_TICK_MS * 1000);
+}
+
+/**
+ * Advances the timing wheel and reaps up to EXPIRE_BUDGET expired sessions
+ * and connections, leaving the rest to the next pass of the event loop.
+ */
+static void handle_wheel(evutil_socket_t fd, short what, void *udata)
+{
+	struct proxy *prx = udata;
+
+	wheel_advance(&prx->wheel, wheel_ticks() + 1);
+
+	if(wheel_run(&prx->wheel, EXPIRE_BUDGET))
+		event_active(prx->wheel_ev, EV_TIMEOUT, 0);
+}
+
+static int proxy_init(struct proxy *prx, unsigned index)
+{
+	struct timeval tick = {0, WHEEL_TICK_MS * 1000};
+	struct sockaddr_in sin;
+	unsigned flags = LEV_OPT_REUSEABLE | LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC;
+
+	htable_init(&prx->sessions);
+	TAILQ_INIT(&prx->inbox);
+	TAILQ_INIT(&prx->wsstreams);
+	TAILQ_INIT(&prx->tunnels);
+	TAILQ_INIT(&prx->dirty);
+	TAILQ_INIT(&prx->udp_dirty);
+	pthread_mutex_init(&prx->inbox_lock, NULL);
+	prx->index = index;
+
+	pool_init(&prx->session_pool, sizeof(struct session), SESSION_SLAB);
+	pool_init(&prx->connection_pool, sizeof(struct connection), CONNECTION_SLAB);
+	if(evbuffer_pool_init(&prx->buffers, EVBUFFER_POOL_MAX) < 0)
+	{
+		fprintf(stderr, "Buffer pool allocation failed\n");
+		return -1;
+	}
+
+	prx->base = event_base_new();
+	prx->http = evhttp_new(prx->base);
+	prx->dns = evdns_base_new(prx->base, nameserver == NULL);
+	if(nameserver && evdns_base_nameserver_ip_add(prx->dns, nameserver) != 0)
+	{
+		fprintf(stderr, "Invalid name server: %s\n", nameserver);
+		return -1;
+	}
+	prx->inbox_ev = event_new(prx->base, -1, 0, handle_inbox, prx);
+	prx->flush_ev = event_new(prx->base, -1, 0, handle_flush, prx);
+
+	wheel_init(&prx->wheel, wheel_ticks() + 1);
+	prx->wheel_ev = event_new(prx->base, -1, EV_PERSIST, handle_wheel, prx);
+	event_add(prx->wheel_ev, &tick);
+
+	/* With several workers every one of them listens on its own socket
+	 * and the kernel balances incoming connections between them.  So may
+	 * a successor with more workers than its predecessor had. */
+	if(num_workers > 1 || restart_path)
+		flags |= LEV_OPT_REUSEABLE_PORT;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if(index < num_inherited)
+	{
+		prx->listener = evconnlistener_new(prx->base, NULL, NULL, flags, 0, inherited_fds[index]);
+		inherited_fds[index] = -1;
+	}
+	else
+	{
+		prx->listener = evconnlistener_new_bind(prx->base, NULL, NULL, flags, -1,
+			(struct sockaddr *)&sin, sizeof(sin));
+	}
+
+	if(prx->listener == NULL || evhttp_bind_listener(prx->http, prx->listener) == NULL)
+	{
+		fprintf(stderr, "Binding to port %"PRIu16" failed\n", port);
+		return -1;
+	}
+
+	if(engine != ENGINE_LIBEVENT && (prx->ring = uring_new(prx->base)) == NULL)
+		uring_error = errno;
+
+	evhttp_set_allowed_methods(prx->http, EVHTTP_REQ_GET | EVHTTP_REQ_HEAD | EVHTTP_REQ_POST | EVHTTP_REQ_OPTIONS |
+		EVHTTP_REQ_CONNECT);
+	evhttp_set_gencb(prx->http, handle_gen, prx);
+	evhttp_set_cb(prx->http, "/session", handle_session, prx);
+	evhttp_set_cb(prx->http, "/ws", handle_ws, prx);
+	evhttp_set_cb(prx->http, "/shutdown", handle_shutdown, prx);
+	evhttp_set_cb(prx->http, "/stats", handle_stats, prx);
+
+	return 0;
+}
+
+static void proxy_cleanup(struct proxy *prx)
+{
+	struct handoff *h;
+	struct wsstream *wss;
+	struct tunnelstream *ts;
+
+	/* Whatever is still in flight between workers is simply dropped,
+	 * the requests themselves are freed along with their evhttp. */
+	while((h = TAILQ_FIRST(&prx->inbox)) != NULL)
+	{
+		TAILQ_REMOVE(&prx->inbox, h, next);
+		if(h->evb)
+			evbuffer_free(h->evb);
+		free(h);
+	}
+
+	/* WebSockets own their evhttp connections, free them before evhttp
+	 * does. */
+	while((wss = TAILQ_FIRST(&prx->wsstreams)) != NULL)
+		wsstream_free(wss);
+
+	/* So do tunnels, and requests waiting for one are dropped. */
+	while((ts = TAILQ_FIRST(&prx->tunnels)) != NULL)
+		tunnelstream_free(ts);
+
+	evbuffer_pool_destroy(&prx->buffers);
+	pool_destroy(&prx->connection_pool);
+	pool_destroy(&prx->session_pool);
+	udp_batch_free(&prx->udp_in);
+
+	if(prx->ring)
+		uring_free(prx->ring);
+
+	event_free(prx->wheel_ev);
+	event_free(prx->flush_ev);
+	event_free(prx->inbox_ev);
+	evdns_base_free(prx->dns, 1);
+	evhttp_free(prx->http);
+	event_base_free(prx->base);
+	pthread_mutex_destroy(&prx->inbox_lock);
+}
+
+static void *worker_main(void *udata)
 {
-	struct proxy prx = { TREE_INITIALIZER(session_compare), NULL, NULL, NULL };
-	int ret;
+	struct proxy *prx = udata;
+
+	event_base_dispatch(prx->base);
+
+	return NULL;
+}
 
-	setvbuf(stdout, NULL, _IONBF, 0);
-	setvbuf(stderr, NULL, _IONBF, 0);
+int main(int argc, char **argv)
+{
+	struct evbuffer *handover_state = NULL;
+	int *handover_fds = NULL;
+	unsigned num_handover_fds = 0;
+	unsigned i;
 
 	if(signal(SIGPIPE, SIG_IGN) == SIG_ERR)
 	{
@@ -911,32 +5416,140 @@ int main(int argc, char **argv)
 
 	handle_argv(argc, argv);
 
-	prx.base = event_base_new();
-	prx.http = evhttp_new(prx.base);
-	prx.dns = evdns_base_new(prx.base, 1);
-	ret = evhttp_bind_socket(prx.http, "0.0.0.0", port);
-	if(ret < 0)
+	mem_init();
+	init_pad_packets();
+	dnscache_init(dns_refresh);
+
+	/* Even a single worker shares file segments of static files with the
+	 * thread reloading them. */
+	if(evthread_use_pthreads() < 0)
 	{
-		fprintf(stderr, "Binding to port %"PRIu16" failed\n", port);
+		fprintf(stderr, "Failed to enable libevent thread support\n");
 		return EXIT_FAILURE;
 	}
 	
-	evhttp_set_allowed_methods(prx.http, EVHTTP_REQ_GET | EVHTTP_REQ_POST | EVHTTP_REQ_OPTIONS);
-	evhttp_set_gencb(prx.http, handle_gen, &prx);
-	evhttp_set_cb(prx.http, "/session", handle_session, &prx);
-	evhttp_set_cb(prx.http, "/shutdown", handle_shutdown, &prx);
+	if(asset_init(".") < 0)
+	{
+		perror("Opening the static files failed");
+		return EXIT_FAILURE;
+	}
+
+	workers = calloc(num_workers, sizeof(struct proxy));
+	if(workers == NULL)
+	{
+		perror("Worker allocation failed");
+		return EXIT_FAILURE;
+	}
 
-	fprintf(stderr, "Starting dispatch, listing on port %"PRIu16"\n", port);
-	event_base_dispatch(prx.base);
+	if(restart_path)
+	{
+		if((handover_state = evbuffer_new()) == NULL ||
+			receive_handover(&handover_fds, &num_handover_fds, handover_state) < 0)
+			return EXIT_FAILURE;
+	}
+
+	for(i = 0; i < num_workers; i++)
+	{
+		if(proxy_init(&workers[i], i) < 0)
+			return EXIT_FAILURE;
+	}
 
-	while(prx.sessions.th_root != NULL)
-		session_free(prx.sessions.th_root, NULL);
+	/* Listening sockets of workers the predecessor had in excess. */
+	for(i = num_workers; i < num_inherited; i++)
+		close(inherited_fds[i]);
 
-	fprintf(stderr, "Shutdown complete, freeing event base\n");
-	
-	evdns_base_free(prx.dns, 1);
-	evhttp_free(prx.http);
-	event_base_free(prx.base);
+	log_init();
+
+	if(workers[0].ring)
+		log_info("Upstream sockets use io_uring");
+	else if(engine == ENGINE_URING)
+		log_warn("io_uring is not available, upstream sockets use libevent: %s", strerror(uring_error));
+
+	if(asset_watch() < 0)
+		log_warn("Watching static files failed, changes need a restart: %s", strerror(errno));
+
+	if(handover_fds)
+	{
+		if(restore_sessions(handover_state, handover_fds, num_handover_fds) < 0)
+		{
+			fprintf(stderr, "Predecessor handed over corrupt state\n");
+			return EXIT_FAILURE;
+		}
+
+		free(handover_fds);
+	}
+
+	if(handover_state)
+		evbuffer_free(handover_state);
+
+	if(restart_path)
+	{
+		if((restart_sock = restart_listen(restart_path)) < 0)
+		{
+			fprintf(stderr, "Listening on %s failed: %s\n", restart_path, strerror(errno));
+			return EXIT_FAILURE;
+		}
+
+		restart_ev = event_new(workers[0].base, restart_sock, EV_READ | EV_PERSIST, handle_restart, NULL);
+		event_add(restart_ev, NULL);
+	}
+
+	log_info("Starting dispatch with %u worker(s), listing on port %"PRIu16, num_workers, port);
+
+	for(i = 1; i < num_workers; i++)
+	{
+		if(pthread_create(&workers[i].thread, NULL, worker_main, &workers[i]) != 0)
+		{
+			perror("pthread_create() failed");
+			return EXIT_FAILURE;
+		}
+	}
+
+	worker_main(&workers[0]);
+
+	for(i = 1; i < num_workers; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	if(restart_ev)
+	{
+		event_free(restart_ev);
+		close(restart_sock);
+	}
+
+	if(successor >= 0)
+	{
+		handover(successor);
+		close(successor);
+	}
+
+	for(i = 0; i < num_workers; i++)
+	{
+		struct session *sess;
+		size_t pos = 0;
+
+		while((sess = htable_next(&workers[i].sessions, &pos)) != NULL)
+			session_free(sess, NULL);
+
+		htable_destroy(&workers[i].sessions);
+	}
+
+	for(i = 0; i < num_workers; i++)
+	{
+		log_info("Worker %u relayed %"PRIu64" reads with %"PRIu64" heap allocations",
+			i, workers[i].stats.relay_reads, workers[i].stats.relay_heap_allocs);
+	}
+
+	log_info("Shutdown complete, freeing event base");
+
+	asset_shutdown();
+
+	for(i = 0; i < num_workers; i++)
+		proxy_cleanup(&workers[i]);
+
+	dnscache_shutdown();
+	free(workers);
+
+	log_shutdown();
 	
 	return EXIT_SUCCESS;
 }
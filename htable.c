@@ -0,0 +1,202 @@
+/* htable.c -- open addressing hash table with incremental resizing */
+
+#include <stdlib.h>
+
+#include "htable.h"
+
+/**
+ * Reserved hash values marking free and removed slots, real hashes are
+ * shifted out of their way.
+ */
+#define HASH_EMPTY 0
+#define HASH_DELETED 1
+
+#define HTABLE_MIN_SIZE 8
+
+/**
+ * Number of old slots migrated per insert.  A grown table takes at least
+ * twice as many inserts as it holds entries before growing again, which
+ * normally leaves enough time to drain the old array; grow() finishes any
+ * leftover in one go.
+ */
+#define HTABLE_MIGRATE_STEP 4
+
+static uint64_t fix_hash(uint64_t hash)
+{
+	return hash < 2 ? hash + 2 : hash;
+}
+
+static struct htable_slot *probe(struct htable_slot *slots, size_t mask, uint64_t hash, htable_match match, const void *key)
+{
+	size_t i = hash & mask;
+
+	for(;;)
+	{
+		struct htable_slot *slot = &slots[i];
+
+		if(slot->hash == HASH_EMPTY)
+			return NULL;
+
+		if(slot->hash == hash && match(slot->value, key))
+			return slot;
+
+		i = (i + 1) & mask;
+	}
+}
+
+static void place(struct htable *t, uint64_t hash, void *value)
+{
+	size_t i = hash & t->mask;
+
+	while(t->slots[i].hash != HASH_EMPTY && t->slots[i].hash != HASH_DELETED)
+		i = (i + 1) & t->mask;
+
+	if(t->slots[i].hash == HASH_EMPTY)
+		t->used++;
+
+	t->slots[i].hash = hash;
+	t->slots[i].value = value;
+}
+
+static void migrate(struct htable *t, size_t n)
+{
+	while(t->old && n-- > 0)
+	{
+		struct htable_slot *slot = &t->old[t->old_pos];
+
+		if(slot->hash != HASH_EMPTY && slot->hash != HASH_DELETED)
+		{
+			place(t, slot->hash, slot->value);
+			slot->hash = HASH_DELETED;
+		}
+
+		if(t->old_pos++ == t->old_mask)
+		{
+			free(t->old);
+			t->old = NULL;
+		}
+	}
+}
+
+static int grow(struct htable *t)
+{
+	struct htable_slot *slots;
+	size_t size = HTABLE_MIN_SIZE;
+
+	if(t->old)
+		migrate(t, t->old_mask + 1 - t->old_pos);
+
+	while(size < 4 * (t->count + 1))
+		size <<= 1;
+
+	slots = calloc(size, sizeof(struct htable_slot));
+	if(slots == NULL)
+		return -1;
+
+	t->old = t->slots;
+	t->old_mask = t->mask;
+	t->old_pos = 0;
+
+	t->slots = slots;
+	t->mask = size - 1;
+	t->used = 0;
+
+	return 0;
+}
+
+void htable_init(struct htable *t)
+{
+	t->slots = NULL;
+	t->mask = 0;
+	t->used = 0;
+	t->count = 0;
+
+	t->old = NULL;
+	t->old_mask = 0;
+	t->old_pos = 0;
+}
+
+void htable_destroy(struct htable *t)
+{
+	free(t->slots);
+	free(t->old);
+	htable_init(t);
+}
+
+void *htable_find(struct htable *t, uint64_t hash, htable_match match, const void *key)
+{
+	struct htable_slot *slot = NULL;
+
+	hash = fix_hash(hash);
+
+	if(t->slots)
+		slot = probe(t->slots, t->mask, hash, match, key);
+
+	if(slot == NULL && t->old)
+		slot = probe(t->old, t->old_mask, hash, match, key);
+
+	return slot ? slot->value : NULL;
+}
+
+int htable_insert(struct htable *t, uint64_t hash, void *value)
+{
+	hash = fix_hash(hash);
+
+	migrate(t, HTABLE_MIGRATE_STEP);
+
+	/* Keep at least a quarter of the slots empty, tombstones included. */
+	if(t->slots == NULL || 4 * (t->used + 1) > 3 * (t->mask + 1))
+	{
+		if(grow(t) < 0)
+			return -1;
+	}
+
+	place(t, hash, value);
+	t->count++;
+
+	return 0;
+}
+
+void *htable_remove(struct htable *t, uint64_t hash, htable_match match, const void *key)
+{
+	struct htable_slot *slot = NULL;
+
+	hash = fix_hash(hash);
+
+	if(t->slots)
+		slot = probe(t->slots, t->mask, hash, match, key);
+
+	if(slot == NULL && t->old)
+		slot = probe(t->old, t->old_mask, hash, match, key);
+
+	if(slot == NULL)
+		return NULL;
+
+	slot->hash = HASH_DELETED;
+	t->count--;
+
+	return slot->value;
+}
+
+void *htable_next(struct htable *t, size_t *pos)
+{
+	size_t old_size = t->old ? t->old_mask + 1 : 0;
+	size_t size = t->slots ? t->mask + 1 : 0;
+
+	while(*pos < old_size + size)
+	{
+		struct htable_slot *slot;
+
+		if(*pos < old_size)
+			slot = &t->old[*pos];
+		else
+			slot = &t->slots[*pos - old_size];
+
+		(*pos)++;
+
+		if(slot->hash != HASH_EMPTY && slot->hash != HASH_DELETED)
+			return slot->value;
+	}
+
+	return NULL;
+}
@@ -0,0 +1,58 @@
+/* htable.h -- open addressing hash table with incremental resizing */
+
+#ifndef HADES_HTABLE_H
+#define HADES_HTABLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct htable_slot {
+	uint64_t hash;
+	void *value;
+};
+
+/**
+ * Linear probing table of (hash, value) pairs kept in one flat array, the
+ * hash is stored next to the value so probing never touches the entries.
+ * When the table grows, the previous array is migrated a few slots at a
+ * time on every insert; lookups and removals consult both meanwhile.
+ *
+ * Removing entries never moves others, so the current entry may be
+ * removed while iterating with htable_next().  Inserting may not.
+ */
+struct htable {
+	struct htable_slot *slots;
+	size_t mask;
+	size_t used;
+	size_t count;
+
+	struct htable_slot *old;
+	size_t old_mask;
+	size_t old_pos;
+};
+
+/**
+ * Returns true if value is the entry identified by key.
+ */
+typedef bool (*htable_match)(const void *value, const void *key);
+
+void htable_init(struct htable *t);
+void htable_destroy(struct htable *t);
+
+void *htable_find(struct htable *t, uint64_t hash, htable_match match, const void *key);
+int htable_insert(struct htable *t, uint64_t hash, void *value);
+void *htable_remove(struct htable *t, uint64_t hash, htable_match match, const void *key);
+
+/**
+ * Iterates over all values, *pos must be 0 initially.  Returns NULL once
+ * all values have been visited.
+ */
+void *htable_next(struct htable *t, size_t *pos);
+
+static inline size_t htable_count(const struct htable *t)
+{
+	return t->count;
+}
+
+#endif
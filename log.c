@@ -0,0 +1,230 @@
+/* log.c -- leveled logging written out by a background thread
+ *
+ * Every thread formats its messages into a ring of its own, a single
+ * producer single consumer queue that only needs ordered loads and stores
+ * of its two indices.  The writer thread wakes up periodically, copies the
+ * rings to stdout (info and debug) or stderr (warnings and errors) and
+ * flushes, so logging costs the relaying threads no system calls.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+
+/**
+ * Records per thread, a power of two, and the longest message kept.
+ */
+#define LOG_RING_SIZE 1024
+#define LOG_MESSAGE_MAX 240
+
+/**
+ * Interval at which the writer drains the rings.
+ */
+#define LOG_FLUSH_INTERVAL_MS 20
+
+struct log_record {
+	int level;
+	unsigned len;
+	char msg[LOG_MESSAGE_MAX];
+};
+
+/**
+ * head is only written by the owning thread, tail only by whoever holds
+ * log_lock.  dropped is updated by both.
+ */
+struct log_ring {
+	struct log_ring *next;
+	unsigned head;
+	unsigned tail;
+	unsigned dropped;
+	struct log_record records[LOG_RING_SIZE];
+};
+
+int log_max_level = LOG_LEVEL_INFO;
+
+static __thread struct log_ring *thread_ring;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static struct log_ring *rings;
+static pthread_t writer;
+static bool writer_running;
+
+static struct log_ring *ring_get(void)
+{
+	struct log_ring *ring = thread_ring;
+
+	if(ring)
+		return ring;
+
+	ring = calloc(1, sizeof(struct log_ring));
+	if(ring == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&log_lock);
+	ring->next = rings;
+	rings = ring;
+	pthread_mutex_unlock(&log_lock);
+
+	thread_ring = ring;
+	return ring;
+}
+
+/**
+ * Writes out all rings, log_lock must be held.
+ */
+static void drain(void)
+{
+	struct log_ring *ring;
+
+	for(ring = rings; ring; ring = ring->next)
+	{
+		unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		unsigned tail = ring->tail;
+		unsigned dropped;
+
+		while(tail != head)
+		{
+			struct log_record *rec = &ring->records[tail & (LOG_RING_SIZE - 1)];
+			FILE *out = rec->level <= LOG_LEVEL_WARN ? stderr : stdout;
+
+			fwrite(rec->msg, 1, rec->len, out);
+			fputc('\n', out);
+			tail++;
+		}
+
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+		dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+		if(dropped > 0)
+			fprintf(stderr, "%u log messages dropped\n", dropped);
+	}
+
+	fflush(stdout);
+	fflush(stderr);
+}
+
+static void *writer_main(void *arg)
+{
+	pthread_mutex_lock(&log_lock);
+
+	while(writer_running)
+	{
+		struct timespec deadline;
+
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += LOG_FLUSH_INTERVAL_MS * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&log_cond, &log_lock, &deadline);
+		drain();
+	}
+
+	pthread_mutex_unlock(&log_lock);
+	return NULL;
+}
+
+int log_init(void)
+{
+	int err;
+
+	writer_running = true;
+
+	if((err = pthread_create(&writer, NULL, writer_main, NULL)) != 0)
+	{
+		writer_running = false;
+		fprintf(stderr, "Failed to start log writer: %s\n", strerror(err));
+		return -1;
+	}
+
+	return 0;
+}
+
+void log_write(int level, const char *fmt, ...)
+{
+	struct log_ring *ring = ring_get();
+	struct log_record *rec;
+	unsigned head;
+	va_list ap;
+	int n;
+
+	if(ring == NULL)
+		return;
+
+	head = ring->head;
+	if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+	{
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &ring->records[head & (LOG_RING_SIZE - 1)];
+
+	va_start(ap, fmt);
+	n = vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+	va_end(ap);
+
+	rec->level = level;
+	rec->len = n < 0 ? 0 : (unsigned)n < sizeof(rec->msg) ? (unsigned)n : sizeof(rec->msg) - 1;
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void log_flush(void)
+{
+	pthread_mutex_lock(&log_lock);
+	drain();
+	pthread_mutex_unlock(&log_lock);
+}
+
+void log_shutdown(void)
+{
+	struct log_ring *ring;
+
+	pthread_mutex_lock(&log_lock);
+	if(writer_running)
+	{
+		writer_running = false;
+		pthread_cond_signal(&log_cond);
+		pthread_mutex_unlock(&log_lock);
+
+		pthread_join(writer, NULL);
+
+		pthread_mutex_lock(&log_lock);
+	}
+
+	drain();
+
+	while((ring = rings) != NULL)
+	{
+		rings = ring->next;
+		free(ring);
+	}
+
+	thread_ring = NULL;
+	pthread_mutex_unlock(&log_lock);
+}
+
+int log_parse_level(const char *str)
+{
+	static const char *const names[] = { "error", "warn", "info", "debug" };
+	int level;
+
+	for(level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_DEBUG; level++)
+	{
+		if(!strcmp(str, names[level]))
+			return level;
+	}
+
+	return -1;
+}
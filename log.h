@@ -0,0 +1,69 @@
+/* log.h -- leveled logging written out by a background thread */
+
+#ifndef HADES_LOG_H
+#define HADES_LOG_H
+
+#define LOG_LEVEL_ERROR 0
+#define LOG_LEVEL_WARN 1
+#define LOG_LEVEL_INFO 2
+#define LOG_LEVEL_DEBUG 3
+
+/**
+ * Messages above this level are compiled out, the Makefile sets it from
+ * LOG_COMPILE_LEVEL.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+/**
+ * Messages above this level are skipped at runtime.
+ */
+extern int log_max_level;
+
+#define LOG_AT(level, ...) \
+	do { \
+		if((level) <= LOG_COMPILE_LEVEL && (level) <= log_max_level) \
+			log_write((level), __VA_ARGS__); \
+	} while(0)
+
+#define log_error(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/**
+ * Starts the writer thread.  Returns -1 on failure, messages are still
+ * queued then and written by log_flush() and log_shutdown().
+ */
+int log_init(void);
+
+/**
+ * Formats a message into the calling thread's ring without blocking or
+ * making system calls, a newline is appended when it is written.  The
+ * message is dropped and counted if the ring is full.
+ */
+void log_write(int level, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+
+/**
+ * Writes out everything queued so far from the calling thread, for use
+ * before abort().
+ */
+void log_flush(void);
+
+/**
+ * Stops the writer thread after writing out everything queued.
+ */
+void log_shutdown(void);
+
+/**
+ * Parses "error", "warn", "info" or "debug".  Returns -1 if str is none of
+ * them.
+ */
+int log_parse_level(const char *str);
+
+#endif
@@ -0,0 +1,136 @@
+/* mem.c -- allocation hooks installed into libevent
+ *
+ * evbuffer chains, bufferevent and request structures are allocated and
+ * released at a high rate while data is relayed.  Blocks are rounded up to
+ * power of two size classes and freed blocks are kept on small per-thread
+ * free lists, so a steady stream of packets is served without touching the
+ * heap.  Every block carries a header recording its class and capacity.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <event2/event.h>
+
+#include "mem.h"
+
+#define MEM_MIN_SHIFT 5
+#define MEM_MAX_SHIFT 15
+#define MEM_CLASSES (MEM_MAX_SHIFT - MEM_MIN_SHIFT + 1)
+
+/**
+ * Maximum number of free blocks kept per class and thread.
+ */
+#define MEM_CACHE_DEPTH 256
+
+/**
+ * Header in front of every block, padded to keep the payload aligned.
+ */
+#define MEM_HEADER 16
+
+struct mem_header {
+	size_t cls;
+	size_t capacity;
+};
+
+struct mem_cache {
+	void *free[MEM_CLASSES];
+	unsigned depth[MEM_CLASSES];
+	uint64_t heap_allocs;
+};
+
+static __thread struct mem_cache cache;
+
+static size_t size_class(size_t sz)
+{
+	size_t cls = 0;
+
+	while(cls < MEM_CLASSES && ((size_t)1 << (cls + MEM_MIN_SHIFT)) < sz)
+		cls++;
+
+	return cls;
+}
+
+void *mem_malloc(size_t sz)
+{
+	size_t cls = size_class(sz);
+	struct mem_header *hdr;
+	char *base;
+
+	if(cls < MEM_CLASSES && cache.free[cls] != NULL)
+	{
+		base = cache.free[cls];
+		cache.free[cls] = *(void **)(base + MEM_HEADER);
+		cache.depth[cls]--;
+		return base + MEM_HEADER;
+	}
+
+	if(cls < MEM_CLASSES)
+		sz = (size_t)1 << (cls + MEM_MIN_SHIFT);
+
+	base = malloc(MEM_HEADER + sz);
+	if(base == NULL)
+		return NULL;
+
+	cache.heap_allocs++;
+
+	hdr = (struct mem_header *)base;
+	hdr->cls = cls;
+	hdr->capacity = sz;
+
+	return base + MEM_HEADER;
+}
+
+void mem_free(void *ptr)
+{
+	char *base;
+	size_t cls;
+
+	if(ptr == NULL)
+		return;
+
+	base = (char *)ptr - MEM_HEADER;
+	cls = ((struct mem_header *)base)->cls;
+
+	if(cls < MEM_CLASSES && cache.depth[cls] < MEM_CACHE_DEPTH)
+	{
+		*(void **)ptr = cache.free[cls];
+		cache.free[cls] = base;
+		cache.depth[cls]++;
+		return;
+	}
+
+	free(base);
+}
+
+void *mem_realloc(void *ptr, size_t sz)
+{
+	size_t capacity;
+	void *grown;
+
+	if(ptr == NULL)
+		return mem_malloc(sz);
+
+	capacity = ((struct mem_header *)((char *)ptr - MEM_HEADER))->capacity;
+	if(sz <= capacity)
+		return ptr;
+
+	grown = mem_malloc(sz);
+	if(grown == NULL)
+		return NULL;
+
+	memcpy(grown, ptr, capacity);
+	mem_free(ptr);
+
+	return grown;
+}
+
+uint64_t mem_heap_allocs(void)
+{
+	return cache.heap_allocs;
+}
+
+void mem_init(void)
+{
+	event_set_mem_functions(mem_malloc, mem_realloc, mem_free);
+}
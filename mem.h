@@ -0,0 +1,26 @@
+/* mem.h -- allocation hooks installed into libevent */
+
+#ifndef HADES_MEM_H
+#define HADES_MEM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Routes all libevent allocations through mem_malloc() and friends.  Must
+ * be called before any other libevent function.  Anything libevent hands
+ * out for the caller to free() must then be released with mem_free().
+ */
+void mem_init(void);
+
+void *mem_malloc(size_t sz);
+void *mem_realloc(void *ptr, size_t sz);
+void mem_free(void *ptr);
+
+/**
+ * Number of allocations the calling thread could not serve from its block
+ * cache and had to take from the heap.
+ */
+uint64_t mem_heap_allocs(void);
+
+#endif
@@ -0,0 +1,152 @@
+/* pool.c -- fixed size object pools and recycled evbuffers
+ *
+ * Sessions and connections come and go by the thousand per minute.
+ * Taking them from slabs instead of calloc() keeps them packed together
+ * and the heap from fragmenting, and emptied evbuffers are kept around
+ * instead of being freed and allocated again for the next request.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "stats.h"
+
+/**
+ * Objects are aligned to POOL_ALIGN and the slab header is padded to it.
+ */
+#define POOL_ALIGN 16
+
+struct pool_slab {
+	struct pool_slab *next;
+};
+
+#define SLAB_HEADER ((sizeof(struct pool_slab) + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1))
+
+void pool_init(struct pool *p, size_t size, unsigned per_slab)
+{
+	memset(p, 0, sizeof(*p));
+
+	if(size < sizeof(void *))
+		size = sizeof(void *);
+
+	p->size = (size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+	p->per_slab = per_slab;
+}
+
+void pool_destroy(struct pool *p)
+{
+	struct pool_slab *slab;
+
+	while((slab = p->slabs) != NULL)
+	{
+		p->slabs = slab->next;
+		free(slab);
+	}
+
+	p->free = NULL;
+}
+
+static int pool_grow(struct pool *p)
+{
+	struct pool_slab *slab;
+	char *obj;
+	unsigned i;
+
+	slab = malloc(SLAB_HEADER + p->size * p->per_slab);
+	if(slab == NULL)
+		return -1;
+
+	slab->next = p->slabs;
+	p->slabs = slab;
+
+	/* Thread the new objects onto the free list, first one on top. */
+	obj = (char *)slab + SLAB_HEADER + p->size * p->per_slab;
+	for(i = 0; i < p->per_slab; i++)
+	{
+		obj -= p->size;
+		*(void **)obj = p->free;
+		p->free = obj;
+	}
+
+	stat_add(&p->capacity, p->per_slab);
+
+	return 0;
+}
+
+void *pool_get(struct pool *p)
+{
+	void *obj;
+
+	if(p->free == NULL && pool_grow(p) < 0)
+		return NULL;
+
+	obj = p->free;
+	p->free = *(void **)obj;
+
+	memset(obj, 0, p->size);
+	stat_add(&p->gets, 1);
+
+	return obj;
+}
+
+void pool_put(struct pool *p, void *obj)
+{
+	if(obj == NULL)
+		return;
+
+	*(void **)obj = p->free;
+	p->free = obj;
+
+	stat_add(&p->puts, 1);
+}
+
+int evbuffer_pool_init(struct evbuffer_pool *p, unsigned max)
+{
+	memset(p, 0, sizeof(*p));
+
+	p->free = calloc(max, sizeof(struct evbuffer *));
+	if(p->free == NULL)
+		return -1;
+
+	p->max = max;
+
+	return 0;
+}
+
+void evbuffer_pool_destroy(struct evbuffer_pool *p)
+{
+	while(p->depth > 0)
+		evbuffer_free(p->free[--p->depth]);
+
+	free(p->free);
+	p->free = NULL;
+	p->max = 0;
+}
+
+struct evbuffer *evbuffer_pool_get(struct evbuffer_pool *p)
+{
+	if(p->depth > 0)
+	{
+		stat_add(&p->hits, 1);
+		return p->free[--p->depth];
+	}
+
+	stat_add(&p->misses, 1);
+	return evbuffer_new();
+}
+
+void evbuffer_pool_put(struct evbuffer_pool *p, struct evbuffer *evb)
+{
+	if(evb == NULL)
+		return;
+
+	if(p->depth == p->max)
+	{
+		evbuffer_free(evb);
+		return;
+	}
+
+	evbuffer_drain(evb, evbuffer_get_length(evb));
+	p->free[p->depth++] = evb;
+}
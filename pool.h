@@ -0,0 +1,64 @@
+/* pool.h -- fixed size object pools and recycled evbuffers */
+
+#ifndef HADES_POOL_H
+#define HADES_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <event2/buffer.h>
+
+struct pool_slab;
+
+/**
+ * Hands out objects of one size, carved from slabs of per_slab objects
+ * each.  Freed objects go on a free list and are reused before another
+ * slab is allocated; slabs are only released by pool_destroy().  A pool
+ * belongs to one thread, its counters may be read from any other.
+ */
+struct pool {
+	size_t size;
+	unsigned per_slab;
+	void *free;
+	struct pool_slab *slabs;
+
+	/**
+	 * Objects handed out and returned, and objects carved so far.
+	 */
+	uint64_t gets;
+	uint64_t puts;
+	uint64_t capacity;
+};
+
+void pool_init(struct pool *p, size_t size, unsigned per_slab);
+void pool_destroy(struct pool *p);
+
+/**
+ * Returns a zeroed object or NULL if a new slab could not be allocated.
+ */
+void *pool_get(struct pool *p);
+void pool_put(struct pool *p, void *obj);
+
+/**
+ * Keeps up to max emptied evbuffers for reuse.  Only buffers without
+ * callbacks may be put back.
+ */
+struct evbuffer_pool {
+	struct evbuffer **free;
+	unsigned depth;
+	unsigned max;
+
+	/**
+	 * Buffers served from the pool and newly allocated.
+	 */
+	uint64_t hits;
+	uint64_t misses;
+};
+
+int evbuffer_pool_init(struct evbuffer_pool *p, unsigned max);
+void evbuffer_pool_destroy(struct evbuffer_pool *p);
+
+struct evbuffer *evbuffer_pool_get(struct evbuffer_pool *p);
+void evbuffer_pool_put(struct evbuffer_pool *p, struct evbuffer *evb);
+
+#endif
@@ -0,0 +1,382 @@
+/* restart.c -- handing sockets and state over to a successor process
+ *
+ * A successor connects to the Unix socket the running process listens on.
+ * The running process stops serving and answers with a header, then the
+ * descriptors in batches of SCM_RIGHTS messages carrying one byte each,
+ * then the state describing them.  Descriptors in flight keep their
+ * sockets open, so the running process may close its own copies and exit
+ * as soon as everything is sent.  Listening sockets pass over with their
+ * accept queues and upstream connections without the peer noticing.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "restart.h"
+
+#define RESTART_MAGIC 0x48414445u
+
+/**
+ * Descriptors passed per message, well below the kernel's SCM_MAX_FD.
+ */
+#define RESTART_FDS_PER_MSG 64
+
+struct restart_header {
+	uint32_t magic;
+	uint32_t num_fds;
+	uint64_t length;
+};
+
+static int restart_address(const char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if(strlen(path) >= sizeof(addr->sun_path))
+	{
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int restart_listen(const char *path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if(restart_address(path, &addr) < 0)
+		return -1;
+
+	if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	unlink(path);
+
+	if(bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0)
+	{
+		int err = errno;
+
+		close(sock);
+		errno = err;
+		return -1;
+	}
+
+	return sock;
+}
+
+int restart_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	struct timeval tv = {RESTART_TIMEOUT, 0};
+	int sock;
+
+	if(restart_address(path, &addr) < 0)
+		return -1;
+
+	if((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	if(setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+		connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		int err = errno;
+
+		close(sock);
+		errno = err;
+		return -1;
+	}
+
+	return sock;
+}
+
+static int send_all(int sock, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while(len > 0)
+	{
+		if((n = send(sock, p, len, MSG_NOSIGNAL)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int recv_all(int sock, void *data, size_t len)
+{
+	char *p = data;
+	ssize_t n;
+
+	while(len > 0)
+	{
+		if((n = recv(sock, p, len, 0)) <= 0)
+		{
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int restart_send(int sock, const int *fds, unsigned num_fds, struct evbuffer *state)
+{
+	struct restart_header hdr;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(RESTART_FDS_PER_MSG * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte = 0;
+	unsigned batch;
+
+	hdr.magic = RESTART_MAGIC;
+	hdr.num_fds = num_fds;
+	hdr.length = evbuffer_get_length(state);
+
+	if(send_all(sock, &hdr, sizeof(hdr)) < 0)
+		return -1;
+
+	while(num_fds > 0)
+	{
+		batch = num_fds < RESTART_FDS_PER_MSG ? num_fds : RESTART_FDS_PER_MSG;
+
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(batch * sizeof(int));
+
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, batch * sizeof(int));
+
+		while(sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+		{
+			if(errno != EINTR)
+				return -1;
+		}
+
+		fds += batch;
+		num_fds -= batch;
+	}
+
+	while(evbuffer_get_length(state) > 0)
+	{
+		if(evbuffer_write(state, sock) < 0 && errno != EINTR)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Receives one batch of descriptors into fds, returns how many there were.
+ */
+static int recv_fds(int sock, int *fds, unsigned max)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(RESTART_FDS_PER_MSG * sizeof(int))];
+	} control;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte;
+	ssize_t n;
+	unsigned num = 0;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0)
+	{
+		if(errno != EINTR)
+			return -1;
+	}
+
+	if(n == 0)
+	{
+		errno = ECONNRESET;
+		return -1;
+	}
+
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		unsigned count;
+
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if(num + count > max)
+		{
+			/* Not ours to keep, but not to leak either. */
+			int *extra = (int *)CMSG_DATA(cmsg);
+
+			while(count-- > 0)
+				close(extra[count]);
+			continue;
+		}
+
+		memcpy(fds + num, CMSG_DATA(cmsg), count * sizeof(int));
+		num += count;
+	}
+
+	if(msg.msg_flags & MSG_CTRUNC)
+	{
+		while(num > 0)
+			close(fds[--num]);
+		errno = EPROTO;
+		return -1;
+	}
+
+	return num;
+}
+
+int restart_recv(int sock, int **fds, unsigned *num_fds, struct evbuffer *state)
+{
+	struct restart_header hdr;
+	unsigned num = 0;
+	int *received;
+	int n;
+
+	if(recv_all(sock, &hdr, sizeof(hdr)) < 0)
+		return -1;
+
+	if(hdr.magic != RESTART_MAGIC)
+	{
+		errno = EPROTO;
+		return -1;
+	}
+
+	received = calloc(hdr.num_fds ? hdr.num_fds : 1, sizeof(int));
+	if(received == NULL)
+		return -1;
+
+	while(num < hdr.num_fds)
+	{
+		if((n = recv_fds(sock, received + num, hdr.num_fds - num)) <= 0)
+		{
+			if(n == 0)
+				errno = EPROTO;
+			goto fail;
+		}
+
+		num += n;
+	}
+
+	while(evbuffer_get_length(state) < hdr.length)
+	{
+		n = evbuffer_read(state, sock, hdr.length - evbuffer_get_length(state));
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+		{
+			if(n == 0)
+				errno = ECONNRESET;
+			goto fail;
+		}
+	}
+
+	*fds = received;
+	*num_fds = num;
+	return 0;
+
+fail:
+	{
+		int err = errno;
+
+		while(num > 0)
+			close(received[--num]);
+		free(received);
+
+		errno = err;
+		return -1;
+	}
+}
+
+void restart_put_u32(struct evbuffer *state, uint32_t value)
+{
+	evbuffer_add(state, &value, sizeof(value));
+}
+
+void restart_put_u64(struct evbuffer *state, uint64_t value)
+{
+	evbuffer_add(state, &value, sizeof(value));
+}
+
+void restart_put_buffer(struct evbuffer *state, struct evbuffer *buf)
+{
+	struct evbuffer_ptr pos;
+	struct evbuffer_iovec vec;
+
+	restart_put_u64(state, evbuffer_get_length(buf));
+
+	/* Copied a chain at a time, buf may be the frozen output buffer of a
+	 * bufferevent. */
+	evbuffer_ptr_set(buf, &pos, 0, EVBUFFER_PTR_SET);
+
+	while(evbuffer_peek(buf, -1, &pos, &vec, 1) > 0 && vec.iov_len > 0)
+	{
+		evbuffer_add(state, vec.iov_base, vec.iov_len);
+		if(evbuffer_ptr_set(buf, &pos, vec.iov_len, EVBUFFER_PTR_ADD) < 0)
+			break;
+	}
+}
+
+bool restart_get_u32(struct evbuffer *state, uint32_t *value)
+{
+	return evbuffer_remove(state, value, sizeof(*value)) == sizeof(*value);
+}
+
+bool restart_get_u64(struct evbuffer *state, uint64_t *value)
+{
+	return evbuffer_remove(state, value, sizeof(*value)) == sizeof(*value);
+}
+
+bool restart_get_buffer(struct evbuffer *state, struct evbuffer *buf)
+{
+	uint64_t len;
+
+	if(!restart_get_u64(state, &len) || len > evbuffer_get_length(state))
+		return false;
+
+	return evbuffer_remove_buffer(state, buf, len) == (int)len;
+}
@@ -0,0 +1,66 @@
+/* restart.h -- handing sockets and state over to a successor process */
+
+#ifndef HADES_RESTART_H
+#define HADES_RESTART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/buffer.h>
+
+/**
+ * Seconds a successor waits for the running process to hand over.
+ */
+#define RESTART_TIMEOUT 30
+
+/**
+ * Listens on the Unix socket at path for a successor, replacing whatever
+ * socket file is there.  Returns the non-blocking listening socket, or -1
+ * with errno set.
+ */
+int restart_listen(const char *path);
+
+/**
+ * Connects to a running process listening at path.  Returns -1 with errno
+ * set to ENOENT or ECONNREFUSED if there is none.
+ */
+int restart_connect(const char *path);
+
+/**
+ * Sends num_fds descriptors and the state describing them over the
+ * connection of a successor, draining state.  The caller still owns the
+ * descriptors and closes them as usual.  Returns -1 with errno set on
+ * failure.
+ */
+int restart_send(int sock, const int *fds, unsigned num_fds, struct evbuffer *state);
+
+/**
+ * Receives what restart_send() sent into a malloc()ed array of descriptors,
+ * which are close-on-exec, and state.  Returns -1 with errno set on
+ * failure, EPROTO if the peer is not speaking this protocol.
+ */
+int restart_recv(int sock, int **fds, unsigned *num_fds, struct evbuffer *state);
+
+/**
+ * The state is a sequence of fields in host byte order, it only ever
+ * travels between processes on the same machine.  The getters return false
+ * if state ends before the field does.
+ */
+void restart_put_u32(struct evbuffer *state, uint32_t value);
+void restart_put_u64(struct evbuffer *state, uint64_t value);
+
+/**
+ * Appends the length of buf and a copy of its contents, buf is left as it
+ * is.
+ */
+void restart_put_buffer(struct evbuffer *state, struct evbuffer *buf);
+
+bool restart_get_u32(struct evbuffer *state, uint32_t *value);
+bool restart_get_u64(struct evbuffer *state, uint64_t *value);
+
+/**
+ * Moves a buffer appended by restart_put_buffer() to buf.
+ */
+bool restart_get_buffer(struct evbuffer *state, struct evbuffer *buf);
+
+#endif
@@ -0,0 +1,141 @@
+/* stats.c -- counters and histograms exported in Prometheus text format */
+
+#include <inttypes.h>
+
+#include "stats.h"
+
+/**
+ * Bucket i holds the values from bucket_bound(i - 1) + 1 through
+ * bucket_bound(i).  Indexing by value - 1 puts the powers of two at the
+ * top of their buckets.
+ */
+static unsigned bucket_index(uint64_t value)
+{
+	unsigned e;
+
+	if(value > 0)
+		value--;
+
+	if(value < HISTOGRAM_SUB)
+		return value;
+
+	e = 63 - __builtin_clzll(value);
+
+	return (e - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB +
+		((value >> (e - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+}
+
+static uint64_t bucket_bound(unsigned i)
+{
+	unsigned group;
+
+	i++;
+	if(i < HISTOGRAM_SUB)
+		return i;
+
+	if(i >= HISTOGRAM_BUCKETS)
+		return UINT64_MAX;
+
+	group = i / HISTOGRAM_SUB;
+	return (uint64_t)(HISTOGRAM_SUB + i % HISTOGRAM_SUB) << (group - 1);
+}
+
+void histogram_record(struct histogram *h, uint64_t value)
+{
+	stat_add(&h->counts[bucket_index(value)], 1);
+	stat_add(&h->sum, value);
+}
+
+void histogram_merge(struct histogram *dst, const struct histogram *src)
+{
+	unsigned i;
+
+	for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+		dst->counts[i] += stat_get(&src->counts[i]);
+
+	dst->sum += stat_get(&src->sum);
+}
+
+static uint64_t histogram_count(const struct histogram *h)
+{
+	uint64_t count = 0;
+	unsigned i;
+
+	for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+		count += h->counts[i];
+
+	return count;
+}
+
+uint64_t histogram_quantile(const struct histogram *h, double q)
+{
+	uint64_t count = histogram_count(h);
+	uint64_t rank, seen = 0;
+	unsigned i;
+
+	if(count == 0)
+		return 0;
+
+	rank = (uint64_t)(q * count);
+	if(rank >= count)
+		rank = count - 1;
+
+	for(i = 0; i < HISTOGRAM_BUCKETS; i++)
+	{
+		seen += h->counts[i];
+		if(seen > rank)
+			return bucket_bound(i);
+	}
+
+	return UINT64_MAX;
+}
+
+void stats_print_help(struct evbuffer *out, const char *name, const char *type, const char *help)
+{
+	evbuffer_add_printf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+void stats_print_value(struct evbuffer *out, const char *name, const char *labels, uint64_t value)
+{
+	if(labels)
+		evbuffer_add_printf(out, "%s{%s} %"PRIu64"\n", name, labels, value);
+	else
+		evbuffer_add_printf(out, "%s %"PRIu64"\n", name, value);
+}
+
+void stats_print_histogram(struct evbuffer *out, const char *name, const char *help,
+		const struct histogram *h, unsigned max_shift)
+{
+	static const char *const quantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+	static const double quantile_values[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t cumulative = 0;
+	unsigned shift = 0;
+	unsigned i;
+
+	stats_print_help(out, name, "histogram", help);
+
+	for(i = 0; i < HISTOGRAM_BUCKETS && shift <= max_shift; i++)
+	{
+		cumulative += h->counts[i];
+
+		if(bucket_bound(i) == (uint64_t)1 << shift)
+		{
+			evbuffer_add_printf(out, "%s_bucket{le=\"%"PRIu64"\"} %"PRIu64"\n",
+				name, (uint64_t)1 << shift, cumulative);
+			shift++;
+		}
+	}
+
+	cumulative = histogram_count(h);
+	evbuffer_add_printf(out, "%s_bucket{le=\"+Inf\"} %"PRIu64"\n", name, cumulative);
+	evbuffer_add_printf(out, "%s_sum %"PRIu64"\n", name, h->sum);
+	evbuffer_add_printf(out, "%s_count %"PRIu64"\n", name, cumulative);
+
+	evbuffer_add_printf(out, "# HELP %s_quantile %s, percentiles\n# TYPE %s_quantile gauge\n", name, help, name);
+
+	for(i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+	{
+		evbuffer_add_printf(out, "%s_quantile{quantile=\"%s\"} %"PRIu64"\n",
+			name, quantiles[i], histogram_quantile(h, quantile_values[i]));
+	}
+}
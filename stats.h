@@ -0,0 +1,68 @@
+/* stats.h -- counters and histograms exported in Prometheus text format */
+
+#ifndef HADES_STATS_H
+#define HADES_STATS_H
+
+#include <stdint.h>
+
+#include <event2/buffer.h>
+
+#define HISTOGRAM_SUB_BITS 3
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+/**
+ * Log-linear histogram in the manner of HdrHistogram: values are grouped
+ * by their highest set bit and every group is split into HISTOGRAM_SUB
+ * linear buckets, so any value is known to within 12.5%.  Recording is a
+ * shift and an increment.  Bucket bounds are inclusive and every power of
+ * two is one of them.
+ */
+struct histogram {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+	uint64_t sum;
+};
+
+/**
+ * Counters and histograms have a single writer, the worker owning them,
+ * and are read from other threads.  Relaxed atomics keep that well defined
+ * while compiling to plain loads and stores.
+ */
+static inline void stat_add(uint64_t *counter, uint64_t n)
+{
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_get(const uint64_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+void histogram_record(struct histogram *h, uint64_t value);
+
+/**
+ * Adds src, which may be written concurrently, to dst.
+ */
+void histogram_merge(struct histogram *dst, const struct histogram *src);
+
+/**
+ * Returns the upper bound of the bucket holding the q-quantile.
+ */
+uint64_t histogram_quantile(const struct histogram *h, double q);
+
+void stats_print_help(struct evbuffer *out, const char *name, const char *type, const char *help);
+
+/**
+ * Prints one sample, labels is the text between the braces or NULL.
+ */
+void stats_print_value(struct evbuffer *out, const char *name, const char *labels, uint64_t value);
+
+/**
+ * Prints h as a Prometheus histogram with buckets at the powers of two up
+ * to 2^max_shift, followed by a name_quantile gauge with the 50th, 90th,
+ * 99th and 99.9th percentile taken from the full resolution.
+ */
+void stats_print_histogram(struct evbuffer *out, const char *name, const char *help,
+		const struct histogram *h, unsigned max_shift);
+
+#endif
@@ -13,7 +13,7 @@ HADES._construct = function()
  * Connection
  */
 
-function /* class */ Connection(session, id, host, port) {
+function /* class */ Connection(session, id, host, port, proto) {
 
 	/**
 	 * Event handlers
@@ -26,7 +26,13 @@ function /* class */ Connection(session, id, host, port) {
 	this._id = id;
 	this._host = host;
 	this._port = port;
+	this._proto = proto || "tcp";
 	this.state = 0; /* STATE.DISCONNECTED */
+
+	/**
+	 * Sequence number of the next act=send.
+	 */
+	this._sendSeq = 0;
 }
 
 Connection.STATE = {
@@ -93,10 +99,33 @@ function /* class */ Session(host, port) {
 	this.error = 0; /* ERROR.NO_ERROR */
 	this.errorText = "";
 
+	/**
+	 * Set to have Connection.onrecv deliver Uint8Array views instead of
+	 * strings with one character per byte.
+	 */
+	this.binary = false;
+
 	/**
 	 * Current XHR request used for streaming in.
 	 */
 	this._recvReq = null;
+
+	/**
+	 * WebSocket carrying the recv stream and the uplink, preferred over
+	 * XHR where available.  _wsOpened tells whether it ever connected.
+	 */
+	this._ws = null;
+	this._wsOpened = false;
+	this._useWebSocket = false;
+
+	/**
+	 * Whether the recv stream is read with fetch() and a stream reader
+	 * instead of XHR, and the read in progress.  Such streams are asked to
+	 * be compressed where DecompressionStream is there to undo it.
+	 */
+	this._useFetch = false;
+	this._useDeflate = false;
+	this._fetchRecv = null;
 	this._relayHost = null;
 	this._relayPort = null;
 
@@ -110,6 +139,12 @@ function /* class */ Session(host, port) {
 	 */
 	this._actionQueue = [];
 
+	/**
+	 * Whether uplink packets are posted as act=batch bodies, which needs
+	 * XHR to send binary data.
+	 */
+	this._useBatch = false;
+
 	/**
 	 * Timeout used to check the XHR responseText for new packets.
 	 */
@@ -125,6 +160,13 @@ function /* class */ Session(host, port) {
 	 */
 	this._recvIdx = 0;
 
+	/**
+	 * Connection packets handled so far.  Every recv stream resumes after
+	 * the last of them, the server resending what it does not know to
+	 * have arrived.
+	 */
+	this._seq = 0;
+
 	/**
 	 * Whether or not to poll for every packet.
 	 */
@@ -132,9 +174,36 @@ function /* class */ Session(host, port) {
 
 	this._localPoll = false;
 
-	this._lastPacket = null;
+	/**
+	 * Packet framing requested for the recv stream.
+	 */
+	this._framing = 1; /* FRAMING.ASCII */
+
+	/**
+	 * Bytes of the recv stream we are willing to buffer before the server
+	 * has to wait for a window update, and the position last reported.
+	 */
+	this._window = 256 * 1024;
+	this._creditIdx = 0;
 
-	this._currentPost = null;
+	/**
+	 * Milliseconds the server may hold packets back to send them in
+	 * fewer, bigger chunks, up to 100.  0 sends them as they come.
+	 */
+	this._flushDelay = 0;
+
+	/**
+	 * Budgets of a recv stream in bytes and milliseconds, the server ends
+	 * it with RECONN once either is used up.  At three quarters of them a
+	 * replacement is opened, which takes over from the current stream
+	 * without a gap.
+	 */
+	this._recvMaxBytes = 4 * 1024 * 1024;
+	this._recvMaxAge = 60 * 1000;
+	this._nextRecvReq = null;
+	this._replaceTimeout = null;
+
+	this._lastPacket = null;
 
 	this._unloadListener = null;
 
@@ -227,9 +296,21 @@ Session.prototype = function() {
 		PAD: 4,
 		TAKEOVER: 5,
 		RECONN: 6,
-		DELETED: 7
+		DELETED: 7,
+		WINDOW: 8
+	};
+
+	var FRAMING = {
+		ASCII: 1,
+		VARINT: 2
 	};
 
+	/**
+	 * Number of queued POSTs looked at for sends to put in flight together,
+	 * no more than the server's reorder window.
+	 */
+	var PIPELINE_DEPTH = 8;
+
 	/**
 	 * Private methods.
 	 */
@@ -354,6 +435,206 @@ Session.prototype = function() {
 		}
 	}
 
+	/**
+	 * Parses a "MAGIC" prefixed header with hex fields.  Returns null if the
+	 * header is not complete yet.
+	 */
+	function parseAsciiHeader(text, idx)
+	{
+		var headerLength = 5 + 2 + 16 + 8;
+
+		if(text.length < idx + headerLength)
+		{
+			return null;
+		}
+
+		var header = text.substr(idx, headerLength);
+
+		debug("HEADER: " + header);
+
+		return {
+			type: parseInt("0x" + header.substr(5, 2), 16),
+			cid: parseInt("0x" + header.substr(5+2, 16), 16),
+			length: parseInt("0x" + header.substr(5+2+16, 8), 16),
+			headerLength: headerLength
+		};
+	}
+
+	/**
+	 * Parses a varint header from a stream decoded as x-user-defined, where
+	 * every byte maps to one character.  Returns null if incomplete.
+	 */
+	function parseVarintHeader(text, idx)
+	{
+		var fields = [];
+		var pos = idx;
+
+		while(fields.length < 3)
+		{
+			var value = 0;
+			var scale = 1;
+			var b;
+
+			do
+			{
+				if(pos >= text.length)
+				{
+					return null;
+				}
+
+				b = text.charCodeAt(pos) & 0xff;
+				pos += 1;
+				value += (b & 0x7f) * scale;
+				scale *= 128;
+			} while(b & 0x80);
+
+			fields.push(value);
+		}
+
+		return {
+			type: fields[0],
+			cid: fields[1],
+			length: fields[2],
+			headerLength: pos - idx
+		};
+	}
+
+	/**
+	 * Same as parseVarintHeader() for a Uint8Array.
+	 */
+	function parseVarintBytes(bytes, idx)
+	{
+		var fields = [];
+		var pos = idx;
+
+		while(fields.length < 3)
+		{
+			var value = 0;
+			var scale = 1;
+			var b;
+
+			do
+			{
+				if(pos >= bytes.length)
+				{
+					return null;
+				}
+
+				b = bytes[pos];
+				pos += 1;
+				value += (b & 0x7f) * scale;
+				scale *= 128;
+			} while(b & 0x80);
+
+			fields.push(value);
+		}
+
+		return {
+			type: fields[0],
+			cid: fields[1],
+			length: fields[2],
+			headerLength: pos - idx
+		};
+	}
+
+	function putVarint(out, value)
+	{
+		while(value >= 0x80)
+		{
+			out.push((value % 0x80) | 0x80);
+			value = Math.floor(value / 0x80);
+		}
+		out.push(value);
+	}
+
+	function putPacket(out, type, cid, payload)
+	{
+		var i;
+
+		payload = payload || "";
+
+		putVarint(out, type);
+		putVarint(out, cid);
+		putVarint(out, payload.length);
+
+		for(i = 0; i < payload.length; i++)
+		{
+			out.push(payload.charCodeAt(i) & 0xff);
+		}
+	}
+
+	/**
+	 * Encodes an uplink packet for the WebSocket, payload is a string with
+	 * one character per byte.
+	 */
+	function encodePacket(type, cid, payload)
+	{
+		var out = [];
+
+		putPacket(out, type, cid, payload);
+
+		return new Uint8Array(out);
+	}
+
+	/**
+	 * Encodes the body of an act=batch POST from a list of packets.
+	 */
+	function encodeBatch(packets)
+	{
+		var out = [];
+		var i;
+
+		for(i = 0; i < packets.length; i++)
+		{
+			putPacket(out, packets[i].type, packets[i].cid, packets[i].payload);
+		}
+
+		return new Uint8Array(out);
+	}
+
+	/**
+	 * Returns a string with one character per byte of a Uint8Array.
+	 */
+	function bytesToString(bytes)
+	{
+		var parts = [];
+		var i;
+
+		for(i = 0; i < bytes.length; i += 8192)
+		{
+			parts.push(String.fromCharCode.apply(null, bytes.subarray(i, i + 8192)));
+		}
+
+		return parts.join("");
+	}
+
+	/**
+	 * Returns a Uint8Array of a string with one character per byte.
+	 */
+	function stringToBytes(text)
+	{
+		var bytes = new Uint8Array(text.length);
+		var i;
+
+		for(i = 0; i < text.length; i++)
+		{
+			bytes[i] = text.charCodeAt(i) & 0xff;
+		}
+
+		return bytes;
+	}
+
+	/**
+	 * Returns the bytes of an x-user-defined decoded string as a string
+	 * with one character per byte.
+	 */
+	function byteString(text)
+	{
+		return text.replace(/[\uf780-\uf7ff]/g, function(c) {
+			return String.fromCharCode(c.charCodeAt(0) & 0xff);
+		});
+	}
+
 	function enumToStr(en, value)
 	{
 		for(var str in en)
@@ -449,19 +730,33 @@ Session.prototype = function() {
 				try { window.clearTimeout(this._checkTimeout); } catch(e) {}
 				this._checkTimeout = null;
 			}
+			if(this._replaceTimeout)
+			{
+				try { window.clearTimeout(this._replaceTimeout); } catch(e) {}
+				this._replaceTimeout = null;
+			}
 
 			debug("Clearing requests");
 
-			if(this._currentPost)
-			{
-				clearRequest(this._currentPost);
-				this._currentPost = null;
-			}
 			if(this._recvReq)
 			{
 				clearRequest(this._recvReq);
 				this._recvReq = null;
 			}
+			if(this._nextRecvReq)
+			{
+				clearRequest(this._nextRecvReq);
+				this._nextRecvReq = null;
+			}
+			this.abortFetchRecv();
+			if(this._ws)
+			{
+				this._ws.onopen = null;
+				this._ws.onmessage = null;
+				this._ws.onclose = null;
+				try { this._ws.close(); } catch(e) {}
+				this._ws = null;
+			}
 
 			while(this._actionQueue.length > 0)
 			{
@@ -471,7 +766,12 @@ Session.prototype = function() {
 			}
 		},
 				
-		connect: function(host, port)
+		/**
+		 * Opens a connection to host:port, a UDP one if proto is "udp".
+		 * Every send() on those is one datagram and every onrecv one
+		 * datagram received.
+		 */
+		connect: function(host, port, proto)
 		{
 			assert(this instanceof Session, "this instanceof Session");	
 
@@ -488,9 +788,9 @@ Session.prototype = function() {
 				cid = Math.floor(Math.random() * (1 << 30));
 			} while(cid in this._connections);
 
-			this.enqConnect(cid, host, port);
+			this.enqConnect(cid, host, port, proto);
 
-			var conn = new Connection(this, cid, host, port);
+			var conn = new Connection(this, cid, host, port, proto);
 			this._connections[cid] = conn;
 			return conn;
 		},
@@ -570,6 +870,41 @@ Session.prototype = function() {
 				}
 			}
 
+			if(typeof XDomainRequest == "undefined" &&
+				typeof XMLHttpRequest != "undefined" &&
+				XMLHttpRequest.prototype &&
+				XMLHttpRequest.prototype.overrideMimeType)
+			{
+				debug("overrideMimeType() supported - using varint framing");
+				this._framing = FRAMING.VARINT;
+
+				if(typeof Uint8Array != "undefined")
+				{
+					debug("Binary POST bodies supported - batching uplink packets");
+					this._useBatch = true;
+				}
+			}
+
+			if(typeof fetch != "undefined" && typeof ReadableStream != "undefined" &&
+				typeof Uint8Array != "undefined")
+			{
+				debug("fetch() streams supported - reading the recv stream as bytes");
+				this._useFetch = true;
+				this._framing = FRAMING.VARINT;
+
+				if(typeof DecompressionStream != "undefined")
+				{
+					debug("DecompressionStream supported - asking for a compressed recv stream");
+					this._useDeflate = true;
+				}
+			}
+
+			if(typeof WebSocket != "undefined" && typeof Uint8Array != "undefined")
+			{
+				debug("WebSocket supported - using it for recv and uplink");
+				this._useWebSocket = true;
+			}
+
 			if(this.state != Session.STATE.DISCONNECTED)
 			{
 				throw new Error("Session.init() called during state " + enumToStr(this.state));
@@ -643,53 +978,39 @@ Session.prototype = function() {
 				return;
 			}
 
+			if(this._recvMaxBytes && responseText.length >= this._recvMaxBytes * 3 / 4)
+			{
+				this.replaceRecv();
+			}
+
 			for(;;)
 			{
-				var headerLength = 5 + 2 + 16 + 8;
+				var header;
 
-				if(responseText.length < this._recvIdx + headerLength)
+				if(this._framing == FRAMING.VARINT)
 				{
-					return;
+					header = parseVarintHeader(responseText, this._recvIdx);
+				}
+				else
+				{
+					header = parseAsciiHeader(responseText, this._recvIdx);
 				}
 
-				debug(responseText);
-
-				var header = responseText.substr(this._recvIdx, headerLength);
-
-				debug("HEADER: " + header);
-
-				var magicString = header.substr(0,5);
-				debug("MAGIC: " + magicString);
-
-				var packetTypeStr = header.substr(5,2);
-				debug("PACKET: " + packetTypeStr);
-				var packetType = parseInt("0x" + packetTypeStr, 16);
-
-				var connectionIdStr = header.substr(5+2, 16);
-				debug("CID: " + connectionIdStr);
-				var connectionId = parseInt("0x" + connectionIdStr, 16);
+				if(!header)
+				{
+					this.updateWindow();
+					return;
+				}
 
-				var payloadLengthStr = header.substr(5+2+16, 8);
-				debug("PAYLOAD: " + payloadLengthStr);
-				var payloadLength = parseInt("0x" + payloadLengthStr, 16);
+				var headerLength = header.headerLength;
+				var packetType = header.type;
+				var connectionId = header.cid;
+				var payloadLength = header.length;
 
-				debug("header=" + header);
 				debug("packetType=" + enumToStr(PACKET, packetType));
 				debug("payloadLength=" + payloadLength);
 				debug("connectionId=" + connectionId);
 
-				var conn = null;
-				if(connectionId in this._connections)
-				{
-					debug("Found connection with id " + connectionId);
-					conn = this._connections[connectionId];
-					debug("Connection: " + conn.toString());
-				}
-				else
-				{
-					 debug("Connection not known");
-				}
-
 				if(isNaN(packetType) || 
 				   isNaN(payloadLength) || 
 				   isNaN(connectionId))
@@ -717,200 +1038,841 @@ Session.prototype = function() {
 				if(responseText.length < this._recvIdx + headerLength + payloadLength)
 				{
 					info("Waiting for more response");
+					this.updateWindow();
 					return;
 				}
 
-				debug("Received packet of type " + enumToStr(PACKET, packetType) + " with payload length " + payloadLength);
+				var payload = responseText.substr(this._recvIdx + headerLength, payloadLength);
 
-				if(packetType != PACKET.PAD)
-				{
-					this._lastPacket = packetType;
-				}
-				
-				
-				if(packetType != PACKET.DELETED && 
-				   packetType != PACKET.PAD &&
-				   !conn)
+				if(this._framing == FRAMING.VARINT)
 				{
-					if(connectionId === 0)
-					{
-						console.error("Received non-PAD packet for unknown connection " + connectionId);
-					}
-					else
-					{
-						console.error("Received non-PAD packet for unknown connection " + connectionId);
-					}
-					this._recvIdx += headerLength + payloadLength;
-					return;
+					payload = byteString(payload);
 				}
 
-				var payload = responseText.substr(this._recvIdx + headerLength, payloadLength);
+				var known = this.seenPacket(this._recvReq, packetType) ||
+					this.handlePacket(packetType, connectionId, payload);
 
-				if(packetType == PACKET.CONNFAIL)
-				{
-					conn.setState(Connection.STATE.DISCONNECTED);
-				}
-				else if(packetType == PACKET.CONNECTED)
-				{
-					conn.setState(Connection.STATE.CONNECTED);
-				}
-				else if(packetType == PACKET.DISCONNECTED)
-				{
-					conn.setState(Connection.STATE.DISCONNECTED);
-				}
-				else if(packetType == PACKET.DATA)
+				this._recvIdx += headerLength + payloadLength;
+
+				/* Nothing follows on this stream, the replacement carries on. */
+				if(this._nextRecvReq &&
+					(packetType == PACKET.TAKEOVER || packetType == PACKET.RECONN))
 				{
-					conn.onrecv(conn, payload);
+					this.promoteRecv();
+					return;
 				}
-				else if(packetType == PACKET.DELETED)
+
+				if(!known)
 				{
-					debug("Setting state to DISCONNECTED");
-					this.state = Session.STATE.DISCONNECTED;
-					// XXX: Disconnect connections first
-					this._sessionId = null;
-					this.onstatechange(this, this.state);
+					return;
 				}
-				this._recvIdx += headerLength + payloadLength;			
 			}
 
 		},
 
-		handleRecvStateChange: function()
+		/**
+		 * Counts a connection packet of stream, which resumed after packet
+		 * stream.seq.  Returns true if it has been handled already, having
+		 * also arrived on the stream it took over from.
+		 */
+		seenPacket: function(stream, packetType)
 		{
 			assert(this instanceof Session, "this instanceof Session");
 
-			assert(!isXDR(this._recvReq), "!isXDR(this._recvReq)");
-
-			debug("handleRecvStateChange() called, readyState=" + this._recvReq.readyState);
-
-			if(this._recvReq.readyState == XHR.INTERACTIVE)
+			if(packetType != PACKET.CONNFAIL &&
+			   packetType != PACKET.CONNECTED &&
+			   packetType != PACKET.DISCONNECTED &&
+			   packetType != PACKET.DATA)
 			{
-				if(this._longPoll)
-				{
-					return;
-				}
-
-				if(this._recvReq.status == 200)
-				{
-					this.checkProgress();
-				}
+				return false;
 			}
-			else if(this._recvReq.readyState == XHR.COMPLETED)
-			{
-				if(this._checkTimeout)
-				{
-					window.clearTimeout(this._checkTimeout);
-				}
-
-				if(this._recvReq.status == 200)
-				{
-					this.handleRecvLoad();
-				}
-				else
-				{
-					if(this._recvReq.status == 404 && this.state == Session.STATE.DISCONNECTING)
-					{
-						info("Failed to recv during shutdown -- that's fine");
-
-						this.state = Session.STATE.DISCONNECTED;
-						this._sessionId = null;
-						this.onstatechange(this, this.state);
-					}
-					else
-					{
-						var errorText = "Connection closed, HTTP response: " + this._recvReq.status;
-						var error = Session.ERROR.RECV_FAILED;
-						warn(errorText);
-						this.onerror(this, error, errorText);
 
-						if(this._recvReq.status == 404)
-						{
-							this._sessionId = null;
-						}
-						else if(this._sessionId && !this._recvTimeout)
-						{
-							debug("Reconnecting to stream");
-							//this._recvTimeout = window.setTimeout(bind(this, this.performRecv), 1000);
-						}																							
-					}
-				}
+			if(++stream.seq <= this._seq)
+			{
+				return true;
 			}
+
+			this._seq = stream.seq;
+			return false;
 		},
 
-		handleRecvLoad: function()
+		/**
+		 * Dispatches a packet of the recv stream.  Returns false if it is
+		 * for an unknown connection.
+		 */
+		handlePacket: function(packetType, connectionId, payload)
 		{
 			assert(this instanceof Session, "this instanceof Session");
 
-			this.checkProgress();
-
-			if(this._lastPacket != PACKET.RECONN &&
-				this._lastPacket != PACKET.DELETED &&
-				!this._longPoll)
+			var conn = null;
+			if(connectionId in this._connections)
 			{
-				this.error = Session.ERROR.RECV_FAILED;
-				this.errorText = "HTTP stream closed, last packet was " + enumToStr(PACKET, this._lastPacket);
-				warn(this.errorText);
-				this.onerror(this, error, this.errorText);
+				debug("Found connection with id " + connectionId);
+				conn = this._connections[connectionId];
+				debug("Connection: " + conn.toString());
 			}
+			else
+			{
+				 debug("Connection not known");
+			}
+
+			debug("Received packet of type " + enumToStr(PACKET, packetType) + " with payload length " + payload.length);
+
+			if(packetType != PACKET.PAD)
+			{
+				this._lastPacket = packetType;
+			}
+			
+			
+			if(packetType != PACKET.DELETED && 
+			   packetType != PACKET.PAD &&
+			   packetType != PACKET.TAKEOVER &&
+			   packetType != PACKET.RECONN &&
+			   !conn)
+			{
+				console.error("Received non-PAD packet for unknown connection " + connectionId);
+				return false;
+			}
+
+			if(packetType == PACKET.CONNFAIL)
+			{
+				conn.setState(Connection.STATE.DISCONNECTED);
+			}
+			else if(packetType == PACKET.CONNECTED)
+			{
+				conn.setState(Connection.STATE.CONNECTED);
+			}
+			else if(packetType == PACKET.DISCONNECTED)
+			{
+				conn.setState(Connection.STATE.DISCONNECTED);
+			}
+			else if(packetType == PACKET.DATA)
+			{
+				if(this.binary && typeof payload == "string")
+				{
+					payload = stringToBytes(payload);
+				}
+				else if(!this.binary && typeof payload != "string")
+				{
+					payload = bytesToString(payload);
+				}
+
+				conn.onrecv(conn, payload);
+			}
+			else if(packetType == PACKET.DELETED)
+			{
+				debug("Setting state to DISCONNECTED");
+				this.state = Session.STATE.DISCONNECTED;
+				// XXX: Disconnect connections first
+				this._sessionId = null;
+				this.onstatechange(this, this.state);
+			}
+
+			return true;
+		},
+
+		/**
+		 * Reports the consumed part of the recv stream once half of the
+		 * window has been used up.
+		 */
+		updateWindow: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			/* The server counts the window for the newest stream. */
+			if(!this._window || !this._sessionId || this._nextRecvReq)
+			{
+				return;
+			}
+
+			if(this._recvIdx - this._creditIdx < this._window / 2)
+			{
+				return;
+			}
+
+			this._creditIdx = this._recvIdx;
+			this.enqWindow(this._recvIdx);
+		},
+
+		handleRecvStateChange: function(req)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(req != this._recvReq)
+			{
+				this.handleNextRecvStateChange(req);
+				return;
+			}
+
+			assert(!isXDR(this._recvReq), "!isXDR(this._recvReq)");
+
+			debug("handleRecvStateChange() called, readyState=" + this._recvReq.readyState);
+
+			if(this._recvReq.readyState == XHR.INTERACTIVE)
+			{
+				if(this._longPoll)
+				{
+					return;
+				}
+
+				if(this._recvReq.status == 200)
+				{
+					this.checkProgress();
+				}
+			}
+			else if(this._recvReq.readyState == XHR.COMPLETED)
+			{
+				if(this._checkTimeout)
+				{
+					window.clearTimeout(this._checkTimeout);
+				}
+
+				if(this._recvReq.status == 200)
+				{
+					this.handleRecvLoad();
+				}
+				else
+				{
+					if(this._recvReq.status == 404 && this.state == Session.STATE.DISCONNECTING)
+					{
+						info("Failed to recv during shutdown -- that's fine");
+
+						this.state = Session.STATE.DISCONNECTED;
+						this._sessionId = null;
+						this.onstatechange(this, this.state);
+					}
+					else
+					{
+						this.handleRecvFailure(this._recvReq.status,
+							"Connection closed, HTTP response: " + this._recvReq.status);
+					}
+				}
+			}
+		},
+
+		handleRecvLoad: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var req = this._recvReq;
+
+			this.checkProgress();
+
+			/* The replacement took over while the rest was read. */
+			if(req != this._recvReq)
+			{
+				return;
+			}
+
+			if(this._lastPacket != PACKET.RECONN &&
+				this._lastPacket != PACKET.DELETED &&
+				!this._longPoll)
+			{
+				this.error = Session.ERROR.RECV_FAILED;
+				this.errorText = "HTTP stream closed, last packet was " + enumToStr(PACKET, this._lastPacket);
+				warn(this.errorText);
+				this.onerror(this, error, this.errorText);
+			}
+
+			if(this._nextRecvReq)
+			{
+				this.promoteRecv();
+				return;
+			}
+
+			if(this._sessionId && !this._recvTimeout)
+			{
+				info("Reconnecting to stream");
+				this._recvTimeout = window.setTimeout(bind(this, this.performRecv),
+					this._lastPacket == PACKET.RECONN ? 1 : 50);
+			}
+		},
+
+		/**
+		 * A recv stream failed.  Unless the session is gone, a new one
+		 * resumes after the last packet handled.
+		 */
+		handleRecvFailure: function(status, errorText)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			warn(errorText);
+
+			if(status == 404 || status == 410)
+			{
+				this.onerror(this, Session.ERROR.RECV_FAILED, errorText);
+				this._sessionId = null;
+			}
+			else if(this._sessionId && !this._recvTimeout)
+			{
+				info("Resuming stream after packet " + this._seq);
+				this._recvTimeout = window.setTimeout(bind(this, this.performRecv), 1000);
+			}
+		},
+
+		/**
+		 * Until it takes over, the replacement stream is only watched for
+		 * failure.  What it receives meanwhile is read once it is current.
+		 */
+		handleNextRecvStateChange: function(req)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(req != this._nextRecvReq)
+			{
+				return;
+			}
+
+			if(req.readyState == XHR.COMPLETED && req.status != 200)
+			{
+				warn("Replacement stream failed, HTTP response: " + req.status);
+				clearRequest(req);
+				this._nextRecvReq = null;
+			}
+		},
+
+		/**
+		 * Opens the stream that is to take over from the current one
+		 * before that has used up its budget.
+		 */
+		replaceRecv: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(this._replaceTimeout)
+			{
+				window.clearTimeout(this._replaceTimeout);
+				this._replaceTimeout = null;
+			}
+
+			if(this._nextRecvReq || this._longPoll || this._recvTimeout ||
+				!this._sessionId || !this._recvReq || isXDR(this._recvReq))
+			{
+				return;
+			}
+
+			debug("Opening replacement stream");
+			this._nextRecvReq = this.openRecv(this.recvUri());
+		},
+
+		/**
+		 * Makes the replacement the current stream once the old one has
+		 * delivered its last packet.
+		 */
+		promoteRecv: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var req = this._nextRecvReq;
+
+			clearRequest(this._recvReq);
+			this._recvReq = req;
+			this._nextRecvReq = null;
+
+			this._recvIdx = 0;
+			this._creditIdx = 0;
+			this.scheduleReplace();
+
+			if(req.readyState >= XHR.INTERACTIVE)
+			{
+				this.handleRecvStateChange(req);
+			}
+		},
+
+		scheduleReplace: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(this._replaceTimeout)
+			{
+				window.clearTimeout(this._replaceTimeout);
+				this._replaceTimeout = null;
+			}
+
+			if(this._recvMaxAge && !this._longPoll)
+			{
+				this._replaceTimeout = window.setTimeout(bind(this, this.replaceRecv),
+					this._recvMaxAge * 3 / 4);
+			}
+		},
+
+		recvUri: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var uri = this._sessionUri + "?act=recv&sid=" + this._sessionId;
+
+			if(this._longPoll)
+			{
+				uri += "&long_poll=1";
+			}
+
+			if(this._framing != FRAMING.ASCII)
+			{
+				uri += "&framing=" + this._framing;
+			}
+
+			if(this._window)
+			{
+				uri += "&window=" + this._window;
+			}
+
+			if(this._flushDelay)
+			{
+				uri += "&flush_delay=" + this._flushDelay;
+			}
+
+			uri += "&seq=" + this._seq;
+
+			/* A stream reader holds on to nothing, so fetch streams need
+			 * no budgets. */
+			if(this._useFetch)
+			{
+				uri += "&max_bytes=0&max_age=0";
+
+				if(this._useDeflate)
+				{
+					uri += "&compress=deflate";
+				}
+			}
+			else
+			{
+				uri += "&max_bytes=" + this._recvMaxBytes + "&max_age=" + this._recvMaxAge;
+			}
+
+			return uri;
+		},
+
+		/**
+		 * Starts a streaming recv XHR.
+		 */
+		openRecv: function(uri)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var req = this.makeXHR("GET", uri, true);
+
+			if(this._framing == FRAMING.VARINT)
+			{
+				/* Keeps every byte of the binary headers intact. */
+				req.overrideMimeType("text/plain; charset=x-user-defined");
+			}
+
+			req.seq = this._seq;
+			req.onreadystatechange = bind(this, this.handleRecvStateChange, req);
+			req.send(null);
+
+			assert(req.readyState == XHR.LOADING, "req.readyState == XHR.LOADING");
+
+			return req;
+		},
+
+		performRecv: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			assert(this._recvTimeout, "this._recvTimeout");
+			window.clearTimeout(this._recvTimeout);
+			this._recvTimeout = null;
+
+			debug("performRecv");
+
+			var uri = this.recvUri();
+
+			if(this._recvReq)
+			{
+				clearRequest(this._recvReq);
+				this._recvReq = null;
+			}
+
+			if(this._nextRecvReq)
+			{
+				clearRequest(this._nextRecvReq);
+				this._nextRecvReq = null;
+			}
+
+			this.abortFetchRecv();
+
+			this._recvIdx = 0;
+			this._creditIdx = 0;
+
+			if(this._useFetch)
+			{
+				this.openFetchRecv(uri);
+			}
+			else if(typeof XDomainRequest == 'undefined')
+			{
+				this._recvReq = this.openRecv(uri);
+				this.scheduleReplace();
+
+				if(this._localPoll)
+				{
+					this._checkTimeout = window.setTimeout(bind(this, this.checkProgress), 100); 
+				}
+			}
+			else
+			{
+				this._recvReq = new XDomainRequest;
+				this._recvReq.seq = this._seq;
+				this._recvReq.onprogress = bind(this, this.checkProgress);
+				this._recvReq.onload = bind(this, this.handleRecvLoad);
+
+				assert(isXDR(this._recvReq), "isXDR(this._recvReq)");
+
+				uri += (uri.match(/\?/) ? "&" : "?") + "ts=" + (new Date()).getTime();
+
+				this._recvReq.open("GET", uri, true);
+				this._recvReq.send(null);
+			}
+		},
+
+		/**
+		 * Reads the recv stream with fetch(), parsing the packets out of
+		 * the chunks as they arrive.
+		 */
+		openFetchRecv: function(uri)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var recv = {
+				controller: typeof AbortController != "undefined" ? new AbortController() : null,
+				reader: null,
+				seq: this._seq,
+
+				/* Chunks of an incomplete packet, their length and how
+				 * many bytes it takes to complete it, if known. */
+				chunks: [],
+				length: 0,
+				need: 0
+			};
+
+			this._fetchRecv = recv;
+
+			fetch(uri, { cache: "no-store", signal: recv.controller ? recv.controller.signal : undefined })
+				.then(bind(this, this.handleFetchResponse, recv), bind(this, this.handleFetchError, recv));
+		},
+
+		abortFetchRecv: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var recv = this._fetchRecv;
+
+			if(!recv)
+			{
+				return;
+			}
+
+			this._fetchRecv = null;
+
+			if(recv.controller)
+			{
+				try { recv.controller.abort(); } catch(e) {}
+			}
+			else if(recv.reader)
+			{
+				try { recv.reader.cancel(); } catch(e) {}
+			}
+		},
+
+		handleFetchResponse: function(recv, res)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(recv != this._fetchRecv)
+			{
+				return;
+			}
+
+			if(res.status != 200 || !res.body)
+			{
+				this.handleFetchError(recv, res.status);
+				return;
+			}
+
+			var body = res.body;
+
+			/* The server may not have compressed the stream after all. */
+			if(this._useDeflate && res.headers.get("X-Recv-Encoding") == "deflate")
+			{
+				body = body.pipeThrough(new DecompressionStream("deflate"));
+			}
+
+			recv.reader = body.getReader();
+			this.readFetchRecv(recv);
+		},
+
+		handleFetchError: function(recv, status)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(recv != this._fetchRecv)
+			{
+				return;
+			}
+
+			this._fetchRecv = null;
+
+			if(status == 404 && this.state == Session.STATE.DISCONNECTING)
+			{
+				info("Failed to recv during shutdown -- that's fine");
+				return;
+			}
+
+			this.handleRecvFailure(status, "Connection closed, " +
+				(typeof status == "number" ? "HTTP response: " + status : "fetch failed"));
+		},
+
+		readFetchRecv: function(recv)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			recv.reader.read().then(bind(this, this.handleFetchChunk, recv),
+				bind(this, this.handleFetchError, recv));
+		},
+
+		handleFetchChunk: function(recv, result)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(recv != this._fetchRecv)
+			{
+				return;
+			}
+
+			if(result.done)
+			{
+				this._fetchRecv = null;
+				this.handleFetchEnd();
+				return;
+			}
+
+			recv.chunks.push(result.value);
+			recv.length += result.value.length;
+
+			/* Chunks of a big packet are only joined once it is complete. */
+			if(recv.length >= recv.need)
+			{
+				this.parseFetchChunks(recv);
+			}
+
+			if(recv == this._fetchRecv)
+			{
+				this.readFetchRecv(recv);
+			}
+		},
 
-			if(this._sessionId && !this._recvTimeout)
+		parseFetchChunks: function(recv)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var bytes = recv.chunks[0];
+			var idx = 0;
+			var i;
+
+			if(recv.chunks.length > 1)
 			{
-				info("Reconnecting to stream");
-				this._recvTimeout = window.setTimeout(bind(this, this.performRecv), 50);	
+				bytes = new Uint8Array(recv.length);
+
+				for(i = 0; i < recv.chunks.length; i++)
+				{
+					bytes.set(recv.chunks[i], idx);
+					idx += recv.chunks[i].length;
+				}
+
+				idx = 0;
+			}
+
+			recv.chunks = [];
+			recv.length = 0;
+			recv.need = 0;
+
+			while(idx < bytes.length)
+			{
+				var header = parseVarintBytes(bytes, idx);
+
+				if(!header || bytes.length < idx + header.headerLength + header.length)
+				{
+					recv.chunks.push(bytes.subarray(idx));
+					recv.length = bytes.length - idx;
+					recv.need = header ? header.headerLength + header.length : 0;
+					break;
+				}
+
+				idx += header.headerLength;
+				if(!this.seenPacket(recv, header.type))
+				{
+					this.handlePacket(header.type, header.cid, bytes.subarray(idx, idx + header.length));
+				}
+				idx += header.length;
+
+				this._recvIdx += header.headerLength + header.length;
+
+				if(recv != this._fetchRecv)
+				{
+					return;
+				}
 			}
+
+			this.updateWindow();
 		},
 
-		performRecv: function()
+		handleFetchEnd: function()
 		{
 			assert(this instanceof Session, "this instanceof Session");
 
-			assert(this._recvTimeout, "this._recvTimeout");
-			window.clearTimeout(this._recvTimeout);
-			this._recvTimeout = null;
+			if(this._lastPacket != PACKET.RECONN &&
+				this._lastPacket != PACKET.DELETED &&
+				!this._longPoll)
+			{
+				this.errorText = "HTTP stream closed, last packet was " + enumToStr(PACKET, this._lastPacket);
+				warn(this.errorText);
+				this.onerror(this, Session.ERROR.RECV_FAILED, this.errorText);
+			}
 
-			debug("performRecv");
+			if(this._sessionId && !this._recvTimeout)
+			{
+				info("Reconnecting to stream");
+				this._recvTimeout = window.setTimeout(bind(this, this.performRecv),
+					this._lastPacket == PACKET.RECONN ? 1 : 50);
+			}
+		},
 
-			var uri = this._sessionUri + "?act=recv&sid=" + this._sessionId;
+		/**
+		 * Attaches a WebSocket to the session as recv stream, it replaces
+		 * the XHR stream and also carries the uplink once open.
+		 */
+		openWebSocket: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
 
-			if(this._longPoll)
+			var uri = "ws://" + this._relayHost + ":" + this._relayPort +
+				"/ws?sid=" + this._sessionId;
+
+			if(this._window)
 			{
-				uri += "&long_poll=1";
+				uri += "&window=" + this._window;
 			}
 
-			if(this._recvReq)
+			if(this._flushDelay)
 			{
-				clearRequest(this._recvReq);
-				this._recvReq = null;
+				uri += "&flush_delay=" + this._flushDelay;
 			}
 
+			uri += "&seq=" + this._seq;
+
 			this._recvIdx = 0;
+			this._creditIdx = 0;
+			this._wsOpened = false;
 
-			if(typeof XDomainRequest == 'undefined')
+			try
 			{
-				this._recvReq = this.makeXHR("GET", uri, true);
-				this._recvReq.onreadystatechange = bind(this, this.handleRecvStateChange);
-				this._recvReq.send(null);
+				this._ws = new WebSocket(uri);
+			}
+			catch(e)
+			{
+				warn("WebSocket failed, falling back to XHR: " + e.message);
+				this._ws = null;
+				this._useWebSocket = false;
+				this._recvTimeout = window.setTimeout(bind(this, this.performRecv), 1);
+				return;
+			}
+
+			this._ws.seq = this._seq;
+			this._ws.binaryType = "arraybuffer";
+			this._ws.onopen = bind(this, this.handleWsOpen);
+			this._ws.onmessage = bind(this, this.handleWsMessage);
+			this._ws.onclose = bind(this, this.handleWsClose);
+		},
 
-				assert(this._recvReq.readyState == XHR.LOADING, "this._recvReq.readyState == XHR.LOADING");
+		handleWsOpen: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
 
-				if(this._localPoll)
+			debug("WebSocket open");
+			this._wsOpened = true;
+		},
+
+		/**
+		 * Every message holds whole varint framed packets.
+		 */
+		handleWsMessage: function(ev)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var bytes = new Uint8Array(ev.data);
+			var idx = 0;
+
+			while(idx < bytes.length)
+			{
+				var header = parseVarintBytes(bytes, idx);
+
+				if(!header || bytes.length < idx + header.headerLength + header.length)
 				{
-					this._checkTimeout = window.setTimeout(bind(this, this.checkProgress), 100); 
+					error("Truncated packet in WebSocket message");
+					break;
+				}
+
+				idx += header.headerLength;
+				if(!this.seenPacket(this._ws, header.type))
+				{
+					this.handlePacket(header.type, header.cid, bytes.subarray(idx, idx + header.length));
 				}
+				idx += header.length;
 			}
-			else
+
+			this._recvIdx += bytes.length;
+			this.updateWindow();
+		},
+
+		handleWsClose: function(ev)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			debug("WebSocket closed with code " + ev.code);
+
+			this._ws = null;
+
+			if(ev.code == 4404 || ev.code == 4410)
 			{
-				this._recvReq = new XDomainRequest;
-				this._recvReq.onprogress = bind(this, this.checkProgress);
-				this._recvReq.onload = bind(this, this.handleRecvLoad);
+				this.onerror(this, Session.ERROR.RECV_FAILED,
+					ev.code == 4404 ? "Session not found" : "Stream cannot resume");
+				this._sessionId = null;
+			}
 
-				assert(isXDR(this._recvReq), "isXDR(this._recvReq)");
+			if(!this._sessionId || this._recvTimeout)
+			{
+				return;
+			}
 
-				uri += (uri.match(/\?/) ? "&" : "?") + "ts=" + (new Date()).getTime();
+			if(this._wsOpened)
+			{
+				info("Reattaching WebSocket");
+				this.openWebSocket();
+			}
+			else
+			{
+				warn("WebSocket unavailable, falling back to XHR");
+				this._useWebSocket = false;
+				this._recvTimeout = window.setTimeout(bind(this, this.performRecv), 1);
+			}
+		},
 
-				this._recvReq.open("GET", uri, true);
-				this._recvReq.send(null);
+		/**
+		 * Sends a packet over the WebSocket instead of a POST if it is open
+		 * and no POST is pending that it could overtake.
+		 */
+		sendPacket: function(type, cid, payload)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(!this._ws || this._ws.readyState != 1 /* OPEN */ || this._actionQueue.length > 0)
+			{
+				return false;
 			}
+
+			this._ws.send(encodePacket(type, cid, payload));
+			return true;
 		},
 
 		handlePostStateChange: function(req)
@@ -923,42 +1885,30 @@ Session.prototype = function() {
 
 			if(req.readyState == XHR.COMPLETED)
 			{
-				var item = this._actionQueue.shift();
+				var i = 0;
+
+				while(this._actionQueue[i].req != req)
+				{
+					i++;
+				}
 
-				assert(item.req == req, "item.req == req");
-				assert(req == this._currentPost, "req == this._currentPost");
+				var item = this._actionQueue.splice(i, 1)[0];
 
 				var status = req.status;
 				var responseText = req.responseText;
 
 				clearRequest(req);
 
-				this._currentPost = null;
 				req = null;
 
-
-				if(status != 200)
+				if(item.packets)
+				{
+					this.handleBatchResult(item, status, responseText);
+				}
+				else if(status != 200)
 				{
 					var errorText = "Request failed for URI " + item.uri + " failed: " + status;
-					this.onerror(this, item.error, errorText);
-
-					if(item.error == Session.ERROR_INITIALIZE_FAILED)
-					{
-						this.state = Session.STATE.DISCONNECTED;
-					}
-					if(item.error == Session.ERROR.CONNECT_FAILED)
-					{
-						this.state = Session.STATE.DISCONNECTED;
-					}
-					else if(item.error == Session.ERROR.DISCONNECT_FAILED)
-					{
-						this.state = Session.STATE.CONNECTED;
-					}
-					else if(item.error == Session.ERROR.SHUTDOWN_FAILED)
-					{
-						this.state = Session.STATE.CONNECTED;					
-					}
-
+					this.failAction(item.error, errorText);
 				}
 				else
 				{
@@ -973,34 +1923,18 @@ Session.prototype = function() {
 
 						assert(!this._recvTimeout, "!this._recvTimeout");
 
-						this._recvTimeout = window.setTimeout(bind(this, this.performRecv), 1);
-					}
-				}
-
-				if(this._actionQueue.length > 0)
-				{
-					var next = this._actionQueue[0];
-
-					assert(next.req.readyState > XHR.DISCONNECTED, "next.req.readyState > XHR.DISCONNECTED");
-
-					try
-					{
-						debug("Front state is " + next.req.readyState + " LOADING would be " + XHR.LOADING);
-
-						if(!next.sent && next.req.readyState < XHR.LOADED)
+						if(this._useWebSocket)
 						{
-							debug("Sending XHR for URI " + next.uri);
-
-							this._currentPost = next.req;
-							next.req.send(next.body);
-							next.sent = true;
+							this.openWebSocket();
+						}
+						else
+						{
+							this._recvTimeout = window.setTimeout(bind(this, this.performRecv), 1);
 						}
-					}
-					catch(e)
-					{
-						throw new Error("Failed to request URI " + next.uri + " with body " + next.body + ": " + e.message);
 					}
 				}
+
+				this.pumpActions();
 			}
 
 			debug("-- handlePostStateChange");
@@ -1014,7 +1948,111 @@ Session.prototype = function() {
 			}
 		},
 
-		enqueuePostAction: function(uri, body, error)
+		failAction: function(error, errorText)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			this.onerror(this, error, errorText);
+
+			if(error == Session.ERROR_INITIALIZE_FAILED)
+			{
+				this.state = Session.STATE.DISCONNECTED;
+			}
+			if(error == Session.ERROR.CONNECT_FAILED)
+			{
+				this.state = Session.STATE.DISCONNECTED;
+			}
+			else if(error == Session.ERROR.DISCONNECT_FAILED)
+			{
+				this.state = Session.STATE.CONNECTED;
+			}
+			else if(error == Session.ERROR.SHUTDOWN_FAILED)
+			{
+				this.state = Session.STATE.CONNECTED;
+			}
+		},
+
+		/**
+		 * Reports the packets of a batch the server did not execute, the
+		 * reply holds one status per packet executed.
+		 */
+		handleBatchResult: function(item, status, responseText)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var results = status == 200 ? responseText.replace(/^\s+|\s+$/g, "").split(/\s+/) : [];
+			var i;
+
+			for(i = 0; i < item.packets.length; i++)
+			{
+				var pkt = item.packets[i];
+				var code = i < results.length ? results[i] : status;
+
+				if(code != 200)
+				{
+					this.failAction(pkt.error, "Packet " + pkt.type + " for cid " + pkt.cid + " in batch " +
+						item.uri + " failed: " + code);
+				}
+			}
+		},
+
+		postAction: function(item)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+			assert(item.req.readyState > XHR.DISCONNECTED, "item.req.readyState > XHR.DISCONNECTED");
+
+			debug("Sending XHR for URI " + item.uri);
+
+			/* Packets keep coming in until a batch is sent. */
+			if(item.packets)
+			{
+				item.body = encodeBatch(item.packets);
+			}
+
+			try
+			{
+				item.req.send(item.body);
+				item.sent = true;
+			}
+			catch(e)
+			{
+				throw new Error("Failed to request URI " + item.uri + " with body " + item.body + ": " + e.message);
+			}
+		},
+
+		/**
+		 * Sends what is due from the action queue.  Sequenced sends among
+		 * the first PIPELINE_DEPTH entries go out together, the server puts
+		 * them back in order; anything else is sent alone once everything
+		 * before it has completed.
+		 */
+		pumpActions: function()
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			var i;
+
+			for(i = 0; i < this._actionQueue.length && i < PIPELINE_DEPTH; i++)
+			{
+				var item = this._actionQueue[i];
+
+				if(!item.pipelined)
+				{
+					if(i == 0 && !item.sent)
+					{
+						this.postAction(item);
+					}
+					break;
+				}
+
+				if(!item.sent)
+				{
+					this.postAction(item);
+				}
+			}
+		},
+
+		enqueuePostAction: function(uri, body, error, packets, pipelined)
 		{
 			assert(this instanceof Session, "this instanceof Session");
 
@@ -1031,24 +2069,46 @@ Session.prototype = function() {
 					uri: uri,
 					req: req, 
 					body: body, 
+					packets: packets,
+					pipelined: !!pipelined,
 					error: error,
 					sent: false
 				});
 
 			req.onreadystatechange = bind(this, this.handlePostStateChange, req);
 
-			if(this._actionQueue.length == 1)
+			this.pumpActions();
+		},
+
+		/**
+		 * Adds a packet to the act=batch POST waiting behind the one in
+		 * flight, starting a new batch if there is none.  Returns false if
+		 * batches are not supported.
+		 */
+		enqueuePacket: function(type, cid, payload, error)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+
+			if(!this._useBatch)
 			{
-				var item = this._actionQueue[0];
+				return false;
+			}
 
-				assert(req.readyState > XHR.DISCONNECTED, "req.readyState > XHR.DISCONNECTED");
+			var pkt = { type: type, cid: cid, payload: payload, error: error };
+			var last = this._actionQueue[this._actionQueue.length - 1];
 
-				debug("Sending enqueued request with state " + req.readyState);
-				this._currentPost = req;
-				req.send(body);
-				debug("sent");
-				item.sent = true;
+			if(last && last.packets && !last.sent)
+			{
+				last.packets.push(pkt);
+				return true;
 			}
+
+			var uri = this._sessionUri +
+				"?act=batch" +
+				"&sid=" + this._sessionId;
+
+			this.enqueuePostAction(uri, null, error, [pkt]);
+			return true;
 		},
 
 		create: function()
@@ -1063,7 +2123,7 @@ Session.prototype = function() {
 			this.state = Session.STATE.CONNECTING;
 		},
 
-		enqConnect: function(cid, host, port)
+		enqConnect: function(cid, host, port, proto)
 		{
 			assert(this instanceof Session, "this instanceof Session");
 			assert(cid, "cid is null");
@@ -1071,12 +2131,21 @@ Session.prototype = function() {
 			assert(port, "port is null");
 			assert(this._sessionId, "Can't connect without stream id");
 
+			var target = host + ":" + port + (proto == "udp" ? "/udp" : "");
+
+			if(this.sendPacket(PACKET.CONNECTED, cid, target) ||
+				this.enqueuePacket(PACKET.CONNECTED, cid, target, Session.ERROR.CONNECT_FAILED))
+			{
+				return;
+			}
+
 			var uri = this._sessionUri +
 				"?act=connect" + 
 				"&sid=" + this._sessionId + 
 				"&cid=" + cid.toString(16) +
 				"&host=" + host + 
-				"&port=" + port;
+				"&port=" + port +
+				(proto == "udp" ? "&proto=udp" : "");
 
 			this.enqueuePostAction(uri, null, Session.ERROR.CONNECT_FAILED);
 		},
@@ -1089,6 +2158,12 @@ Session.prototype = function() {
 			var cid = conn.getId();
 			assert(cid, "cid not null");
 
+			if(this.sendPacket(PACKET.DISCONNECTED, cid) ||
+				this.enqueuePacket(PACKET.DISCONNECTED, cid, null, Session.ERROR.DISCONNECT_FAILED))
+			{
+				return;
+			}
+
 			var uri = this._sessionUri + 
 				"?act=disconnect" +
 				"&sid=" + this._sessionId +
@@ -1107,21 +2182,65 @@ Session.prototype = function() {
 
 			debug("Sending '" + window.escape(data) + "' to connection");
 
+			/* POST bodies go out UTF-8 encoded, so do packets.  A Uint8Array
+			 * is sent as it is. */
+			var bytes = typeof data == "string" ? unescape(encodeURIComponent(data)) : bytesToString(data);
+
+			if(this.sendPacket(PACKET.DATA, cid, bytes) ||
+				this.enqueuePacket(PACKET.DATA, cid, bytes, Session.ERROR.SEND_FAILED))
+			{
+				return;
+			}
+
 			var uri = this._sessionUri + 
 				"?act=send" +
 				"&sid=" + this._sessionId +
-				"&cid=" + cid.toString(16);
+				"&cid=" + cid.toString(16) +
+				"&seq=" + conn._sendSeq++;
 
-			this.enqueuePostAction(uri, data, Session.ERROR.SEND_FAILED);
+			this.enqueuePostAction(uri, data, Session.ERROR.SEND_FAILED, null, true);
 		},
 		
+		enqWindow: function(consumed)
+		{
+			assert(this instanceof Session, "this instanceof Session");
+			assert(this._sessionId, "_sessionId is not null");
+
+			var credit = [];
+			putVarint(credit, consumed);
+			putVarint(credit, this._window);
+			putVarint(credit, this._seq);
+
+			credit = String.fromCharCode.apply(null, credit);
+
+			if(this.sendPacket(PACKET.WINDOW, 0, credit) ||
+				this.enqueuePacket(PACKET.WINDOW, 0, credit, Session.ERROR.RECV_FAILED))
+			{
+				return;
+			}
+
+			var uri = this._sessionUri +
+				"?act=window" +
+				"&sid=" + this._sessionId +
+				"&consumed=" + consumed +
+				"&seq=" + this._seq;
+
+			this.enqueuePostAction(uri, null, Session.ERROR.RECV_FAILED);
+		},
+
 		enqShutdown: function(data)
 		{
 			assert(this instanceof Session, "this instanceof Session");
 			assert(this._sessionId, "_sessionId is null");
+			this.state = Session.STATE.DISCONNECTING;
+
+			if(this.sendPacket(PACKET.DELETED, 0))
+			{
+				return;
+			}
+
 			var uri = this._sessionUri + "?act=delete&sid=" + this._sessionId;
 			this.enqueuePostAction(uri, null, Session.ERROR.SHUTDOWN_FAILED);
-			this.state = Session.STATE.DISCONNECTING;
 		}
 
 	};
@@ -0,0 +1,276 @@
+/* tunnel.c -- CONNECT tunnels spliced between client and upstream
+ *
+ * Once the upstream socket is connected, "200 Connection established" is
+ * queued for the client and evhttp is cut off from the connection the way
+ * ws.c does it.  From then on bytes are moved from one socket into a pipe
+ * and from the pipe into the other socket with splice(), so they never
+ * pass through userspace.  Each direction has a pipe of its own and its
+ * source is only read while the pipe is empty, so a slow reader holds up
+ * the writer through the socket buffers alone.  A direction that reached
+ * the end of file is shut down on the other socket, and the tunnel closes
+ * once both have.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/http.h>
+
+#include "stats.h"
+#include "tunnel.h"
+
+/**
+ * Bytes moved into a pipe per splice(), the default pipe capacity.
+ */
+#define TUNNEL_SPLICE_MAX (64 * 1024)
+
+/**
+ * One direction, from one socket to the other.  head is sent before
+ * anything spliced: the response to the client, or what the client sent
+ * along with its request.
+ */
+struct tunnel_half {
+	struct tunnel *t;
+	evutil_socket_t from;
+	evutil_socket_t to;
+	struct event *read_ev;
+	struct event *write_ev;
+
+	struct evbuffer *head;
+	int pipe[2];
+	size_t piped;
+
+	bool eof;
+	bool done;
+	uint64_t *bytes;
+};
+
+struct tunnel {
+	struct evhttp_connection *evcon;
+	evutil_socket_t upstream;
+
+	struct tunnel_half up;
+	struct tunnel_half down;
+	struct tunnel_stats *stats;
+
+	tunnel_close_cb on_close;
+	void *arg;
+};
+
+static void tunnel_close(struct tunnel *t)
+{
+	event_del(t->up.read_ev);
+	event_del(t->up.write_ev);
+	event_del(t->down.read_ev);
+	event_del(t->down.write_ev);
+
+	t->on_close(t, t->arg);
+}
+
+/**
+ * Sends head and the contents of the pipe.  Returns 1 once both are
+ * empty, 0 if the socket has no room for more or -1 on errors.
+ */
+static int half_flush(struct tunnel_half *h)
+{
+	ssize_t n;
+
+	while(evbuffer_get_length(h->head) > 0)
+	{
+		if(evbuffer_write(h->head, h->to) < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+	}
+
+	while(h->piped > 0)
+	{
+		n = splice(h->pipe[0], NULL, h->to, NULL, h->piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return errno == EAGAIN ? 0 : -1;
+		}
+
+		h->piped -= n;
+		stat_add(h->bytes, n);
+		stat_add(&h->t->stats->splices, 1);
+	}
+
+	return 1;
+}
+
+/**
+ * Moves on what it can without blocking, then waits for whichever socket
+ * holds it up.
+ */
+static void half_pump(struct tunnel_half *h)
+{
+	struct tunnel *t = h->t;
+	ssize_t n;
+	int flushed;
+
+	if((flushed = half_flush(h)) < 0)
+	{
+		tunnel_close(t);
+		return;
+	}
+
+	if(flushed && !h->eof)
+	{
+		n = splice(h->from, NULL, h->pipe[1], NULL, TUNNEL_SPLICE_MAX, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+
+		if(n > 0)
+		{
+			h->piped = n;
+			stat_add(&t->stats->splices, 1);
+
+			if((flushed = half_flush(h)) < 0)
+			{
+				tunnel_close(t);
+				return;
+			}
+		}
+		else if(n == 0)
+		{
+			h->eof = true;
+		}
+		else if(errno != EAGAIN && errno != EINTR)
+		{
+			tunnel_close(t);
+			return;
+		}
+	}
+
+	if(!flushed)
+	{
+		/* Reading on would only fill the pipe. */
+		event_del(h->read_ev);
+		event_add(h->write_ev, NULL);
+		return;
+	}
+
+	event_del(h->write_ev);
+
+	if(!h->eof)
+	{
+		event_add(h->read_ev, NULL);
+		return;
+	}
+
+	if(!h->done)
+	{
+		event_del(h->read_ev);
+		shutdown(h->to, SHUT_WR);
+		h->done = true;
+
+		if(t->up.done && t->down.done)
+			tunnel_close(t);
+	}
+}
+
+static void handle_half(evutil_socket_t fd, short what, void *arg)
+{
+	half_pump(arg);
+}
+
+static bool half_init(struct tunnel_half *h, struct tunnel *t, struct event_base *base,
+		evutil_socket_t from, evutil_socket_t to, uint64_t *bytes)
+{
+	h->t = t;
+	h->from = from;
+	h->to = to;
+	h->bytes = bytes;
+	h->pipe[0] = h->pipe[1] = -1;
+
+	h->read_ev = event_new(base, from, EV_READ | EV_PERSIST, handle_half, h);
+	h->write_ev = event_new(base, to, EV_WRITE | EV_PERSIST, handle_half, h);
+	h->head = evbuffer_new();
+
+	return h->read_ev && h->write_ev && h->head && pipe2(h->pipe, O_NONBLOCK | O_CLOEXEC) == 0;
+}
+
+static void half_free(struct tunnel_half *h)
+{
+	if(h->read_ev)
+		event_free(h->read_ev);
+	if(h->write_ev)
+		event_free(h->write_ev);
+	if(h->head)
+		evbuffer_free(h->head);
+	if(h->pipe[0] >= 0)
+		close(h->pipe[0]);
+	if(h->pipe[1] >= 0)
+		close(h->pipe[1]);
+}
+
+struct tunnel *tunnel_accept(struct evhttp_request *req, evutil_socket_t upstream, struct tunnel_stats *stats,
+		tunnel_close_cb on_close, void *arg)
+{
+	struct evhttp_connection *evcon = evhttp_request_get_connection(req);
+	struct bufferevent *bev = evhttp_connection_get_bufferevent(evcon);
+	struct event_base *base = bufferevent_get_base(bev);
+	evutil_socket_t client = bufferevent_getfd(bev);
+	struct tunnel *t;
+	bool up_ok, down_ok;
+
+	t = calloc(1, sizeof(struct tunnel));
+	if(t == NULL)
+	{
+		evutil_closesocket(upstream);
+		evhttp_send_error(req, 500, "Tunnel allocation failed");
+		return NULL;
+	}
+
+	up_ok = half_init(&t->up, t, base, client, upstream, &stats->bytes_up);
+	down_ok = half_init(&t->down, t, base, upstream, client, &stats->bytes_down);
+
+	if(!up_ok || !down_ok)
+	{
+		half_free(&t->up);
+		half_free(&t->down);
+		free(t);
+		evutil_closesocket(upstream);
+		evhttp_send_error(req, 500, "Tunnel allocation failed");
+		return NULL;
+	}
+
+	t->evcon = evcon;
+	t->upstream = upstream;
+	t->stats = stats;
+	t->on_close = on_close;
+	t->arg = arg;
+
+	evbuffer_add_printf(t->down.head, "HTTP/1.1 200 Connection established\r\n\r\n");
+
+	/* From here on the request is left pending and evhttp is cut off
+	 * from its connection. */
+	bufferevent_disable(bev, EV_READ | EV_WRITE);
+	bufferevent_setcb(bev, NULL, NULL, NULL, NULL);
+	bufferevent_set_timeouts(bev, NULL, NULL);
+	evbuffer_add_buffer(t->up.head, bufferevent_get_input(bev));
+
+	/* Both sockets are writable, which starts both directions without
+	 * calling back before this returns. */
+	event_add(t->up.write_ev, NULL);
+	event_add(t->down.write_ev, NULL);
+
+	return t;
+}
+
+void tunnel_free(struct tunnel *t)
+{
+	half_free(&t->up);
+	half_free(&t->down);
+	evutil_closesocket(t->upstream);
+	evhttp_connection_free(t->evcon);
+	free(t);
+}
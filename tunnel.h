@@ -0,0 +1,46 @@
+/* tunnel.h -- CONNECT tunnels spliced between client and upstream */
+
+#ifndef HADES_TUNNEL_H
+#define HADES_TUNNEL_H
+
+#include <stdint.h>
+
+#include <event2/http.h>
+#include <event2/util.h>
+
+struct tunnel;
+
+/**
+ * Bytes spliced each way and the splice() calls moving them, shared by
+ * the tunnels of a worker.
+ */
+struct tunnel_stats {
+	uint64_t bytes_up;
+	uint64_t bytes_down;
+	uint64_t splices;
+};
+
+/**
+ * Called once both directions have ended or one of the sockets failed.
+ * Nothing is moved anymore afterwards, tunnel_free() may be called from
+ * within.
+ */
+typedef void (*tunnel_close_cb)(struct tunnel *t, void *arg);
+
+/**
+ * Answers the CONNECT request req with "200 Connection established",
+ * takes its connection over from evhttp and relays between it and the
+ * connected socket upstream, which the tunnel owns from then on.  Bytes
+ * the client sent ahead of the response go upstream first.  Replies with
+ * an HTTP error, closes upstream and returns NULL on failure.
+ */
+struct tunnel *tunnel_accept(struct evhttp_request *req, evutil_socket_t upstream, struct tunnel_stats *stats,
+		tunnel_close_cb on_close, void *arg);
+
+/**
+ * Closes both sockets, the client's along with the evhttp connection it
+ * came from.
+ */
+void tunnel_free(struct tunnel *t);
+
+#endif
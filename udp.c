@@ -0,0 +1,180 @@
+/* udp.c -- batched datagram I/O on connected UDP sockets
+ *
+ * Datagrams are moved a batch per system call: recvmmsg() fills one slot
+ * of UDP_DATAGRAM_MAX bytes per datagram, and sendmmsg() gathers every
+ * datagram straight from the chains of the buffer holding it.  Only pages
+ * of the receive slots actually written to take up memory.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "udp.h"
+
+/**
+ * Chains a batch of datagrams to send may span, a datagram needing more
+ * than that on its own is made contiguous first.
+ */
+#define UDP_IOV_MAX (4 * UDP_BATCH)
+
+evutil_socket_t udp_connect(const struct sockaddr *addr, socklen_t len)
+{
+	int fd;
+
+	if((fd = socket(addr->sa_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+		return -1;
+
+	if(connect(fd, addr, len) < 0)
+	{
+		int err = errno;
+
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+int udp_recv(evutil_socket_t fd, struct udp_batch *batch)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	unsigned i;
+	int n;
+
+	batch->num = 0;
+
+	if(batch->buf == NULL && (batch->buf = malloc(UDP_BATCH * (size_t)UDP_DATAGRAM_MAX)) == NULL)
+		return -1;
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for(i = 0; i < UDP_BATCH; i++)
+	{
+		iov[i].iov_base = batch->buf + i * (size_t)UDP_DATAGRAM_MAX;
+		iov[i].iov_len = UDP_DATAGRAM_MAX;
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while((n = recvmmsg(fd, msgs, UDP_BATCH, 0, NULL)) < 0)
+	{
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		if(errno != EINTR)
+			return -1;
+	}
+
+	for(i = 0; i < (unsigned)n; i++)
+	{
+		batch->data[i] = iov[i].iov_base;
+		batch->lens[i] = msgs[i].msg_len;
+	}
+
+	batch->num = n;
+	return n;
+}
+
+/**
+ * Points up to max iovecs at the len bytes at pos in buf.  Returns how
+ * many were needed, which may be more than max.
+ */
+static int udp_gather(struct evbuffer *buf, struct evbuffer_ptr *pos, size_t len, struct iovec *iov, int max)
+{
+	int i, n;
+
+	/* evbuffer_peek() cannot start at the end of the buffer. */
+	if(len == 0)
+		return 0;
+
+	n = evbuffer_peek(buf, len, pos, (struct evbuffer_iovec *)iov, max);
+
+	/* The last chain may hold the start of the next datagram. */
+	for(i = 0; i < n && i < max; i++)
+	{
+		if(iov[i].iov_len > len)
+			iov[i].iov_len = len;
+		len -= iov[i].iov_len;
+	}
+
+	return n;
+}
+
+unsigned udp_send(evutil_socket_t fd, struct evbuffer *buf, const size_t *lens, unsigned num, uint64_t *calls)
+{
+	struct mmsghdr msgs[UDP_BATCH];
+	struct iovec iov[UDP_IOV_MAX];
+	struct evbuffer_ptr pos;
+	unsigned i = 0, built, done, sent = 0;
+	size_t bytes;
+	int used, n;
+
+	while(i < num)
+	{
+		evbuffer_ptr_set(buf, &pos, 0, EVBUFFER_PTR_SET);
+		memset(msgs, 0, sizeof(msgs));
+
+		for(built = 0, used = 0, bytes = 0; built < UDP_BATCH && i + built < num; built++)
+		{
+			n = udp_gather(buf, &pos, lens[i + built], iov + used, UDP_IOV_MAX - used);
+
+			if(n > UDP_IOV_MAX - used)
+			{
+				if(built > 0)
+					break;
+
+				/* The first datagram starts the buffer. */
+				evbuffer_pullup(buf, lens[i]);
+				evbuffer_ptr_set(buf, &pos, 0, EVBUFFER_PTR_SET);
+				n = udp_gather(buf, &pos, lens[i], iov, UDP_IOV_MAX);
+			}
+
+			msgs[built].msg_hdr.msg_iov = iov + used;
+			msgs[built].msg_hdr.msg_iovlen = n;
+			used += n;
+			bytes += lens[i + built];
+
+			evbuffer_ptr_set(buf, &pos, lens[i + built], EVBUFFER_PTR_ADD);
+		}
+
+		for(done = 0; done < built; )
+		{
+			n = sendmmsg(fd, msgs + done, built - done, 0);
+			(*calls)++;
+
+			if(n >= 0)
+			{
+				done += n;
+				sent += n;
+			}
+			else if(errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				evbuffer_drain(buf, evbuffer_get_length(buf));
+				return sent;
+			}
+			else if(errno != EINTR)
+			{
+				/* Too long, or refused by the peer before. */
+				done++;
+			}
+		}
+
+		evbuffer_drain(buf, bytes);
+		i += built;
+	}
+
+	return sent;
+}
+
+void udp_batch_free(struct udp_batch *batch)
+{
+	free(batch->buf);
+	batch->buf = NULL;
+	batch->num = 0;
+}
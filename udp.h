@@ -0,0 +1,58 @@
+/* udp.h -- batched datagram I/O on connected UDP sockets */
+
+#ifndef HADES_UDP_H
+#define HADES_UDP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+#include <event2/buffer.h>
+#include <event2/util.h>
+
+/**
+ * Datagrams received or sent per system call, and the largest datagram a
+ * socket may receive.
+ */
+#define UDP_BATCH 32
+#define UDP_DATAGRAM_MAX 65535
+
+/**
+ * Datagrams received by one udp_recv(), data[i] holding lens[i] bytes.
+ * The buffer is allocated on first use and shared by all sockets of a
+ * worker, it stays valid until the next udp_recv().
+ */
+struct udp_batch {
+	unsigned num;
+	size_t lens[UDP_BATCH];
+	const uint8_t *data[UDP_BATCH];
+	uint8_t *buf;
+};
+
+/**
+ * Creates a non-blocking datagram socket connected to addr.  Returns -1
+ * with errno set on failure.
+ */
+evutil_socket_t udp_connect(const struct sockaddr *addr, socklen_t len);
+
+/**
+ * Receives up to UDP_BATCH datagrams into batch with a single recvmmsg().
+ * Returns how many there were, 0 if none were waiting, or -1 with errno
+ * set.  A datagram refused by the peer earlier is reported as
+ * ECONNREFUSED once.
+ */
+int udp_recv(evutil_socket_t fd, struct udp_batch *batch);
+
+/**
+ * Sends the num datagrams held back to back in buf, lens[i] bytes each,
+ * with as few sendmmsg() calls as they fit, which are added to *calls.
+ * Datagrams the socket refuses are dropped, once its buffer is full all
+ * remaining ones are.  buf is empty on return.  Returns the number of
+ * datagrams sent.
+ */
+unsigned udp_send(evutil_socket_t fd, struct evbuffer *buf, const size_t *lens, unsigned num, uint64_t *calls);
+
+void udp_batch_free(struct udp_batch *batch);
+
+#endif
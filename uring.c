@@ -0,0 +1,844 @@
+/* uring.c -- upstream socket I/O through io_uring
+ *
+ * Every worker may have a ring of its own, driven from its event loop: the
+ * ring descriptor turns readable when completions are waiting, and the
+ * operations queued during a loop iteration are submitted with a single
+ * io_uring_enter() at its end.  Each socket has one multishot receive
+ * armed, which keeps completing into buffers the kernel picks from a
+ * provided buffer ring until it is cancelled, and at most one send of the
+ * chains of its output buffer in flight.  A busy socket thus costs no
+ * system calls of its own at all.
+ *
+ * The ring is set up through the raw system calls, so liburing is not
+ * needed.  Without HAVE_URING, uring_new() always fails.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+
+#include "stats.h"
+#include "uring.h"
+
+#ifdef HAVE_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/**
+ * The low bits of the user data of an operation tell which one it is, the
+ * rest points to its socket.  Cancellations carry no socket.
+ */
+#define URING_OP_RECV 1
+#define URING_OP_SEND 2
+#define URING_OP_MASK 3
+
+#define URING_BGID 0
+
+struct uring_sock {
+	struct uring *u;
+	evutil_socket_t fd;
+
+	uring_read_cb read_cb;
+	uring_event_cb event_cb;
+	void *udata;
+
+	/**
+	 * Output of the owner, and the part of it being sent.  Chains are
+	 * moved over from out before they are handed to the kernel, so
+	 * nothing added meanwhile moves them.
+	 */
+	struct evbuffer *out;
+	struct evbuffer *inflight;
+	struct msghdr msg;
+	struct iovec iov[URING_IOV_MAX];
+
+	/**
+	 * Received while receiving was being stopped, passed on once it is
+	 * started again.
+	 */
+	struct evbuffer *held;
+
+	/**
+	 * Operations the kernel has not completed yet.
+	 */
+	unsigned pending;
+
+	bool recv_wanted;
+	bool recv_armed;
+	bool recv_cancelled;
+	bool sending;
+
+	/**
+	 * Reached the end of file or failed, closed by the owner, or stopped
+	 * for being released.
+	 */
+	bool done;
+	bool closed;
+	bool stopped;
+	bool cancelled;
+
+	bool dirty;
+	TAILQ_ENTRY(uring_sock) dirty_next;
+	TAILQ_ENTRY(uring_sock) next;
+};
+
+TAILQ_HEAD(uring_sock_list, uring_sock);
+
+struct uring {
+	int fd;
+	struct event *ev;
+	struct event *submit_ev;
+
+	void *rings;
+	size_t rings_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_queued;
+	unsigned sq_submitted;
+
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	uint8_t *bufs;
+	uint16_t br_tail;
+
+	/**
+	 * Sockets with operations to queue at the end of the loop iteration,
+	 * and all of them.
+	 */
+	struct uring_sock_list dirty;
+	struct uring_sock_list socks;
+
+	struct uring_stats stats;
+};
+
+static int uring_enter(struct uring *u, unsigned wait)
+{
+	unsigned num = u->sq_queued - u->sq_submitted;
+	int ret;
+
+	__atomic_store_n(u->sq_tail, u->sq_queued, __ATOMIC_RELEASE);
+
+	while((ret = syscall(__NR_io_uring_enter, u->fd, num, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) < 0)
+	{
+		if(errno != EINTR)
+			return -1;
+	}
+
+	u->sq_submitted += ret;
+	stat_add(&u->stats.enters, 1);
+	stat_add(&u->stats.submissions, ret);
+	return ret;
+}
+
+/**
+ * Returns a cleared submission queue entry, submitting those queued so
+ * far if the queue is full.
+ */
+static struct io_uring_sqe *uring_sqe(struct uring *u)
+{
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	if(u->sq_queued - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+	{
+		if(uring_enter(u, 0) < 0 ||
+			u->sq_queued - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries)
+			return NULL;
+	}
+
+	index = u->sq_queued & u->sq_mask;
+	sqe = &u->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	u->sq_array[index] = index;
+	u->sq_queued++;
+
+	return sqe;
+}
+
+static uint64_t uring_user_data(struct uring_sock *s, unsigned op)
+{
+	return (uintptr_t)s | op;
+}
+
+static void uring_cancel(struct uring *u, int fd, uint64_t user_data)
+{
+	struct io_uring_sqe *sqe = uring_sqe(u);
+
+	if(sqe == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	if(user_data)
+	{
+		sqe->addr = user_data;
+	}
+	else
+	{
+		sqe->fd = fd;
+		sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+	}
+}
+
+static void uring_arm_recv(struct uring_sock *s)
+{
+	struct io_uring_sqe *sqe = uring_sqe(s->u);
+
+	if(sqe == NULL)
+		return;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = s->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = uring_user_data(s, URING_OP_RECV);
+
+	s->recv_armed = true;
+	s->recv_cancelled = false;
+	s->pending++;
+}
+
+static void uring_start_send(struct uring_sock *s)
+{
+	struct io_uring_sqe *sqe;
+	int n;
+
+	if(evbuffer_get_length(s->inflight) == 0)
+		evbuffer_add_buffer(s->inflight, s->out);
+
+	if(evbuffer_get_length(s->inflight) == 0)
+		return;
+
+	if((sqe = uring_sqe(s->u)) == NULL)
+		return;
+
+	n = evbuffer_peek(s->inflight, -1, NULL, (struct evbuffer_iovec *)s->iov, URING_IOV_MAX);
+
+	memset(&s->msg, 0, sizeof(s->msg));
+	s->msg.msg_iov = s->iov;
+	s->msg.msg_iovlen = n < URING_IOV_MAX ? n : URING_IOV_MAX;
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = s->fd;
+	sqe->addr = (uintptr_t)&s->msg;
+	sqe->len = 1;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	sqe->user_data = uring_user_data(s, URING_OP_SEND);
+
+	s->sending = true;
+	s->pending++;
+}
+
+static void uring_sock_schedule(struct uring_sock *s)
+{
+	if(s->dirty)
+		return;
+
+	s->dirty = true;
+	TAILQ_INSERT_TAIL(&s->u->dirty, s, dirty_next);
+
+	/* Active events run in the order they were activated, so this runs
+	 * after whatever else the iteration has to do. */
+	event_active(s->u->submit_ev, EV_READ, 0);
+}
+
+static void uring_sock_destroy(struct uring_sock *s)
+{
+	if(s->dirty)
+		TAILQ_REMOVE(&s->u->dirty, s, dirty_next);
+
+	TAILQ_REMOVE(&s->u->socks, s, next);
+
+	if(s->closed)
+		close(s->fd);
+
+	evbuffer_free(s->inflight);
+	evbuffer_free(s->held);
+	free(s);
+}
+
+/**
+ * Passes on what was held back.  Returns false if s was closed meanwhile.
+ */
+static bool uring_sock_deliver(struct uring_sock *s)
+{
+	size_t len = evbuffer_get_length(s->held);
+
+	if(len > 0)
+	{
+		s->read_cb(s, evbuffer_pullup(s->held, len), len, s->udata);
+		evbuffer_drain(s->held, len);
+	}
+
+	return !s->closed;
+}
+
+/**
+ * Queues whatever the state of s asks for.
+ */
+static void uring_sock_update(struct uring_sock *s)
+{
+	if(s->closed || s->stopped)
+	{
+		if(s->pending > 0 && !s->cancelled)
+		{
+			uring_cancel(s->u, s->fd, 0);
+			s->cancelled = true;
+		}
+
+		if(s->closed && s->pending == 0)
+			uring_sock_destroy(s);
+		return;
+	}
+
+	if(s->recv_wanted && !uring_sock_deliver(s))
+		return;
+
+	if(s->done)
+		return;
+
+	if(s->recv_wanted && !s->recv_armed)
+	{
+		uring_arm_recv(s);
+	}
+	else if(!s->recv_wanted && s->recv_armed && !s->recv_cancelled)
+	{
+		uring_cancel(s->u, -1, uring_user_data(s, URING_OP_RECV));
+		s->recv_cancelled = true;
+	}
+
+	if(!s->sending)
+		uring_start_send(s);
+}
+
+static void uring_submit(struct uring *u)
+{
+	struct uring_sock *s;
+
+	while((s = TAILQ_FIRST(&u->dirty)) != NULL)
+	{
+		TAILQ_REMOVE(&u->dirty, s, dirty_next);
+		s->dirty = false;
+
+		uring_sock_update(s);
+	}
+
+	if(u->sq_queued != u->sq_submitted)
+		uring_enter(u, 0);
+}
+
+static void handle_submit(evutil_socket_t fd, short what, void *udata)
+{
+	uring_submit(udata);
+}
+
+static void uring_recycle(struct uring *u, uint16_t bid)
+{
+	struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (URING_BUFFERS - 1)];
+
+	buf->addr = (uintptr_t)(u->bufs + (size_t)bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+
+	__atomic_store_n(&u->br->tail, ++u->br_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_fail(struct uring_sock *s, int error, short what)
+{
+	s->done = true;
+
+	if(s->closed)
+		return;
+
+	errno = error;
+	s->event_cb(s, what, s->udata);
+}
+
+static void uring_complete_recv(struct uring_sock *s, int res, unsigned flags)
+{
+	struct uring *u = s->u;
+	uint16_t bid;
+
+	if(!(flags & IORING_CQE_F_MORE))
+	{
+		s->recv_armed = false;
+		s->pending--;
+	}
+
+	if(flags & IORING_CQE_F_BUFFER)
+	{
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+		if(res > 0 && !s->closed)
+		{
+			if(s->recv_wanted && evbuffer_get_length(s->held) == 0)
+				s->read_cb(s, u->bufs + (size_t)bid * URING_BUFFER_SIZE, res, s->udata);
+			else
+				evbuffer_add(s->held, u->bufs + (size_t)bid * URING_BUFFER_SIZE, res);
+		}
+
+		uring_recycle(u, bid);
+	}
+
+	if(res == 0)
+		uring_fail(s, 0, BEV_EVENT_EOF | BEV_EVENT_READING);
+	else if(res == -ENOBUFS)
+		stat_add(&u->stats.buffers_exhausted, 1);
+	else if(res < 0 && res != -ECANCELED)
+		uring_fail(s, -res, BEV_EVENT_ERROR | BEV_EVENT_READING);
+
+	/* Rearmed, or freed if that was the last operation of a closed
+	 * socket. */
+	if(!s->recv_armed)
+		uring_sock_schedule(s);
+}
+
+static void uring_complete_send(struct uring_sock *s, int res)
+{
+	s->sending = false;
+	s->pending--;
+
+	if(res > 0)
+		evbuffer_drain(s->inflight, res);
+	else if(res < 0 && res != -ECANCELED && !s->done)
+		uring_fail(s, -res, BEV_EVENT_ERROR | BEV_EVENT_WRITING);
+
+	uring_sock_schedule(s);
+}
+
+static void uring_reap(struct uring *u)
+{
+	unsigned head = *u->cq_head;
+	unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	struct uring_sock *s;
+	uint64_t user_data;
+	unsigned flags;
+	int res;
+
+	while(head != tail)
+	{
+		cqe = &u->cqes[head & u->cq_mask];
+		user_data = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+
+		__atomic_store_n(u->cq_head, ++head, __ATOMIC_RELEASE);
+		stat_add(&u->stats.completions, 1);
+
+		s = (struct uring_sock *)(uintptr_t)(user_data & ~(uint64_t)URING_OP_MASK);
+
+		if((user_data & URING_OP_MASK) == URING_OP_RECV)
+			uring_complete_recv(s, res, flags);
+		else if((user_data & URING_OP_MASK) == URING_OP_SEND)
+			uring_complete_send(s, res);
+
+		if(head == tail)
+			tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+	}
+}
+
+static void handle_ring(evutil_socket_t fd, short what, void *udata)
+{
+	uring_reap(udata);
+}
+
+/**
+ * Checks that multishot receives into provided buffers work, they need a
+ * newer kernel than the ring itself.
+ */
+static bool uring_probe(struct uring *u)
+{
+	int sv[2];
+	bool ok = false;
+	unsigned flags;
+	int res;
+
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return false;
+
+	{
+		struct io_uring_sqe *sqe = uring_sqe(u);
+		struct io_uring_cqe *cqe;
+
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = sv[0];
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID;
+		sqe->user_data = 0;
+
+		if(write(sv[1], "", 1) == 1 && uring_enter(u, 1) >= 0 &&
+			*u->cq_head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+		{
+			cqe = &u->cqes[*u->cq_head & u->cq_mask];
+			res = cqe->res;
+			flags = cqe->flags;
+			__atomic_store_n(u->cq_head, *u->cq_head + 1, __ATOMIC_RELEASE);
+
+			ok = res == 1 && (flags & IORING_CQE_F_BUFFER) && (flags & IORING_CQE_F_MORE);
+			if(flags & IORING_CQE_F_BUFFER)
+				uring_recycle(u, flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+	}
+
+	/* Closing the peer ends the receive, its completion is awaited so
+	 * the probe leaves nothing behind. */
+	close(sv[1]);
+
+	while(ok)
+	{
+		unsigned head;
+
+		if(uring_enter(u, 1) < 0)
+		{
+			ok = false;
+			break;
+		}
+
+		head = *u->cq_head;
+		if(head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE))
+			continue;
+
+		flags = u->cqes[head & u->cq_mask].flags;
+		__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+
+		if(flags & IORING_CQE_F_BUFFER)
+			uring_recycle(u, flags >> IORING_CQE_BUFFER_SHIFT);
+		if(!(flags & IORING_CQE_F_MORE))
+			break;
+	}
+
+	close(sv[0]);
+	return ok;
+}
+
+struct uring *uring_new(struct event_base *base)
+{
+	struct io_uring_params p;
+	struct io_uring_buf_reg reg;
+	struct uring *u;
+	unsigned i;
+	int err;
+
+	if((u = calloc(1, sizeof(*u))) == NULL)
+		return NULL;
+
+	TAILQ_INIT(&u->dirty);
+	TAILQ_INIT(&u->socks);
+	u->fd = -1;
+	u->rings = MAP_FAILED;
+	u->sqes = MAP_FAILED;
+	u->br = MAP_FAILED;
+
+	memset(&p, 0, sizeof(p));
+	if((u->fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p)) < 0)
+		goto fail;
+
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP))
+	{
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	u->rings_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	if(u->rings_size < p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe))
+		u->rings_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+	u->rings = mmap(NULL, u->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		u->fd, IORING_OFF_SQ_RING);
+	u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		u->fd, IORING_OFF_SQES);
+	if(u->rings == MAP_FAILED || u->sqes == MAP_FAILED)
+		goto fail;
+
+	u->sq_head = (unsigned *)((char *)u->rings + p.sq_off.head);
+	u->sq_tail = (unsigned *)((char *)u->rings + p.sq_off.tail);
+	u->sq_array = (unsigned *)((char *)u->rings + p.sq_off.array);
+	u->sq_mask = *(unsigned *)((char *)u->rings + p.sq_off.ring_mask);
+	u->sq_entries = p.sq_entries;
+	u->sq_queued = u->sq_submitted = *u->sq_tail;
+
+	u->cq_head = (unsigned *)((char *)u->rings + p.cq_off.head);
+	u->cq_tail = (unsigned *)((char *)u->rings + p.cq_off.tail);
+	u->cq_mask = *(unsigned *)((char *)u->rings + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)((char *)u->rings + p.cq_off.cqes);
+
+	u->br_size = URING_BUFFERS * sizeof(struct io_uring_buf);
+	u->br = mmap(NULL, u->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	u->bufs = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+	if(u->br == MAP_FAILED || u->bufs == NULL)
+		goto fail;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)u->br;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+
+	if(syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		goto fail;
+
+	for(i = 0; i < URING_BUFFERS; i++)
+		uring_recycle(u, i);
+
+	if(!uring_probe(u))
+	{
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	u->ev = event_new(base, u->fd, EV_READ | EV_PERSIST, handle_ring, u);
+	u->submit_ev = event_new(base, -1, 0, handle_submit, u);
+	if(u->ev == NULL || u->submit_ev == NULL || event_add(u->ev, NULL) < 0)
+		goto fail;
+
+	return u;
+
+fail:
+	err = errno;
+	uring_free(u);
+	errno = err;
+	return NULL;
+}
+
+/**
+ * Closes every socket still on the ring and waits for their operations to
+ * complete, the kernel may write into the provided buffers and read from
+ * the iovecs of sends until then.  Returns false if waiting failed.
+ */
+static bool uring_quiesce(struct uring *u)
+{
+	struct uring_sock *s;
+
+	TAILQ_FOREACH(s, &u->socks, next)
+	{
+		if(!s->closed)
+		{
+			s->closed = true;
+			shutdown(s->fd, SHUT_RDWR);
+		}
+
+		uring_sock_schedule(s);
+	}
+
+	for(;;)
+	{
+		uring_submit(u);
+
+		if(TAILQ_EMPTY(&u->socks))
+			return true;
+		if(uring_enter(u, 1) < 0)
+			return false;
+
+		uring_reap(u);
+	}
+}
+
+void uring_free(struct uring *u)
+{
+	/* Closing the ring does not wait for what is in flight, if that
+	 * cannot be waited for the memory it uses is left alone. */
+	if(!TAILQ_EMPTY(&u->socks) && !uring_quiesce(u))
+		u->bufs = NULL;
+
+	if(u->ev)
+		event_free(u->ev);
+	if(u->submit_ev)
+		event_free(u->submit_ev);
+
+	if(u->fd >= 0)
+		close(u->fd);
+
+	if(u->rings != MAP_FAILED)
+		munmap(u->rings, u->rings_size);
+	if(u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqes_size);
+	if(u->br != MAP_FAILED)
+		munmap(u->br, u->br_size);
+
+	free(u->bufs);
+	free(u);
+}
+
+struct uring_sock *uring_sock_new(struct uring *u, evutil_socket_t fd, struct evbuffer *out,
+		uring_read_cb read_cb, uring_event_cb event_cb, void *udata)
+{
+	struct uring_sock *s = calloc(1, sizeof(*s));
+
+	if(s == NULL)
+		return NULL;
+
+	if((s->inflight = evbuffer_new()) == NULL || (s->held = evbuffer_new()) == NULL)
+	{
+		if(s->inflight)
+			evbuffer_free(s->inflight);
+		free(s);
+		return NULL;
+	}
+
+	s->u = u;
+	s->fd = fd;
+	s->out = out;
+	s->read_cb = read_cb;
+	s->event_cb = event_cb;
+	s->udata = udata;
+
+	TAILQ_INSERT_TAIL(&u->socks, s, next);
+	return s;
+}
+
+void uring_sock_recv(struct uring_sock *s, bool enable)
+{
+	if(s->recv_wanted == enable)
+		return;
+
+	s->recv_wanted = enable;
+
+	/* The kernel keeps filling buffers until the receive is cancelled,
+	 * so that is not left for the end of the loop iteration. */
+	if(!enable && s->recv_armed && !s->recv_cancelled && !s->closed && !s->stopped)
+	{
+		uring_cancel(s->u, -1, uring_user_data(s, URING_OP_RECV));
+		s->recv_cancelled = true;
+		uring_enter(s->u, 0);
+	}
+
+	uring_sock_schedule(s);
+}
+
+void uring_sock_write(struct uring_sock *s)
+{
+	if(!s->sending)
+		uring_sock_schedule(s);
+}
+
+void uring_sock_close(struct uring_sock *s)
+{
+	s->closed = true;
+
+	/* Wakes up a send stuck on a full socket buffer. */
+	shutdown(s->fd, SHUT_RDWR);
+	uring_sock_schedule(s);
+}
+
+void uring_sock_stop(struct uring_sock *s)
+{
+	s->stopped = true;
+	uring_sock_schedule(s);
+}
+
+void uring_wait(struct uring *u)
+{
+	struct uring_sock *s;
+	bool waiting;
+
+	for(;;)
+	{
+		uring_submit(u);
+		uring_reap(u);
+
+		waiting = false;
+		TAILQ_FOREACH(s, &u->socks, next)
+		{
+			if(s->stopped && s->pending > 0)
+				waiting = true;
+		}
+
+		if(!waiting || uring_enter(u, 1) < 0)
+			break;
+	}
+
+	TAILQ_FOREACH(s, &u->socks, next)
+	{
+		if(s->stopped)
+			uring_sock_deliver(s);
+	}
+}
+
+evutil_socket_t uring_sock_release(struct uring_sock *s)
+{
+	evutil_socket_t fd = s->fd;
+
+	evbuffer_prepend_buffer(s->out, s->inflight);
+	uring_sock_destroy(s);
+
+	return fd;
+}
+
+void uring_get_stats(struct uring *u, struct uring_stats *st)
+{
+	st->enters = stat_get(&u->stats.enters);
+	st->submissions = stat_get(&u->stats.submissions);
+	st->completions = stat_get(&u->stats.completions);
+	st->buffers_exhausted = stat_get(&u->stats.buffers_exhausted);
+}
+
+#else
+
+struct uring *uring_new(struct event_base *base)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void uring_free(struct uring *u)
+{
+}
+
+struct uring_sock *uring_sock_new(struct uring *u, evutil_socket_t fd, struct evbuffer *out,
+		uring_read_cb read_cb, uring_event_cb event_cb, void *udata)
+{
+	errno = ENOSYS;
+	return NULL;
+}
+
+void uring_sock_recv(struct uring_sock *s, bool enable)
+{
+}
+
+void uring_sock_write(struct uring_sock *s)
+{
+}
+
+void uring_sock_close(struct uring_sock *s)
+{
+}
+
+void uring_sock_stop(struct uring_sock *s)
+{
+}
+
+void uring_wait(struct uring *u)
+{
+}
+
+evutil_socket_t uring_sock_release(struct uring_sock *s)
+{
+	return -1;
+}
+
+void uring_get_stats(struct uring *u, struct uring_stats *st)
+{
+	memset(st, 0, sizeof(*st));
+}
+
+#endif
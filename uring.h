@@ -0,0 +1,100 @@
+/* uring.h -- upstream socket I/O through io_uring */
+
+#ifndef HADES_URING_H
+#define HADES_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+/**
+ * Submission queue entries of a ring, and the buffers provided for
+ * receiving, URING_BUFFER_SIZE bytes each.  Every socket has one multishot
+ * receive armed, which picks a buffer per completion.
+ */
+#define URING_ENTRIES 1024
+#define URING_BUFFERS 512
+#define URING_BUFFER_SIZE (16 * 1024)
+
+/**
+ * Chains of the output buffer sent with one operation.
+ */
+#define URING_IOV_MAX 16
+
+struct uring;
+struct uring_sock;
+
+/**
+ * Data received on s, only valid during the call.
+ */
+typedef void (*uring_read_cb)(struct uring_sock *s, const void *data, size_t len, void *udata);
+
+/**
+ * End of file or an error on s, what is a mask of BEV_EVENT_* flags as a
+ * bufferevent would report, errno is set for errors.
+ */
+typedef void (*uring_event_cb)(struct uring_sock *s, short what, void *udata);
+
+struct uring_stats {
+	uint64_t enters;
+	uint64_t submissions;
+	uint64_t completions;
+	uint64_t buffers_exhausted;
+};
+
+/**
+ * Sets up a ring whose completions are handled from base.  Returns NULL
+ * with errno set if the kernel lacks io_uring, provided buffer rings or
+ * multishot receives, or if hades was built without io_uring support.
+ */
+struct uring *uring_new(struct event_base *base);
+
+/**
+ * Frees the ring and closes the sockets still on it.  Must be called
+ * before base is freed.
+ */
+void uring_free(struct uring *u);
+
+/**
+ * Moves the connected socket fd onto the ring.  Data added to out is
+ * sent after uring_sock_write(), out is not touched otherwise.
+ */
+struct uring_sock *uring_sock_new(struct uring *u, evutil_socket_t fd, struct evbuffer *out,
+		uring_read_cb read_cb, uring_event_cb event_cb, void *udata);
+
+/**
+ * Starts or stops receiving.  Sockets start out not receiving.  What the
+ * kernel still completes after stopping is held back until receiving is
+ * started again.
+ */
+void uring_sock_recv(struct uring_sock *s, bool enable);
+
+/**
+ * Has what was added to out sent.  Operations are submitted together at
+ * the end of the loop iteration.
+ */
+void uring_sock_write(struct uring_sock *s);
+
+/**
+ * Closes the socket, dropping unsent output.  No callbacks are made for s
+ * afterwards, it is freed once the kernel is done with it.
+ */
+void uring_sock_close(struct uring_sock *s);
+
+/**
+ * Taking sockets off the ring: uring_sock_stop() cancels the operations
+ * of s, uring_wait() blocks until those of every stopped socket have
+ * completed, passing on what they received, and uring_sock_release() then
+ * frees s, puts unsent output back in front of out and returns the
+ * socket, still open.
+ */
+void uring_sock_stop(struct uring_sock *s);
+void uring_wait(struct uring *u);
+evutil_socket_t uring_sock_release(struct uring_sock *s);
+
+void uring_get_stats(struct uring *u, struct uring_stats *st);
+
+#endif
@@ -0,0 +1,131 @@
+/* wheel.c -- hierarchical timing wheel for coarse timeouts
+ *
+ * Every session and upstream connection has an idle timeout, most of which
+ * are pushed back long before they fire.  A libevent timer each would keep
+ * a heap of a hundred thousand entries churning; here adding a timeout is
+ * linking it into a slot and expiring one is unlinking it.
+ */
+
+#include "wheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+void wheel_init(struct wheel *w, uint64_t now)
+{
+	unsigned l, s;
+
+	for(l = 0; l < WHEEL_LEVELS; l++)
+	{
+		for(s = 0; s < WHEEL_SLOTS; s++)
+			LIST_INIT(&w->slots[l][s]);
+	}
+
+	LIST_INIT(&w->expired);
+	w->now = now;
+	w->count = 0;
+}
+
+void wheel_timer_init(struct wheel_timer *t, wheel_cb cb, void *arg)
+{
+	t->pending = false;
+	t->expires = 0;
+	t->cb = cb;
+	t->arg = arg;
+}
+
+static void wheel_link(struct wheel *w, struct wheel_timer *t)
+{
+	uint64_t delta;
+	unsigned level = 0;
+
+	if(t->expires < w->now)
+		t->expires = w->now;
+
+	delta = t->expires - w->now;
+
+	while(level < WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * (level + 1)))
+		level++;
+
+	/* Beyond the top level, park the timer at its far end. */
+	if(level == WHEEL_LEVELS - 1 && delta >> (WHEEL_BITS * WHEEL_LEVELS))
+		t->expires = w->now + ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+	LIST_INSERT_HEAD(&w->slots[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK], t, next);
+}
+
+void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t expires)
+{
+	wheel_del(w, t);
+
+	t->expires = expires;
+	t->pending = true;
+	w->count++;
+
+	wheel_link(w, t);
+}
+
+void wheel_del(struct wheel *w, struct wheel_timer *t)
+{
+	if(!t->pending)
+		return;
+
+	LIST_REMOVE(t, next);
+	t->pending = false;
+	w->count--;
+}
+
+/**
+ * Moves the timers of slot s of level l down to where they belong now,
+ * which is always a lower level.  Returns s, so that the next level is
+ * only cascaded when this one has come full circle.
+ */
+static unsigned cascade(struct wheel *w, unsigned l, unsigned s)
+{
+	struct wheel_timer *t;
+
+	while((t = LIST_FIRST(&w->slots[l][s])) != NULL)
+	{
+		LIST_REMOVE(t, next);
+		wheel_link(w, t);
+	}
+
+	return s;
+}
+
+void wheel_advance(struct wheel *w, uint64_t now)
+{
+	struct wheel_timer *t;
+	unsigned l, s;
+
+	while(w->now < now)
+	{
+		s = w->now & WHEEL_MASK;
+
+		for(l = 1; s == 0 && l < WHEEL_LEVELS; l++)
+			s = cascade(w, l, (w->now >> (WHEEL_BITS * l)) & WHEEL_MASK);
+
+		while((t = LIST_FIRST(&w->slots[0][w->now & WHEEL_MASK])) != NULL)
+		{
+			LIST_REMOVE(t, next);
+			LIST_INSERT_HEAD(&w->expired, t, next);
+		}
+
+		w->now++;
+	}
+}
+
+bool wheel_run(struct wheel *w, unsigned max)
+{
+	struct wheel_timer *t;
+
+	while(max-- > 0 && (t = LIST_FIRST(&w->expired)) != NULL)
+	{
+		LIST_REMOVE(t, next);
+		t->pending = false;
+		w->count--;
+
+		t->cb(t, t->arg);
+	}
+
+	return !LIST_EMPTY(&w->expired);
+}
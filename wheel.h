@@ -0,0 +1,75 @@
+/* wheel.h -- hierarchical timing wheel for coarse timeouts */
+
+#ifndef HADES_WHEEL_H
+#define HADES_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/queue.h>
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+struct wheel_timer;
+
+typedef void (*wheel_cb)(struct wheel_timer *t, void *arg);
+
+struct wheel_timer {
+	LIST_ENTRY(wheel_timer) next;
+	uint64_t expires;
+	bool pending;
+
+	wheel_cb cb;
+	void *arg;
+};
+
+LIST_HEAD(wheel_list, wheel_timer);
+
+/**
+ * Timers in ticks of whatever length the owner advances the wheel by.
+ * Level n holds timers due within WHEEL_SLOTS^(n+1) ticks, one slot per
+ * WHEEL_SLOTS^n ticks; a slot is moved down a level once the lower level
+ * has come round to it.  Adding and deleting are O(1), and so is every
+ * tick apart from those cascades.  Timers further out than the top level
+ * reaches fire at its end.
+ *
+ * Due timers are collected on an expired list and run from there in
+ * batches, so a burst of them is spread over several passes of the event
+ * loop.  A wheel belongs to one thread.
+ */
+struct wheel {
+	/**
+	 * Next tick to be processed.
+	 */
+	uint64_t now;
+
+	struct wheel_list slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	struct wheel_list expired;
+	size_t count;
+};
+
+void wheel_init(struct wheel *w, uint64_t now);
+void wheel_timer_init(struct wheel_timer *t, wheel_cb cb, void *arg);
+
+/**
+ * (Re)schedules t for tick expires, ticks already past are due at the
+ * next one.
+ */
+void wheel_add(struct wheel *w, struct wheel_timer *t, uint64_t expires);
+void wheel_del(struct wheel *w, struct wheel_timer *t);
+
+/**
+ * Processes all ticks before now, collecting the timers that have become
+ * due.
+ */
+void wheel_advance(struct wheel *w, uint64_t now);
+
+/**
+ * Runs up to max due timers.  Returns true if some are left.  Callbacks
+ * may add and delete any timer, including their own.
+ */
+bool wheel_run(struct wheel *w, unsigned max);
+
+#endif
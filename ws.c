@@ -0,0 +1,605 @@
+/* ws.c -- WebSocket server connections taken over from evhttp
+ *
+ * The upgrade request is parsed by evhttp as usual.  Once it has been
+ * validated the "101 Switching Protocols" response is written straight into
+ * the connection's bufferevent and the bufferevent callbacks are replaced,
+ * so evhttp never looks at the connection again until it is freed.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/keyvalq_struct.h>
+
+#include "ws.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+/**
+ * Largest message accepted from a peer, fragments included.
+ */
+#define WS_MAX_MESSAGE (1024 * 1024)
+
+/**
+ * Largest frame header: two bytes, a 64 bit length and the mask.
+ */
+#define WS_HEADER_MAX 14
+
+typedef enum {
+	WS_OP_CONTINUATION = 0x0,
+	WS_OP_TEXT = 0x1,
+	WS_OP_BINARY = 0x2,
+	WS_OP_CLOSE = 0x8,
+	WS_OP_PING = 0x9,
+	WS_OP_PONG = 0xa
+} ws_opcode;
+
+struct ws {
+	struct evhttp_connection *evcon;
+	struct bufferevent *bev;
+
+	/**
+	 * Payload of the fragmented message being received, if any.
+	 */
+	struct evbuffer *msg;
+	bool fragmented;
+
+	ws_message_cb on_message;
+	ws_close_cb on_close;
+	void *arg;
+
+	bool close_sent;
+	bool closed;
+};
+
+/***************************************************************************
+ * SHA-1, only needed to compute Sec-WebSocket-Accept
+ */
+
+struct sha1 {
+	uint32_t h[5];
+	uint8_t block[64];
+	size_t used;
+	uint64_t length;
+};
+
+static uint32_t rol(uint32_t x, unsigned n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_block(struct sha1 *s)
+{
+	uint32_t w[80];
+	uint32_t a, b, c, d, e, f, k, t;
+	unsigned i;
+
+	for(i = 0; i < 16; i++)
+	{
+		w[i] = (uint32_t)s->block[4 * i] << 24 | (uint32_t)s->block[4 * i + 1] << 16 |
+			(uint32_t)s->block[4 * i + 2] << 8 | s->block[4 * i + 3];
+	}
+
+	for(i = 16; i < 80; i++)
+		w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = s->h[0];
+	b = s->h[1];
+	c = s->h[2];
+	d = s->h[3];
+	e = s->h[4];
+
+	for(i = 0; i < 80; i++)
+	{
+		if(i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		}
+		else if(i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		}
+		else if(i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = rol(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol(b, 30);
+		b = a;
+		a = t;
+	}
+
+	s->h[0] += a;
+	s->h[1] += b;
+	s->h[2] += c;
+	s->h[3] += d;
+	s->h[4] += e;
+}
+
+static void sha1_init(struct sha1 *s)
+{
+	s->h[0] = 0x67452301;
+	s->h[1] = 0xefcdab89;
+	s->h[2] = 0x98badcfe;
+	s->h[3] = 0x10325476;
+	s->h[4] = 0xc3d2e1f0;
+	s->used = 0;
+	s->length = 0;
+}
+
+static void sha1_update(struct sha1 *s, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	s->length += len;
+
+	while(len-- > 0)
+	{
+		s->block[s->used++] = *p++;
+		if(s->used == sizeof(s->block))
+		{
+			sha1_block(s);
+			s->used = 0;
+		}
+	}
+}
+
+static void sha1_final(struct sha1 *s, uint8_t digest[20])
+{
+	uint64_t bits = s->length * 8;
+	uint8_t pad = 0x80;
+	unsigned i;
+
+	sha1_update(s, &pad, 1);
+
+	pad = 0;
+	while(s->used != 56)
+		sha1_update(s, &pad, 1);
+
+	for(i = 0; i < 8; i++)
+		s->block[56 + i] = bits >> (56 - 8 * i);
+	sha1_block(s);
+
+	for(i = 0; i < 20; i++)
+		digest[i] = s->h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static void base64_encode(char *dst, const uint8_t *src, size_t len)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t i;
+
+	for(i = 0; i + 2 < len; i += 3)
+	{
+		*dst++ = digits[src[i] >> 2];
+		*dst++ = digits[(src[i] & 0x03) << 4 | src[i + 1] >> 4];
+		*dst++ = digits[(src[i + 1] & 0x0f) << 2 | src[i + 2] >> 6];
+		*dst++ = digits[src[i + 2] & 0x3f];
+	}
+
+	if(i + 1 == len)
+	{
+		*dst++ = digits[src[i] >> 2];
+		*dst++ = digits[(src[i] & 0x03) << 4];
+		*dst++ = '=';
+		*dst++ = '=';
+	}
+	else if(i + 2 == len)
+	{
+		*dst++ = digits[src[i] >> 2];
+		*dst++ = digits[(src[i] & 0x03) << 4 | src[i + 1] >> 4];
+		*dst++ = digits[(src[i + 1] & 0x0f) << 2];
+		*dst++ = '=';
+	}
+
+	*dst = 0;
+}
+
+/**
+ * Computes the Sec-WebSocket-Accept value for key into accept (29 bytes).
+ */
+static void ws_accept_key(const char *key, char *accept)
+{
+	struct sha1 s;
+	uint8_t digest[20];
+
+	sha1_init(&s);
+	sha1_update(&s, key, strlen(key));
+	sha1_update(&s, WS_GUID, strlen(WS_GUID));
+	sha1_final(&s, digest);
+
+	base64_encode(accept, digest, sizeof(digest));
+}
+
+/***************************************************************************
+ * Framing
+ */
+
+/**
+ * Returns true if the comma separated header value contains token.
+ */
+static bool header_has_token(const char *value, const char *token)
+{
+	size_t len = strlen(token);
+
+	while(value && *value)
+	{
+		while(*value == ' ' || *value == '\t' || *value == ',')
+			value++;
+
+		if(strncasecmp(value, token, len) == 0 &&
+			(value[len] == 0 || value[len] == ',' || value[len] == ' ' || value[len] == '\t'))
+			return true;
+
+		value = strchr(value, ',');
+	}
+
+	return false;
+}
+
+static void ws_send_frame(struct ws *ws, ws_opcode opcode, const void *data, size_t len, struct evbuffer *evb)
+{
+	struct evbuffer *output = bufferevent_get_output(ws->bev);
+	uint8_t hdr[WS_HEADER_MAX];
+	size_t n = 0;
+	unsigned i;
+
+	if(evb)
+		len = evbuffer_get_length(evb);
+
+	hdr[n++] = 0x80 | opcode;
+
+	if(len < 126)
+	{
+		hdr[n++] = len;
+	}
+	else if(len <= 0xffff)
+	{
+		hdr[n++] = 126;
+		hdr[n++] = len >> 8;
+		hdr[n++] = len;
+	}
+	else
+	{
+		hdr[n++] = 127;
+		for(i = 0; i < 8; i++)
+			hdr[n++] = (uint64_t)len >> (56 - 8 * i);
+	}
+
+	evbuffer_add(output, hdr, n);
+
+	if(evb)
+		evbuffer_add_buffer(output, evb);
+	else if(len > 0)
+		evbuffer_add(output, data, len);
+}
+
+/**
+ * XORs len bytes of evb starting at offset with the frame's mask.
+ */
+static void ws_unmask(struct evbuffer *evb, size_t offset, size_t len, const uint8_t mask[4])
+{
+	struct evbuffer_ptr ptr;
+	struct evbuffer_iovec vec;
+	size_t done = 0;
+
+	if(len == 0 || evbuffer_ptr_set(evb, &ptr, offset, EVBUFFER_PTR_SET) < 0)
+		return;
+
+	while(done < len && evbuffer_peek(evb, -1, &ptr, &vec, 1) > 0)
+	{
+		uint8_t *p = vec.iov_base;
+		size_t n = vec.iov_len < len - done ? vec.iov_len : len - done;
+		size_t i;
+
+		for(i = 0; i < n; i++)
+			p[i] ^= mask[(done + i) & 3];
+
+		done += n;
+		if(evbuffer_ptr_set(evb, &ptr, n, EVBUFFER_PTR_ADD) < 0)
+			break;
+	}
+}
+
+static void ws_finish(struct ws *ws)
+{
+	if(ws->closed)
+		return;
+
+	ws->closed = true;
+	bufferevent_disable(ws->bev, EV_READ | EV_WRITE);
+
+	ws->on_close(ws, ws->arg);
+}
+
+void ws_close(struct ws *ws, uint16_t code, const char *reason)
+{
+	uint8_t payload[125];
+	size_t len = reason ? strlen(reason) : 0;
+
+	if(ws->close_sent || ws->closed)
+		return;
+
+	if(len > sizeof(payload) - 2)
+		len = sizeof(payload) - 2;
+
+	payload[0] = code >> 8;
+	payload[1] = code;
+	if(len > 0)
+		memcpy(payload + 2, reason, len);
+
+	ws_send_frame(ws, WS_OP_CLOSE, payload, len + 2, NULL);
+	ws->close_sent = true;
+
+	/* Incoming data is of no interest anymore, the connection is shut
+	 * down once the close frame has been written. */
+	bufferevent_disable(ws->bev, EV_READ);
+	bufferevent_enable(ws->bev, EV_WRITE);
+}
+
+void ws_send(struct ws *ws, struct evbuffer *evb)
+{
+	if(ws->close_sent || ws->closed)
+	{
+		evbuffer_drain(evb, evbuffer_get_length(evb));
+		return;
+	}
+
+	ws_send_frame(ws, WS_OP_BINARY, NULL, 0, evb);
+}
+
+/**
+ * Handles one complete frame of len payload bytes at the front of input,
+ * the header has already been drained.  Returns false if the connection
+ * has been finished, ws may be gone then.
+ */
+static bool ws_handle_frame(struct ws *ws, struct evbuffer *input, ws_opcode opcode, bool fin,
+		size_t len, const uint8_t mask[4])
+{
+	uint8_t payload[125];
+	size_t i;
+
+	if(opcode == WS_OP_TEXT || opcode == WS_OP_BINARY || opcode == WS_OP_CONTINUATION)
+	{
+		if(ws->fragmented != (opcode == WS_OP_CONTINUATION))
+		{
+			evbuffer_drain(input, len);
+			ws_close(ws, WS_CLOSE_PROTOCOL_ERROR, "Unexpected fragment");
+			return true;
+		}
+
+		ws_unmask(input, 0, len, mask);
+		evbuffer_remove_buffer(input, ws->msg, len);
+
+		ws->fragmented = !fin;
+		if(fin)
+		{
+			ws->on_message(ws, ws->msg, ws->arg);
+			evbuffer_drain(ws->msg, evbuffer_get_length(ws->msg));
+		}
+		return true;
+	}
+
+	if(len > sizeof(payload))
+	{
+		evbuffer_drain(input, len);
+		ws_close(ws, WS_CLOSE_PROTOCOL_ERROR, "Invalid control frame");
+		return true;
+	}
+
+	evbuffer_remove(input, payload, len);
+	for(i = 0; i < len; i++)
+		payload[i] ^= mask[i & 3];
+
+	switch(opcode)
+	{
+	case WS_OP_PING:
+		ws_send_frame(ws, WS_OP_PONG, payload, len, NULL);
+		break;
+	case WS_OP_CLOSE:
+		if(ws->close_sent)
+		{
+			ws_finish(ws);
+			return false;
+		}
+
+		/* Echo the status code and let the write callback finish the
+		 * connection once the close frame is out. */
+		ws_send_frame(ws, WS_OP_CLOSE, payload, len >= 2 ? 2 : 0, NULL);
+		ws->close_sent = true;
+		bufferevent_disable(ws->bev, EV_READ);
+		break;
+	case WS_OP_PONG:
+		break;
+	case WS_OP_TEXT:
+	case WS_OP_BINARY:
+	case WS_OP_CONTINUATION:
+	default:
+		ws_close(ws, WS_CLOSE_PROTOCOL_ERROR, "Unknown opcode");
+		break;
+	}
+
+	return true;
+}
+
+/**
+ * Whether op is one of the opcodes RFC 6455 defines, the others are
+ * reserved.
+ */
+static bool ws_opcode_known(unsigned op)
+{
+	return op <= WS_OP_BINARY || (op >= WS_OP_CLOSE && op <= WS_OP_PONG);
+}
+
+static void ws_handle_read(struct bufferevent *bev, void *arg)
+{
+	struct ws *ws = arg;
+	struct evbuffer *input = bufferevent_get_input(bev);
+	uint8_t hdr[WS_HEADER_MAX];
+	ev_ssize_t avail;
+
+	while(!ws->close_sent && !ws->closed &&
+		(avail = evbuffer_copyout(input, hdr, sizeof(hdr))) >= 2)
+	{
+		ws_opcode opcode = hdr[0] & 0x0f;
+		bool fin = (hdr[0] & 0x80) != 0;
+		uint64_t len = hdr[1] & 0x7f;
+		size_t n = 2;
+		unsigned i;
+
+		/* No extensions are negotiated and clients must mask. */
+		if((hdr[0] & 0x70) || !(hdr[1] & 0x80))
+		{
+			ws_close(ws, WS_CLOSE_PROTOCOL_ERROR, "Invalid frame");
+			return;
+		}
+
+		if(!ws_opcode_known(opcode))
+		{
+			ws_close(ws, WS_CLOSE_PROTOCOL_ERROR, "Unknown opcode");
+			return;
+		}
+
+		if(len == 126)
+			n += 2;
+		else if(len == 127)
+			n += 8;
+
+		if((size_t)avail < n + 4)
+			return;
+
+		if(len == 126)
+		{
+			len = (uint64_t)hdr[2] << 8 | hdr[3];
+		}
+		else if(len == 127)
+		{
+			len = 0;
+			for(i = 0; i < 8; i++)
+				len = len << 8 | hdr[2 + i];
+		}
+
+		if((opcode & 0x08) && (!fin || len > 125))
+		{
+			ws_close(ws, WS_CLOSE_PROTOCOL_ERROR, "Invalid control frame");
+			return;
+		}
+
+		if(len > WS_MAX_MESSAGE - evbuffer_get_length(ws->msg))
+		{
+			ws_close(ws, WS_CLOSE_TOO_BIG, "Message too big");
+			return;
+		}
+
+		if(evbuffer_get_length(input) < n + 4 + len)
+		{
+			/* Wake up again only once the frame is complete. */
+			bufferevent_setwatermark(bev, EV_READ, n + 4 + len, 0);
+			return;
+		}
+
+		bufferevent_setwatermark(bev, EV_READ, 0, 0);
+
+		evbuffer_drain(input, n + 4);
+		if(!ws_handle_frame(ws, input, opcode, fin, len, hdr + n))
+			return;
+	}
+}
+
+static void ws_handle_write(struct bufferevent *bev, void *arg)
+{
+	struct ws *ws = arg;
+
+	if(ws->close_sent && evbuffer_get_length(bufferevent_get_output(bev)) == 0)
+		ws_finish(ws);
+}
+
+static void ws_handle_event(struct bufferevent *bev, short what, void *arg)
+{
+	struct ws *ws = arg;
+
+	if(what & (BEV_EVENT_EOF | BEV_EVENT_ERROR | BEV_EVENT_TIMEOUT))
+		ws_finish(ws);
+}
+
+struct ws *ws_accept(struct evhttp_request *req, ws_message_cb on_message, ws_close_cb on_close, void *arg)
+{
+	struct evkeyvalq *headers = evhttp_request_get_input_headers(req);
+	const char *upgrade = evhttp_find_header(headers, "Upgrade");
+	const char *connection = evhttp_find_header(headers, "Connection");
+	const char *version = evhttp_find_header(headers, "Sec-WebSocket-Version");
+	const char *key = evhttp_find_header(headers, "Sec-WebSocket-Key");
+	char accept[29];
+	struct ws *ws;
+
+	if(evhttp_request_get_command(req) != EVHTTP_REQ_GET ||
+		upgrade == NULL || strcasecmp(upgrade, "websocket") != 0 ||
+		!header_has_token(connection, "upgrade") || key == NULL || strlen(key) != 24)
+	{
+		evhttp_send_error(req, 400, "WebSocket upgrade expected");
+		return NULL;
+	}
+
+	if(version == NULL || strcmp(version, "13") != 0)
+	{
+		evhttp_add_header(evhttp_request_get_output_headers(req), "Sec-WebSocket-Version", "13");
+		evhttp_send_error(req, 426, "Unsupported WebSocket version");
+		return NULL;
+	}
+
+	ws = calloc(1, sizeof(struct ws));
+	if(ws == NULL || (ws->msg = evbuffer_new()) == NULL)
+	{
+		free(ws);
+		evhttp_send_error(req, 500, "WebSocket allocation failed");
+		return NULL;
+	}
+
+	ws->evcon = evhttp_request_get_connection(req);
+	ws->bev = evhttp_connection_get_bufferevent(ws->evcon);
+	ws->on_message = on_message;
+	ws->on_close = on_close;
+	ws->arg = arg;
+
+	ws_accept_key(key, accept);
+
+	evbuffer_add_printf(bufferevent_get_output(ws->bev),
+		"HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: %s\r\n"
+		"\r\n", accept);
+
+	/* From here on the request is left pending and evhttp is cut off
+	 * from its connection. */
+	bufferevent_setcb(ws->bev, ws_handle_read, ws_handle_write, ws_handle_event, ws);
+	bufferevent_set_timeouts(ws->bev, NULL, NULL);
+	bufferevent_enable(ws->bev, EV_READ | EV_WRITE);
+
+	return ws;
+}
+
+void ws_free(struct ws *ws)
+{
+	evhttp_connection_free(ws->evcon);
+	evbuffer_free(ws->msg);
+	free(ws);
+}
@@ -0,0 +1,56 @@
+/* ws.h -- WebSocket server connections taken over from evhttp */
+
+#ifndef HADES_WS_H
+#define HADES_WS_H
+
+#include <stdint.h>
+
+#include <event2/buffer.h>
+#include <event2/http.h>
+
+struct ws;
+
+/**
+ * Close codes used by this module.  Applications may use 4000-4999.
+ */
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_TOO_BIG 1009
+
+/**
+ * Called for every complete message, whatever is left in msg afterwards is
+ * discarded.  ws_close() may be called from within, ws_free() may not.
+ */
+typedef void (*ws_message_cb)(struct ws *ws, struct evbuffer *msg, void *arg);
+
+/**
+ * Called once the connection is gone, either closed by the peer, failed or
+ * closed by ws_close() and flushed.  Nothing is sent or received anymore
+ * afterwards but the connection stays allocated until ws_free(), which may
+ * be called from within.
+ */
+typedef void (*ws_close_cb)(struct ws *ws, void *arg);
+
+/**
+ * Answers a WebSocket upgrade request with "101 Switching Protocols" and
+ * takes its connection over from evhttp.  Replies with an HTTP error and
+ * returns NULL if req is not a valid upgrade request.
+ */
+struct ws *ws_accept(struct evhttp_request *req, ws_message_cb on_message, ws_close_cb on_close, void *arg);
+
+/**
+ * Sends the contents of evb as one binary message, evb is drained.
+ */
+void ws_send(struct ws *ws, struct evbuffer *evb);
+
+/**
+ * Starts the closing handshake, nothing is sent after the close frame.
+ */
+void ws_close(struct ws *ws, uint16_t code, const char *reason);
+
+/**
+ * Frees the connection along with the evhttp connection it came from.
+ */
+void ws_free(struct ws *ws);
+
+#endif